@@ -0,0 +1,51 @@
+#pragma once
+#include "afp/types.hpp"
+
+namespace afp {
+/// Default cap on the capacity an `ExtractionArena` keeps for reuse.
+inline constexpr std::size_t kArenaDefaultRetainBytes = std::size_t{256} << 20;
+
+/// Recycled intermediates of one worker's per-track extraction.
+/// - **Process:** stages given an arena draw their output and scratch
+///   vectors from it instead of the heap, and the pipeline hands buffers
+///   back (`recycle`) once consumed; after the first track a worker only
+///   allocates when a track outgrows the earlier ones.
+/// - **Memory:** at most `max_retained_bytes` of capacity (and a few
+///   buffers per type) is kept; beyond it recycled buffers are freed, so
+///   one outlier track does not pin RSS.
+/// - **Concurrency:** not thread-safe; one per worker (see `for_thread`).
+class ExtractionArena {
+ public:
+  explicit ExtractionArena(
+      std::size_t max_retained_bytes = kArenaDefaultRetainBytes);
+
+  /// The calling thread's arena (created on first use).
+  [[nodiscard]] static ExtractionArena& for_thread();
+
+  /// An empty buffer for about `n` elements: the smallest recycled one
+  /// that holds `n`, else the largest (grown by the caller as needed).
+  [[nodiscard]] Array<float> floats(std::size_t n);
+  [[nodiscard]] Array<Peak> peaks(std::size_t n);
+
+  /// Return a buffer for reuse (freed if over the retention cap).
+  void recycle(Array<float>&& v);
+  void recycle(Array<Peak>&& v);
+
+  /// Capacity currently held for reuse, in bytes.
+  [[nodiscard]] std::size_t retained_bytes() const { return retained_; }
+
+  /// Free every retained buffer.
+  void release();
+
+ private:
+  template <class T>
+  Array<T> take(Array<Array<T>>& pool, std::size_t n);
+  template <class T>
+  void give(Array<Array<T>>& pool, Array<T>&& v);
+
+  Array<Array<float>> floats_;
+  Array<Array<Peak>> peaks_;
+  std::size_t retained_{};
+  std::size_t max_retained_;
+};
+} // namespace afp
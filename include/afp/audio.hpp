@@ -1,13 +1,102 @@
 #pragma once
+#include "afp/arena.hpp"
+#include "afp/mmap.hpp"
 #include "afp/types.hpp"
+#include <filesystem>
+#include <memory>
+#include <span>
 
 namespace afp {
+/// DC/rumble high-pass cutoff (Hz) used by the extraction pipeline.
+inline constexpr float kDcCutoffHz = 30.f;
+
+/// PCM frames decoded per `AudioStream::read` in the extraction pipeline.
+inline constexpr std::size_t kDecodeChunkFrames = 4096;
+
+/// Which downmixed channels a decode produces.
+enum class DecodeMode {
+  /// Mid only; side is never computed (all the fingerprint pipeline uses).
+  MidOnly,
+  /// Mid, plus side for 2+ channel input.
+  MidSide,
+};
+
+/// Average interleaved `channels`-channel PCM into `mid` (resized).
+/// - **Process:** mono is copied and stereo is one fused `(l + r) / 2` pass
+///   the compiler vectorizes; wider layouts sum each frame.
+void downmix_mid(std::span<const float> interleaved, std::uint16_t channels,
+                 Array<float>& mid);
+
+/// Pull-based decoder over encoded bytes (WAV, FLAC or MP3, probed in that
+/// order), yielding downmixed chunks without materializing the track.
+/// - **Lifetime:** borrows `encoded`, which must outlive the stream; a
+///   stream opened from a path owns its `MappedFile`.
+/// - **Memory:** one chunk of interleaved samples plus decoder state.
+class AudioStream {
+ public:
+  /// Open a decoder over `encoded`.
+  /// - **Failure:** `Error::EmptyAudio` for no bytes,
+  ///   `Error::UnsupportedFormat` if no decoder accepts them.
+  [[nodiscard]] static Result<AudioStream> open(
+      std::span<const std::uint8_t> encoded);
+
+  /// Open a decoder reading the file at `path` in place through `mmap`.
+  /// - **Failure:** `Error::DecodeError` if it cannot be mapped, else as
+  ///   the span form.
+  [[nodiscard]] static Result<AudioStream> open(
+      const std::filesystem::path& path);
+
+  AudioStream(AudioStream&&) noexcept;
+  AudioStream& operator=(AudioStream&&) noexcept;
+  ~AudioStream();
+
+  [[nodiscard]] std::uint32_t sample_rate() const;
+  [[nodiscard]] std::uint16_t channels() const;
+
+  /// Frames of the whole input at `sample_rate()`, 0 if unknown: the
+  /// WAV/FLAC header count, or for MP3 a scan of the frame headers (no
+  /// synthesis; the read position is kept).
+  [[nodiscard]] std::uint64_t total_frames();
+
+  /// Restrict further reads to `window`: seek to its start and end the
+  /// stream after `max_seconds`, so the rest is never decoded (MP3 without
+  /// a seek table still decodes, but does not emit, the skipped frames).
+  /// - **Failure:** `Error::InvalidArgument` for a negative or non-finite
+  ///   window, `Error::DecodeError` if the decoder cannot seek there.
+  [[nodiscard]] Result<OK> set_window(DecodeWindow window);
+
+  /// Decode up to `max_frames` frames into `mid` (channel mean) and, if
+  /// given and the input has 2+ channels, `side` ((ch0 - ch1) / 2); side
+  /// costs nothing when not requested, and mono decodes straight into `mid`.
+  /// - **Outputs:** frames decoded (0 at end); `mid`/`side` are replaced.
+  [[nodiscard]] std::size_t read(std::size_t max_frames, Array<float>& mid,
+                                 Array<float>* side = nullptr);
+
+ private:
+  struct Impl;
+  explicit AudioStream(std::unique_ptr<Impl> impl);
+
+  std::unique_ptr<Impl> impl_;
+};
+
 /// Decode audio into mono Mid (and optional Side) deterministically.
-/// - **Inputs:** URI path or raw bytes.
-/// - **Outputs:** `MidSide { mid, side_opt }`.
+/// - **Inputs:** encoded bytes (see `AudioStream`): owned, borrowed, or a
+///   file path decoded from its memory map without a heap copy.
+/// - **Process:** drains an `AudioStream`; prefer the stream to avoid
+///   holding the whole track as PCM.
+/// - **Outputs:** `MidSide { mid, side_opt }` covering `window`; side only
+///   with `DecodeMode::MidSide` and 2+ channels.
 /// - **Complexity:** O(N) in samples.
 /// - **Edge cases:** Empty/invalid → `Error::DecodeError`/`Error::EmptyAudio`.
-[[nodiscard]] Result<MidSide> decode_and_downmix(ByteArray input);
+[[nodiscard]] Result<MidSide> decode_and_downmix(
+    ByteArray input, DecodeMode mode = DecodeMode::MidOnly,
+    DecodeWindow window = {});
+[[nodiscard]] Result<MidSide> decode_and_downmix(
+    std::span<const std::uint8_t> input,
+    DecodeMode mode = DecodeMode::MidOnly, DecodeWindow window = {});
+[[nodiscard]] Result<MidSide> decode_and_downmix(
+    const std::filesystem::path& path, DecodeMode mode = DecodeMode::MidOnly,
+    DecodeWindow window = {});
 
 /// Remove DC/rumble with a deterministic HPF (IIR).
 /// - **Outputs:** New `PCM`.
@@ -16,11 +105,67 @@ namespace afp {
 
 /// Anti-alias prior to downsampling to `target_sr`.
 /// - **Outputs:** New `PCM`.
+/// - **Note:** `resample_if_needed` and `StreamResampler` already band-limit
+///   in their polyphase pass; do not chain this in front of them.
 [[nodiscard]] Result<PCM> pre_resample_lowpass(PCM x, std::uint32_t target_sr);
 
 /// Resample Mid (and Side if present) to `target_sr`.
-/// - **Outputs:** New `MidSide` with updated `sr`.
+/// - **Process:** one polyphase pass per channel (see `StreamResampler`);
+///   side is skipped when absent (`DecodeMode::MidOnly`).
+/// - **Outputs:** New `MidSide` with updated `sr`; with an `arena`, output
+///   storage comes from it and the inputs are recycled into it.
 /// - **Edge cases:** If same `sr`, return inputs unchanged.
 [[nodiscard]] Result<MidSide> resample_if_needed(
-    PCM mid, std::optional<PCM> side_opt, std::uint32_t target_sr);
+    PCM mid, std::optional<PCM> side_opt, std::uint32_t target_sr,
+    ExtractionArena* arena = nullptr);
+
+/// Chunked DC/rumble high-pass (one-pole DC blocker) carrying filter state.
+/// - **Equivalence:** filtering chunks in order equals one `dc_highpass` call.
+class StreamHighpass {
+ public:
+  StreamHighpass(float cutoff_hz, std::uint32_t sr);
+
+  /// Filter `x` in place, continuing from the previous chunk.
+  void process(std::span<float> x);
+
+ private:
+  float r_{};
+  float x1_{};
+  float y1_{};
+};
+
+/// Polyphase windowed-sinc filter bank for one reduced ratio `up/down`.
+struct ResampleBank;
+
+/// Chunked band-limited polyphase resampler carrying input history.
+/// - **Process:** the ratio is reduced to `up/down`; output `n` is one dot
+///   product of the input window at `n*down/up` with phase `(n*down) % up`
+///   of a windowed-sinc bank that anti-aliases and interpolates in one pass
+///   (no separate `pre_resample_lowpass`). Banks are built once per ratio
+///   and shared process-wide (e.g. 44100→8000 is 80 phases).
+/// - **Equivalence:** chunked output equals resampling the concatenated input.
+/// - **Complexity:** O(taps) multiply-adds per output sample.
+class StreamResampler {
+ public:
+  StreamResampler(std::uint32_t src_sr, std::uint32_t dst_sr);
+
+  /// Append every output sample that `in` makes computable to `out`.
+  void process(std::span<const float> in, Array<float>& out);
+
+  /// Emit the remaining tail (input zero-padded) at end of stream.
+  void flush(Array<float>& out);
+
+ private:
+  void drain(Array<float>& out, bool flushing);
+
+  std::shared_ptr<const ResampleBank> bank_;
+  /// Coefficients of the current phase when the bank is too large to cache.
+  Array<float> phase_;
+  /// Retained input, zero-padded before sample 0 so every window is full;
+  /// `hist_[0]` is absolute input sample `hist_start_`.
+  Array<float> hist_;
+  std::int64_t hist_start_{};
+  std::uint64_t consumed_{};
+  std::uint64_t next_out_{};
+};
 } // namespace afp
@@ -4,12 +4,53 @@
 #include "afp/keys.hpp"
 
 namespace afp {
+/// Index info record (`kv_get_info`) holding the build's `PostingFormat` byte.
+inline constexpr std::string_view kInfoPostingFormat = "posting_format";
+/// Index info record with the sorted hot-key stoplist (16-byte keys).
+inline constexpr std::string_view kInfoHotKeys = "hot_keys";
+/// Index info record with the hot-key posting-length cap (u32 LE).
+inline constexpr std::string_view kInfoHotKeyCap = "hot_key_cap";
+
 /// Build a sharded KV index from a manifest of tracks.
 /// - **Process:** open KV → per-track extract/group/pack/append → finalize → report.
 /// - **Outputs:** `BuildReport`.
 /// - **Edge cases:** Empty/short/corrupt tracks → warnings, not fatal by default.
+/// - **Parallelism:** `cfg.workers` extraction threads hand each track's
+///   blocks to a reorder stage that releases tracks to bounded per-shard
+///   queues in `track_id` order; one writer thread per shard appends them
+///   in batches, one write transaction per batch. Every posting value thus
+///   gets its blocks in `track_id` order (as `build_db_bulk` writes them),
+///   so the index, like the report (counts, histogram, warnings in manifest
+///   order), does not depend on the thread count.
+/// - **Hot keys:** with `cfg.hot_key_pct` set, a final pass measures every
+///   key's posting length, drops or truncates keys above that percentile
+///   (the cap, `kInfoHotKeyCap`) and records them (`kInfoHotKeys`) so queries
+///   can skip them unfetched. Truncation depends only on the stored anchors,
+///   not on their block order.
 [[nodiscard]] Result<BuildReport> build_db(
     Array<std::pair<std::uint32_t, std::string>> manifest,
     BuildCfg cfg,
     std::string_view kv_path);
+
+/// External-sort settings for `build_db_bulk`.
+struct BulkLoadCfg {
+  /// Directory for sorted runs (created if missing; runs removed afterwards).
+  std::string spill_dir;
+  /// Triples buffered per worker before a run is sorted and spilled
+  /// (0 = default).
+  std::size_t run_triples{};
+};
+
+/// Offline full-catalog build through external sort and append-only loads.
+/// - **Process:** extract → spill sorted `(shard, Key, track_id, t_anchor)`
+///   runs → k-way merge → pack postings per key in key order → `bulk_merge`.
+/// - **Outputs:** `BuildReport` (same counts and hot-key pass as `build_db`).
+/// - **Why:** every key is written once, in order, with `MDB_APPEND`, so the
+///   load is sequential IO instead of repeated read-modify-write.
+/// - **Edge cases:** Spill IO failure → `Error::KvWriteError`.
+[[nodiscard]] Result<BuildReport> build_db_bulk(
+    Array<std::pair<std::uint32_t, std::string>> manifest,
+    BuildCfg cfg,
+    std::string_view kv_path,
+    BulkLoadCfg bulk);
 } // namespace afp
@@ -0,0 +1,77 @@
+#pragma once
+#include "afp/types.hpp"
+#include <memory>
+#include <optional>
+#include <span>
+
+namespace afp {
+/// Value compression algorithm (also the frame tag on disk).
+enum class Compression : std::uint8_t {
+  /// Stored as is.
+  None = 0,
+  /// LZ4 block (fast decode).
+  Lz4 = 1,
+  /// zstd frame, optionally with a trained dictionary (smaller).
+  Zstd = 2,
+};
+
+/// Value codec settings, recorded in the index by `kv_set_codec`.
+struct CodecCfg {
+  /// Algorithm for values at or above `min_bytes`.
+  Compression algo{Compression::None};
+  /// zstd level, or LZ4 acceleration; 0 = library default.
+  int level{};
+  /// Values shorter than this stay raw (0 = default).
+  std::uint32_t min_bytes{};
+  /// Optional zstd dictionary (see `train_value_dictionary`).
+  ByteArray dictionary;
+};
+
+/// Parse a `BuildCfg::value_compression` spec.
+/// - **Inputs:** `nullptr`/`"none"`, `"lz4"`, `"zstd"` or `"zstd:<level>"`.
+/// - **Failure:** `Error::InvalidArgument` for unknown specs.
+[[nodiscard]] Result<CodecCfg> parse_value_compression(const char* spec);
+
+/// Train a zstd dictionary from sample values (e.g. postings of a prior
+/// build, fetched with `get`).
+/// - **Outputs:** dictionary of at most `dict_bytes` bytes.
+/// - **Failure:** `Error::InvalidArgument` if the samples are too few/small.
+[[nodiscard]] Result<ByteArray> train_value_dictionary(
+    const Array<ByteArray>& samples, std::size_t dict_bytes);
+
+/// Compressor/decompressor for stored values.
+/// - **Layout:** a stored value is a sequence of frames, one per write:
+///   `tag u8, raw_len, stored_len` (LEB128) then `stored_len` bytes; the tag
+///   is the `Compression` used (`None` when below threshold or not smaller).
+/// - **Concurrency:** const methods may be called from several threads.
+class ValueCodec {
+ public:
+  /// Build a codec (digests the dictionary once).
+  /// - **Failure:** `Error::InvalidArgument` for a bad level or dictionary.
+  [[nodiscard]] static Result<ValueCodec> create(CodecCfg cfg);
+
+  /// Settings this codec was created with.
+  [[nodiscard]] const CodecCfg& cfg() const;
+
+  /// Append `raw` to `out` as one frame.
+  void append_frame(ByteArray& out, std::span<const std::uint8_t> raw) const;
+
+  /// Decode all frames of `stored`, appending the raw bytes to `out`.
+  /// - **Failure:** `Error::IntegrityError` for malformed frames.
+  [[nodiscard]] Result<OK> decode(std::span<const std::uint8_t> stored,
+                                  ByteArray& out) const;
+
+  /// Payload of `stored` if it is exactly one uncompressed frame (no copy).
+  [[nodiscard]] static std::optional<std::span<const std::uint8_t>>
+  raw_payload(std::span<const std::uint8_t> stored);
+
+  /// True if `stored` is exactly one frame (compressed or not).
+  [[nodiscard]] static bool single_frame(std::span<const std::uint8_t> stored);
+
+ private:
+  struct Impl;
+  explicit ValueCodec(std::shared_ptr<const Impl> impl);
+
+  std::shared_ptr<const Impl> impl_;
+};
+} // namespace afp
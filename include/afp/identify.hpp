@@ -1,12 +1,82 @@
 #pragma once
 #include "afp/types.hpp"
+#include <filesystem>
+#include <memory>
+#include <span>
 
 namespace afp {
 /// Identify the best-matching track and offset for a query audio clip.
-/// - **Process:** extract → fetch/parse → vote → select → coverage/entropy gates.
+/// - **Inputs:** owned or borrowed encoded bytes, or a file path decoded in
+///   place from its memory map.
+/// - **Process:** extract → fetch/parse → vote → select → coverage/entropy gates
+///   (the decoded query streams through an `IdentifySession`); only
+///   `cfg.query_window` of the input is decoded.
 /// - **Outputs:** `IdentifyResult::Match` or `IdentifyResult::NoMatch`.
 [[nodiscard]] Result<IdentifyResult> identify_audio(
     ByteArray query_input,
     IdentifyCfg cfg,
     std::string_view kv_path);
+[[nodiscard]] Result<IdentifyResult> identify_audio(
+    std::span<const std::uint8_t> query_input, IdentifyCfg cfg,
+    std::string_view kv_path);
+[[nodiscard]] Result<IdentifyResult> identify_audio(
+    const std::filesystem::path& path, IdentifyCfg cfg,
+    std::string_view kv_path);
+
+/// Incremental identification over a live audio stream.
+/// - **Process:** per chunk: a `StreamKeyExtractor` (same keys as
+///   `extract_keys_for_track` on the whole stream) → vote, keeping per-bin
+///   vote and frame-coverage counts up to date.
+/// - **Window:** only the last `cfg.session_window_frames` frames of
+///   anchors count; older keys expire with their votes and coverage, so a
+///   stream moving to another track matches the new one.
+/// - **Memory:** bounded by the keys and votes of one window.
+/// - **Outputs:** a `Match` as soon as the coverage/entropy gates pass.
+class IdentifySession {
+ public:
+  /// Open the index at `kv_path` read-only and start an empty stream.
+  /// - **Failure:** `Error::KvOpenError`, `Error::InvalidArgument` for bad cfg.
+  [[nodiscard]] static Result<IdentifySession> open(IdentifyCfg cfg,
+                                                    std::string_view kv_path);
+
+  IdentifySession(IdentifySession&&) noexcept;
+  IdentifySession& operator=(IdentifySession&&) noexcept;
+  ~IdentifySession();
+
+  /// Push interleaved float PCM; channels are averaged to mid.
+  /// - **Outputs:** `Match` if the gates pass after this chunk, else `nullopt`.
+  /// - **Failure:** `Error::ConfigMismatch` if `sr`/`channels` change mid-stream.
+  [[nodiscard]] Result<std::optional<Match>> push_pcm(
+      std::span<const float> interleaved, std::uint16_t channels,
+      std::uint32_t sr);
+
+  /// Push the next bytes of an encoded MP3 stream (partial frames are kept).
+  /// - **Process:** a leading ID3v2 tag is skipped and a Xing/Info tag's
+  ///   gapless delay/padding trimmed, as `AudioStream` decodes the file.
+  /// - **Outputs:** as `push_pcm`.
+  [[nodiscard]] Result<std::optional<Match>> push_encoded(
+      std::span<const std::uint8_t> bytes);
+
+  /// End of stream: decode the buffered MP3 tail, flush the look-ahead
+  /// buffers and run the gates once more.
+  /// - **Outputs:** `IdentifyResult::Match` or `IdentifyResult::NoMatch`.
+  [[nodiscard]] Result<IdentifyResult> finish();
+
+  /// Forget stream state and votes; keeps the KV handle and allocations.
+  void reset();
+
+  /// Keys extracted (and voted) in the current window, in on-disk form
+  /// (the session keeps them native).
+  [[nodiscard]] Array<KeyWithTime> query_keys() const;
+
+ private:
+  struct State;
+  explicit IdentifySession(std::unique_ptr<State> state);
+
+  /// Decode buffered MP3 frames into `push_pcm`; `at_end` drains the
+  /// look-ahead too.
+  [[nodiscard]] Result<std::optional<Match>> decode_encoded(bool at_end);
+
+  std::unique_ptr<State> state_;
+};
 } // namespace afp
@@ -1,20 +1,223 @@
 #pragma once
+#include "afp/arena.hpp"
 #include "afp/types.hpp"
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <type_traits>
 
 namespace afp {
+template <unsigned Bits>
+struct PackedKeyWithTime;
+
 /// Convert audio input into a sorted list of `(Key, t_anchor)` per spec pipeline.
 /// - **Process:** decode → safety → resample → STFT → scale/band/clip → DoG → thresholds →
-///   candidates → NMS → pairing → quantize → pack.
-/// - **Outputs:** sorted `Array<KeyWithTime>`.
+///   candidates → NMS → pairing → quantize → pack, streamed: `AudioStream`
+///   chunks feed a `StreamKeyExtractor` in blocks of `kExtractBlockFrames`.
+/// - **Memory:** bounded by the block and look-ahead sizes plus the keys,
+///   not by the decoded track; intermediates are drawn from and returned
+///   to `arena` (the calling thread's arena when null).
+/// - **Inputs:** owned or borrowed encoded bytes, or a file path decoded in
+///   place from its memory map (no copy of the file).
+/// - **Outputs:** `Array<KeyWithTime>` sorted by `stable_sort_by`.
 [[nodiscard]] Result<Array<KeyWithTime>> extract_keys_for_track(
     ByteArray input,
     FeatureCfg feat,
     PairingCfg pair,
-    KeyLayout layout);
+    KeyLayout layout,
+    ExtractionArena* arena = nullptr);
+[[nodiscard]] Result<Array<KeyWithTime>> extract_keys_for_track(
+    std::span<const std::uint8_t> input, FeatureCfg feat, PairingCfg pair,
+    KeyLayout layout, ExtractionArena* arena = nullptr);
+[[nodiscard]] Result<Array<KeyWithTime>> extract_keys_for_track(
+    const std::filesystem::path& path, FeatureCfg feat, PairingCfg pair,
+    KeyLayout layout, ExtractionArena* arena = nullptr);
+
+/// STFT frames per block in `extract_keys_for_track` (~4 s at 8 kHz / hop
+/// 128); keys do not depend on it.
+inline constexpr std::uint32_t kExtractBlockFrames = 256;
+
+/// Incremental key extraction over a PCM stream (the streaming form of
+/// `extract_keys_for_track`, also behind `IdentifySession`).
+/// - **Process:** per block: HPF → resample → STFT (frame overlap kept) →
+///   scale/band/clip (`StreamScaler`, clip window kept) → DoG → peaks
+///   (±`neigh_dt` rows kept) → pairing (`dt_max_frames` look-ahead kept).
+/// - **Equivalence:** every stage carries its state across blocks, so the
+///   keys do not depend on how the PCM is chunked or blocked.
+/// - **Memory:** bounded by the block, frame, clip window and look-ahead
+///   sizes.
+class StreamKeyExtractor {
+ public:
+  /// Start an empty stream.
+  /// - **Inputs:** `block_frames`: STFT frames gathered before a block is
+  ///   processed (0 = process every push); `arena`: intermediates' storage
+  ///   (null = owned by the extractor).
+  /// - **Failure:** `Error::InvalidArgument` for a bad config.
+  [[nodiscard]] static Result<StreamKeyExtractor> create(
+      FeatureCfg feat, PairingCfg pair, KeyLayout layout,
+      std::uint32_t block_frames = 0, ExtractionArena* arena = nullptr);
+
+  StreamKeyExtractor(StreamKeyExtractor&&) noexcept;
+  StreamKeyExtractor& operator=(StreamKeyExtractor&&) noexcept;
+  ~StreamKeyExtractor();
+
+  /// Push interleaved float PCM; channels are averaged to mid.
+  /// - **Outputs:** keys whose targets became final, appended to `out` in
+  ///   anchor order.
+  /// - **Failure:** `Error::ConfigMismatch` if `sr`/`channels` change
+  ///   mid-stream.
+  [[nodiscard]] Result<OK> push_pcm(std::span<const float> interleaved,
+                                    std::uint16_t channels, std::uint32_t sr,
+                                    Array<KeyWithTime>& out);
+
+  /// End of stream: flush the look-ahead buffers, appending the last keys.
+  [[nodiscard]] Result<OK> finish(Array<KeyWithTime>& out);
+
+  /// Native-key forms of `push_pcm` and `finish`.
+  /// - **Failure:** also `Error::InvalidArgument` if the layout is not
+  ///   `Bits` wide.
+  template <unsigned Bits>
+  [[nodiscard]] Result<OK> push_pcm(std::span<const float> interleaved,
+                                    std::uint16_t channels, std::uint32_t sr,
+                                    Array<PackedKeyWithTime<Bits>>& out);
+  template <unsigned Bits>
+  [[nodiscard]] Result<OK> finish(Array<PackedKeyWithTime<Bits>>& out);
+
+  /// Forget stream state; keeps allocations.
+  void reset();
+
+ private:
+  struct State;
+  explicit StreamKeyExtractor(std::unique_ptr<State> state);
+
+  std::unique_ptr<State> state_;
+};
 
 /// Pack `(f_a, f_t, dt_bin)` into a fixed-width `Key` per layout and endianness.
 /// - **Preconditions:** fields fit within their bit budgets.
 /// - **Failure:** `Error::NumericOverflow` if any field exceeds allocation.
 [[nodiscard]] Result<Key> pack_key(std::uint32_t f_a, std::uint32_t f_t,
                                    std::uint32_t dt_bin, KeyLayout layout);
+
+/// Native key of a `Bits`-wide layout (32, 48 for 40..48, or 64 bits).
+/// - **Layout:** fields MSB→LSB `shard, ver, f_a, f_t, dt` in the low
+///   `total_bits`; the prefix fields are left 0 by `pack`.
+/// - **Order:** plain integer order; `to_key` with `Endian::Big` keeps it.
+template <unsigned Bits>
+struct PackedKey {
+  static_assert(Bits == 32 || Bits == 48 || Bits == 64);
+  using Rep = std::conditional_t<Bits == 32, std::uint32_t, std::uint64_t>;
+  static constexpr unsigned kBits = Bits;
+  /// Bytes per key in radix passes.
+  static constexpr unsigned kBytes = Bits / 8;
+
+  Rep value{};
+
+  /// Pack fields per `layout` (its `total_bits` must map to `Bits`).
+  /// - **Failure:** `Error::InvalidArgument` for a bad layout,
+  ///   `Error::NumericOverflow` if a field exceeds its bits.
+  [[nodiscard]] static Result<PackedKey> pack(std::uint32_t f_a,
+                                              std::uint32_t f_t,
+                                              std::uint32_t dt_bin,
+                                              const KeyLayout& layout);
+
+  /// Byte `i` (0 = least significant) for LSD radix sorting.
+  [[nodiscard]] constexpr std::uint8_t radix_byte(unsigned i) const {
+    return static_cast<std::uint8_t>(value >> (8 * i));
+  }
+
+  friend constexpr auto operator<=>(PackedKey, PackedKey) = default;
+};
+
+/// Native key with its anchor time (frame index).
+template <unsigned Bits>
+struct PackedKeyWithTime {
+  PackedKey<Bits> key;
+  std::uint32_t t_anchor{};
+};
+
+/// `PackedKey` width for a layout's `total_bits` (0 if unsupported).
+[[nodiscard]] constexpr unsigned packed_key_bits(std::uint8_t total_bits) {
+  if (total_bits == 32) return 32;
+  if (total_bits >= 40 && total_bits <= 48) return 48;
+  if (total_bits == 64) return 64;
+  return 0;
+}
+
+/// Call `f(PackedKey<B>{})` with `B` picked from `layout.total_bits`.
+/// - **Outputs:** `f`'s result, which must be a `Result<...>`.
+/// - **Failure:** `Error::InvalidArgument` for an unsupported width.
+template <class F>
+auto with_packed_key(const KeyLayout& layout, F&& f)
+    -> decltype(f(PackedKey<32>{})) {
+  switch (packed_key_bits(layout.total_bits)) {
+    case 32: return f(PackedKey<32>{});
+    case 48: return f(PackedKey<48>{});
+    case 64: return f(PackedKey<64>{});
+    default: return tl::unexpected(Error::InvalidArgument);
+  }
+}
+
+/// On-disk form: the low `ceil(total_bits / 8)` bytes of the value in
+/// `layout.endian` order, zero-padded to 16 bytes. Keys stay native from
+/// pairing through grouping and voting and take this form only where they
+/// meet the store (`put_append`, `bulk_merge`, `get_many`).
+template <unsigned Bits>
+[[nodiscard]] Key to_key(PackedKey<Bits> k, const KeyLayout& layout) {
+  Key out{};
+  const unsigned n = (layout.total_bits + 7u) / 8u;
+  for (unsigned i = 0; i < n; ++i) {
+    const unsigned at = layout.endian == Endian::Big ? n - 1 - i : i;
+    out.bytes[at] = k.radix_byte(i);
+  }
+  return out;
+}
+
+/// Inverse of `to_key`.
+template <unsigned Bits>
+[[nodiscard]] PackedKey<Bits> from_key(const Key& key,
+                                       const KeyLayout& layout) {
+  PackedKey<Bits> out;
+  const unsigned n = (layout.total_bits + 7u) / 8u;
+  for (unsigned i = 0; i < n; ++i) {
+    const unsigned at = layout.endian == Endian::Big ? n - 1 - i : i;
+    out.value |= static_cast<typename PackedKey<Bits>::Rep>(
+        static_cast<typename PackedKey<Bits>::Rep>(key.bytes[at]) << (8 * i));
+  }
+  return out;
+}
+
+/// `extract_keys_for_track` on native keys, left in anchor order: for
+/// callers that group or vote before any key reaches the store.
+/// - **Failure:** also `Error::InvalidArgument` if the layout is not
+///   `Bits` wide.
+template <unsigned Bits>
+[[nodiscard]] Result<Array<PackedKeyWithTime<Bits>>> extract_native_keys(
+    const std::filesystem::path& path, FeatureCfg feat, PairingCfg pair,
+    KeyLayout layout, ExtractionArena* arena = nullptr);
+
+template <unsigned Bits>
+Result<PackedKey<Bits>> PackedKey<Bits>::pack(std::uint32_t f_a,
+                                              std::uint32_t f_t,
+                                              std::uint32_t dt_bin,
+                                              const KeyLayout& layout) {
+  const unsigned used = unsigned{layout.bits_shard} + layout.bits_ver +
+                        layout.bits_fa + layout.bits_ft + layout.bits_dt;
+  if (packed_key_bits(layout.total_bits) != Bits ||
+      used > layout.total_bits || layout.bits_fa > 32 ||
+      layout.bits_ft > 32 || layout.bits_dt > 32) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  const auto fits = [](std::uint32_t v, unsigned bits) {
+    return bits >= 32 || v < (std::uint32_t{1} << bits);
+  };
+  if (!fits(f_a, layout.bits_fa) || !fits(f_t, layout.bits_ft) ||
+      !fits(dt_bin, layout.bits_dt)) {
+    return tl::unexpected(Error::NumericOverflow);
+  }
+  std::uint64_t v = f_a;
+  v = (v << layout.bits_ft) | f_t;
+  v = (v << layout.bits_dt) | dt_bin;
+  return PackedKey{static_cast<Rep>(v)};
+}
 } // namespace afp
@@ -1,6 +1,10 @@
 #pragma once
 #include "afp/types.hpp"
+#include "afp/codec.hpp"
+#include <functional>
+#include <memory>
 #include <optional>
+#include <span>
 #include <utility>
 
 namespace afp {
@@ -14,11 +18,17 @@ enum class KVMode {
   ReadOnly,
 };
 
-/// Opaque KV handle (no state exposed).
+/// Implementation-private KV state (LMDB environments, one per shard).
+struct KVState;
+
+/// Opaque KV handle (no state exposed); copies share the same store.
 struct KVHandle {
+  /// Implementation-private state.
+  std::shared_ptr<KVState> _priv;
 };
 
 /// Open a KV store at `path` with a mode and shard count.
+/// - **Inputs:** `shards == 0` in read modes uses the recorded shard count.
 /// - **Outputs:** `KVHandle` or `Error::KvOpenError`.
 [[nodiscard]] Result<KVHandle> open(std::string_view path, KVMode mode,
                                     std::uint16_t shards);
@@ -27,25 +37,111 @@ struct KVHandle {
 /// - **Outputs:** shard id in `[0..shards)`.
 [[nodiscard]] std::uint16_t shard_for_key(const KVHandle& h, Key key);
 
-/// Get value bytes for `key` from `shard`, or `None` if absent.
+/// Compress values written from now on with `cfg` (see `ValueCodec`).
+/// - **Inputs:** a writable store that holds no values yet; the settings and
+///   dictionary are recorded so later `open` calls decode transparently.
+/// - **Outputs:** `OK`, or `Error::InvalidArgument` for a non-empty store or
+///   bad settings.
+[[nodiscard]] Result<OK> kv_set_codec(const KVHandle& h, CodecCfg cfg);
+
+/// Get value bytes for `key` from `shard`, or `None` if absent (copied out
+/// and decompressed; hot read paths borrow views via `get_many` instead).
 /// - **Outputs:** `Option<ByteArray>`.
 [[nodiscard]] Result<std::optional<ByteArray>> get(
     const KVHandle& h, std::uint16_t shard, Key key);
 
+/// Borrowed value bytes: inside the store's memory map when stored raw,
+/// else in a buffer owned by the `KVReadBatch` that decompressed them.
+using ValueView = std::span<const std::uint8_t>;
+
+/// Reusable per-shard read transactions backing `get_many` views.
+/// - **Lifetime:** views stay valid until the next `get_many` on this batch,
+///   `release()`, or destruction; destroy the batch before `close(h)`.
+class KVReadBatch {
+ public:
+  explicit KVReadBatch(KVHandle h);
+  KVReadBatch(KVReadBatch&&) noexcept;
+  KVReadBatch& operator=(KVReadBatch&&) noexcept;
+  ~KVReadBatch();
+
+  /// Reset the read transactions (kept for cheap renewal on next use).
+  void release();
+
+ private:
+  friend Result<Array<std::optional<ValueView>>> get_many(
+      KVReadBatch& batch, std::span<const Key> keys_sorted);
+
+  struct Txns;
+  KVHandle h_;
+  std::unique_ptr<Txns> txns_;
+};
+
+/// Look up many keys with one read transaction per touched shard.
+/// - **Inputs:** `keys_sorted` in ascending `Key` order (duplicates allowed).
+/// - **Process:** group by shard (order kept) → per shard: renew a read txn,
+///   then cursor-seek the keys in order so neighbouring keys hit hot pages.
+/// - **Outputs:** `out[i]` = view of `keys_sorted[i]`'s value, or `nullopt`;
+///   uncompressed single-frame values are not copied.
+/// - **Failure:** `Error::InvalidArgument` if keys are unsorted,
+///   `Error::KvReadError` on store errors.
+[[nodiscard]] Result<Array<std::optional<ValueView>>> get_many(
+    KVReadBatch& batch, std::span<const Key> keys_sorted);
+
 /// Append a value block to `(shard,key)` atomically.
+/// - **Process:** with a codec set, the block becomes one (possibly
+///   compressed) frame appended to the stored value.
 /// - **Outputs:** `OK` or `Error::KvWriteError`.
+/// - **Concurrency:** calls for distinct shards may run in parallel (one
+///   writer per shard); calls for the same shard must be serialized.
 [[nodiscard]] Result<OK> put_append(const KVHandle& h, std::uint16_t shard,
                                     Key key, ByteArray value);
 
+/// `put_append` of many blocks under one write transaction.
+/// - **Inputs:** `(key, block)` pairs in append order (keys may repeat);
+///   the blocks are moved out.
+/// - **Outputs:** `OK`, or `Error::KvWriteError` with none of them written.
+/// - **Concurrency:** as `put_append`.
+[[nodiscard]] Result<OK> put_append_many(
+    const KVHandle& h, std::uint16_t shard,
+    std::span<std::pair<Key, ByteArray>> blocks);
+
+/// Replace the value of `(shard,key)` (framed like `put_append`).
+/// - **Outputs:** `OK` or `Error::KvWriteError`.
+[[nodiscard]] Result<OK> put_replace(const KVHandle& h, std::uint16_t shard,
+                                     Key key, ByteArray value);
+
+/// Remove `(shard,key)`; absent keys are not an error.
+/// - **Outputs:** `OK` or `Error::KvWriteError`.
+[[nodiscard]] Result<OK> erase(const KVHandle& h, std::uint16_t shard,
+                               Key key);
+
+/// Visit every `(key, value)` of `shard` in key order under one read txn.
+/// - **Lifetime:** the (decompressed) view is valid only during the call.
+/// - **Outputs:** `OK`, `Error::KvReadError` or `Error::IntegrityError`.
+[[nodiscard]] Result<OK> scan_shard(
+    const KVHandle& h, std::uint16_t shard,
+    const std::function<void(const Key&, ValueView)>& f);
+
+/// Producer of `(Key, Value)` pairs in ascending key order.
+struct SortedKeyValueSource {
+  virtual ~SortedKeyValueSource() = default;
+  /// Next `(Key, ByteArray)` or `nullopt` at end.
+  virtual std::optional<std::pair<Key, ByteArray>> next() = 0;
+};
+
 /// Iterator type placeholder for sorted (Key, Value) pairs used in bulk merge.
 struct SortedKeyValueIter {
-  /// Implementation-private placeholder.
+  /// Caller-owned `SortedKeyValueSource*` (non-owning).
   void* _priv{nullptr};
   /// Next `(Key, ByteArray)` or `nullopt`.
   std::optional<std::pair<Key, ByteArray>> next();
 };
 
 /// Bulk merge sorted key/value pairs into `shard` (compaction/finalization).
+/// - **Process:** keys past the shard's current last key are written with
+///   `MDB_APPEND` (no B-tree search, pages filled sequentially); keys that
+///   already exist get the new value appended to the stored one. With a
+///   codec set, each written value is one (possibly compressed) frame.
 /// - **Outputs:** `OK` or `Error::KvMergeError`.
 [[nodiscard]] Result<OK> bulk_merge(const KVHandle& h, std::uint16_t shard,
                                     SortedKeyValueIter iter);
@@ -59,7 +155,19 @@ struct SortedKeyValueIter {
 [[nodiscard]] Result<OK> kv_put_trackmeta(const KVHandle& h,
                                           const TrackMeta& meta);
 
+/// Store a named index-wide record (format versions, build options).
+/// - **Outputs:** `OK` or `Error::KvWriteError`.
+[[nodiscard]] Result<OK> kv_put_info(const KVHandle& h, std::string_view name,
+                                     const ByteArray& value);
+
+/// Read a named index-wide record, or `None` if it was never written.
+/// - **Outputs:** `Option<ByteArray>` or `Error::KvReadError`.
+[[nodiscard]] Result<std::optional<ByteArray>> kv_get_info(
+    const KVHandle& h, std::string_view name);
+
 /// Optional per-shard merge/compact step.
+/// - **Process:** with a codec set, values built from several appended
+///   frames are re-encoded as one frame (better ratio, zero-copy reads).
 /// - **Outputs:** `OK` or `Error::KvMergeError`.
 [[nodiscard]] Result<OK> finalize_shards(const KVHandle& h);
 } // namespace afp
@@ -1,11 +1,13 @@
 #pragma once
 
 // Re-exports (clean public API)
+#include "afp/arena.hpp"
 #include "afp/audio.hpp"
 #include "afp/build.hpp"
 #include "afp/identify.hpp"
 #include "afp/keys.hpp"
 #include "afp/kv.hpp"
+#include "afp/mmap.hpp"
 #include "afp/pack.hpp"
 #include "afp/pairing.hpp"
 #include "afp/peaks.hpp"
@@ -0,0 +1,37 @@
+#pragma once
+#include "afp/types.hpp"
+#include <filesystem>
+#include <span>
+
+namespace afp {
+/// Read-only memory map of a whole file.
+/// - **Process:** `mmap` with sequential read-ahead advice; pages come
+///   straight from the page cache, so decoders read the file in place
+///   instead of from a heap copy.
+/// - **Lifetime:** `bytes()` is valid until the map is destroyed or moved
+///   from; the file should not be truncated while mapped.
+class MappedFile {
+ public:
+  /// Map `path` read-only (an empty file maps to no bytes).
+  /// - **Failure:** `Error::DecodeError` if it cannot be opened or mapped.
+  [[nodiscard]] static Result<MappedFile> open(
+      const std::filesystem::path& path);
+
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  [[nodiscard]] std::span<const std::uint8_t> bytes() const {
+    return {data_, size_};
+  }
+
+ private:
+  MappedFile(const std::uint8_t* data, std::size_t size)
+      : data_(data), size_(size) {}
+
+  const std::uint8_t* data_{};
+  std::size_t size_{};
+};
+} // namespace afp
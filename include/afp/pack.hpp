@@ -1,24 +1,94 @@
 #pragma once
 #include "afp/types.hpp"
+#include <array>
 #include <optional>
+#include <span>
 
 namespace afp {
-/// Pack one (key, track) list of anchor times into bytes (LEB128 for varints).
+/// Deltas per frame-of-reference chunk in `PostingFormat::BitPacked` blocks.
+inline constexpr std::uint32_t kPostingChunk = 128;
+
+/// Pack one (key, track) list of anchor times into a posting block.
+/// - **Layout:** format byte, header `track_id, n, payload_bytes` (LEB128),
+///   then the payload of deltas `t0, dt[n-1]`:
+///   - `Varint`: one LEB128 varint per delta;
+///   - `BitPacked`: chunks of 128 deltas, each `base` (LEB128), `width` (u8)
+///     and `width`-bit little-endian packed `delta - base` values.
 /// - **Outputs:** `ByteArray`.
+/// - **Failure:** `Error::InvalidArgument` if empty or not sorted ascending.
 /// - **Complexity:** O(n) for `n = times_sorted.len()`.
 [[nodiscard]] Result<ByteArray> pack_posting_block(
-    std::uint32_t track_id, const Array<std::uint32_t>& times_sorted);
+    std::uint32_t track_id, std::span<const std::uint32_t> times_sorted,
+    PostingFormat format = PostingFormat::Varint);
+
+/// Borrowed bytes of concatenated posting blocks (e.g. a `ValueView`).
+using PostingView = std::span<const std::uint8_t>;
+
+/// Header of one posting block, readable without touching its payload.
+struct PostingBlockHeader {
+  /// Payload encoding.
+  PostingFormat format{PostingFormat::Varint};
+  /// Track identifier.
+  std::uint32_t track_id{};
+  /// Anchor count (>= 1).
+  std::uint32_t n{};
+  /// Payload size in bytes.
+  std::uint32_t bytes{};
+};
+
+/// Iterator over anchors decoded in place from concatenated posting blocks.
+/// - **Lifetime:** borrows the viewed bytes; they must outlive the iterator.
+/// - **Usage:** either per anchor via `next()`, or per block via
+///   `next_block()` + optional `read_times()` (bulk decode); do not mix the
+///   two inside one block.
+class PostingIter {
+ public:
+  PostingIter() = default;
+  explicit PostingIter(PostingView buf) noexcept;
 
-/// Iterator over anchors parsed from concatenated posting blocks.
-struct PostingIter {
-  /// Implementation-private placeholder.
-  void* _priv{nullptr};
   /// Return next `(track_id, t_anchor)` or `std::nullopt` at end.
-  std::optional<Anchor> next();
+  /// - **Edge cases:** malformed input ends iteration and sets `failed()`.
+  std::optional<Anchor> next() noexcept;
+
+  /// Advance to the next block, skipping whatever of the current one was not
+  /// decoded; `std::nullopt` at end or on a malformed header.
+  std::optional<PostingBlockHeader> next_block() noexcept;
+
+  /// Decode the current block's absolute times into `out[0, n)`.
+  /// - **Inputs:** `out.size() >= n` from the last `next_block()`.
+  /// - **Outputs:** `false` (and `failed()`) on malformed payload.
+  /// - **Process:** dispatch on the block format: vectorized varint +
+  ///   prefix-sum kernel (AVX2/SSE4.1 picked at runtime, scalar elsewhere),
+  ///   or scalar per-chunk bit unpacking (one loop per width, with
+  ///   compile-time shifts and masks; no SIMD kernel).
+  bool read_times(std::span<std::uint32_t> out) noexcept;
+
+  /// True if iteration stopped on malformed/truncated input.
+  [[nodiscard]] bool failed() const noexcept { return failed_; }
+
+ private:
+  bool fail() noexcept;
+  bool next_chunk() noexcept;
+
+  const std::uint8_t* p_{nullptr};
+  const std::uint8_t* end_{nullptr};
+  const std::uint8_t* block_end_{nullptr};
+  std::uint32_t track_id_{};
+  std::uint32_t left_{};
+  std::uint32_t t_{};
+  PostingFormat format_{PostingFormat::Varint};
+  bool failed_{false};
+  /// Decoded deltas of the current `BitPacked` chunk (per-anchor path).
+  std::array<std::uint32_t, kPostingChunk> chunk_{};
+  std::uint32_t chunk_pos_{};
+  std::uint32_t chunk_len_{};
 };
 
 /// Parse concatenated posting blocks to a stream of `(track_id, t_anchor)`.
-/// - **Outputs:** `PostingIter`.
-/// - **Failure:** `Error::IntegrityError` for malformed/truncated input.
-[[nodiscard]] Result<PostingIter> parse_posting_blocks(ByteArray buf);
+/// - **Process:** each block is decoded according to its own format byte, so
+///   values may mix formats (e.g. appends to an older index).
+/// - **Outputs:** `PostingIter` borrowing `buf` (no copy).
+/// - **Failure:** `Error::IntegrityError` for an empty buffer; later
+///   corruption is reported through `PostingIter::failed()`.
+[[nodiscard]] Result<PostingIter> parse_posting_blocks(PostingView buf);
 } // namespace afp
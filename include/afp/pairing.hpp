@@ -1,11 +1,14 @@
 #pragma once
 #include "afp/types.hpp"
+#include "afp/keys.hpp"
+#include <span>
 
 namespace afp {
 /// For given anchor, select up to `max_targets_per_anchor` targets in [dt_min, dt_max].
 /// - **Inputs:** `peaks` sorted by (t,f), `anchor_idx`.
-/// - **Outputs:** `Array<Peak>` targets (k ≤ max).
-/// - **Complexity:** O(W log W) per anchor.
+/// - **Outputs:** `Array<Peak>` targets (k ≤ max): the strongest peaks after
+///   the anchor in the Δt window, in (t,f) order (as `pair_peaks`).
+/// - **Complexity:** O(log P + W) per anchor; prefer `pair_peaks` in bulk.
 [[nodiscard]] Result<Array<Peak>> select_targets(
     const Array<Peak>& peaks,
     std::uint32_t anchor_idx,
@@ -21,6 +24,33 @@ namespace afp {
     const PairingCfg& pair,
     const Array<std::uint32_t>& df_hist);
 
+/// Pair anchors with their targets in one sweep (bulk `select_targets`).
+/// - **Inputs:** `peaks` sorted by (t,f); the first `n_anchors` of them are
+///   anchors (later ones only serve as targets, e.g. past a stream horizon).
+/// - **Process:** two pointers track the window of peaks after the anchor
+///   with `dt` in [dt_min, dt_max]; the `max_targets_per_anchor` strongest
+///   are picked by partial selection (`nth_element`) over a reused index
+///   scratch, then quantized and packed straight into `out`.
+/// - **Outputs:** keys appended to `out`, grouped by anchor in peak order
+///   and each group's targets in (t,f) order.
+/// - **Failure:** errors of `quantize_dt`/`pack_key`.
+/// - **Complexity:** O(W) per anchor for `W` peaks in its window.
+[[nodiscard]] Result<OK> pair_peaks(std::span<const Peak> peaks,
+                                    std::size_t n_anchors,
+                                    const PairingCfg& pair,
+                                    const KeyLayout& layout,
+                                    Array<KeyWithTime>& out);
+
+/// `pair_peaks` into native keys: the form that grouping and voting work
+/// on, converted by `to_key` only where keys meet the store.
+/// - **Failure:** `Error::InvalidArgument` if `layout` is not `Bits` wide.
+template <unsigned Bits>
+[[nodiscard]] Result<OK> pair_peaks(std::span<const Peak> peaks,
+                                    std::size_t n_anchors,
+                                    const PairingCfg& pair,
+                                    const KeyLayout& layout,
+                                    Array<PackedKeyWithTime<Bits>>& out);
+
 /// Quantize Δt (frames) into a Δt_bin clamped to bit budget.
 /// - **Outputs:** `u32` Δt_bin.
 /// - **Range:** [0 .. (2^bits_dt - 1)].
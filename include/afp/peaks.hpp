@@ -1,24 +1,98 @@
 #pragma once
+#include "afp/arena.hpp"
 #include "afp/types.hpp"
+#include <span>
 
 namespace afp {
 /// Compute per-frame thresholds from the Base spectrogram via SNR proxy.
-/// - **Outputs:** thresholds `Array<f32>` of length T.
-/// - **Complexity:** O(T * F').
-[[nodiscard]] Result<Array<float>> per_frame_thresholds(const ScaledSpec& base);
+/// - **Process:** `thr[t]` = median of row `t` (its noise floor) plus a
+///   6 dB margin; each row is independent of the others.
+/// - **Outputs:** thresholds `Array<f32>` of length T (storage from `arena`
+///   when given; -inf for rows without columns).
+/// - **Failure:** `Error::InvalidArgument` for a malformed matrix.
+/// - **Complexity:** O(T * F') expected.
+[[nodiscard]] Result<Array<float>> per_frame_thresholds(
+    const ScaledSpec& base, ExtractionArena* arena = nullptr);
 
 /// 2D local maxima detection on the detection spectrogram (`Det`).
-/// - **Outputs:** unfiltered candidate `Peak`s.
-/// - **Complexity:** O(T * F').
+/// - **Process:** one pass of `StreamPeakDetector` over the rows.
+/// - **Outputs:** unfiltered candidate `Peak`s, sorted by (t,f): cells equal
+///   to the max of their `(2*neigh_dt+1) x (2*neigh_df+1)` window (clipped
+///   at the edges) and above at least one frequency neighbour (no plateaus);
+///   storage from `arena` when given.
+/// - **Complexity:** O(T * F'), independent of the neighbourhood size.
 [[nodiscard]] Result<Array<Peak>> detect_candidates(
-    const ScaledSpec& det, std::uint8_t neigh_dt, std::uint8_t neigh_df);
+    const ScaledSpec& det, std::uint8_t neigh_dt, std::uint8_t neigh_df,
+    ExtractionArena* arena = nullptr);
+
+/// Streaming form of `detect_candidates`, fed one `Det` row at a time.
+/// - **Process:** van Herk/Gil-Werman running max, separable: along
+///   frequency per row, then along time in blocks of `2*neigh_dt+1` rows
+///   (running prefix max of the current block, suffix max of the previous
+///   one), all as row-wide max operations.
+/// - **Memory:** `2*neigh_dt+1` max rows, `neigh_dt+1` input rows, O(F').
+/// - **Equivalence:** same candidates as `detect_candidates` on all rows.
+class StreamPeakDetector {
+ public:
+  StreamPeakDetector(std::uint16_t cols, std::uint8_t neigh_dt,
+                     std::uint8_t neigh_df);
+
+  /// Push the next row (`cols` values); appends the candidates of row
+  /// `rows_pushed() - neigh_dt` once its window is complete.
+  void push_row(std::span<const float> row, Array<Peak>& out);
+
+  /// End of stream: append the candidates of the last `neigh_dt` rows and
+  /// start over at row 0.
+  void finish(Array<Peak>& out);
+
+  /// Rows pushed since construction or the last `finish`.
+  [[nodiscard]] std::uint32_t rows_pushed() const { return rows_; }
+
+ private:
+  void advance(const float* fmax, Array<Peak>& out);
+
+  std::uint32_t cols_{};
+  std::uint32_t dt_{};
+  std::uint32_t df_{};
+  /// Rows pushed (`rows_`) and rows advanced incl. end padding (`t_`).
+  std::uint32_t rows_{};
+  std::uint32_t t_{};
+  /// Slot `j` of block `k`: suffix max of block `k-1` until row
+  /// `k*(2*dt+1)+j` arrives, then that row's frequency max.
+  Array<float> ring_;
+  Array<float> prefix_;
+  /// Input rows in a ring of `dt+1` (centers awaiting their window).
+  Array<float> raw_;
+  /// Scratch rows: frequency max, window max, and the padded input and
+  /// block prefix/suffix maxima of the frequency pass.
+  Array<float> fmax_;
+  Array<float> win_;
+  Array<float> padded_;
+  Array<float> g_;
+  Array<float> h_;
+};
 
 /// Threshold, confirm, per-frame NMS & density control, then sort.
+/// - **Inputs:** `cands` grouped by frame (as `detect_candidates` emits
+///   them, else they are sorted first); `thr[t]` per `base` row.
+/// - **Process:** per frame, in one scratch buffer reused across frames:
+///   a candidate passes if its `base` cell reaches `thr[t]`; passing
+///   candidates are heapified by strength and popped greedily, each kept
+///   unless within `nms_min_freq_sep_bins` of a kept one, until
+///   `max_peaks_per_frame` (0 = no cap) are kept; below
+///   `min_peaks_per_frame`, failed candidates backfill the same way. The
+///   kept set (at most the cap) is emitted sorted by `f`, so the output is
+///   in (t,f) order with no global sort. With an `arena`, the output and
+///   scratch come from it and `cands`/`thr` are recycled into it.
 /// - **Outputs:** filtered `Array<Peak>`.
+/// - **Failure:** `Error::InvalidArgument` for candidates outside `base`
+///   or a short `thr`.
 /// - **Edge cases:** If all frames drop, `Error::NoPeaks`.
+/// - **Complexity:** O(n + kept log n) per frame of `n` candidates.
 [[nodiscard]] Result<Array<Peak>> filter_and_nms(
     Array<Peak> cands,
     Array<float> thr,
     const FeatureCfg& feat,
-    const ScaledSpec& base);
+    const ScaledSpec& base,
+    ExtractionArena* arena = nullptr);
 } // namespace afp
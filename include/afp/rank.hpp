@@ -1,17 +1,105 @@
 #pragma once
 #include "afp/types.hpp"
+#include "afp/keys.hpp"
 #include "afp/kv.hpp"
+#include <span>
+#include <type_traits>
+#include <vector>
 
 namespace afp {
+/// Open-addressing accumulator for `(track_id, off_bin)` votes.
+/// - **Layout:** packed 64-bit key `track_id << 32 | u32(off_bin)`, linear probing.
+/// - **Reuse:** `clear()` keeps capacity, so one table serves many queries.
+/// - **Complexity:** O(1) expected per vote; iteration is O(capacity).
+class VoteTable {
+ public:
+  /// Create a table sized for about `expected_bins` distinct bins.
+  explicit VoteTable(std::size_t expected_bins = 0);
+
+  /// Drop all votes but keep the allocated slots.
+  void clear();
+
+  /// Add `n` votes to `(track_id, off_bin)`.
+  void add(std::uint32_t track_id, std::int32_t off_bin, std::uint32_t n = 1);
+
+  /// Take back up to `n` votes from `(track_id, off_bin)`; a bin left at 0
+  /// is deleted (backward shift, so probe chains stay intact).
+  void remove(std::uint32_t track_id, std::int32_t off_bin,
+              std::uint32_t n = 1);
+
+  /// Vote count for `(track_id, off_bin)`, 0 if absent.
+  [[nodiscard]] std::uint32_t count(std::uint32_t track_id,
+                                    std::int32_t off_bin) const;
+
+  /// Number of distinct `(track_id, off_bin)` bins.
+  [[nodiscard]] std::size_t size() const { return size_; }
+
+  /// True if no votes were cast since construction or `clear()`.
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+
+  /// Visit each occupied bin as `f(track_id, off_bin, count)` (slot order).
+  template <class F>
+  void for_each(F&& f) const {
+    for (const Slot& s : slots_) {
+      if (s.count != 0) {
+        f(static_cast<std::uint32_t>(s.key >> 32),
+          static_cast<std::int32_t>(static_cast<std::uint32_t>(s.key)),
+          s.count);
+      }
+    }
+  }
+
+ private:
+  /// One probe slot; `count == 0` marks an empty slot.
+  struct Slot {
+    std::uint64_t key{};
+    std::uint32_t count{};
+  };
+
+  void rehash(std::size_t capacity);
+
+  std::vector<Slot> slots_;
+  std::size_t size_{};
+  std::uint8_t shift_{64};
+};
+
+/// One vote of `vote_offsets`: the query anchor at frame `t_query` met a
+/// posting of `track_id` in offset bin `off_bin`.
+struct CastVote {
+  std::uint32_t t_query{};
+  std::uint32_t track_id{};
+  std::int32_t off_bin{};
+};
+
 /// Accumulate votes for `(track_id, off_bin)` across all query keys.
-/// - **Outputs:** `Map<(u32,i32), u32>` vote counts.
+/// - **Inputs:** native keys of a `Bits`-wide `layout`; `batch`: read
+///   transactions reused across calls (e.g. one per session);
+///   `skip_sorted`: native keys never fetched, ascending (e.g.
+///   `load_hot_keys` through `from_key`).
+/// - **Process:** queries are sorted natively and grouped by key; each
+///   distinct key is converted by `to_key` once, for `get_many`.
+/// - **Outputs:** counts added into `votes` (not cleared first); with
+///   `cast`, every vote is also appended there (e.g. to expire it later).
+/// - **Failure:** `Error::InvalidArgument` if `layout` is not `Bits` wide.
 /// - **Complexity:** linear in emitted anchors.
-[[nodiscard]] Result<Map<std::tuple<std::uint32_t, std::int32_t>,
-                         std::uint32_t>> vote_offsets(
-    const Array<KeyWithTime>& query_keys,
-    const KVHandle& kvh,
+template <unsigned Bits>
+[[nodiscard]] Result<OK> vote_offsets(
+    const Array<PackedKeyWithTime<Bits>>& query_keys,
+    KVReadBatch& batch,
     const PairingCfg& pair,
-    const KeyLayout& layout);
+    const KeyLayout& layout,
+    VoteTable& votes,
+    std::type_identity_t<std::span<const PackedKey<Bits>>> skip_sorted = {},
+    Array<CastVote>* cast = nullptr);
+
+/// Hot-key stoplist recorded by the build, sorted (empty if none).
+/// - **Failure:** `Error::KvReadError`, `Error::IntegrityError`.
+[[nodiscard]] Result<Array<Key>> load_hot_keys(const KVHandle& kvh);
+
+/// Export votes as an ordered map (determinism tests and debugging only).
+/// - **Outputs:** `Map<(u32,i32), u32>` vote counts.
+[[nodiscard]] Map<std::tuple<std::uint32_t, std::int32_t>, std::uint32_t>
+export_votes(const VoteTable& votes);
 
 /// Peak/compactness stats for the winning mode.
 struct BestStats {
@@ -33,18 +121,25 @@ struct BestByVotes {
 };
 
 /// Select the best `(track, off_bin)` pair given the vote histogram.
-/// - **Outputs:** `BestByVotes`.
-[[nodiscard]] Result<BestByVotes> select_best_by_votes(
-    const Map<std::tuple<std::uint32_t, std::int32_t>, std::uint32_t>& votes);
+/// - **Outputs:** `BestByVotes`; ties go to the smallest `(track, off_bin)`.
+/// - **Edge cases:** Empty table → `Error::InvalidArgument`.
+[[nodiscard]] Result<BestByVotes> select_best_by_votes(const VoteTable& votes);
 
 /// Fraction of query frames that contributed ≥1 vote to the winner.
-/// - **Outputs:** coverage in `[0,1]`.
+/// - **Inputs:** `query_keys`, `batch`, `layout` and `skip_sorted` as for
+///   `vote_offsets`.
+/// - **Process:** skipped keys are dropped before the lookup, and frames
+///   left with no fetched key are not counted.
+/// - **Outputs:** coverage in `[0,1]` (0 if every key was skipped).
+template <unsigned Bits>
 [[nodiscard]] Result<float> frame_coverage(
     std::uint32_t best_track,
     std::int32_t best_off_bin,
-    const Array<KeyWithTime>& query_keys,
-    const KVHandle& kvh,
-    const PairingCfg& pair);
+    const Array<PackedKeyWithTime<Bits>>& query_keys,
+    KVReadBatch& batch,
+    const PairingCfg& pair,
+    const KeyLayout& layout,
+    std::type_identity_t<std::span<const PackedKey<Bits>>> skip_sorted = {});
 
 /// Shannon entropy (bits) of the offset histogram around a window.
 /// - **Outputs:** entropy value.
@@ -55,8 +150,7 @@ struct BestByVotes {
 /// Project per-(track,off_bin) votes to a histogram for one track.
 /// - **Outputs:** `Map<off_bin, count>`.
 [[nodiscard]] Map<std::int32_t, std::uint32_t> project_track_hist(
-    const Map<std::tuple<std::uint32_t, std::int32_t>, std::uint32_t>& votes,
-    std::uint32_t track_id);
+    const VoteTable& votes, std::uint32_t track_id);
 
 /// Construct a window of bins around the winning offset bin.
 /// - **Outputs:** contiguous list of off_bins to evaluate.
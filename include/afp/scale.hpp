@@ -1,26 +1,106 @@
 #pragma once
+#include "afp/arena.hpp"
 #include "afp/types.hpp"
+#include <memory>
 
 namespace afp {
+/// Narrow DoG sigma (bins) used by the extraction pipeline.
+inline constexpr float kDogSigma1Bins = 1.0f;
+/// Wide DoG sigma (bins) used by the extraction pipeline.
+inline constexpr float kDogSigma2Bins = 3.0f;
+
+/// dB domain of the percentile histogram; values outside it fall in the
+/// end bins (bounds are still clamped to the observed min/max).
+inline constexpr float kClipHistMinDb = -200.f;
+inline constexpr float kClipHistMaxDb = 200.f;
+/// Default histogram bins (0.1 dB each).
+inline constexpr std::uint32_t kClipHistDefaultBins = 4000;
+/// Default rows of the clip window (~4 s at 8 kHz / hop 128).
+inline constexpr std::uint32_t kClipWindowFrames = 256;
+
 /// Convert magnitudes to log/PCEN, crop to [f0..f1], and clip percentiles.
 /// - **Preconditions:** `band_max_hz > band_min_hz`.
+/// - **Process:** one `StreamScaler` pass over all rows, so a matrix split
+///   into blocks scales exactly like the whole of it.
 /// - **Outputs:** `ScaledSpec { val[T,F'], unit, f0_bin, fprime }`.
-/// - **Complexity:** O(T * F').
-[[nodiscard]] Result<ScaledSpec> scale_and_band(STFTSpec spec, FeatureCfg feat);
+/// - **Complexity:** O(T * F') (histogram mode).
+[[nodiscard]] Result<ScaledSpec> scale_and_band(
+    STFTSpec spec, FeatureCfg feat, ExtractionArena* arena = nullptr);
+
+/// Streaming `scale_and_band`: spectra pushed block by block, with the PCEN
+/// smoother and the clip window carried from one push to the next.
+/// - **Process:** per row, one sweep over the in-band bins maps each cell
+///   and compacts the row in place (the matrix storage is reused); the row
+///   then enters the causal window of the last `clip_window_frames` mapped
+///   rows and is clipped to that window's percentiles, picked by
+///   `clip_percentile` (histogram: counts added and removed per row, a walk
+///   over 64-bin group sums, error within one bin; exact: selection over a
+///   copy of the window). No clipping while `clip_high_pct` is 0.
+/// - **Equivalence:** a row's output depends only on its window (and the
+///   PCEN history), never on where blocks start, so an excerpt scales like
+///   the track once `clip_window_frames` rows are in.
+/// - **Memory:** `clip_window_frames * F'` mapped cells plus the histogram.
+class StreamScaler {
+ public:
+  /// Start an empty stream.
+  /// - **Failure:** `Error::InvalidArgument` for a bad band or percentiles.
+  [[nodiscard]] static Result<StreamScaler> create(const FeatureCfg& feat);
+
+  StreamScaler(StreamScaler&&) noexcept;
+  StreamScaler& operator=(StreamScaler&&) noexcept;
+  ~StreamScaler();
+
+  /// Scale the next block of rows (same `sr`/`fft` as earlier pushes).
+  /// - **Process:** scratch (exact-mode copy) comes from `arena` when given.
+  /// - **Failure:** `Error::InvalidArgument` for a malformed or mismatched
+  ///   spectrum, `Error::NoFrames` for an empty one.
+  [[nodiscard]] Result<ScaledSpec> push(STFTSpec spec,
+                                        ExtractionArena* arena = nullptr);
+
+  /// Forget the PCEN state and the window; keeps allocations.
+  void reset();
+
+ private:
+  struct State;
+  explicit StreamScaler(std::unique_ptr<State> state);
+
+  std::unique_ptr<State> state_;
+};
 
 /// Optional frequency-only Difference-of-Gaussians enhancement.
-/// - **Outputs:** `DogOutput { det, base }`.
-/// - **Complexity:** O(T * F').
+/// - **Process:** with `use_dog`, one fused pass runs both recursive
+///   Gaussians (see `gaussian_blur_freq`) over 8 frames at a time, reading
+///   the input once; `base` = G1 reuses the input storage, `det` storage
+///   and scratch rows come from `arena` when given.
+/// - **Outputs:** `DogOutput { det = G1 - G2, base = G1 }`, or `det` and
+///   `base` both the input when `use_dog` is false.
+/// - **Failure:** `Error::InvalidArgument` unless
+///   `0.5 <= sigma1_bins < sigma2_bins` (when `use_dog`).
+/// - **Complexity:** O(T * F'), independent of the sigmas.
 [[nodiscard]] Result<DogOutput> dog_enhance_freq(
-    ScaledSpec scaled, bool use_dog, float sigma1_bins, float sigma2_bins);
+    ScaledSpec scaled, bool use_dog, float sigma1_bins, float sigma2_bins,
+    ExtractionArena* arena = nullptr);
 
 /// Separable 1D Gaussian blur along frequency for each row.
-/// - **Outputs:** new `Matrix<f32>`.
+/// - **Process:** Young-van Vliet recursive Gaussian (3rd-order causal +
+///   anti-causal pass, edges replicated: the causal pass starts in steady
+///   state, the anti-causal one from the Triggs-Sdika boundary state); 8
+///   frames are filtered per step, one per vector lane, without transposing
+///   the matrix.
+/// - **Outputs:** the blurred matrix (in place of `m`).
+/// - **Failure:** `Error::InvalidArgument` for `sigma_bins < 0.5`.
+/// - **Complexity:** O(T * F'), independent of `sigma_bins`.
 [[nodiscard]] Result<Matrix<float>> gaussian_blur_freq(
     Matrix<float> m, float sigma_bins);
 
 /// Compute robust percentile clip bounds over all cells.
+/// - **Inputs:** `mode`/`hist_bins` as `FeatureCfg::clip_percentile` and
+///   `FeatureCfg::clip_hist_bins`.
+/// - **Process:** histogram: one pass, no copy; exact: `nth_element` on a
+///   copy of the cells.
 /// - **Outputs:** `ClipBounds { lo, hi }`.
 [[nodiscard]] Result<ClipBounds> percentile_clip_bounds(
-    const ScaledSpec& scaled, float p_lo, float p_hi);
+    const ScaledSpec& scaled, float p_lo, float p_hi,
+    PercentileMode mode = PercentileMode::Histogram,
+    std::uint32_t hist_bins = 0);
 } // namespace afp
@@ -1,10 +1,62 @@
 #pragma once
+#include "afp/arena.hpp"
 #include "afp/types.hpp"
+#include <memory>
+#include <span>
 
 namespace afp {
 /// Compute magnitude STFT (optionally reassigned).
 /// - **Inputs:** `PCM`, Hann window, `fft=frame_size`, `hop=hop_size`.
+/// - **Process:** runs on the calling thread's cached `StftEngine`; with an
+///   `arena`, `mag` storage comes from it and `mid` is recycled into it.
 /// - **Outputs:** `STFTSpec { mag[T,K], sr, fft, hop, unit="linear" }`.
 /// - **Complexity:** O(T * fft log fft).  **Edge:** T==0 → `Error::NoFrames`.
-[[nodiscard]] Result<STFTSpec> stft_magnitude(PCM mid, FeatureCfg feat);
+/// - **Failure:** `Error::InvalidArgument` for a bad frame/hop size or if
+///   `use_reassignment` is set (not computed by the engine).
+[[nodiscard]] Result<STFTSpec> stft_magnitude(
+    PCM mid, FeatureCfg feat, ExtractionArena* arena = nullptr);
+
+/// Reusable magnitude STFT for one `(frame_size, hop_size)` pair.
+/// - **Process:** the real DFT plan and periodic Hann window are built once;
+///   frames are windowed into aligned scratch in batches, transformed, and
+///   a vectorized `|X|` kernel writes each batch straight into the output.
+/// - **Concurrency:** not thread-safe (owns scratch); use one per thread,
+///   e.g. via `for_thread`.
+class StftEngine {
+ public:
+  /// Plan an engine.
+  /// - **Failure:** `Error::InvalidArgument` unless `frame_size` is even and
+  ///   `>= 2` and `hop_size > 0`.
+  [[nodiscard]] static Result<StftEngine> create(std::uint32_t frame_size,
+                                                 std::uint32_t hop_size);
+
+  /// The calling thread's engine for these sizes (planned on first use,
+  /// kept for the thread's lifetime).
+  /// - **Failure:** as `create`.
+  [[nodiscard]] static Result<StftEngine*> for_thread(
+      std::uint32_t frame_size, std::uint32_t hop_size);
+
+  StftEngine(StftEngine&&) noexcept;
+  StftEngine& operator=(StftEngine&&) noexcept;
+  ~StftEngine();
+
+  [[nodiscard]] std::uint32_t frame_size() const;
+  [[nodiscard]] std::uint32_t hop_size() const;
+  /// Bins per frame, `frame_size / 2 + 1`.
+  [[nodiscard]] std::uint32_t bins() const;
+  /// Full frames in `samples` samples (0 if shorter than one frame).
+  [[nodiscard]] std::uint32_t frame_count(std::size_t samples) const;
+
+  /// Magnitudes of every full frame of `x` into `out` [T, bins].
+  /// - **Outputs:** `out` resized (its capacity is reused across calls).
+  /// - **Failure:** `Error::NoFrames` if `x` is shorter than one frame.
+  [[nodiscard]] Result<OK> magnitude(std::span<const float> x,
+                                     Matrix<float>& out);
+
+ private:
+  struct Impl;
+  explicit StftEngine(std::unique_ptr<Impl> impl);
+
+  std::unique_ptr<Impl> impl_;
+};
 } // namespace afp
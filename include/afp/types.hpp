@@ -48,6 +48,9 @@ enum class Error {
   IntegrityError,
 };
 
+/// Stable lowercase name of an error code (for warnings and logs).
+[[nodiscard]] std::string_view error_name(Error e);
+
 /// Canonical result used across the crate.
 template <class T>
 using Result = tl::expected<T, Error>;
@@ -71,10 +74,40 @@ enum class Endian {
   Little,
 };
 
+/// On-disk posting block encoding; the value is the block's leading byte.
+enum class PostingFormat : std::uint8_t {
+  /// LEB128 delta varints.
+  Varint = 1,
+  /// Frame-of-reference bit-packed deltas in chunks of 128.
+  BitPacked = 2,
+};
+
+/// How percentile clip bounds are computed.
+enum class PercentileMode : std::uint8_t {
+  /// Fixed-width histogram over the dB domain, updated as rows enter and
+  /// leave the clip window; error at most one bin width (400 dB /
+  /// `FeatureCfg::clip_hist_bins`) once the window holds many cells.
+  Histogram,
+  /// Exact linear-rank percentiles (`nth_element` over a copy of the
+  /// window, per row: a slow reference path).
+  Exact,
+};
+
+/// What a build does with the postings of hot (very common) keys.
+enum class HotKeyPolicy : std::uint8_t {
+  /// Remove the key from the index.
+  Drop,
+  /// Thin the postings to the hot-key length cap: an even stride over the
+  /// `(track_id, t)`-sorted anchors (deterministic, spread over tracks).
+  Truncate,
+};
+
 /// Opaque key container; layout defines used bits (32/48/64 packed into `u128`).
 /// Represented as 16 raw bytes (opaque).
 struct Key {
   std::array<std::uint8_t, 16> bytes;
+  /// Lexicographic byte order (the KV store's key order).
+  friend auto operator<=>(const Key&, const Key&) = default;
 };
 
 /// Unit OK marker for functions that succeed without returning data.
@@ -232,6 +265,12 @@ struct FeatureCfg {
   float clip_low_pct{};
   /// Upper percentile clip.
   float clip_high_pct{};
+  /// Percentile estimator for the clip bounds.
+  PercentileMode clip_percentile{PercentileMode::Histogram};
+  /// Histogram bins for `PercentileMode::Histogram` (0 = 4000, 0.1 dB).
+  std::uint32_t clip_hist_bins{};
+  /// Rows in the causal clip-percentile window (0 = 256).
+  std::uint32_t clip_window_frames{};
   /// Min frequency separation (bins) for per-frame NMS.
   std::uint8_t nms_min_freq_sep_bins{};
   /// Neighborhood half-width in time (for maxima).
@@ -244,6 +283,14 @@ struct FeatureCfg {
   std::uint8_t min_peaks_per_frame{};
 };
 
+/// Time range of an input to decode (decoding stops at its end).
+struct DecodeWindow {
+  /// Seconds skipped from the start of the input.
+  double start_seconds{};
+  /// Seconds decoded from `start_seconds` (0 = to the end).
+  double max_seconds{};
+};
+
 /// Identification configuration (query-time).
 struct IdentifyCfg {
   /// Pairing configuration.
@@ -256,6 +303,14 @@ struct IdentifyCfg {
   float min_coverage{};
   /// Maximum entropy threshold (bits).
   float max_entropy{};
+  /// Skip query keys on the index's hot-key stoplist (no fetch).
+  bool skip_hot_keys{};
+  /// Frames an `IdentifySession` votes over: keys anchored this many
+  /// frames before the newest anchor expire with their votes (0 = default,
+  /// about a minute of audio).
+  std::uint32_t session_window_frames{};
+  /// Part of an `identify_audio` query to decode (default: all of it).
+  DecodeWindow query_window;
 };
 
 /// Build (index-time) configuration.
@@ -268,8 +323,23 @@ struct BuildCfg {
   KeyLayout key_layout;
   /// Shard fan-out bits.
   std::uint8_t shard_bits{};
-  /// Value compression indicator.
+  /// Value compression spec: none, lz4 or zstd[:level] (see `ValueCodec`).
   const char* value_compression{};
+  /// Optional zstd dictionary for `value_compression`.
+  ByteArray value_dictionary;
+  /// Values shorter than this stay uncompressed (0 = default).
+  std::uint32_t value_compress_min_bytes{};
+  /// Posting block encoding (recorded in the index metadata).
+  PostingFormat posting_format{PostingFormat::Varint};
+  /// Posting-length percentile (0..100) above which keys are hot; hot keys
+  /// are handled per `hot_key_policy` and recorded in the index (0 = off).
+  float hot_key_pct{};
+  /// Drop or truncate hot keys.
+  HotKeyPolicy hot_key_policy{HotKeyPolicy::Drop};
+  /// Extraction worker threads (0 = hardware concurrency, 1 = serial).
+  std::uint16_t workers{};
+  /// Posting blocks buffered per shard writer queue (0 = default).
+  std::uint32_t shard_queue_depth{};
 };
 
 /// Build report summarizing ingestion.
@@ -282,6 +352,8 @@ struct BuildReport {
   std::uint64_t unique_keys{};
   /// Histogram of postings lengths for hot keys.
   std::vector<std::uint32_t> hotkey_histogram;
+  /// Keys put on the hot-key stoplist (dropped or truncated).
+  std::uint64_t hot_keys{};
   /// Non-fatal warnings encountered.
   std::vector<std::string> warnings;
 };
@@ -1,6 +1,7 @@
 #pragma once
+#include "afp/keys.hpp"
 #include "afp/types.hpp"
-#include <map>
+#include <span>
 
 namespace afp {
 /// Deterministic monotonic calibration of confidence into [0,1].
@@ -15,18 +16,42 @@ namespace afp {
                                     std::uint32_t sr,
                                     std::uint16_t delta_bin_frames);
 
-/// Group anchor times by key and return per-key sorted-unique times.
-/// - **Outputs:** map `Key → Array<u32>`.
-[[nodiscard]] std::map<Key, Array<std::uint32_t>> group_times_by_key(
-    const Array<KeyWithTime>& pairs);
+/// Anchor times grouped by native key, flat (CSR): group `g` is `keys[g]`
+/// with times `times[offsets[g] .. offsets[g + 1])`, sorted and unique.
+template <unsigned Bits>
+struct KeyTimeGroups {
+  /// Distinct keys in native order.
+  Array<PackedKey<Bits>> keys;
+  /// `keys.size() + 1` group bounds into `times`.
+  Array<std::uint32_t> offsets;
+  /// Times of all groups back to back.
+  Array<std::uint32_t> times;
 
-/// Possibly compress value bytes (opaque policy).
-/// - **Outputs:** new `ByteArray`.
+  [[nodiscard]] std::size_t size() const { return keys.size(); }
+  [[nodiscard]] std::span<const std::uint32_t> times_of(std::size_t g) const {
+    return std::span(times).subspan(offsets[g], offsets[g + 1] - offsets[g]);
+  }
+};
+
+/// Group anchor times by key into `out` (its buffers are reused).
+/// - **Process:** LSD radix sort of `pairs` in place by `(key, t_anchor)`
+///   (passes on constant bytes skipped), then one run-length sweep.
+/// - **Complexity:** O(n · (4 + key bytes)), two record buffers.
+template <unsigned Bits>
+void group_times_by_key(Array<PackedKeyWithTime<Bits>>& pairs,
+                        KeyTimeGroups<Bits>& out);
+
+/// Encode value bytes as one `ValueCodec` frame under the `algo` spec.
+/// - **Outputs:** the frame, or `bytes` unchanged for none/unknown specs.
 [[nodiscard]] ByteArray maybe_compress(ByteArray bytes, const char* algo);
 
-/// Observe postings length into a small histogram (implementation-defined).
+/// Observe postings length into a small histogram (log2 buckets).
 void observe_hotkey_histogram(Array<std::uint32_t>& hist, std::size_t len);
 
+/// Add histogram `src` into `dst` bucket-wise (same bucketing as above).
+void merge_histogram(Array<std::uint32_t>& dst,
+                     const Array<std::uint32_t>& src);
+
 /// Render histogram to a public array for the report.
 /// - **Outputs:** `Array<u32>`.
 [[nodiscard]] Array<std::uint32_t> render_histogram(
@@ -37,15 +62,21 @@ void observe_hotkey_histogram(Array<std::uint32_t>& hist, std::size_t len);
 [[nodiscard]] Array<std::string> collect_warnings();
 
 /// Estimate total frames for the given media and feature config.
-/// - **Outputs:** frame count `u32`.
+/// - **Process:** `AudioStream::total_frames` (headers only, nothing is
+///   decoded) rescaled to `feat.target_sr`, then the STFT frame count.
+/// - **Outputs:** frame count `u32`; 0 if the file cannot be probed.
 [[nodiscard]] std::uint32_t estimate_frames(std::string_view uri,
                                             const FeatureCfg& feat);
 
 /// Compute CRC64 over canonicalized audio content.
-/// - **Outputs:** 64-bit checksum.
+/// - **Process:** CRC-64/XZ (ECMA-182, reflected) over the file's bytes,
+///   read through its memory map.
+/// - **Outputs:** 64-bit checksum; 0 if the file cannot be mapped.
 [[nodiscard]] std::uint64_t crc64_of_uri(std::string_view uri);
 
 /// Derive layout version byte from `KeyLayout`.
+/// - **Process:** FNV-1a over every field that shapes key bytes, folded to
+///   one byte, so indexes built with different layouts tell apart.
 /// - **Outputs:** version nibble/byte as `u8`.
 [[nodiscard]] std::uint8_t derive_version(const KeyLayout& layout);
 
@@ -54,7 +85,14 @@ void observe_hotkey_histogram(Array<std::uint32_t>& hist, std::size_t len);
 [[nodiscard]] Array<std::uint32_t> histogram_abs_delta_f(
     const Array<Peak>& peaks, std::uint16_t fprime);
 
-/// Deterministic stable sort by `(t_anchor, key)` for returned keys.
-/// - **Outputs:** newly sorted vector.
-[[nodiscard]] Array<KeyWithTime> stable_sort_by(Array<KeyWithTime> arr);
+/// Deterministic sort by `(t_anchor, packed key)` for returned keys.
+/// - **Process:** LSD radix sort on packed records (stable, no compares).
+/// - **Outputs:** `arr`, sorted.
+/// - **Failure:** `Error::InvalidArgument` for an unsupported layout width.
+[[nodiscard]] Result<Array<KeyWithTime>> stable_sort_by(
+    Array<KeyWithTime> arr, const KeyLayout& layout);
+
+/// `stable_sort_by` on native keys, in place.
+template <unsigned Bits>
+void stable_sort_by(Array<PackedKeyWithTime<Bits>>& arr);
 } // namespace afp
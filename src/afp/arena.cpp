@@ -0,0 +1,72 @@
+#include "afp/arena.hpp"
+
+#include <algorithm>
+
+namespace afp {
+namespace {
+/// Buffers kept per element type; a track's pipeline has fewer live at once,
+/// so the excess (e.g. decoder output recycled each track) is freed.
+constexpr std::size_t kMaxPooled = 16;
+} // namespace
+
+ExtractionArena::ExtractionArena(std::size_t max_retained_bytes)
+    : max_retained_(max_retained_bytes) {}
+
+ExtractionArena& ExtractionArena::for_thread() {
+  thread_local ExtractionArena arena;
+  return arena;
+}
+
+template <class T>
+Array<T> ExtractionArena::take(Array<Array<T>>& pool, std::size_t n) {
+  if (pool.empty()) return {};
+  // Best fit keeps big buffers for big requests (pools hold a handful):
+  // the smallest buffer holding `n`, else the largest one.
+  const auto better = [n](const Array<T>& a, const Array<T>& b) {
+    const bool a_fits = a.capacity() >= n;
+    const bool b_fits = b.capacity() >= n;
+    if (a_fits != b_fits) return a_fits;
+    return a_fits ? a.capacity() < b.capacity() : a.capacity() > b.capacity();
+  };
+  auto it = std::min_element(pool.begin(), pool.end(), better);
+  Array<T> v = std::move(*it);
+  *it = std::move(pool.back());
+  pool.pop_back();
+  retained_ -= v.capacity() * sizeof(T);
+  return v;
+}
+
+template <class T>
+void ExtractionArena::give(Array<Array<T>>& pool, Array<T>&& v) {
+  const std::size_t bytes = v.capacity() * sizeof(T);
+  if (bytes == 0 || retained_ + bytes > max_retained_) {
+    Array<T>().swap(v);
+    return;
+  }
+  v.clear();
+  retained_ += bytes;
+  pool.push_back(std::move(v));
+  if (pool.size() > kMaxPooled) {
+    auto smallest = std::min_element(pool.begin(), pool.end(),
+                                     [](const Array<T>& a, const Array<T>& b) {
+                                       return a.capacity() < b.capacity();
+                                     });
+    retained_ -= smallest->capacity() * sizeof(T);
+    *smallest = std::move(pool.back());
+    pool.pop_back();
+  }
+}
+
+Array<float> ExtractionArena::floats(std::size_t n) {
+  return take(floats_, n);
+}
+Array<Peak> ExtractionArena::peaks(std::size_t n) { return take(peaks_, n); }
+void ExtractionArena::recycle(Array<float>&& v) { give(floats_, std::move(v)); }
+void ExtractionArena::recycle(Array<Peak>&& v) { give(peaks_, std::move(v)); }
+
+void ExtractionArena::release() {
+  floats_.clear();
+  peaks_.clear();
+  retained_ = 0;
+}
+} // namespace afp
@@ -1,4 +1,450 @@
 #include "afp/audio.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <numeric>
+#include <optional>
+
+// Vendored single-header decoders do not build clean under our warnings.
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wconversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#endif
+#define DR_FLAC_IMPLEMENTATION
+#include "dr_flac.h"
+#define DR_MP3_IMPLEMENTATION
+#include "dr_mp3.h"
+#define DR_WAV_IMPLEMENTATION
+#include "dr_wav.h"
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
 namespace afp {
-}
\ No newline at end of file
+namespace {
+/// Zero crossings of the sinc kernel kept on each side of the center tap.
+constexpr double kSincZeroCrossings = 16.0;
+/// Passband edge as a fraction of the output Nyquist frequency.
+constexpr double kRolloff = 0.95;
+/// Taps per phase are padded (with leading zeros) to a multiple of this so
+/// the dot product runs in whole vector-width blocks.
+constexpr std::size_t kTapAlign = 8;
+/// Largest bank cached, in coefficients (4 MiB); ratios that reduce to more
+/// phases compute each output's phase on the fly.
+constexpr std::size_t kMaxBankCoeffs = std::size_t{1} << 20;
+
+double blackman(double x) {
+  // x in [-1, 1]
+  const double a = std::numbers::pi * (x + 1.0);
+  return 0.42 - 0.5 * std::cos(a) + 0.08 * std::cos(2.0 * a);
+}
+
+/// `sum(a[i] * b[i])` for `n` a multiple of `kTapAlign`.
+float dot(const float* a, const float* b, std::size_t n) {
+  // Independent lanes let the loop vectorize without -ffast-math.
+  float lane[kTapAlign] = {};
+  for (std::size_t i = 0; i < n; i += kTapAlign) {
+    for (std::size_t j = 0; j < kTapAlign; ++j) lane[j] += a[i + j] * b[i + j];
+  }
+  float acc = 0.f;
+  for (const float v : lane) acc += v;
+  return acc;
+}
+} // namespace
+
+struct ResampleBank {
+  std::uint64_t up{};
+  std::uint64_t down{};
+  /// Cutoff in cycles per input sample.
+  double fc{};
+  /// Filter half-width in input samples (`2 * half_width` live taps).
+  std::int64_t half_width{};
+  /// Taps per phase, a multiple of `kTapAlign`; the first `lead` are zero.
+  std::size_t taps{};
+  std::int64_t lead{};
+  /// `up * taps` coefficients, phase-major; empty if over `kMaxBankCoeffs`.
+  Array<float> coeffs;
+
+  ResampleBank(std::uint32_t src_sr, std::uint32_t dst_sr) {
+    const std::uint32_t g = std::gcd(src_sr, dst_sr);
+    up = dst_sr / g;
+    down = src_sr / g;
+    const double ratio = std::min(
+        1.0, static_cast<double>(dst_sr) / static_cast<double>(src_sr));
+    fc = 0.5 * ratio * kRolloff;
+    half_width =
+        static_cast<std::int64_t>(std::ceil(kSincZeroCrossings / (2.0 * fc)));
+    const auto live = static_cast<std::size_t>(2 * half_width);
+    taps = (live + kTapAlign - 1) / kTapAlign * kTapAlign;
+    lead = static_cast<std::int64_t>(taps - live);
+    if (up * taps <= kMaxBankCoeffs) {
+      coeffs.resize(up * taps);
+      for (std::uint64_t p = 0; p < up; ++p) fill(p, coeffs.data() + p * taps);
+    }
+  }
+
+  /// Coefficients of `phase` (output at `phase / up` past an input sample),
+  /// for the window starting `half_width - 1 + lead` samples before it.
+  void fill(std::uint64_t phase, float* out) const {
+    const double frac = static_cast<double>(phase) / static_cast<double>(up);
+    const auto hw = static_cast<double>(half_width);
+    std::fill_n(out, lead, 0.f);
+    for (std::int64_t k = 0; k < 2 * half_width; ++k) {
+      const double x = static_cast<double>(k - half_width + 1) - frac;
+      const double arg = std::numbers::pi * 2.0 * fc * x;
+      const double sinc = arg == 0.0 ? 1.0 : std::sin(arg) / arg;
+      out[lead + k] = static_cast<float>(2.0 * fc * sinc * blackman(x / hw));
+    }
+  }
+};
+
+namespace {
+/// The process-wide bank for `src_sr → dst_sr` (built on first use).
+std::shared_ptr<const ResampleBank> bank_for(std::uint32_t src_sr,
+                                             std::uint32_t dst_sr) {
+  static std::mutex mu;
+  static Map<std::pair<std::uint32_t, std::uint32_t>,
+             std::shared_ptr<const ResampleBank>>
+      cache;
+  const std::lock_guard<std::mutex> lock(mu);
+  auto& bank = cache[{src_sr, dst_sr}];
+  if (!bank) bank = std::make_shared<const ResampleBank>(src_sr, dst_sr);
+  return bank;
+}
+} // namespace
+
+struct AudioStream::Impl {
+  enum class Codec { None, Wav, Flac, Mp3 };
+
+  // Declared first so it is unmapped after the decoders are closed.
+  std::optional<MappedFile> file;
+  Codec codec{};
+  drwav wav{};
+  drflac* flac{};
+  drmp3 mp3{};
+  std::uint32_t sr{};
+  std::uint16_t channels{};
+  /// Frames left before the end of the decode window.
+  std::uint64_t remaining = std::numeric_limits<std::uint64_t>::max();
+  /// One chunk of interleaved decoder output.
+  Array<float> interleaved;
+
+  Impl() = default;
+  Impl(const Impl&) = delete;
+  Impl& operator=(const Impl&) = delete;
+
+  ~Impl() {
+    switch (codec) {
+      case Codec::None: break;
+      case Codec::Wav: drwav_uninit(&wav); break;
+      case Codec::Flac: drflac_close(flac); break;
+      case Codec::Mp3: drmp3_uninit(&mp3); break;
+    }
+  }
+
+  std::uint64_t decode(std::uint64_t frames, float* out) {
+    switch (codec) {
+      case Codec::None: break;
+      case Codec::Wav: return drwav_read_pcm_frames_f32(&wav, frames, out);
+      case Codec::Flac: return drflac_read_pcm_frames_f32(flac, frames, out);
+      case Codec::Mp3: return drmp3_read_pcm_frames_f32(&mp3, frames, out);
+    }
+    return 0;
+  }
+
+  bool seek(std::uint64_t frame) {
+    switch (codec) {
+      case Codec::None: break;
+      case Codec::Wav: return drwav_seek_to_pcm_frame(&wav, frame);
+      case Codec::Flac: return drflac_seek_to_pcm_frame(flac, frame);
+      case Codec::Mp3: return drmp3_seek_to_pcm_frame(&mp3, frame);
+    }
+    return false;
+  }
+
+  /// Probe the decoders over `encoded`.
+  Result<OK> probe(std::span<const std::uint8_t> encoded) {
+    // MP3 goes last: its decoder resyncs past arbitrary leading bytes.
+    if (drwav_init_memory(&wav, encoded.data(), encoded.size(), nullptr)) {
+      codec = Codec::Wav;
+      sr = wav.sampleRate;
+      channels = wav.channels;
+    } else if ((flac = drflac_open_memory(encoded.data(), encoded.size(),
+                                          nullptr)) != nullptr) {
+      codec = Codec::Flac;
+      sr = flac->sampleRate;
+      channels = flac->channels;
+    } else if (drmp3_init_memory(&mp3, encoded.data(), encoded.size(),
+                                 nullptr)) {
+      codec = Codec::Mp3;
+      sr = mp3.sampleRate;
+      channels = static_cast<std::uint16_t>(mp3.channels);
+    } else {
+      return tl::unexpected(Error::UnsupportedFormat);
+    }
+    if (sr == 0 || channels == 0) {
+      return tl::unexpected(Error::UnsupportedFormat);
+    }
+    return OK{};
+  }
+};
+
+AudioStream::AudioStream(std::unique_ptr<Impl> impl)
+    : impl_(std::move(impl)) {}
+AudioStream::AudioStream(AudioStream&&) noexcept = default;
+AudioStream& AudioStream::operator=(AudioStream&&) noexcept = default;
+AudioStream::~AudioStream() = default;
+
+Result<AudioStream> AudioStream::open(std::span<const std::uint8_t> encoded) {
+  if (encoded.empty()) return tl::unexpected(Error::EmptyAudio);
+  auto impl = std::make_unique<Impl>();
+  if (auto r = impl->probe(encoded); !r) return tl::unexpected(r.error());
+  return AudioStream(std::move(impl));
+}
+
+Result<AudioStream> AudioStream::open(const std::filesystem::path& path) {
+  auto file = MappedFile::open(path);
+  if (!file) return tl::unexpected(file.error());
+  if (file->bytes().empty()) return tl::unexpected(Error::EmptyAudio);
+  auto impl = std::make_unique<Impl>();
+  impl->file = std::move(*file);
+  if (auto r = impl->probe(impl->file->bytes()); !r) {
+    return tl::unexpected(r.error());
+  }
+  return AudioStream(std::move(impl));
+}
+
+std::uint32_t AudioStream::sample_rate() const { return impl_->sr; }
+std::uint16_t AudioStream::channels() const { return impl_->channels; }
+
+std::uint64_t AudioStream::total_frames() {
+  Impl& s = *impl_;
+  switch (s.codec) {
+    case Impl::Codec::None: break;
+    case Impl::Codec::Wav: return s.wav.totalPCMFrameCount;
+    case Impl::Codec::Flac: return s.flac->totalPCMFrameCount;
+    case Impl::Codec::Mp3: return drmp3_get_pcm_frame_count(&s.mp3);
+  }
+  return 0;
+}
+
+Result<OK> AudioStream::set_window(DecodeWindow window) {
+  const double start = window.start_seconds;
+  const double len = window.max_seconds;
+  if (!std::isfinite(start) || !std::isfinite(len) || start < 0.0 ||
+      len < 0.0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  Impl& s = *impl_;
+  const auto sr = static_cast<double>(s.sr);
+  if (!s.seek(static_cast<std::uint64_t>(std::llround(start * sr)))) {
+    return tl::unexpected(Error::DecodeError);
+  }
+  s.remaining = len > 0.0
+                    ? static_cast<std::uint64_t>(std::llround(len * sr))
+                    : std::numeric_limits<std::uint64_t>::max();
+  return OK{};
+}
+
+std::size_t AudioStream::read(std::size_t max_frames, Array<float>& mid,
+                              Array<float>* side) {
+  Impl& s = *impl_;
+  max_frames = static_cast<std::size_t>(
+      std::min<std::uint64_t>(max_frames, s.remaining));
+  const std::size_t ch = s.channels;
+  if (ch == 1) {
+    mid.resize(max_frames);
+    mid.resize(static_cast<std::size_t>(s.decode(max_frames, mid.data())));
+    if (side) side->clear();
+    s.remaining -= mid.size();
+    return mid.size();
+  }
+  s.interleaved.resize(max_frames * ch);
+  const auto n =
+      static_cast<std::size_t>(s.decode(max_frames, s.interleaved.data()));
+  s.remaining -= n;
+  const std::span<const float> x(s.interleaved.data(), n * ch);
+  downmix_mid(x, s.channels, mid);
+  if (side) {
+    side->resize(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      (*side)[i] = 0.5f * (x[i * ch] - x[i * ch + 1]);
+    }
+  }
+  return n;
+}
+
+void downmix_mid(std::span<const float> interleaved, std::uint16_t channels,
+                 Array<float>& mid) {
+  const std::size_t ch = channels;
+  const std::size_t n = interleaved.size() / ch;
+  const float* x = interleaved.data();
+  mid.resize(n);
+  float* m = mid.data();
+  if (ch == 1) {
+    std::copy_n(x, n, m);
+  } else if (ch == 2) {
+    for (std::size_t i = 0; i < n; ++i) m[i] = 0.5f * (x[2 * i] + x[2 * i + 1]);
+  } else {
+    const float inv_ch = 1.f / static_cast<float>(ch);
+    for (std::size_t i = 0; i < n; ++i) {
+      float acc = 0.f;
+      for (std::size_t c = 0; c < ch; ++c) acc += x[i * ch + c];
+      m[i] = acc * inv_ch;
+    }
+  }
+}
+
+namespace {
+Result<MidSide> drain(Result<AudioStream> stream, DecodeMode mode,
+                      DecodeWindow window) {
+  if (!stream) return tl::unexpected(stream.error());
+  if (auto r = stream->set_window(window); !r) {
+    return tl::unexpected(r.error());
+  }
+  const bool with_side =
+      mode == DecodeMode::MidSide && stream->channels() >= 2;
+  MidSide out{PCM{{}, stream->sample_rate()}, std::nullopt};
+  if (with_side) out.side_opt = PCM{{}, stream->sample_rate()};
+  Array<float> mid;
+  Array<float> side;
+  while (stream->read(kDecodeChunkFrames, mid, with_side ? &side : nullptr)) {
+    out.mid.samples.insert(out.mid.samples.end(), mid.begin(), mid.end());
+    if (with_side) {
+      out.side_opt->samples.insert(out.side_opt->samples.end(), side.begin(),
+                                   side.end());
+    }
+  }
+  if (out.mid.samples.empty()) return tl::unexpected(Error::EmptyAudio);
+  return out;
+}
+} // namespace
+
+Result<MidSide> decode_and_downmix(ByteArray input, DecodeMode mode,
+                                   DecodeWindow window) {
+  return drain(AudioStream::open(std::span<const std::uint8_t>(input)), mode,
+               window);
+}
+
+Result<MidSide> decode_and_downmix(std::span<const std::uint8_t> input,
+                                   DecodeMode mode, DecodeWindow window) {
+  return drain(AudioStream::open(input), mode, window);
+}
+
+Result<MidSide> decode_and_downmix(const std::filesystem::path& path,
+                                   DecodeMode mode, DecodeWindow window) {
+  return drain(AudioStream::open(path), mode, window);
+}
+
+StreamHighpass::StreamHighpass(float cutoff_hz, std::uint32_t sr)
+    : r_(static_cast<float>(std::exp(-2.0 * std::numbers::pi * cutoff_hz /
+                                     static_cast<double>(sr)))) {}
+
+void StreamHighpass::process(std::span<float> x) {
+  for (float& v : x) {
+    const float y = v - x1_ + r_ * y1_;
+    x1_ = v;
+    y1_ = y;
+    v = y;
+  }
+}
+
+StreamResampler::StreamResampler(std::uint32_t src_sr, std::uint32_t dst_sr)
+    : bank_(bank_for(src_sr, dst_sr)) {
+  // Zeros before sample 0 stand in for taps that fall off the start.
+  const std::int64_t pad = bank_->half_width - 1 + bank_->lead;
+  hist_.assign(static_cast<std::size_t>(pad), 0.f);
+  hist_start_ = -pad;
+  if (bank_->coeffs.empty()) phase_.resize(bank_->taps);
+}
+
+void StreamResampler::process(std::span<const float> in, Array<float>& out) {
+  hist_.insert(hist_.end(), in.begin(), in.end());
+  consumed_ += in.size();
+  drain(out, false);
+}
+
+void StreamResampler::flush(Array<float>& out) {
+  hist_.resize(hist_.size() + static_cast<std::size_t>(bank_->half_width) + 1,
+               0.f);
+  drain(out, true);
+}
+
+void StreamResampler::drain(Array<float>& out, bool flushing) {
+  const ResampleBank& b = *bank_;
+  const std::int64_t available =
+      hist_start_ + static_cast<std::int64_t>(hist_.size());
+  const std::uint64_t total_out = (consumed_ * b.up + b.down - 1) / b.down;
+  // Window of output `n`: `taps` samples ending at `n*down/up + half_width`.
+  const std::int64_t back = b.half_width - 1 + b.lead;
+  while (!flushing || next_out_ < total_out) {
+    const std::uint64_t t_num = next_out_ * b.down;
+    const auto t_int = static_cast<std::int64_t>(t_num / b.up);
+    if (t_int + b.half_width >= available) break;
+
+    const std::uint64_t phase = t_num % b.up;
+    const float* h = b.coeffs.data() + phase * b.taps;
+    if (b.coeffs.empty()) {
+      b.fill(phase, phase_.data());
+      h = phase_.data();
+    }
+    const float* x =
+        hist_.data() + static_cast<std::size_t>(t_int - back - hist_start_);
+    out.push_back(dot(x, h, b.taps));
+    ++next_out_;
+  }
+
+  // Drop history no longer reachable by the next output's window.
+  const auto next_t = static_cast<std::int64_t>(next_out_ * b.down / b.up);
+  const std::int64_t keep_from = next_t - back;
+  if (keep_from > hist_start_) {
+    const auto drop = std::min<std::uint64_t>(
+        hist_.size(), static_cast<std::uint64_t>(keep_from - hist_start_));
+    hist_.erase(hist_.begin(),
+                hist_.begin() + static_cast<std::ptrdiff_t>(drop));
+    hist_start_ += static_cast<std::int64_t>(drop);
+  }
+}
+
+Result<PCM> dc_highpass(PCM x, float cutoff_hz) {
+  if (x.sr == 0 || cutoff_hz <= 0.f) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  StreamHighpass hpf(cutoff_hz, x.sr);
+  hpf.process(x.samples);
+  return x;
+}
+
+Result<MidSide> resample_if_needed(PCM mid, std::optional<PCM> side_opt,
+                                   std::uint32_t target_sr,
+                                   ExtractionArena* arena) {
+  if (target_sr == 0 || mid.sr == 0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (mid.sr == target_sr) return MidSide{std::move(mid), std::move(side_opt)};
+
+  auto resample = [&](PCM& in) {
+    const std::size_t n = in.samples.size() * target_sr / in.sr + 1;
+    PCM out{arena ? arena->floats(n) : Array<float>{}, target_sr};
+    out.samples.reserve(n);
+    // Chunked, so the resampler's history stays small.
+    StreamResampler rs(in.sr, target_sr);
+    const std::span<const float> x(in.samples);
+    for (std::size_t i = 0; i < x.size(); i += kDecodeChunkFrames) {
+      rs.process(x.subspan(i, std::min(kDecodeChunkFrames, x.size() - i)),
+                 out.samples);
+    }
+    rs.flush(out.samples);
+    if (arena) arena->recycle(std::move(in.samples));
+    return out;
+  };
+  MidSide res{resample(mid), std::nullopt};
+  if (side_opt) res.side_opt = resample(*side_opt);
+  return res;
+}
+} // namespace afp
@@ -1,4 +1,802 @@
 #include "afp/build.hpp"
+#include "afp/pack.hpp"
+#include "afp/util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <thread>
 
 namespace afp {
-}
\ No newline at end of file
+namespace {
+constexpr std::uint32_t kDefaultShardQueueDepth = 4096;
+/// Queued blocks a shard writer appends per write transaction.
+constexpr std::size_t kWriteBatchBlocks = 1024;
+constexpr std::size_t kDefaultRunTriples = std::size_t{1} << 22;
+/// Triples read per refill of one spilled run during the merge.
+constexpr std::size_t kRunReadChunk = std::size_t{1} << 14;
+
+/// One packed posting block `(key, block)` routed to its shard writer.
+using ShardItem = std::pair<Key, ByteArray>;
+
+/// Bounded multi-producer queue drained by a single shard writer.
+class ShardQueue {
+ public:
+  explicit ShardQueue(std::size_t capacity) : capacity_(capacity) {}
+
+  /// Block while full; returns false if the queue was aborted.
+  bool push(ShardItem item) {
+    std::unique_lock lock(mu_);
+    not_full_.wait(lock, [&] { return q_.size() < capacity_ || aborted_; });
+    if (aborted_) return false;
+    q_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /// Move up to `max` items into `out` (cleared first), blocking until one
+  /// is queued; false once closed and drained (or aborted).
+  bool pop_batch(Array<ShardItem>& out, std::size_t max) {
+    std::unique_lock lock(mu_);
+    not_empty_.wait(lock, [&] { return !q_.empty() || closed_ || aborted_; });
+    out.clear();
+    if (aborted_ || q_.empty()) return false;
+    const std::size_t n = std::min(max, q_.size());
+    for (std::size_t i = 0; i < n; ++i) {
+      out.push_back(std::move(q_.front()));
+      q_.pop_front();
+    }
+    not_full_.notify_all();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard lock(mu_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+  void abort() {
+    std::lock_guard lock(mu_);
+    aborted_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+ private:
+  std::mutex mu_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<ShardItem> q_;
+  std::size_t capacity_;
+  bool closed_{false};
+  bool aborted_{false};
+};
+
+/// Reorder stage in front of the shard queues: workers finish tracks in any
+/// order, but each track's items reach the queues in slot order, so every
+/// posting value gets its blocks in the same order whatever the thread count.
+class TrackReorder {
+ public:
+  /// `ahead`: slots a worker may start past the next one due, which bounds
+  /// the items held back.
+  TrackReorder(const KVHandle& kvh, std::deque<ShardQueue>& queues,
+               std::size_t ahead)
+      : kvh_(kvh), queues_(queues), ahead_(std::max<std::size_t>(ahead, 1)) {}
+
+  /// Block until slot `seq` may start; false once aborted.
+  bool admit(std::size_t seq) {
+    std::unique_lock lock(mu_);
+    turn_.wait(lock, [&] { return seq < next_ + ahead_ || aborted_; });
+    return !aborted_;
+  }
+
+  /// Hand in slot `seq`'s items (possibly none) and release every slot now
+  /// due, in order; false if a queue was aborted.
+  bool submit(std::size_t seq, Array<ShardItem> items) {
+    std::lock_guard lock(mu_);
+    held_.emplace(seq, std::move(items));
+    for (auto it = held_.find(next_); it != held_.end();
+         it = held_.find(next_)) {
+      for (ShardItem& item : it->second) {
+        if (!queues_[shard_for_key(kvh_, item.first)].push(std::move(item))) {
+          return false;
+        }
+      }
+      held_.erase(it);
+      ++next_;
+      turn_.notify_all();
+    }
+    return true;
+  }
+
+  void abort() {
+    std::lock_guard lock(mu_);
+    aborted_ = true;
+    turn_.notify_all();
+  }
+
+ private:
+  const KVHandle& kvh_;
+  std::deque<ShardQueue>& queues_;
+  std::size_t ahead_;
+  std::mutex mu_;
+  std::condition_variable turn_;
+  Map<std::size_t, Array<ShardItem>> held_;
+  std::size_t next_{};
+  bool aborted_{false};
+};
+
+/// Per-track result, merged into the report in manifest order.
+struct TrackOutcome {
+  bool ingested{false};
+  std::uint64_t keys{};
+  std::uint64_t unique_keys{};
+  Array<std::uint32_t> hist;
+  std::optional<TrackMeta> meta;
+  std::optional<std::string> warning;
+};
+
+std::string track_warning(std::uint32_t track_id, Error e) {
+  return "track " + std::to_string(track_id) + ": " +
+         std::string(error_name(e));
+}
+
+std::size_t worker_count(const BuildCfg& cfg, std::size_t tracks) {
+  std::size_t workers = cfg.workers;
+  if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+  return std::min(workers, std::max<std::size_t>(tracks, 1));
+}
+
+/// Run `work` on `n` threads and wait for all of them.
+template <class F>
+void run_pool(std::size_t n, F&& work) {
+  Array<std::thread> pool;
+  pool.reserve(n);
+  for (std::size_t w = 0; w < n; ++w) pool.emplace_back(work, w);
+  for (std::thread& t : pool) t.join();
+}
+
+/// Read and fingerprint one manifest entry; failures become a warning.
+/// Keys stay native (`Bits` wide) and in anchor order.
+template <unsigned Bits>
+std::optional<Array<PackedKeyWithTime<Bits>>> extract_entry(
+    std::uint32_t track_id, const std::string& uri, const BuildCfg& cfg,
+    TrackOutcome& out) {
+  // Decoded in place from the page cache; no heap copy of the file.
+  auto keys = extract_native_keys<Bits>(std::filesystem::path(uri),
+                                        cfg.feature, cfg.pairing,
+                                        cfg.key_layout);
+  if (!keys) {
+    out.warning = track_warning(track_id, keys.error());
+    return std::nullopt;
+  }
+  out.keys = keys->size();
+
+  TrackMeta meta;
+  meta.track_id = track_id;
+  meta.sr = cfg.feature.target_sr;
+  meta.fft = static_cast<std::uint16_t>(cfg.feature.frame_size);
+  meta.hop = static_cast<std::uint16_t>(cfg.feature.hop_size);
+  meta.frames = estimate_frames(uri, cfg.feature);
+  meta.audio_crc64 = crc64_of_uri(uri);
+  meta.key_layout_version = derive_version(cfg.key_layout);
+  out.meta = meta;
+  return std::move(*keys);
+}
+
+/// Store TrackMeta and fold outcomes into `report` in manifest order.
+Result<OK> fold_outcomes(const KVHandle& kvh, Array<TrackOutcome>& outcomes,
+                         BuildReport& report, Array<std::uint32_t>& hist) {
+  for (TrackOutcome& out : outcomes) {
+    if (out.warning) report.warnings.push_back(std::move(*out.warning));
+    if (!out.ingested) continue;
+    if (auto r = kv_put_trackmeta(kvh, *out.meta); !r) return r;
+    ++report.tracks_ingested;
+    report.keys_total += out.keys;
+    report.unique_keys += out.unique_keys;
+    merge_histogram(hist, out.hist);
+  }
+  return OK{};
+}
+
+/// Apply `cfg.value_compression` to the freshly created store.
+Result<OK> configure_codec(const KVHandle& kvh, const BuildCfg& cfg) {
+  auto codec = parse_value_compression(cfg.value_compression);
+  if (!codec) return tl::unexpected(codec.error());
+  if (codec->algo == Compression::None) return OK{};
+  codec->dictionary = cfg.value_dictionary;
+  codec->min_bytes = cfg.value_compress_min_bytes;
+  return kv_set_codec(kvh, std::move(*codec));
+}
+
+/// Record the build options a reader of the index may need to inspect.
+Result<OK> record_build_info(const KVHandle& kvh, const BuildCfg& cfg) {
+  return kv_put_info(kvh, kInfoPostingFormat,
+                     ByteArray{static_cast<std::uint8_t>(cfg.posting_format)});
+}
+
+/// Anchor count of a posting value (block headers only, payload skipped).
+std::uint64_t posting_length(ValueView value) {
+  std::uint64_t n = 0;
+  if (auto it = parse_posting_blocks(value)) {
+    while (auto block = it->next_block()) n += block->n;
+  }
+  return n;
+}
+
+/// Thin a posting value to `cap` anchors, independent of block order.
+/// - **Process:** all `(track_id, t)` pairs are sorted and every
+///   `n / cap`-th is kept (index `floor(i * n / cap)`), so each track keeps
+///   a share proportional to its length, spread over its whole duration;
+///   then one block per track is packed in the value's format.
+Result<ByteArray> truncate_postings(ValueView value, std::uint64_t cap) {
+  auto it = parse_posting_blocks(value);
+  if (!it) return tl::unexpected(it.error());
+  Array<std::pair<std::uint32_t, std::uint32_t>> anchors;
+  PostingFormat format = PostingFormat::Varint;
+  Array<std::uint32_t> times;
+  while (auto block = it->next_block()) {
+    format = block->format;
+    times.resize(block->n);
+    if (!it->read_times(times)) break;
+    for (const std::uint32_t t : times) {
+      anchors.emplace_back(block->track_id, t);
+    }
+  }
+  if (it->failed()) return tl::unexpected(Error::IntegrityError);
+  std::sort(anchors.begin(), anchors.end());
+  const std::uint64_t n = anchors.size();
+  if (cap < n) {
+    for (std::uint64_t i = 0; i < cap; ++i) {
+      anchors[i] = anchors[i * n / cap];
+    }
+    anchors.resize(cap);
+  }
+
+  ByteArray out;
+  for (std::size_t i = 0; i < anchors.size();) {
+    const std::uint32_t track = anchors[i].first;
+    times.clear();
+    for (; i < anchors.size() && anchors[i].first == track; ++i) {
+      times.push_back(anchors[i].second);
+    }
+    auto packed = pack_posting_block(track, times, format);
+    if (!packed) return tl::unexpected(packed.error());
+    out.insert(out.end(), packed->begin(), packed->end());
+  }
+  return out;
+}
+
+/// Stoplist keys longer than the `cfg.hot_key_pct` length percentile.
+/// - **Outputs:** number of hot keys (0 when the pass is disabled).
+Result<std::uint64_t> apply_hot_key_stoplist(const KVHandle& kvh,
+                                             const BuildCfg& cfg,
+                                             std::uint16_t shards) {
+  if (!(cfg.hot_key_pct > 0.f && cfg.hot_key_pct < 100.f)) {
+    return std::uint64_t{0};
+  }
+
+  // Pass 1: exact length distribution (distinct lengths are few).
+  Map<std::uint64_t, std::uint64_t> dist;
+  std::uint64_t keys = 0;
+  for (std::uint16_t s = 0; s < shards; ++s) {
+    auto r = scan_shard(kvh, s, [&](const Key&, ValueView v) {
+      ++dist[posting_length(v)];
+      ++keys;
+    });
+    if (!r) return tl::unexpected(r.error());
+  }
+  if (keys == 0) return std::uint64_t{0};
+  const auto rank = static_cast<std::uint64_t>(
+      std::ceil(static_cast<double>(cfg.hot_key_pct) / 100.0 *
+                static_cast<double>(keys)));
+  std::uint64_t cap = 0;
+  std::uint64_t seen = 0;
+  for (const auto& [len, n] : dist) {
+    cap = len;
+    if ((seen += n) >= rank) break;
+  }
+
+  // Pass 2: collect each shard's hot keys, then drop or truncate them.
+  Array<Key> hot;
+  for (std::uint16_t s = 0; s < shards; ++s) {
+    const std::size_t first = hot.size();
+    auto r = scan_shard(kvh, s, [&](const Key& k, ValueView v) {
+      if (posting_length(v) > cap) hot.push_back(k);
+    });
+    if (!r) return tl::unexpected(r.error());
+    for (std::size_t i = first; i < hot.size(); ++i) {
+      if (cfg.hot_key_policy == HotKeyPolicy::Drop) {
+        if (auto e = erase(kvh, s, hot[i]); !e) {
+          return tl::unexpected(e.error());
+        }
+        continue;
+      }
+      auto value = get(kvh, s, hot[i]);
+      if (!value) return tl::unexpected(value.error());
+      if (!*value) continue;
+      auto cut = truncate_postings(**value, cap);
+      if (!cut) return tl::unexpected(cut.error());
+      if (auto p = put_replace(kvh, s, hot[i], std::move(*cut)); !p) {
+        return tl::unexpected(p.error());
+      }
+    }
+  }
+
+  std::sort(hot.begin(), hot.end());
+  ByteArray list;
+  list.reserve(hot.size() * sizeof(Key::bytes));
+  for (const Key& k : hot) {
+    list.insert(list.end(), k.bytes.begin(), k.bytes.end());
+  }
+  const auto cap32 = static_cast<std::uint32_t>(
+      std::min<std::uint64_t>(cap, UINT32_MAX));
+  ByteArray cap_le;
+  for (int i = 0; i < 4; ++i) {
+    cap_le.push_back(static_cast<std::uint8_t>(cap32 >> (8 * i)));
+  }
+  if (auto r = kv_put_info(kvh, kInfoHotKeys, list); !r) {
+    return tl::unexpected(r.error());
+  }
+  if (auto r = kv_put_info(kvh, kInfoHotKeyCap, cap_le); !r) {
+    return tl::unexpected(r.error());
+  }
+  return hot.size();
+}
+
+/// One extracted key occurrence; spilled runs sort by (shard, key, track, t).
+struct Triple {
+  Key key;
+  std::uint16_t shard{};
+  std::uint32_t track_id{};
+  std::uint32_t t_anchor{};
+
+  friend bool operator<(const Triple& a, const Triple& b) {
+    return std::tie(a.shard, a.key, a.track_id, a.t_anchor) <
+           std::tie(b.shard, b.key, b.track_id, b.t_anchor);
+  }
+};
+
+/// On-disk size of one spilled triple: key bytes, then shard, track and
+/// time little-endian (no padding, so run files are fully defined).
+constexpr std::size_t kTripleBytes = sizeof(Key::bytes) + 2 + 4 + 4;
+
+void put_le(std::uint8_t* p, std::uint32_t v, int n) {
+  for (int i = 0; i < n; ++i) p[i] = static_cast<std::uint8_t>(v >> (8 * i));
+}
+
+std::uint32_t get_le(const std::uint8_t* p, int n) {
+  std::uint32_t v = 0;
+  for (int i = 0; i < n; ++i) v |= std::uint32_t{p[i]} << (8 * i);
+  return v;
+}
+
+void encode_triple(const Triple& t, std::uint8_t* p) {
+  std::copy(t.key.bytes.begin(), t.key.bytes.end(), p);
+  p += sizeof(Key::bytes);
+  put_le(p, t.shard, 2);
+  put_le(p + 2, t.track_id, 4);
+  put_le(p + 6, t.t_anchor, 4);
+}
+
+Triple decode_triple(const std::uint8_t* p) {
+  Triple t;
+  std::copy_n(p, sizeof(Key::bytes), t.key.bytes.begin());
+  p += sizeof(Key::bytes);
+  t.shard = static_cast<std::uint16_t>(get_le(p, 2));
+  t.track_id = get_le(p + 2, 4);
+  t.t_anchor = get_le(p + 6, 4);
+  return t;
+}
+
+/// Sort `buf` and write it to `file` as one run, then clear it.
+Result<OK> spill_run(Array<Triple>& buf, const std::filesystem::path& file) {
+  std::sort(buf.begin(), buf.end());
+  ByteArray bytes(buf.size() * kTripleBytes);
+  for (std::size_t i = 0; i < buf.size(); ++i) {
+    encode_triple(buf[i], bytes.data() + i * kTripleBytes);
+  }
+  std::ofstream out(file, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(bytes.data()),
+            static_cast<std::streamsize>(bytes.size()));
+  if (!out) return tl::unexpected(Error::KvWriteError);
+  buf.clear();
+  return OK{};
+}
+
+/// Buffered sequential reader over one spilled run.
+class RunReader {
+ public:
+  explicit RunReader(const std::filesystem::path& file)
+      : in_(file, std::ios::binary) {
+    refill();
+  }
+
+  [[nodiscard]] bool done() const { return pos_ == buf_.size(); }
+  [[nodiscard]] bool bad() const { return bad_; }
+  [[nodiscard]] const Triple& head() const { return buf_[pos_]; }
+
+  void advance() {
+    if (++pos_ == buf_.size()) refill();
+  }
+
+ private:
+  void refill() {
+    bytes_.resize(kRunReadChunk * kTripleBytes);
+    in_.read(reinterpret_cast<char*>(bytes_.data()),
+             static_cast<std::streamsize>(bytes_.size()));
+    const auto got = static_cast<std::size_t>(in_.gcount());
+    buf_.resize(got / kTripleBytes);
+    for (std::size_t i = 0; i < buf_.size(); ++i) {
+      buf_[i] = decode_triple(bytes_.data() + i * kTripleBytes);
+    }
+    bad_ = bad_ || in_.bad() || got % kTripleBytes != 0;
+    pos_ = 0;
+  }
+
+  std::ifstream in_;
+  ByteArray bytes_;
+  Array<Triple> buf_;
+  std::size_t pos_{};
+  bool bad_{false};
+};
+
+/// K-way merge over sorted runs (binary min-heap of run indices).
+class RunMerger {
+ public:
+  explicit RunMerger(std::deque<RunReader>& runs) : runs_(runs) {
+    for (std::size_t i = 0; i < runs_.size(); ++i) {
+      if (!runs_[i].done()) heap_.push_back(i);
+    }
+    std::make_heap(heap_.begin(), heap_.end(), cmp());
+  }
+
+  /// Smallest pending triple, or nullptr when all runs are exhausted.
+  [[nodiscard]] const Triple* peek() const {
+    return heap_.empty() ? nullptr : &runs_[heap_.front()].head();
+  }
+
+  void pop() {
+    std::pop_heap(heap_.begin(), heap_.end(), cmp());
+    RunReader& run = runs_[heap_.back()];
+    run.advance();
+    if (run.done()) {
+      heap_.pop_back();
+    } else {
+      std::push_heap(heap_.begin(), heap_.end(), cmp());
+    }
+  }
+
+ private:
+  /// Inverted order so the std heap keeps the smallest head on top.
+  struct HeadGreater {
+    const std::deque<RunReader>* runs;
+    bool operator()(std::size_t a, std::size_t b) const {
+      return (*runs)[b].head() < (*runs)[a].head();
+    }
+  };
+  [[nodiscard]] HeadGreater cmp() const { return HeadGreater{&runs_}; }
+
+  std::deque<RunReader>& runs_;
+  Array<std::size_t> heap_;
+};
+
+/// Feeds one shard's merged triples to `bulk_merge` as packed posting values.
+class PostingSource final : public SortedKeyValueSource {
+ public:
+  PostingSource(RunMerger& merger, std::uint16_t shard, const BuildCfg& cfg,
+                Array<std::uint32_t>& hist, std::uint64_t& unique_keys)
+      : merger_(merger),
+        shard_(shard),
+        cfg_(cfg),
+        hist_(hist),
+        unique_keys_(unique_keys) {}
+
+  std::optional<std::pair<Key, ByteArray>> next() override {
+    const Triple* t = merger_.peek();
+    if (t == nullptr || t->shard != shard_ || error) return std::nullopt;
+    const Key key = t->key;
+    auto same_key = [&](const Triple* x) {
+      return x != nullptr && x->shard == shard_ && x->key == key;
+    };
+
+    ByteArray value;
+    while (same_key(t = merger_.peek())) {
+      const std::uint32_t track_id = t->track_id;
+      times_.clear();
+      while (same_key(t = merger_.peek()) && t->track_id == track_id) {
+        if (times_.empty() || times_.back() != t->t_anchor) {
+          times_.push_back(t->t_anchor);
+        }
+        merger_.pop();
+      }
+      auto block = pack_posting_block(track_id, times_, cfg_.posting_format);
+      if (!block) {
+        error = block.error();
+        return std::nullopt;
+      }
+      observe_hotkey_histogram(hist_, times_.size());
+      ++unique_keys_;
+      value.insert(value.end(), block->begin(), block->end());
+    }
+    return std::make_pair(key, std::move(value));
+  }
+
+  /// First packing error, if any (iteration stops at it).
+  std::optional<Error> error;
+
+ private:
+  RunMerger& merger_;
+  std::uint16_t shard_;
+  const BuildCfg& cfg_;
+  Array<std::uint32_t>& hist_;
+  std::uint64_t& unique_keys_;
+  Array<std::uint32_t> times_;
+};
+} // namespace
+
+Result<BuildReport> build_db(
+    Array<std::pair<std::uint32_t, std::string>> manifest, BuildCfg cfg,
+    std::string_view kv_path) {
+  if (packed_key_bits(cfg.key_layout.total_bits) == 0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  const auto shards = static_cast<std::uint16_t>(1u << cfg.shard_bits);
+  auto kvh = open(kv_path, KVMode::Create, shards);
+  if (!kvh) return tl::unexpected(kvh.error());
+  if (auto r = configure_codec(*kvh, cfg); !r) {
+    (void)close(*kvh);
+    return tl::unexpected(r.error());
+  }
+
+  const std::size_t workers = worker_count(cfg, manifest.size());
+  const std::size_t depth = cfg.shard_queue_depth != 0
+                                ? cfg.shard_queue_depth
+                                : kDefaultShardQueueDepth;
+
+  std::deque<ShardQueue> queues;
+  for (std::uint16_t s = 0; s < shards; ++s) queues.emplace_back(depth);
+
+  // Tracks are released to the writers in `track_id` order (ties in
+  // manifest order), the order `build_db_bulk` writes blocks in.
+  Array<std::size_t> slots(manifest.size());
+  std::iota(slots.begin(), slots.end(), std::size_t{0});
+  std::stable_sort(slots.begin(), slots.end(),
+                   [&](std::size_t a, std::size_t b) {
+                     return manifest[a].first < manifest[b].first;
+                   });
+  TrackReorder reorder(*kvh, queues, 2 * workers);
+
+  std::atomic<bool> failed{false};
+  std::mutex fail_mu;
+  Error fail_error = Error::KvWriteError;
+  auto fail = [&](Error e) {
+    std::lock_guard lock(fail_mu);
+    if (!failed.exchange(true)) fail_error = e;
+    for (ShardQueue& q : queues) q.abort();
+    reorder.abort();
+  };
+
+  Array<std::thread> writers;
+  writers.reserve(shards);
+  for (std::uint16_t s = 0; s < shards; ++s) {
+    writers.emplace_back([&, s] {
+      Array<ShardItem> batch;
+      while (queues[s].pop_batch(batch, kWriteBatchBlocks)) {
+        if (auto r = put_append_many(*kvh, s, batch); !r) {
+          fail(r.error());
+          return;
+        }
+      }
+    });
+  }
+
+  Array<TrackOutcome> outcomes(manifest.size());
+  std::atomic<std::size_t> next{0};
+  auto work = [&](std::size_t /*worker*/) {
+    // The key width is picked once; keys stay native up to the queues.
+    auto r = with_packed_key(cfg.key_layout, [&](auto tag) -> Result<OK> {
+      constexpr unsigned kBits = decltype(tag)::kBits;
+      KeyTimeGroups<kBits> groups;
+      for (std::size_t seq = next++; seq < slots.size() && !failed;
+           seq = next++) {
+        if (!reorder.admit(seq)) return OK{};
+        const std::size_t i = slots[seq];
+        const auto& [track_id, uri] = manifest[i];
+        TrackOutcome& out = outcomes[i];
+        Array<ShardItem> items;
+        if (auto keys = extract_entry<kBits>(track_id, uri, cfg, out)) {
+          group_times_by_key(*keys, groups);
+          items.reserve(groups.size());
+          for (std::size_t g = 0; g < groups.size(); ++g) {
+            const auto times = groups.times_of(g);
+            auto block =
+                pack_posting_block(track_id, times, cfg.posting_format);
+            if (!block) return tl::unexpected(block.error());
+            observe_hotkey_histogram(out.hist, times.size());
+            items.emplace_back(to_key(groups.keys[g], cfg.key_layout),
+                               std::move(*block));
+          }
+          out.unique_keys = items.size();
+          out.ingested = true;
+        }
+        if (!reorder.submit(seq, std::move(items))) return OK{};
+      }
+      return OK{};
+    });
+    if (!r) fail(r.error());
+  };
+
+  run_pool(workers, work);
+  for (ShardQueue& q : queues) q.close();
+  for (std::thread& t : writers) t.join();
+  if (failed) {
+    (void)close(*kvh);
+    return tl::unexpected(fail_error);
+  }
+
+  BuildReport report;
+  Array<std::uint32_t> hist;
+  if (auto r = fold_outcomes(*kvh, outcomes, report, hist); !r) {
+    (void)close(*kvh);
+    return tl::unexpected(r.error());
+  }
+  if (auto r = record_build_info(*kvh, cfg); !r) {
+    (void)close(*kvh);
+    return tl::unexpected(r.error());
+  }
+  auto hot = apply_hot_key_stoplist(*kvh, cfg, shards);
+  if (!hot) {
+    (void)close(*kvh);
+    return tl::unexpected(hot.error());
+  }
+  report.hot_keys = *hot;
+  report.hotkey_histogram = render_histogram(hist);
+
+  if (auto r = finalize_shards(*kvh); !r) {
+    (void)close(*kvh);
+    return tl::unexpected(r.error());
+  }
+  if (auto r = close(*kvh); !r) return tl::unexpected(r.error());
+  return report;
+}
+
+Result<BuildReport> build_db_bulk(
+    Array<std::pair<std::uint32_t, std::string>> manifest, BuildCfg cfg,
+    std::string_view kv_path, BulkLoadCfg bulk) {
+  namespace fs = std::filesystem;
+  const fs::path spill_dir(bulk.spill_dir);
+  std::error_code ec;
+  fs::create_directories(spill_dir, ec);
+  if (ec) return tl::unexpected(Error::KvWriteError);
+
+  if (packed_key_bits(cfg.key_layout.total_bits) == 0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  const auto shards = static_cast<std::uint16_t>(1u << cfg.shard_bits);
+  auto kvh = open(kv_path, KVMode::Create, shards);
+  if (!kvh) return tl::unexpected(kvh.error());
+  if (auto r = configure_codec(*kvh, cfg); !r) {
+    (void)close(*kvh);
+    return tl::unexpected(r.error());
+  }
+
+  const std::size_t run_triples =
+      bulk.run_triples != 0 ? bulk.run_triples : kDefaultRunTriples;
+  Array<fs::path> runs;
+  std::mutex runs_mu;
+  std::atomic<std::size_t> run_seq{0};
+  std::atomic<bool> failed{false};
+  auto spill = [&](Array<Triple>& buf) {
+    if (buf.empty()) return true;
+    char name[32];
+    std::snprintf(name, sizeof(name), "run-%06zu.bin", run_seq++);
+    const fs::path file = spill_dir / name;
+    {
+      std::lock_guard lock(runs_mu);
+      runs.push_back(file);
+    }
+    if (!spill_run(buf, file)) {
+      failed = true;
+      return false;
+    }
+    return true;
+  };
+  auto cleanup = [&] {
+    for (const fs::path& f : runs) fs::remove(f, ec);
+  };
+
+  // Phase 1: extract in parallel; each worker spills its own sorted runs.
+  Array<TrackOutcome> outcomes(manifest.size());
+  std::atomic<std::size_t> next{0};
+  run_pool(worker_count(cfg, manifest.size()), [&](std::size_t /*worker*/) {
+    Array<Triple> buf;
+    buf.reserve(run_triples);
+    // Keys stay native through grouping; each distinct key of a track is
+    // converted once for the runs (sorted in on-disk order for the merge).
+    auto r = with_packed_key(cfg.key_layout, [&](auto tag) -> Result<OK> {
+      constexpr unsigned kBits = decltype(tag)::kBits;
+      KeyTimeGroups<kBits> groups;
+      for (std::size_t i = next++; i < manifest.size() && !failed;
+           i = next++) {
+        const auto& [track_id, uri] = manifest[i];
+        TrackOutcome& out = outcomes[i];
+        auto keys = extract_entry<kBits>(track_id, uri, cfg, out);
+        if (!keys) continue;
+        group_times_by_key(*keys, groups);
+        for (std::size_t g = 0; g < groups.size(); ++g) {
+          const Key key = to_key(groups.keys[g], cfg.key_layout);
+          const std::uint16_t shard = shard_for_key(*kvh, key);
+          for (const std::uint32_t t : groups.times_of(g)) {
+            buf.push_back({key, shard, track_id, t});
+            if (buf.size() >= run_triples && !spill(buf)) return OK{};
+          }
+        }
+        out.ingested = true;
+      }
+      spill(buf);
+      return OK{};
+    });
+    if (!r) failed = true;
+  });
+  if (failed) {
+    cleanup();
+    (void)close(*kvh);
+    return tl::unexpected(Error::KvWriteError);
+  }
+
+  // Phase 2: merge all runs; shards come out in order, keys sorted within.
+  BuildReport report;
+  Array<std::uint32_t> hist;
+  std::deque<RunReader> readers;
+  for (const fs::path& f : runs) readers.emplace_back(f);
+  RunMerger merger(readers);
+  std::optional<Error> merge_error;
+  while (const Triple* head = merger.peek()) {
+    PostingSource src(merger, head->shard, cfg, hist, report.unique_keys);
+    auto r = bulk_merge(*kvh, head->shard, SortedKeyValueIter{&src});
+    if (!r || src.error) {
+      merge_error = r ? *src.error : r.error();
+      break;
+    }
+  }
+  for (const RunReader& rd : readers) {
+    if (rd.bad()) merge_error = Error::KvMergeError;
+  }
+  readers.clear();
+  cleanup();
+  if (merge_error) {
+    (void)close(*kvh);
+    return tl::unexpected(*merge_error);
+  }
+
+  if (auto r = fold_outcomes(*kvh, outcomes, report, hist); !r) {
+    (void)close(*kvh);
+    return tl::unexpected(r.error());
+  }
+  if (auto r = record_build_info(*kvh, cfg); !r) {
+    (void)close(*kvh);
+    return tl::unexpected(r.error());
+  }
+  auto hot = apply_hot_key_stoplist(*kvh, cfg, shards);
+  if (!hot) {
+    (void)close(*kvh);
+    return tl::unexpected(hot.error());
+  }
+  report.hot_keys = *hot;
+  report.hotkey_histogram = render_histogram(hist);
+  if (auto r = finalize_shards(*kvh); !r) {
+    (void)close(*kvh);
+    return tl::unexpected(r.error());
+  }
+  if (auto r = close(*kvh); !r) return tl::unexpected(r.error());
+  return report;
+}
+} // namespace afp
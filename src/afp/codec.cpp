@@ -0,0 +1,282 @@
+#include "afp/codec.hpp"
+
+#include <charconv>
+#include <cstring>
+#include <string_view>
+
+#include <lz4.h>
+#include <zdict.h>
+#include <zstd.h>
+
+namespace afp {
+namespace {
+/// Values below this many bytes are not worth a codec call.
+constexpr std::uint32_t kDefaultMinBytes = 64;
+/// Sanity cap on a frame's declared raw size (guards corrupt headers).
+constexpr std::uint32_t kMaxRawBytes = std::uint32_t{1} << 30;
+/// Largest raw/stored ratio each codec can produce: an LZ4 sequence adds at
+/// most 255 bytes per input byte; a 4-byte zstd RLE block expands to one
+/// 128 KiB block. Claims beyond it are corrupt, and rejecting them keeps a
+/// tiny value from forcing a huge allocation.
+constexpr std::uint64_t kLz4MaxRatio = 255;
+constexpr std::uint64_t kZstdMaxRatio = std::uint64_t{1} << 15;
+
+void put_varint(ByteArray& out, std::uint32_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<std::uint8_t>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<std::uint8_t>(v));
+}
+
+bool get_varint(const std::uint8_t*& p, const std::uint8_t* end,
+                std::uint32_t& v) {
+  std::uint32_t x = 0;
+  for (unsigned shift = 0; shift < 35; shift += 7) {
+    if (p == end) return false;
+    const std::uint8_t b = *p++;
+    if (shift == 28 && b > 0x0F) return false;
+    x |= static_cast<std::uint32_t>(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) {
+      v = x;
+      return true;
+    }
+  }
+  return false;
+}
+
+struct FrameHeader {
+  Compression tag{};
+  std::uint32_t raw_len{};
+  std::uint32_t stored_len{};
+};
+
+/// Read one frame header and leave `p` at its payload.
+bool read_frame(const std::uint8_t*& p, const std::uint8_t* end,
+                FrameHeader& h) {
+  if (p == end) return false;
+  h.tag = static_cast<Compression>(*p++);
+  if (h.tag != Compression::None && h.tag != Compression::Lz4 &&
+      h.tag != Compression::Zstd) {
+    return false;
+  }
+  if (!get_varint(p, end, h.raw_len) || !get_varint(p, end, h.stored_len)) {
+    return false;
+  }
+  if (h.stored_len > static_cast<std::size_t>(end - p)) return false;
+  if (h.tag == Compression::None) return h.raw_len == h.stored_len;
+  const std::uint64_t ratio =
+      h.tag == Compression::Lz4 ? kLz4MaxRatio : kZstdMaxRatio;
+  return h.raw_len <= kMaxRawBytes && h.raw_len <= ratio * h.stored_len;
+}
+
+using CCtxPtr = std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)>;
+using DCtxPtr = std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)>;
+
+/// zstd contexts are not thread-safe; each thread keeps its own.
+ZSTD_CCtx* thread_cctx() {
+  thread_local CCtxPtr ctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+  return ctx.get();
+}
+
+ZSTD_DCtx* thread_dctx() {
+  thread_local DCtxPtr ctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+  return ctx.get();
+}
+} // namespace
+
+struct ValueCodec::Impl {
+  CodecCfg cfg;
+  ZSTD_CDict* cdict{nullptr};
+  ZSTD_DDict* ddict{nullptr};
+
+  Impl() = default;
+  Impl(const Impl&) = delete;
+  Impl& operator=(const Impl&) = delete;
+  ~Impl() {
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+  }
+};
+
+Result<CodecCfg> parse_value_compression(const char* spec) {
+  CodecCfg cfg;
+  const std::string_view s = spec != nullptr ? spec : "none";
+  const std::string_view name = s.substr(0, s.find(':'));
+  if (name == "none") {
+    cfg.algo = Compression::None;
+  } else if (name == "lz4") {
+    cfg.algo = Compression::Lz4;
+  } else if (name == "zstd") {
+    cfg.algo = Compression::Zstd;
+  } else {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (name.size() < s.size()) {
+    const char* first = s.data() + name.size() + 1;
+    const char* last = s.data() + s.size();
+    auto [ptr, ec] = std::from_chars(first, last, cfg.level);
+    if (ec != std::errc{} || ptr != last || cfg.algo == Compression::None) {
+      return tl::unexpected(Error::InvalidArgument);
+    }
+  }
+  return cfg;
+}
+
+Result<ByteArray> train_value_dictionary(const Array<ByteArray>& samples,
+                                         std::size_t dict_bytes) {
+  ByteArray joined;
+  Array<std::size_t> sizes;
+  sizes.reserve(samples.size());
+  for (const ByteArray& s : samples) {
+    joined.insert(joined.end(), s.begin(), s.end());
+    sizes.push_back(s.size());
+  }
+  ByteArray dict(dict_bytes);
+  const std::size_t n = ZDICT_trainFromBuffer(
+      dict.data(), dict.size(), joined.data(), sizes.data(),
+      static_cast<unsigned>(sizes.size()));
+  if (ZDICT_isError(n)) return tl::unexpected(Error::InvalidArgument);
+  dict.resize(n);
+  return dict;
+}
+
+ValueCodec::ValueCodec(std::shared_ptr<const Impl> impl)
+    : impl_(std::move(impl)) {}
+
+Result<ValueCodec> ValueCodec::create(CodecCfg cfg) {
+  auto impl = std::make_shared<Impl>();
+  if (cfg.min_bytes == 0) cfg.min_bytes = kDefaultMinBytes;
+  switch (cfg.algo) {
+    case Compression::None:
+      break;
+    case Compression::Lz4:
+      if (cfg.level < 0 || !cfg.dictionary.empty()) {
+        return tl::unexpected(Error::InvalidArgument);
+      }
+      if (cfg.level == 0) cfg.level = 1;
+      break;
+    case Compression::Zstd:
+      if (cfg.level == 0) cfg.level = ZSTD_CLEVEL_DEFAULT;
+      if (cfg.level < ZSTD_minCLevel() || cfg.level > ZSTD_maxCLevel()) {
+        return tl::unexpected(Error::InvalidArgument);
+      }
+      if (!cfg.dictionary.empty()) {
+        impl->cdict = ZSTD_createCDict(cfg.dictionary.data(),
+                                       cfg.dictionary.size(), cfg.level);
+        impl->ddict =
+            ZSTD_createDDict(cfg.dictionary.data(), cfg.dictionary.size());
+        if (impl->cdict == nullptr || impl->ddict == nullptr) {
+          return tl::unexpected(Error::InvalidArgument);
+        }
+      }
+      break;
+    default:
+      return tl::unexpected(Error::InvalidArgument);
+  }
+  impl->cfg = std::move(cfg);
+  return ValueCodec(std::move(impl));
+}
+
+const CodecCfg& ValueCodec::cfg() const { return impl_->cfg; }
+
+void ValueCodec::append_frame(ByteArray& out,
+                              std::span<const std::uint8_t> raw) const {
+  const CodecCfg& cfg = impl_->cfg;
+  const auto raw_len = static_cast<std::uint32_t>(raw.size());
+  if (cfg.algo != Compression::None && raw_len >= cfg.min_bytes &&
+      raw_len <= kMaxRawBytes) {
+    thread_local ByteArray packed;
+    std::size_t n = 0;
+    if (cfg.algo == Compression::Lz4) {
+      const int src = static_cast<int>(raw_len);
+      packed.resize(static_cast<std::size_t>(LZ4_compressBound(src)));
+      const int r = LZ4_compress_fast(
+          reinterpret_cast<const char*>(raw.data()),
+          reinterpret_cast<char*>(packed.data()), src,
+          static_cast<int>(packed.size()), cfg.level);
+      n = r > 0 ? static_cast<std::size_t>(r) : 0;
+    } else {
+      packed.resize(ZSTD_compressBound(raw.size()));
+      const std::size_t r =
+          impl_->cdict != nullptr
+              ? ZSTD_compress_usingCDict(thread_cctx(), packed.data(),
+                                         packed.size(), raw.data(),
+                                         raw.size(), impl_->cdict)
+              : ZSTD_compressCCtx(thread_cctx(), packed.data(),
+                                  packed.size(), raw.data(), raw.size(),
+                                  cfg.level);
+      n = ZSTD_isError(r) ? 0 : r;
+    }
+    // Keep the frame compressed only if it actually saves space.
+    if (n != 0 && n < raw.size()) {
+      out.push_back(static_cast<std::uint8_t>(cfg.algo));
+      put_varint(out, raw_len);
+      put_varint(out, static_cast<std::uint32_t>(n));
+      out.insert(out.end(), packed.begin(),
+                 packed.begin() + static_cast<std::ptrdiff_t>(n));
+      return;
+    }
+  }
+  out.push_back(static_cast<std::uint8_t>(Compression::None));
+  put_varint(out, raw_len);
+  put_varint(out, raw_len);
+  out.insert(out.end(), raw.begin(), raw.end());
+}
+
+Result<OK> ValueCodec::decode(std::span<const std::uint8_t> stored,
+                              ByteArray& out) const {
+  const std::uint8_t* p = stored.data();
+  const std::uint8_t* end = p + stored.size();
+  while (p != end) {
+    FrameHeader h;
+    if (!read_frame(p, end, h)) return tl::unexpected(Error::IntegrityError);
+    const std::size_t at = out.size();
+    if (h.tag == Compression::None) {
+      out.insert(out.end(), p, p + h.stored_len);
+    } else if (h.tag == Compression::Lz4) {
+      out.resize(at + h.raw_len);
+      const int r = LZ4_decompress_safe(
+          reinterpret_cast<const char*>(p),
+          reinterpret_cast<char*>(out.data() + at),
+          static_cast<int>(h.stored_len), static_cast<int>(h.raw_len));
+      if (r < 0 || static_cast<std::uint32_t>(r) != h.raw_len) {
+        return tl::unexpected(Error::IntegrityError);
+      }
+    } else {
+      out.resize(at + h.raw_len);
+      const std::size_t r =
+          impl_->ddict != nullptr
+              ? ZSTD_decompress_usingDDict(thread_dctx(), out.data() + at,
+                                           h.raw_len, p, h.stored_len,
+                                           impl_->ddict)
+              : ZSTD_decompressDCtx(thread_dctx(), out.data() + at,
+                                    h.raw_len, p, h.stored_len);
+      if (ZSTD_isError(r) || r != h.raw_len) {
+        return tl::unexpected(Error::IntegrityError);
+      }
+    }
+    p += h.stored_len;
+  }
+  return OK{};
+}
+
+std::optional<std::span<const std::uint8_t>> ValueCodec::raw_payload(
+    std::span<const std::uint8_t> stored) {
+  const std::uint8_t* p = stored.data();
+  const std::uint8_t* end = p + stored.size();
+  FrameHeader h;
+  if (!read_frame(p, end, h) || h.tag != Compression::None ||
+      p + h.stored_len != end) {
+    return std::nullopt;
+  }
+  return std::span<const std::uint8_t>(p, h.stored_len);
+}
+
+bool ValueCodec::single_frame(std::span<const std::uint8_t> stored) {
+  const std::uint8_t* p = stored.data();
+  const std::uint8_t* end = p + stored.size();
+  FrameHeader h;
+  return read_frame(p, end, h) && p + h.stored_len == end;
+}
+} // namespace afp
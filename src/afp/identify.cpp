@@ -1,4 +1,475 @@
 #include "afp/identify.hpp"
+#include "afp/audio.hpp"
+#include "afp/keys.hpp"
+#include "afp/kv.hpp"
+#include "afp/rank.hpp"
+#include "afp/util.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <variant>
+
+#include "dr_mp3.h"
 
 namespace afp {
-}
\ No newline at end of file
+namespace {
+/// Encoded bytes kept beyond the current MP3 frame so its successor header
+/// can be checked before decoding (one max-size frame plus a header).
+constexpr std::size_t kMp3Lookahead = 2 * 1441 + 4;
+constexpr std::uint64_t kNoEnd = std::numeric_limits<std::uint64_t>::max();
+/// Session window when `IdentifyCfg::session_window_frames` is 0.
+constexpr std::uint32_t kDefaultSessionWindowSeconds = 60;
+
+/// Bytes of a leading ID3v2 tag (header and footer included), 0 if none.
+std::size_t id3v2_size(std::span<const std::uint8_t> b) {
+  if (b.size() < 10 || b[0] != 'I' || b[1] != 'D' || b[2] != '3') return 0;
+  std::size_t size = 10 + ((std::size_t{b[6] & 0x7Fu} << 21) |
+                           (std::size_t{b[7] & 0x7Fu} << 14) |
+                           (std::size_t{b[8] & 0x7Fu} << 7) | (b[9] & 0x7Fu));
+  if (b[5] & 0x10) size += 10;
+  return size;
+}
+
+/// Session keys, native to the layout's width.
+template <unsigned Bits>
+struct SessionKeys {
+  // `fresh` receives each push's newly paired keys; `query` the voted ones
+  // still in the window, in anchor order.
+  Array<PackedKeyWithTime<Bits>> fresh;
+  std::deque<PackedKeyWithTime<Bits>> query;
+  // Index stoplist skipped at lookup, ascending (empty unless
+  // `cfg.skip_hot_keys`).
+  Array<PackedKey<Bits>> hot;
+};
+
+using AnySessionKeys =
+    std::variant<SessionKeys<32>, SessionKeys<48>, SessionKeys<64>>;
+
+/// Votes one query frame cast into one `(track_id, off_bin)` bin.
+struct FrameVotes {
+  std::uint32_t t_query{};
+  std::uint32_t track_id{};
+  std::int32_t off_bin{};
+  std::uint32_t n{};
+};
+
+/// `session_window_frames`, or the default span in frames.
+std::uint32_t session_window(const IdentifyCfg& cfg) {
+  if (cfg.session_window_frames != 0) return cfg.session_window_frames;
+  const std::uint64_t frames = std::uint64_t{kDefaultSessionWindowSeconds} *
+                               cfg.feature.target_sr /
+                               std::max(cfg.feature.hop_size, 1u);
+  return static_cast<std::uint32_t>(
+      std::clamp<std::uint64_t>(frames, 1, UINT32_MAX));
+}
+
+/// Gapless trim read from a Xing/Info tag frame.
+struct Mp3Gapless {
+  /// PCM frames to skip after the tag frame.
+  std::uint64_t delay{};
+  /// PCM frame (counted like `delay`) at which the stream ends.
+  std::uint64_t end{kNoEnd};
+};
+
+/// Parse the Xing/Info (and LAME) tag of the first audio `frame`, the way
+/// `drmp3_init` does, so pushed MP3 decodes like `AudioStream`.
+std::optional<Mp3Gapless> mp3_gapless(const std::uint8_t* frame,
+                                      std::size_t frame_bytes,
+                                      std::uint64_t frame_samples) {
+  if (frame_bytes < 4 || (frame[1] & 0x06) != 0x02) return std::nullopt;
+  const bool mpeg1 = frame[1] & 0x08;
+  const bool mono = (frame[3] & 0xC0) == 0xC0;
+  const std::size_t side = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+  const std::size_t at = 4 + ((frame[1] & 1) ? 0 : 2) + side;
+  if (at + 8 > frame_bytes) return std::nullopt;
+  const std::uint8_t* p = frame + at;
+  if (!std::equal(p, p + 4, "Xing") && !std::equal(p, p + 4, "Info")) {
+    return std::nullopt;
+  }
+  const std::uint8_t* const end = frame + frame_bytes;
+  const auto u32 = [](const std::uint8_t* q) {
+    return std::uint32_t{q[0]} << 24 | std::uint32_t{q[1]} << 16 |
+           std::uint32_t{q[2]} << 8 | q[3];
+  };
+  const std::uint8_t flags = p[7];
+  p += 8;
+  std::uint64_t total = kNoEnd;
+  if (flags & 0x01) {
+    if (p + 4 > end) return Mp3Gapless{};
+    total = u32(p) * frame_samples;
+    p += 4;
+  }
+  if (flags & 0x02) p += 4;
+  if (flags & 0x04) p += 100;
+  if (flags & 0x08) p += 4;
+
+  // LAME encoder delay/padding, 12 bits each, net of the decoder delay.
+  Mp3Gapless g;
+  std::uint64_t padding = 0;
+  if (p < end && p[0] != 0 && p + 21 + 14 < end) {
+    p += 21;
+    g.delay = ((std::uint32_t{p[0]} << 4) | (p[1] >> 4)) + 529u;
+    const int pad = (((p[1] & 0xF) << 8) | p[2]) - 529;
+    padding = static_cast<std::uint64_t>(std::max(pad, 0));
+  }
+  if (total != kNoEnd && total > padding) g.end = total - padding;
+  return g;
+}
+
+/// Stream `cfg.query_window` of a query through a fresh session.
+Result<IdentifyResult> identify_stream(Result<AudioStream> stream,
+                                       const IdentifyCfg& cfg,
+                                       std::string_view kv_path) {
+  if (!stream) return tl::unexpected(stream.error());
+  if (auto r = stream->set_window(cfg.query_window); !r) {
+    return tl::unexpected(r.error());
+  }
+  auto session = IdentifySession::open(cfg, kv_path);
+  if (!session) return tl::unexpected(session.error());
+  Array<float> mid;
+  std::size_t decoded = 0;
+  while (const std::size_t n = stream->read(kDecodeChunkFrames, mid)) {
+    decoded += n;
+    auto m = session->push_pcm(mid, 1, stream->sample_rate());
+    if (!m) return tl::unexpected(m.error());
+  }
+  if (decoded == 0) return tl::unexpected(Error::EmptyAudio);
+  return session->finish();
+}
+} // namespace
+
+Result<IdentifyResult> identify_audio(ByteArray query_input, IdentifyCfg cfg,
+                                      std::string_view kv_path) {
+  return identify_stream(
+      AudioStream::open(std::span<const std::uint8_t>(query_input)), cfg,
+      kv_path);
+}
+
+Result<IdentifyResult> identify_audio(
+    std::span<const std::uint8_t> query_input, IdentifyCfg cfg,
+    std::string_view kv_path) {
+  return identify_stream(AudioStream::open(query_input), cfg, kv_path);
+}
+
+Result<IdentifyResult> identify_audio(const std::filesystem::path& path,
+                                      IdentifyCfg cfg,
+                                      std::string_view kv_path) {
+  return identify_stream(AudioStream::open(path), cfg, kv_path);
+}
+
+struct IdentifySession::State {
+  IdentifyCfg cfg;
+  KVHandle kvh;
+  // Read transactions of every lookup; destroyed before `kvh` is closed.
+  std::optional<KVReadBatch> batch;
+
+  drmp3dec mp3{};
+  ByteArray encoded;
+  // MP3 framing: whether the ID3v2 probe and the first audio frame (a
+  // possible gapless tag) were seen, tag bytes left to drop, and PCM frames
+  // decoded after the tag with the window [delay, end) to emit.
+  bool mp3_probed{};
+  bool mp3_started{};
+  std::size_t mp3_skip{};
+  std::uint64_t mp3_at{};
+  Mp3Gapless mp3_trim;
+
+  // PCM → keys, native until they are looked up.
+  std::optional<StreamKeyExtractor> extractor;
+  AnySessionKeys keys;
+
+  // Votes of the frames in the window: per bin (`votes`), per bin in
+  // distinct frames (`covers`, the coverage numerators), and per frame in
+  // arrival order (`cast`) to expire them again. `frames` holds the window's
+  // distinct frames with a looked-up key (the coverage denominator).
+  std::uint32_t window{};
+  VoteTable votes;
+  VoteTable covers;
+  std::deque<FrameVotes> cast;
+  std::deque<std::uint32_t> frames;
+  Array<CastVote> fresh_votes;
+  std::uint32_t last_peak{};
+
+  void clear_stream() {
+    drmp3dec_init(&mp3);
+    encoded.clear();
+    mp3_probed = false;
+    mp3_started = false;
+    mp3_skip = 0;
+    mp3_at = 0;
+    mp3_trim = {};
+    extractor->reset();
+    std::visit(
+        [](auto& k) {
+          k.fresh.clear();
+          k.query.clear();
+        },
+        keys);
+    votes.clear();
+    covers.clear();
+    cast.clear();
+    frames.clear();
+    last_peak = 0;
+  }
+
+  Result<OK> vote();
+  void expire(std::uint32_t newest);
+  Result<IdentifyResult> evaluate(const BestByVotes& best);
+};
+
+Result<OK> IdentifySession::State::vote() {
+  return std::visit(
+      [&](auto& k) -> Result<OK> {
+        if (k.fresh.empty()) return OK{};
+        fresh_votes.clear();
+        auto voted = vote_offsets(k.fresh, *batch, cfg.pairing,
+                                  cfg.key_layout, votes, k.hot, &fresh_votes);
+        if (!voted) return voted;
+
+        // Pairing releases anchors frame by frame, so each frame's votes
+        // all arrive in one batch: count its bins for coverage once here.
+        std::sort(fresh_votes.begin(), fresh_votes.end(),
+                  [](const CastVote& a, const CastVote& b) {
+                    return std::tie(a.t_query, a.track_id, a.off_bin) <
+                           std::tie(b.t_query, b.track_id, b.off_bin);
+                  });
+        for (const CastVote& v : fresh_votes) {
+          if (!cast.empty() && cast.back().t_query == v.t_query &&
+              cast.back().track_id == v.track_id &&
+              cast.back().off_bin == v.off_bin) {
+            ++cast.back().n;
+            continue;
+          }
+          cast.push_back({v.t_query, v.track_id, v.off_bin, 1});
+          covers.add(v.track_id, v.off_bin);
+        }
+        for (const auto& kt : k.fresh) {
+          if (std::binary_search(k.hot.begin(), k.hot.end(), kt.key)) {
+            continue;
+          }
+          if (frames.empty() || frames.back() != kt.t_anchor) {
+            frames.push_back(kt.t_anchor);
+          }
+        }
+        k.query.insert(k.query.end(), k.fresh.begin(), k.fresh.end());
+        const std::uint32_t newest = k.fresh.back().t_anchor;
+        k.fresh.clear();
+
+        expire(newest);
+        while (!k.query.empty() &&
+               std::uint64_t{k.query.front().t_anchor} + window <= newest) {
+          k.query.pop_front();
+        }
+        return OK{};
+      },
+      keys);
+}
+
+void IdentifySession::State::expire(std::uint32_t newest) {
+  const auto old = [&](std::uint32_t t) {
+    return std::uint64_t{t} + window <= newest;
+  };
+  while (!cast.empty() && old(cast.front().t_query)) {
+    const FrameVotes& v = cast.front();
+    votes.remove(v.track_id, v.off_bin, v.n);
+    covers.remove(v.track_id, v.off_bin);
+    cast.pop_front();
+  }
+  while (!frames.empty() && old(frames.front())) frames.pop_front();
+}
+
+Result<IdentifyResult> IdentifySession::State::evaluate(
+    const BestByVotes& best) {
+  last_peak = best.stats.peak;
+  // A frame covers the winner if it voted into the winning bin.
+  const float coverage =
+      frames.empty() ? 0.f
+                     : static_cast<float>(covers.count(best.track_id,
+                                                       best.off_bin)) /
+                           static_cast<float>(frames.size());
+  auto entropy =
+      histogram_entropy(project_track_hist(votes, best.track_id),
+                        window_around(best.off_bin));
+  if (!entropy) return tl::unexpected(entropy.error());
+
+  if (coverage < cfg.min_coverage) {
+    return IdentifyResultNoMatch{"coverage below threshold"};
+  }
+  if (*entropy > cfg.max_entropy) {
+    return IdentifyResultNoMatch{"entropy above threshold"};
+  }
+  Match m;
+  m.track_id = best.track_id;
+  m.offset_seconds =
+      bin_to_seconds(best.off_bin, cfg.feature.hop_size, cfg.feature.target_sr,
+                     cfg.pairing.delta_bin_frames);
+  m.score = calibrate_confidence(best.stats.peak, coverage, *entropy);
+  return IdentifyResultMatch{m};
+}
+
+IdentifySession::IdentifySession(std::unique_ptr<State> state)
+    : state_(std::move(state)) {}
+
+IdentifySession::IdentifySession(IdentifySession&&) noexcept = default;
+IdentifySession& IdentifySession::operator=(IdentifySession&&) noexcept =
+    default;
+
+IdentifySession::~IdentifySession() {
+  if (!state_) return;
+  state_->batch.reset();
+  (void)close(state_->kvh);
+}
+
+Result<IdentifySession> IdentifySession::open(IdentifyCfg cfg,
+                                              std::string_view kv_path) {
+  auto extractor =
+      StreamKeyExtractor::create(cfg.feature, cfg.pairing, cfg.key_layout);
+  if (!extractor) return tl::unexpected(extractor.error());
+  auto kvh = afp::open(kv_path, KVMode::ReadOnly, 0);
+  if (!kvh) return tl::unexpected(kvh.error());
+
+  auto st = std::make_unique<State>();
+  st->extractor = std::move(*extractor);
+  st->cfg = cfg;
+  st->kvh = *kvh;
+  st->window = session_window(cfg);
+  // The key width is picked once; keys stay native from here on.
+  auto keyed = with_packed_key(cfg.key_layout, [&](auto tag) -> Result<OK> {
+    constexpr unsigned kBits = decltype(tag)::kBits;
+    auto& keys = st->keys.emplace<SessionKeys<kBits>>();
+    if (!cfg.skip_hot_keys) return OK{};
+    auto hot = load_hot_keys(st->kvh);
+    if (!hot) return tl::unexpected(hot.error());
+    keys.hot.reserve(hot->size());
+    for (const Key& k : *hot) {
+      keys.hot.push_back(from_key<kBits>(k, cfg.key_layout));
+    }
+    std::sort(keys.hot.begin(), keys.hot.end());
+    return OK{};
+  });
+  if (!keyed) {
+    (void)close(st->kvh);
+    return tl::unexpected(keyed.error());
+  }
+  st->batch.emplace(st->kvh);
+  st->clear_stream();
+  return IdentifySession(std::move(st));
+}
+
+Result<std::optional<Match>> IdentifySession::push_pcm(
+    std::span<const float> interleaved, std::uint16_t channels,
+    std::uint32_t sr) {
+  State& st = *state_;
+  auto pushed = std::visit(
+      [&](auto& k) {
+        return st.extractor->push_pcm(interleaved, channels, sr, k.fresh);
+      },
+      st.keys);
+  if (!pushed) return tl::unexpected(pushed.error());
+  if (auto r = st.vote(); !r) return tl::unexpected(r.error());
+  // Re-run the gates only when the leading bin's height changed.
+  if (st.votes.empty()) return std::nullopt;
+  auto best = select_best_by_votes(st.votes);
+  if (!best) return tl::unexpected(best.error());
+  if (best->stats.peak == st.last_peak) return std::nullopt;
+
+  auto res = st.evaluate(*best);
+  if (!res) return tl::unexpected(res.error());
+  if (auto* m = std::get_if<IdentifyResultMatch>(&*res)) return m->value;
+  return std::nullopt;
+}
+
+Result<std::optional<Match>> IdentifySession::push_encoded(
+    std::span<const std::uint8_t> bytes) {
+  state_->encoded.insert(state_->encoded.end(), bytes.begin(), bytes.end());
+  return decode_encoded(false);
+}
+
+Result<std::optional<Match>> IdentifySession::decode_encoded(bool at_end) {
+  State& st = *state_;
+  if (!st.mp3_probed) {
+    if (st.encoded.size() < 10 && !at_end) return std::nullopt;
+    st.mp3_probed = true;
+    st.mp3_skip = id3v2_size(st.encoded);
+  }
+  std::size_t pos = std::min(st.mp3_skip, st.encoded.size());
+  st.mp3_skip -= pos;
+
+  std::optional<Match> latest;
+  drmp3_int16 frame[DRMP3_MAX_SAMPLES_PER_FRAME];
+  Array<float> pcm;
+  // Mid-stream a frame is decoded only with its successor's header in the
+  // buffer; at the end the rest is drained.
+  while (at_end ? pos < st.encoded.size()
+                : st.encoded.size() - pos > kMp3Lookahead) {
+    drmp3dec_frame_info info{};
+    const std::uint8_t* data = st.encoded.data() + pos;
+    const int samples = drmp3dec_decode_frame(
+        &st.mp3, data, static_cast<int>(st.encoded.size() - pos), frame,
+        &info);
+    if (info.frame_bytes <= 0) break;
+    pos += static_cast<std::size_t>(info.frame_bytes);
+    if (samples <= 0) continue; // skipped garbage or a priming frame
+
+    const auto n = static_cast<std::uint64_t>(samples);
+    if (!st.mp3_started) {
+      st.mp3_started = true;
+      // A gapless tag frame is metadata, not audio.
+      if (auto tag = mp3_gapless(
+              data, static_cast<std::size_t>(info.frame_bytes), n)) {
+        st.mp3_trim = *tag;
+        continue;
+      }
+    }
+    const std::uint64_t first = st.mp3_at;
+    st.mp3_at += n;
+    const std::uint64_t lo = std::max(first, st.mp3_trim.delay);
+    const std::uint64_t hi = std::min(st.mp3_at, st.mp3_trim.end);
+    if (lo >= hi) continue;
+
+    const auto ch = static_cast<std::size_t>(info.channels);
+    pcm.resize(static_cast<std::size_t>(hi - lo) * ch);
+    const drmp3_int16* src = frame + static_cast<std::size_t>(lo - first) * ch;
+    for (std::size_t i = 0; i < pcm.size(); ++i) pcm[i] = src[i] / 32768.f;
+    auto m = push_pcm(pcm, static_cast<std::uint16_t>(info.channels),
+                      static_cast<std::uint32_t>(info.sample_rate));
+    if (!m) return m;
+    if (*m) latest = *m;
+  }
+  st.encoded.erase(st.encoded.begin(),
+                   st.encoded.begin() + static_cast<std::ptrdiff_t>(pos));
+  return latest;
+}
+
+Result<IdentifyResult> IdentifySession::finish() {
+  State& st = *state_;
+  if (auto r = decode_encoded(true); !r) return tl::unexpected(r.error());
+  auto flushed = std::visit(
+      [&](auto& k) { return st.extractor->finish(k.fresh); }, st.keys);
+  if (!flushed) return tl::unexpected(flushed.error());
+  if (auto r = st.vote(); !r) return tl::unexpected(r.error());
+  if (st.votes.empty()) return IdentifyResultNoMatch{"no votes"};
+  auto best = select_best_by_votes(st.votes);
+  if (!best) return tl::unexpected(best.error());
+  return st.evaluate(*best);
+}
+
+void IdentifySession::reset() { state_->clear_stream(); }
+
+Array<KeyWithTime> IdentifySession::query_keys() const {
+  return std::visit(
+      [&](const auto& k) {
+        Array<KeyWithTime> out;
+        out.reserve(k.query.size());
+        for (const auto& kt : k.query) {
+          out.push_back(
+              KeyWithTime{to_key(kt.key, state_->cfg.key_layout), kt.t_anchor});
+        }
+        return out;
+      },
+      state_->keys);
+}
+} // namespace afp
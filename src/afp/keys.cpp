@@ -1,4 +1,419 @@
 #include "afp/keys.hpp"
+#include "afp/audio.hpp"
+#include "afp/pairing.hpp"
+#include "afp/peaks.hpp"
+#include "afp/scale.hpp"
+#include "afp/stft.hpp"
+#include "afp/util.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+#include <utility>
 
 namespace afp {
-}
\ No newline at end of file
+namespace {
+/// Append the rows of `block` to the rolling window `win`.
+void append_rows(ScaledSpec& win, ScaledSpec block, ExtractionArena& arena) {
+  if (win.val.rows == 0) {
+    arena.recycle(std::move(win.val.data));
+    win = std::move(block);
+    return;
+  }
+  win.val.data.insert(win.val.data.end(), block.val.data.begin(),
+                      block.val.data.end());
+  win.val.rows += block.val.rows;
+  arena.recycle(std::move(block.val.data));
+}
+
+/// Drop the first `n` rows of the rolling window `win`.
+void drop_rows(ScaledSpec& win, std::uint32_t n) {
+  n = std::min(n, win.val.rows);
+  win.val.data.erase(
+      win.val.data.begin(),
+      win.val.data.begin() + static_cast<std::ptrdiff_t>(n) * win.val.cols);
+  win.val.rows -= n;
+}
+} // namespace
+
+struct StreamKeyExtractor::State {
+  FeatureCfg feat;
+  PairingCfg pair;
+  KeyLayout layout;
+  std::uint32_t block_frames{};
+  StftEngine stft;
+  // Spectra, candidates and thresholds of each block cycle through here.
+  std::unique_ptr<ExtractionArena> own_arena;
+  ExtractionArena* arena{};
+
+  // Input format, fixed by the first pushed chunk.
+  std::uint16_t channels{};
+  std::uint32_t sr{};
+  std::optional<StreamHighpass> hpf;
+  std::optional<StreamResampler> resampler;
+
+  // Target-rate PCM not yet covered by a full frame (STFT overlap).
+  Array<float> pcm;
+  Array<float> mono;
+
+  // Clip window and PCEN state span blocks.
+  StreamScaler scaler;
+
+  // Det rows stream through the detector (it keeps only the rows its
+  // windows need); candidates wait in `cands` until their rows settle.
+  std::optional<StreamPeakDetector> detector;
+  Array<Peak> cands;
+  // Rolling Base rows; row 0 is absolute frame `win_first`.
+  ScaledSpec base_win;
+  std::uint32_t win_first{};
+  // Frames below this have had their peaks emitted.
+  std::uint32_t settled{};
+
+  // Peaks awaiting pairing (sorted by (t,f), absolute frame index).
+  Array<Peak> peaks;
+
+  State(StftEngine engine, StreamScaler scale)
+      : stft(std::move(engine)), scaler(std::move(scale)) {}
+
+  void clear() {
+    channels = 0;
+    sr = 0;
+    hpf.reset();
+    resampler.reset();
+    pcm.clear();
+    scaler.reset();
+    detector.reset();
+    cands.clear();
+    base_win = ScaledSpec{};
+    win_first = 0;
+    settled = 0;
+    peaks.clear();
+  }
+
+  Result<OK> feed(std::span<const float> interleaved, std::uint16_t ch,
+                  std::uint32_t rate);
+  /// `Rec` is `KeyWithTime` or a `PackedKeyWithTime`.
+  template <class Rec>
+  Result<OK> run_frames(bool at_end, Array<Rec>& out);
+  Result<OK> detect(bool at_end);
+  template <class Rec>
+  Result<OK> pair_ready(bool at_end, Array<Rec>& out);
+};
+
+Result<OK> StreamKeyExtractor::State::feed(std::span<const float> interleaved,
+                                           std::uint16_t ch,
+                                           std::uint32_t rate) {
+  if (ch == 0 || rate == 0 || interleaved.size() % ch != 0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (sr == 0) {
+    channels = ch;
+    sr = rate;
+    hpf.emplace(kDcCutoffHz, rate);
+    if (rate != feat.target_sr) resampler.emplace(rate, feat.target_sr);
+  } else if (ch != channels || rate != sr) {
+    return tl::unexpected(Error::ConfigMismatch);
+  }
+
+  downmix_mid(interleaved, ch, mono);
+  hpf->process(mono);
+  if (resampler) {
+    resampler->process(mono, pcm);
+  } else {
+    pcm.insert(pcm.end(), mono.begin(), mono.end());
+  }
+  return OK{};
+}
+
+template <class Rec>
+Result<OK> StreamKeyExtractor::State::run_frames(bool at_end,
+                                                 Array<Rec>& out) {
+  if (pcm.size() < feat.frame_size) return OK{};
+  const std::size_t n_frames =
+      1 + (pcm.size() - feat.frame_size) / feat.hop_size;
+  if (!at_end && n_frames < block_frames) return OK{};
+  const auto used = static_cast<std::ptrdiff_t>(
+      (n_frames - 1) * feat.hop_size + feat.frame_size);
+  const auto advance = static_cast<std::ptrdiff_t>(n_frames * feat.hop_size);
+
+  STFTSpec spec{{}, feat.target_sr, feat.frame_size, feat.hop_size, "linear"};
+  spec.mag.data = arena->floats(n_frames * stft.bins());
+  auto mag = stft.magnitude(
+      std::span<const float>(pcm.data(), static_cast<std::size_t>(used)),
+      spec.mag);
+  if (!mag) return tl::unexpected(mag.error());
+  pcm.erase(pcm.begin(), pcm.begin() + advance);
+
+  auto scaled = scaler.push(std::move(spec), arena);
+  if (!scaled) return tl::unexpected(scaled.error());
+  auto dog = dog_enhance_freq(std::move(*scaled), feat.use_dog, kDogSigma1Bins,
+                              kDogSigma2Bins, arena);
+  if (!dog) return tl::unexpected(dog.error());
+
+  const Matrix<float>& det = dog->det.val;
+  if (!detector) {
+    detector.emplace(dog->det.fprime, feat.neigh_dt, feat.neigh_df);
+  }
+  for (std::uint32_t t = 0; t < det.rows; ++t) {
+    detector->push_row(std::span<const float>(det.data).subspan(
+                           std::size_t{t} * det.cols, det.cols),
+                       cands);
+  }
+  arena->recycle(std::move(dog->det.val.data));
+  append_rows(base_win, std::move(dog->base), *arena);
+  if (auto r = detect(false); !r) return r;
+  return pair_ready(false, out);
+}
+
+Result<OK> StreamKeyExtractor::State::detect(bool at_end) {
+  const std::uint32_t win_end = win_first + base_win.val.rows;
+  // A row is final once `neigh_dt` rows of future context exist; the
+  // detector has emitted the candidates of exactly those rows.
+  std::uint32_t ready = win_end;
+  if (!at_end) ready = win_end > feat.neigh_dt ? win_end - feat.neigh_dt : 0;
+  if (ready <= settled) return OK{};
+  if (at_end && detector) detector->finish(cands);
+
+  Array<Peak> batch = std::exchange(cands, arena->peaks(0));
+  for (Peak& p : batch) p.t -= win_first;
+
+  auto thr = per_frame_thresholds(base_win, arena);
+  if (!thr) return tl::unexpected(thr.error());
+  auto kept = filter_and_nms(std::move(batch), std::move(*thr), feat,
+                             base_win, arena);
+  if (kept) {
+    for (Peak p : *kept) {
+      p.t += win_first;
+      peaks.push_back(p);
+    }
+    arena->recycle(std::move(*kept));
+  } else if (kept.error() != Error::NoPeaks) {
+    return tl::unexpected(kept.error());
+  }
+  settled = ready;
+
+  // Keep the past context needed by the first unsettled row.
+  const std::uint32_t keep_from =
+      settled > feat.neigh_dt ? settled - feat.neigh_dt : 0;
+  if (keep_from > win_first) {
+    drop_rows(base_win, keep_from - win_first);
+    win_first = keep_from;
+  }
+  return OK{};
+}
+
+template <class Rec>
+Result<OK> StreamKeyExtractor::State::pair_ready(bool at_end,
+                                                 Array<Rec>& out) {
+  // Anchors are pairable once every target candidate up to dt_max is final.
+  const std::uint64_t horizon =
+      at_end ? std::numeric_limits<std::uint64_t>::max() : settled;
+
+  std::size_t idx = 0;
+  while (idx < peaks.size() &&
+         static_cast<std::uint64_t>(peaks[idx].t) + pair.dt_max_frames <
+             horizon) {
+    ++idx;
+  }
+  if (auto r = pair_peaks(peaks, idx, pair, layout, out); !r) return r;
+  // Peaks before the next anchor's frame can no longer be targets.
+  if (idx > 0) {
+    constexpr auto kNone = std::numeric_limits<std::uint32_t>::max();
+    const std::uint32_t next_t = idx < peaks.size() ? peaks[idx].t : kNone;
+    std::erase_if(peaks, [&](const Peak& p) { return p.t < next_t; });
+  }
+  return OK{};
+}
+
+StreamKeyExtractor::StreamKeyExtractor(std::unique_ptr<State> state)
+    : state_(std::move(state)) {}
+StreamKeyExtractor::StreamKeyExtractor(StreamKeyExtractor&&) noexcept =
+    default;
+StreamKeyExtractor& StreamKeyExtractor::operator=(
+    StreamKeyExtractor&&) noexcept = default;
+StreamKeyExtractor::~StreamKeyExtractor() = default;
+
+Result<StreamKeyExtractor> StreamKeyExtractor::create(
+    FeatureCfg feat, PairingCfg pair, KeyLayout layout,
+    std::uint32_t block_frames, ExtractionArena* arena) {
+  if (feat.target_sr == 0 || feat.hop_size == 0 ||
+      feat.frame_size < feat.hop_size || pair.delta_bin_frames == 0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (feat.use_reassignment) return tl::unexpected(Error::InvalidArgument);
+  auto stft = StftEngine::create(feat.frame_size, feat.hop_size);
+  if (!stft) return tl::unexpected(stft.error());
+  auto scaler = StreamScaler::create(feat);
+  if (!scaler) return tl::unexpected(scaler.error());
+
+  auto st = std::make_unique<State>(std::move(*stft), std::move(*scaler));
+  st->feat = feat;
+  st->pair = pair;
+  st->layout = layout;
+  st->block_frames = block_frames;
+  if (!arena) {
+    st->own_arena = std::make_unique<ExtractionArena>();
+    arena = st->own_arena.get();
+  }
+  st->arena = arena;
+  return StreamKeyExtractor(std::move(st));
+}
+
+Result<OK> StreamKeyExtractor::push_pcm(std::span<const float> interleaved,
+                                        std::uint16_t channels,
+                                        std::uint32_t sr,
+                                        Array<KeyWithTime>& out) {
+  if (auto r = state_->feed(interleaved, channels, sr); !r) return r;
+  return state_->run_frames(false, out);
+}
+
+Result<OK> StreamKeyExtractor::finish(Array<KeyWithTime>& out) {
+  State& st = *state_;
+  if (st.resampler) st.resampler->flush(st.pcm);
+  if (auto r = st.run_frames(true, out); !r) return r;
+  if (auto r = st.detect(true); !r) return r;
+  return st.pair_ready(true, out);
+}
+
+template <unsigned Bits>
+Result<OK> StreamKeyExtractor::push_pcm(std::span<const float> interleaved,
+                                        std::uint16_t channels,
+                                        std::uint32_t sr,
+                                        Array<PackedKeyWithTime<Bits>>& out) {
+  if (packed_key_bits(state_->layout.total_bits) != Bits) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (auto r = state_->feed(interleaved, channels, sr); !r) return r;
+  return state_->run_frames(false, out);
+}
+
+template <unsigned Bits>
+Result<OK> StreamKeyExtractor::finish(Array<PackedKeyWithTime<Bits>>& out) {
+  State& st = *state_;
+  if (packed_key_bits(st.layout.total_bits) != Bits) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (st.resampler) st.resampler->flush(st.pcm);
+  if (auto r = st.run_frames(true, out); !r) return r;
+  if (auto r = st.detect(true); !r) return r;
+  return st.pair_ready(true, out);
+}
+
+template Result<OK> StreamKeyExtractor::push_pcm<32>(
+    std::span<const float>, std::uint16_t, std::uint32_t,
+    Array<PackedKeyWithTime<32>>&);
+template Result<OK> StreamKeyExtractor::finish<32>(
+    Array<PackedKeyWithTime<32>>&);
+template Result<OK> StreamKeyExtractor::push_pcm<48>(
+    std::span<const float>, std::uint16_t, std::uint32_t,
+    Array<PackedKeyWithTime<48>>&);
+template Result<OK> StreamKeyExtractor::finish<48>(
+    Array<PackedKeyWithTime<48>>&);
+template Result<OK> StreamKeyExtractor::push_pcm<64>(
+    std::span<const float>, std::uint16_t, std::uint32_t,
+    Array<PackedKeyWithTime<64>>&);
+template Result<OK> StreamKeyExtractor::finish<64>(
+    Array<PackedKeyWithTime<64>>&);
+
+void StreamKeyExtractor::reset() { state_->clear(); }
+
+namespace {
+/// Keys of `stream` in anchor order; `Rec` as in `StreamKeyExtractor`.
+template <class Rec>
+Result<Array<Rec>> extract_from(Result<AudioStream> stream,
+                                const FeatureCfg& feat, const PairingCfg& pair,
+                                const KeyLayout& layout,
+                                ExtractionArena* arena) {
+  if (!stream) return tl::unexpected(stream.error());
+  auto extractor = StreamKeyExtractor::create(
+      feat, pair, layout, kExtractBlockFrames,
+      arena ? arena : &ExtractionArena::for_thread());
+  if (!extractor) return tl::unexpected(extractor.error());
+
+  Array<Rec> keys;
+  Array<float> mid;
+  std::size_t decoded = 0;
+  while (const std::size_t n = stream->read(kDecodeChunkFrames, mid)) {
+    decoded += n;
+    if (auto r = extractor->push_pcm(mid, 1, stream->sample_rate(), keys);
+        !r) {
+      return tl::unexpected(r.error());
+    }
+  }
+  if (decoded == 0) return tl::unexpected(Error::EmptyAudio);
+  if (auto r = extractor->finish(keys); !r) return tl::unexpected(r.error());
+  return keys;
+}
+
+/// Keys of `stream` sorted by `stable_sort_by`, converted to `Key` last.
+Result<Array<KeyWithTime>> extract_sorted(Result<AudioStream> stream,
+                                          const FeatureCfg& feat,
+                                          const PairingCfg& pair,
+                                          const KeyLayout& layout,
+                                          ExtractionArena* arena) {
+  return with_packed_key(
+      layout, [&](auto tag) -> Result<Array<KeyWithTime>> {
+        using K = decltype(tag);
+        auto keys = extract_from<PackedKeyWithTime<K::kBits>>(
+            std::move(stream), feat, pair, layout, arena);
+        if (!keys) return tl::unexpected(keys.error());
+        stable_sort_by(*keys);
+        Array<KeyWithTime> out;
+        out.reserve(keys->size());
+        for (const auto& kt : *keys) {
+          out.push_back(KeyWithTime{to_key(kt.key, layout), kt.t_anchor});
+        }
+        return out;
+      });
+}
+} // namespace
+
+Result<Array<KeyWithTime>> extract_keys_for_track(ByteArray input,
+                                                  FeatureCfg feat,
+                                                  PairingCfg pair,
+                                                  KeyLayout layout,
+                                                  ExtractionArena* arena) {
+  return extract_sorted(
+      AudioStream::open(std::span<const std::uint8_t>(input)), feat, pair,
+      layout, arena);
+}
+
+Result<Array<KeyWithTime>> extract_keys_for_track(
+    std::span<const std::uint8_t> input, FeatureCfg feat, PairingCfg pair,
+    KeyLayout layout, ExtractionArena* arena) {
+  return extract_sorted(AudioStream::open(input), feat, pair, layout, arena);
+}
+
+Result<Array<KeyWithTime>> extract_keys_for_track(
+    const std::filesystem::path& path, FeatureCfg feat, PairingCfg pair,
+    KeyLayout layout, ExtractionArena* arena) {
+  return extract_sorted(AudioStream::open(path), feat, pair, layout, arena);
+}
+
+template <unsigned Bits>
+Result<Array<PackedKeyWithTime<Bits>>> extract_native_keys(
+    const std::filesystem::path& path, FeatureCfg feat, PairingCfg pair,
+    KeyLayout layout, ExtractionArena* arena) {
+  return extract_from<PackedKeyWithTime<Bits>>(AudioStream::open(path), feat,
+                                               pair, layout, arena);
+}
+
+template Result<Array<PackedKeyWithTime<32>>> extract_native_keys<32>(
+    const std::filesystem::path&, FeatureCfg, PairingCfg, KeyLayout,
+    ExtractionArena*);
+template Result<Array<PackedKeyWithTime<48>>> extract_native_keys<48>(
+    const std::filesystem::path&, FeatureCfg, PairingCfg, KeyLayout,
+    ExtractionArena*);
+template Result<Array<PackedKeyWithTime<64>>> extract_native_keys<64>(
+    const std::filesystem::path&, FeatureCfg, PairingCfg, KeyLayout,
+    ExtractionArena*);
+
+Result<Key> pack_key(std::uint32_t f_a, std::uint32_t f_t,
+                     std::uint32_t dt_bin, KeyLayout layout) {
+  return with_packed_key(layout, [&](auto tag) -> Result<Key> {
+    auto key = decltype(tag)::pack(f_a, f_t, dt_bin, layout);
+    if (!key) return tl::unexpected(key.error());
+    return to_key(*key, layout);
+  });
+}
+} // namespace afp
@@ -1,4 +1,755 @@
 #include "afp/kv.hpp"
 
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <lmdb.h>
+
 namespace afp {
-}
\ No newline at end of file
+namespace {
+/// Address space reserved per shard environment (sparse; grows on demand).
+constexpr std::size_t kShardMapBytes = std::size_t{256} << 30;
+constexpr std::size_t kMetaMapBytes = std::size_t{16} << 30;
+/// Entries written per transaction during `bulk_merge`.
+constexpr std::size_t kMergeBatch = 1 << 16;
+
+constexpr const char* kInfoDb = "info";
+constexpr const char* kTracksDb = "tracks";
+constexpr const char* kShardsInfoKey = "shards";
+constexpr const char* kCodecInfoKey = "value_codec";
+constexpr const char* kDictInfoKey = "value_dict";
+
+/// RAII LMDB transaction (aborts unless committed).
+struct Txn {
+  MDB_txn* txn{nullptr};
+  Txn() = default;
+  Txn(const Txn&) = delete;
+  Txn& operator=(const Txn&) = delete;
+  ~Txn() {
+    if (txn != nullptr) mdb_txn_abort(txn);
+  }
+  int begin(MDB_env* env, unsigned flags) {
+    return mdb_txn_begin(env, nullptr, flags, &txn);
+  }
+  int commit() {
+    const int rc = mdb_txn_commit(txn);
+    txn = nullptr;
+    return rc;
+  }
+};
+
+MDB_val as_val(const Key& key) {
+  return MDB_val{key.bytes.size(),
+                 const_cast<std::uint8_t*>(key.bytes.data())};
+}
+
+MDB_val as_val(const ByteArray& bytes) {
+  return MDB_val{bytes.size(), const_cast<std::uint8_t*>(bytes.data())};
+}
+
+int open_env(MDB_env** env, const std::filesystem::path& file,
+             std::size_t map_bytes, unsigned max_dbs, unsigned flags) {
+  int rc = mdb_env_create(env);
+  if (rc != MDB_SUCCESS) return rc;
+  if ((rc = mdb_env_set_mapsize(*env, map_bytes)) != MDB_SUCCESS ||
+      (rc = mdb_env_set_maxdbs(*env, max_dbs)) != MDB_SUCCESS ||
+      (rc = mdb_env_open(*env, file.string().c_str(), flags, 0644)) !=
+          MDB_SUCCESS) {
+    mdb_env_close(*env);
+    *env = nullptr;
+  }
+  return rc;
+}
+} // namespace
+
+struct KVState {
+  KVMode mode{};
+  std::uint16_t shards{};
+  Array<MDB_env*> envs;
+  Array<MDB_dbi> dbis;
+  MDB_env* meta_env{nullptr};
+  MDB_dbi info_dbi{};
+  MDB_dbi tracks_dbi{};
+  /// Value codec; unset for stores that keep values unframed.
+  std::optional<ValueCodec> codec;
+
+  KVState() = default;
+  KVState(const KVState&) = delete;
+  KVState& operator=(const KVState&) = delete;
+  ~KVState() { shutdown(); }
+
+  [[nodiscard]] bool writable() const { return mode != KVMode::ReadOnly; }
+
+  void shutdown() {
+    for (MDB_env*& env : envs) {
+      if (env == nullptr) continue;
+      if (writable()) mdb_env_sync(env, 1);
+      mdb_env_close(env);
+      env = nullptr;
+    }
+    if (meta_env != nullptr) {
+      if (writable()) mdb_env_sync(meta_env, 1);
+      mdb_env_close(meta_env);
+      meta_env = nullptr;
+    }
+  }
+};
+
+namespace {
+KVState* state_of(const KVHandle& h) { return h._priv.get(); }
+
+Result<OK> open_dbi(MDB_env* env, const char* name, unsigned flags,
+                    MDB_dbi* dbi) {
+  Txn txn;
+  const bool ro = (flags & MDB_CREATE) == 0;
+  if (txn.begin(env, ro ? MDB_RDONLY : 0) != MDB_SUCCESS ||
+      mdb_dbi_open(txn.txn, name, flags, dbi) != MDB_SUCCESS ||
+      txn.commit() != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvOpenError);
+  }
+  return OK{};
+}
+
+/// Frame `piece` with the store's codec (unchanged for unframed stores).
+ByteArray encode_piece(const KVState& st, ByteArray piece) {
+  if (!st.codec) return piece;
+  ByteArray framed;
+  framed.reserve(piece.size() + 11);
+  st.codec->append_frame(framed, piece);
+  return framed;
+}
+
+/// Serialized `CodecCfg` minus the dictionary: algo u8, level i32, min u32.
+ByteArray codec_record(const CodecCfg& cfg) {
+  ByteArray out{static_cast<std::uint8_t>(cfg.algo)};
+  const auto level = static_cast<std::uint32_t>(cfg.level);
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(static_cast<std::uint8_t>(level >> (8 * i)));
+  }
+  for (int i = 0; i < 4; ++i) {
+    out.push_back(static_cast<std::uint8_t>(cfg.min_bytes >> (8 * i)));
+  }
+  return out;
+}
+
+std::optional<CodecCfg> parse_codec_record(const ByteArray& rec) {
+  if (rec.size() != 9) return std::nullopt;
+  CodecCfg cfg;
+  cfg.algo = static_cast<Compression>(rec[0]);
+  std::uint32_t level = 0;
+  for (std::size_t i = 0; i < 4; ++i) {
+    level |= std::uint32_t{rec[1 + i]} << (8 * i);
+    cfg.min_bytes |= std::uint32_t{rec[5 + i]} << (8 * i);
+  }
+  cfg.level = static_cast<std::int32_t>(level);
+  return cfg;
+}
+
+/// Rewrite multi-frame values of one shard as single frames.
+bool compact_shard(const KVState& st, std::uint16_t shard) {
+  MDB_env* env = st.envs[shard];
+  const MDB_dbi dbi = st.dbis[shard];
+  Txn txn;
+  MDB_cursor* cur = nullptr;
+  auto begin = [&] {
+    return txn.begin(env, 0) == MDB_SUCCESS &&
+           mdb_cursor_open(txn.txn, dbi, &cur) == MDB_SUCCESS;
+  };
+  auto fail = [&] {
+    if (cur != nullptr) mdb_cursor_close(cur);
+    return false;
+  };
+  if (!begin()) return fail();
+
+  ByteArray raw;
+  ByteArray framed;
+  std::size_t in_txn = 0;
+  MDB_val k{};
+  MDB_val v{};
+  int rc = mdb_cursor_get(cur, &k, &v, MDB_FIRST);
+  while (rc == MDB_SUCCESS) {
+    const ValueView stored(static_cast<const std::uint8_t*>(v.mv_data),
+                           v.mv_size);
+    if (!ValueCodec::single_frame(stored)) {
+      raw.clear();
+      framed.clear();
+      if (!st.codec->decode(stored, raw)) return fail();
+      st.codec->append_frame(framed, raw);
+      v = as_val(framed);
+      if (mdb_cursor_put(cur, &k, &v, MDB_CURRENT) != MDB_SUCCESS) {
+        return fail();
+      }
+      if (++in_txn == kMergeBatch) {
+        // Commit and re-seek: the cursor does not survive the txn.
+        Key at{};
+        if (k.mv_size != at.bytes.size()) return fail();
+        std::memcpy(at.bytes.data(), k.mv_data, at.bytes.size());
+        mdb_cursor_close(cur);
+        cur = nullptr;
+        if (txn.commit() != MDB_SUCCESS || !begin()) return fail();
+        in_txn = 0;
+        k = as_val(at);
+        if (mdb_cursor_get(cur, &k, &v, MDB_SET_KEY) != MDB_SUCCESS) {
+          return fail();
+        }
+      }
+    }
+    rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT);
+  }
+  mdb_cursor_close(cur);
+  cur = nullptr;
+  return rc == MDB_NOTFOUND && txn.commit() == MDB_SUCCESS;
+}
+} // namespace
+
+Result<KVHandle> open(std::string_view path, KVMode mode,
+                      std::uint16_t shards) {
+  namespace fs = std::filesystem;
+  const fs::path root(path);
+  std::error_code ec;
+  if (mode == KVMode::Create) {
+    if (shards == 0) return tl::unexpected(Error::InvalidArgument);
+    // Truncate: drop only the files this module owns.
+    for (const auto& entry : fs::directory_iterator(root, ec)) {
+      const std::string name = entry.path().filename().string();
+      if (name.starts_with("meta.mdb") || name.starts_with("shard-")) {
+        fs::remove(entry.path(), ec);
+      }
+    }
+    ec.clear();
+    fs::create_directories(root, ec);
+    if (ec) return tl::unexpected(Error::KvOpenError);
+  }
+
+  auto st = std::make_shared<KVState>();
+  st->mode = mode;
+  const unsigned base_flags =
+      MDB_NOSUBDIR | MDB_NOTLS |
+      (mode == KVMode::ReadOnly ? MDB_RDONLY : MDB_NOSYNC);
+  if (open_env(&st->meta_env, root / "meta.mdb", kMetaMapBytes, 4,
+               base_flags) != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvOpenError);
+  }
+  const unsigned db_flags = st->writable() ? MDB_CREATE : 0u;
+  if (!open_dbi(st->meta_env, kInfoDb, db_flags, &st->info_dbi) ||
+      !open_dbi(st->meta_env, kTracksDb, db_flags, &st->tracks_dbi)) {
+    return tl::unexpected(Error::KvOpenError);
+  }
+
+  // The shard count is recorded at creation and checked on every reopen.
+  {
+    Txn txn;
+    if (txn.begin(st->meta_env, st->writable() ? 0 : MDB_RDONLY) !=
+        MDB_SUCCESS) {
+      return tl::unexpected(Error::KvOpenError);
+    }
+    MDB_val k{std::char_traits<char>::length(kShardsInfoKey),
+              const_cast<char*>(kShardsInfoKey)};
+    MDB_val v{};
+    std::uint16_t recorded = 0;
+    if (mdb_get(txn.txn, st->info_dbi, &k, &v) == MDB_SUCCESS &&
+        v.mv_size == sizeof(recorded)) {
+      std::memcpy(&recorded, v.mv_data, sizeof(recorded));
+    }
+    if (recorded == 0) {
+      if (mode == KVMode::ReadOnly || shards == 0) {
+        return tl::unexpected(Error::KvOpenError);
+      }
+      recorded = shards;
+      v = MDB_val{sizeof(recorded), &recorded};
+      if (mdb_put(txn.txn, st->info_dbi, &k, &v, 0) != MDB_SUCCESS ||
+          txn.commit() != MDB_SUCCESS) {
+        return tl::unexpected(Error::KvOpenError);
+      }
+    } else if (shards != 0 && shards != recorded) {
+      return tl::unexpected(Error::ConfigMismatch);
+    }
+    st->shards = recorded;
+  }
+
+  // Stores created with a codec record it; pick it up for every reopen.
+  {
+    const KVHandle view{st};
+    auto rec = kv_get_info(view, kCodecInfoKey);
+    auto dict = kv_get_info(view, kDictInfoKey);
+    if (!rec || !dict) return tl::unexpected(Error::KvOpenError);
+    if (*rec) {
+      auto cfg = parse_codec_record(**rec);
+      if (!cfg) return tl::unexpected(Error::KvOpenError);
+      if (*dict) cfg->dictionary = std::move(**dict);
+      auto codec = ValueCodec::create(std::move(*cfg));
+      if (!codec) return tl::unexpected(Error::KvOpenError);
+      if (codec->cfg().algo != Compression::None) st->codec = *codec;
+    }
+  }
+
+  st->envs.assign(st->shards, nullptr);
+  st->dbis.assign(st->shards, MDB_dbi{});
+  for (std::uint16_t s = 0; s < st->shards; ++s) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "shard-%04u.mdb", unsigned{s});
+    if (open_env(&st->envs[s], root / name, kShardMapBytes, 1, base_flags) !=
+            MDB_SUCCESS ||
+        !open_dbi(st->envs[s], nullptr, db_flags, &st->dbis[s])) {
+      return tl::unexpected(Error::KvOpenError);
+    }
+  }
+  return KVHandle{std::move(st)};
+}
+
+std::uint16_t shard_for_key(const KVHandle& h, Key key) {
+  // FNV-1a over the key bytes: stable across builds and platforms.
+  std::uint64_t x = 0xcbf29ce484222325ull;
+  for (std::uint8_t b : key.bytes) {
+    x ^= b;
+    x *= 0x100000001b3ull;
+  }
+  return static_cast<std::uint16_t>(x % state_of(h)->shards);
+}
+
+Result<std::optional<ByteArray>> get(const KVHandle& h, std::uint16_t shard,
+                                     Key key) {
+  KVState* st = state_of(h);
+  if (st == nullptr || shard >= st->shards) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  Txn txn;
+  if (txn.begin(st->envs[shard], MDB_RDONLY) != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvReadError);
+  }
+  MDB_val k = as_val(key);
+  MDB_val v{};
+  const int rc = mdb_get(txn.txn, st->dbis[shard], &k, &v);
+  if (rc == MDB_NOTFOUND) return std::nullopt;
+  if (rc != MDB_SUCCESS) return tl::unexpected(Error::KvReadError);
+  const auto* p = static_cast<const std::uint8_t*>(v.mv_data);
+  if (!st->codec) return ByteArray(p, p + v.mv_size);
+  ByteArray out;
+  if (!st->codec->decode(ValueView(p, v.mv_size), out)) {
+    return tl::unexpected(Error::IntegrityError);
+  }
+  return out;
+}
+
+struct KVReadBatch::Txns {
+  /// Per-shard read txn and cursor (created lazily, renewed on reuse).
+  Array<MDB_txn*> txn;
+  Array<MDB_cursor*> cur;
+  Array<std::uint8_t> live;
+  /// Scratch: key indices bucketed by shard, and bucket offsets.
+  Array<std::uint32_t> order;
+  Array<std::uint32_t> start;
+  /// Decompressed values (stable addresses; capacity reused across calls).
+  std::deque<ByteArray> decoded;
+  std::size_t decoded_used{};
+};
+
+KVReadBatch::KVReadBatch(KVHandle h)
+    : h_(std::move(h)), txns_(std::make_unique<Txns>()) {
+  const std::size_t shards = state_of(h_) ? state_of(h_)->shards : 0;
+  txns_->txn.assign(shards, nullptr);
+  txns_->cur.assign(shards, nullptr);
+  txns_->live.assign(shards, 0);
+}
+
+KVReadBatch::KVReadBatch(KVReadBatch&&) noexcept = default;
+KVReadBatch& KVReadBatch::operator=(KVReadBatch&&) noexcept = default;
+
+KVReadBatch::~KVReadBatch() {
+  if (!txns_) return;
+  for (std::size_t s = 0; s < txns_->txn.size(); ++s) {
+    if (txns_->cur[s] != nullptr) mdb_cursor_close(txns_->cur[s]);
+    if (txns_->txn[s] != nullptr) mdb_txn_abort(txns_->txn[s]);
+  }
+}
+
+void KVReadBatch::release() {
+  for (std::size_t s = 0; s < txns_->txn.size(); ++s) {
+    if (txns_->live[s]) mdb_txn_reset(txns_->txn[s]);
+    txns_->live[s] = 0;
+  }
+}
+
+Result<Array<std::optional<ValueView>>> get_many(
+    KVReadBatch& batch, std::span<const Key> keys_sorted) {
+  KVState* st = state_of(batch.h_);
+  if (st == nullptr) return tl::unexpected(Error::InvalidArgument);
+  for (std::size_t i = 1; i < keys_sorted.size(); ++i) {
+    if (keys_sorted[i] < keys_sorted[i - 1]) {
+      return tl::unexpected(Error::InvalidArgument);
+    }
+  }
+  batch.release();
+  batch.txns_->decoded_used = 0;
+
+  // Stable bucket by shard so each shard sees its keys in ascending order.
+  KVReadBatch::Txns& t = *batch.txns_;
+  t.start.assign(st->shards + 1u, 0);
+  for (const Key& k : keys_sorted) ++t.start[shard_for_key(batch.h_, k) + 1u];
+  for (std::size_t s = 0; s < st->shards; ++s) t.start[s + 1] += t.start[s];
+  t.order.resize(keys_sorted.size());
+  {
+    Array<std::uint32_t> fill(t.start.begin(), t.start.end() - 1);
+    for (std::uint32_t i = 0; i < keys_sorted.size(); ++i) {
+      t.order[fill[shard_for_key(batch.h_, keys_sorted[i])]++] = i;
+    }
+  }
+
+  Array<std::optional<ValueView>> out(keys_sorted.size());
+  for (std::uint16_t s = 0; s < st->shards; ++s) {
+    if (t.start[s] == t.start[s + 1u]) continue;
+    int rc = MDB_SUCCESS;
+    if (t.txn[s] == nullptr) {
+      rc = mdb_txn_begin(st->envs[s], nullptr, MDB_RDONLY, &t.txn[s]);
+      if (rc != MDB_SUCCESS) return tl::unexpected(Error::KvReadError);
+      rc = mdb_cursor_open(t.txn[s], st->dbis[s], &t.cur[s]);
+      if (rc != MDB_SUCCESS) {
+        mdb_txn_abort(t.txn[s]);
+        t.txn[s] = nullptr;
+        return tl::unexpected(Error::KvReadError);
+      }
+    } else {
+      rc = mdb_txn_renew(t.txn[s]);
+      if (rc == MDB_SUCCESS) rc = mdb_cursor_renew(t.txn[s], t.cur[s]);
+      if (rc != MDB_SUCCESS) return tl::unexpected(Error::KvReadError);
+    }
+    t.live[s] = 1;
+
+    for (std::uint32_t j = t.start[s]; j < t.start[s + 1u]; ++j) {
+      const std::uint32_t i = t.order[j];
+      MDB_val k = as_val(keys_sorted[i]);
+      MDB_val v{};
+      rc = mdb_cursor_get(t.cur[s], &k, &v, MDB_SET_KEY);
+      if (rc == MDB_NOTFOUND) continue;
+      if (rc != MDB_SUCCESS) return tl::unexpected(Error::KvReadError);
+      const ValueView stored(static_cast<const std::uint8_t*>(v.mv_data),
+                             v.mv_size);
+      if (!st->codec) {
+        out[i] = stored;
+      } else if (auto raw = ValueCodec::raw_payload(stored)) {
+        out[i] = *raw;
+      } else {
+        if (t.decoded_used == t.decoded.size()) t.decoded.emplace_back();
+        ByteArray& buf = t.decoded[t.decoded_used++];
+        buf.clear();
+        if (!st->codec->decode(stored, buf)) {
+          return tl::unexpected(Error::IntegrityError);
+        }
+        out[i] = ValueView(buf);
+      }
+    }
+  }
+  return out;
+}
+
+Result<OK> put_append(const KVHandle& h, std::uint16_t shard, Key key,
+                      ByteArray value) {
+  std::pair<Key, ByteArray> block{key, std::move(value)};
+  return put_append_many(h, shard, std::span(&block, 1));
+}
+
+Result<OK> put_append_many(const KVHandle& h, std::uint16_t shard,
+                           std::span<std::pair<Key, ByteArray>> blocks) {
+  KVState* st = state_of(h);
+  if (st == nullptr || shard >= st->shards || !st->writable()) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  Txn txn;
+  if (txn.begin(st->envs[shard], 0) != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvWriteError);
+  }
+  for (auto& [key, block] : blocks) {
+    ByteArray value = encode_piece(*st, std::move(block));
+    MDB_val k = as_val(key);
+    MDB_val v{};
+    const int rc = mdb_get(txn.txn, st->dbis[shard], &k, &v);
+    if (rc == MDB_SUCCESS) {
+      const auto* p = static_cast<const std::uint8_t*>(v.mv_data);
+      value.insert(value.begin(), p, p + v.mv_size);
+    } else if (rc != MDB_NOTFOUND) {
+      return tl::unexpected(Error::KvWriteError);
+    }
+    v = as_val(value);
+    if (mdb_put(txn.txn, st->dbis[shard], &k, &v, 0) != MDB_SUCCESS) {
+      return tl::unexpected(Error::KvWriteError);
+    }
+  }
+  if (txn.commit() != MDB_SUCCESS) return tl::unexpected(Error::KvWriteError);
+  return OK{};
+}
+
+Result<OK> put_replace(const KVHandle& h, std::uint16_t shard, Key key,
+                       ByteArray value) {
+  KVState* st = state_of(h);
+  if (st == nullptr || shard >= st->shards || !st->writable()) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  value = encode_piece(*st, std::move(value));
+  Txn txn;
+  MDB_val k = as_val(key);
+  MDB_val v = as_val(value);
+  if (txn.begin(st->envs[shard], 0) != MDB_SUCCESS ||
+      mdb_put(txn.txn, st->dbis[shard], &k, &v, 0) != MDB_SUCCESS ||
+      txn.commit() != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvWriteError);
+  }
+  return OK{};
+}
+
+Result<OK> erase(const KVHandle& h, std::uint16_t shard, Key key) {
+  KVState* st = state_of(h);
+  if (st == nullptr || shard >= st->shards || !st->writable()) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  Txn txn;
+  if (txn.begin(st->envs[shard], 0) != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvWriteError);
+  }
+  MDB_val k = as_val(key);
+  const int rc = mdb_del(txn.txn, st->dbis[shard], &k, nullptr);
+  if ((rc != MDB_SUCCESS && rc != MDB_NOTFOUND) ||
+      txn.commit() != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvWriteError);
+  }
+  return OK{};
+}
+
+Result<OK> scan_shard(const KVHandle& h, std::uint16_t shard,
+                      const std::function<void(const Key&, ValueView)>& f) {
+  KVState* st = state_of(h);
+  if (st == nullptr || shard >= st->shards) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  Txn txn;
+  MDB_cursor* cur = nullptr;
+  if (txn.begin(st->envs[shard], MDB_RDONLY) != MDB_SUCCESS ||
+      mdb_cursor_open(txn.txn, st->dbis[shard], &cur) != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvReadError);
+  }
+  ByteArray raw;
+  Key key{};
+  MDB_val k{};
+  MDB_val v{};
+  int rc = mdb_cursor_get(cur, &k, &v, MDB_FIRST);
+  for (; rc == MDB_SUCCESS; rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT)) {
+    if (k.mv_size != key.bytes.size()) continue;
+    std::memcpy(key.bytes.data(), k.mv_data, key.bytes.size());
+    const ValueView stored(static_cast<const std::uint8_t*>(v.mv_data),
+                           v.mv_size);
+    if (!st->codec) {
+      f(key, stored);
+      continue;
+    }
+    raw.clear();
+    if (!st->codec->decode(stored, raw)) {
+      mdb_cursor_close(cur);
+      return tl::unexpected(Error::IntegrityError);
+    }
+    f(key, raw);
+  }
+  mdb_cursor_close(cur);
+  if (rc != MDB_NOTFOUND) return tl::unexpected(Error::KvReadError);
+  return OK{};
+}
+
+std::optional<std::pair<Key, ByteArray>> SortedKeyValueIter::next() {
+  if (_priv == nullptr) return std::nullopt;
+  return static_cast<SortedKeyValueSource*>(_priv)->next();
+}
+
+Result<OK> bulk_merge(const KVHandle& h, std::uint16_t shard,
+                      SortedKeyValueIter iter) {
+  KVState* st = state_of(h);
+  if (st == nullptr || shard >= st->shards || !st->writable()) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  MDB_env* env = st->envs[shard];
+  const MDB_dbi dbi = st->dbis[shard];
+
+  Txn txn;
+  MDB_cursor* cur = nullptr;
+  auto begin = [&] {
+    return txn.begin(env, 0) == MDB_SUCCESS &&
+           mdb_cursor_open(txn.txn, dbi, &cur) == MDB_SUCCESS;
+  };
+  auto fail = [&] {
+    if (cur != nullptr) mdb_cursor_close(cur);
+    return tl::unexpected(Error::KvMergeError);
+  };
+  if (!begin()) return fail();
+
+  // Everything above the current last key can be appended blindly.
+  std::optional<Key> last;
+  {
+    MDB_val k{};
+    MDB_val v{};
+    const int rc = mdb_cursor_get(cur, &k, &v, MDB_LAST);
+    if (rc == MDB_SUCCESS && k.mv_size == sizeof(Key::bytes)) {
+      Key lk{};
+      std::memcpy(lk.bytes.data(), k.mv_data, lk.bytes.size());
+      last = lk;
+    } else if (rc != MDB_NOTFOUND) {
+      return fail();
+    }
+  }
+
+  std::size_t in_txn = 0;
+  while (auto kv = iter.next()) {
+    auto& [key, value] = *kv;
+    value = encode_piece(*st, std::move(value));
+    MDB_val k = as_val(key);
+    int rc;
+    if (!last || key > *last) {
+      MDB_val v = as_val(value);
+      rc = mdb_cursor_put(cur, &k, &v, MDB_APPEND);
+      last = key;
+    } else {
+      MDB_val v{};
+      rc = mdb_get(txn.txn, dbi, &k, &v);
+      if (rc == MDB_SUCCESS) {
+        const auto* p = static_cast<const std::uint8_t*>(v.mv_data);
+        value.insert(value.begin(), p, p + v.mv_size);
+      } else if (rc != MDB_NOTFOUND) {
+        return fail();
+      }
+      v = as_val(value);
+      rc = mdb_put(txn.txn, dbi, &k, &v, 0);
+    }
+    if (rc != MDB_SUCCESS) return fail();
+
+    if (++in_txn == kMergeBatch) {
+      mdb_cursor_close(cur);
+      cur = nullptr;
+      if (txn.commit() != MDB_SUCCESS || !begin()) return fail();
+      in_txn = 0;
+    }
+  }
+  mdb_cursor_close(cur);
+  cur = nullptr;
+  if (txn.commit() != MDB_SUCCESS) return fail();
+  return OK{};
+}
+
+Result<OK> close(const KVHandle& h) {
+  if (KVState* st = state_of(h)) st->shutdown();
+  return OK{};
+}
+
+Result<OK> kv_put_trackmeta(const KVHandle& h, const TrackMeta& meta) {
+  KVState* st = state_of(h);
+  if (st == nullptr || !st->writable()) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  // Big-endian id keeps the tracks table in numeric order.
+  const std::uint8_t key[4] = {
+      static_cast<std::uint8_t>(meta.track_id >> 24),
+      static_cast<std::uint8_t>(meta.track_id >> 16),
+      static_cast<std::uint8_t>(meta.track_id >> 8),
+      static_cast<std::uint8_t>(meta.track_id)};
+  ByteArray value;
+  auto put_le = [&](std::uint64_t x, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+      value.push_back(static_cast<std::uint8_t>(x >> (8 * i)));
+    }
+  };
+  put_le(meta.sr, 4);
+  put_le(meta.fft, 2);
+  put_le(meta.hop, 2);
+  put_le(meta.frames, 4);
+  put_le(meta.audio_crc64, 8);
+  put_le(meta.key_layout_version, 1);
+
+  Txn txn;
+  MDB_val k{sizeof(key), const_cast<std::uint8_t*>(key)};
+  MDB_val v = as_val(value);
+  if (txn.begin(st->meta_env, 0) != MDB_SUCCESS ||
+      mdb_put(txn.txn, st->tracks_dbi, &k, &v, 0) != MDB_SUCCESS ||
+      txn.commit() != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvWriteError);
+  }
+  return OK{};
+}
+
+Result<OK> kv_put_info(const KVHandle& h, std::string_view name,
+                       const ByteArray& value) {
+  KVState* st = state_of(h);
+  if (st == nullptr || !st->writable() || name == kShardsInfoKey) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  Txn txn;
+  MDB_val k{name.size(), const_cast<char*>(name.data())};
+  MDB_val v = as_val(value);
+  if (txn.begin(st->meta_env, 0) != MDB_SUCCESS ||
+      mdb_put(txn.txn, st->info_dbi, &k, &v, 0) != MDB_SUCCESS ||
+      txn.commit() != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvWriteError);
+  }
+  return OK{};
+}
+
+Result<std::optional<ByteArray>> kv_get_info(const KVHandle& h,
+                                             std::string_view name) {
+  KVState* st = state_of(h);
+  if (st == nullptr) return tl::unexpected(Error::InvalidArgument);
+  Txn txn;
+  if (txn.begin(st->meta_env, MDB_RDONLY) != MDB_SUCCESS) {
+    return tl::unexpected(Error::KvReadError);
+  }
+  MDB_val k{name.size(), const_cast<char*>(name.data())};
+  MDB_val v{};
+  const int rc = mdb_get(txn.txn, st->info_dbi, &k, &v);
+  if (rc == MDB_NOTFOUND) return std::nullopt;
+  if (rc != MDB_SUCCESS) return tl::unexpected(Error::KvReadError);
+  const auto* p = static_cast<const std::uint8_t*>(v.mv_data);
+  return ByteArray(p, p + v.mv_size);
+}
+
+Result<OK> kv_set_codec(const KVHandle& h, CodecCfg cfg) {
+  KVState* st = state_of(h);
+  if (st == nullptr || !st->writable()) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  // Existing values were written unframed; mixing would be ambiguous.
+  for (std::uint16_t s = 0; s < st->shards; ++s) {
+    Txn txn;
+    MDB_stat stat{};
+    if (txn.begin(st->envs[s], MDB_RDONLY) != MDB_SUCCESS ||
+        mdb_stat(txn.txn, st->dbis[s], &stat) != MDB_SUCCESS) {
+      return tl::unexpected(Error::KvReadError);
+    }
+    if (stat.ms_entries != 0) return tl::unexpected(Error::InvalidArgument);
+  }
+  auto codec = ValueCodec::create(std::move(cfg));
+  if (!codec) return tl::unexpected(codec.error());
+  if (auto r = kv_put_info(h, kCodecInfoKey, codec_record(codec->cfg())); !r) {
+    return r;
+  }
+  if (auto r = kv_put_info(h, kDictInfoKey, codec->cfg().dictionary); !r) {
+    return r;
+  }
+  if (codec->cfg().algo == Compression::None) {
+    st->codec.reset();
+  } else {
+    st->codec = std::move(*codec);
+  }
+  return OK{};
+}
+
+Result<OK> finalize_shards(const KVHandle& h) {
+  KVState* st = state_of(h);
+  if (st == nullptr) return tl::unexpected(Error::InvalidArgument);
+  if (!st->writable()) return OK{};
+  if (st->codec) {
+    for (std::uint16_t s = 0; s < st->shards; ++s) {
+      if (!compact_shard(*st, s)) return tl::unexpected(Error::KvMergeError);
+    }
+  }
+  for (MDB_env* env : st->envs) {
+    if (env != nullptr && mdb_env_sync(env, 1) != MDB_SUCCESS) {
+      return tl::unexpected(Error::KvMergeError);
+    }
+  }
+  return OK{};
+}
+} // namespace afp
@@ -1,4 +1,420 @@
 #include "afp/pack.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <utility>
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define AFP_PACK_X86 1
+#include <immintrin.h>
+#endif
+
 namespace afp {
-}
\ No newline at end of file
+namespace {
+void put_varint(ByteArray& out, std::uint32_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<std::uint8_t>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<std::uint8_t>(v));
+}
+
+/// Read one u32 varint from `[p, end)`; false if truncated or too long.
+bool get_varint(const std::uint8_t*& p, const std::uint8_t* end,
+                std::uint32_t& v) {
+  std::uint32_t x = 0;
+  for (unsigned shift = 0; shift < 35; shift += 7) {
+    if (p == end) return false;
+    const std::uint8_t b = *p++;
+    // The fifth byte may only carry the top four bits of a u32.
+    if (shift == 28 && b > 0x0F) return false;
+    x |= static_cast<std::uint32_t>(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) {
+      v = x;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Decode `n` varints as a running sum starting at `acc` into `out`.
+/// - **Outputs:** bytes consumed, or `nullopt` if the input is malformed.
+using DecodeFn = std::optional<std::size_t> (*)(const std::uint8_t* in,
+                                                const std::uint8_t* end,
+                                                std::uint32_t n,
+                                                std::uint32_t* out);
+
+std::optional<std::size_t> decode_scalar_from(const std::uint8_t* in,
+                                              const std::uint8_t* end,
+                                              std::uint32_t n,
+                                              std::uint32_t* out,
+                                              std::uint32_t acc) {
+  const std::uint8_t* p = in;
+  for (std::uint32_t i = 0; i < n; ++i) {
+    std::uint32_t v = 0;
+    if (!get_varint(p, end, v)) return std::nullopt;
+    acc += v;
+    out[i] = acc;
+  }
+  return static_cast<std::size_t>(p - in);
+}
+
+std::optional<std::size_t> decode_scalar(const std::uint8_t* in,
+                                         const std::uint8_t* end,
+                                         std::uint32_t n, std::uint32_t* out) {
+  return decode_scalar_from(in, end, n, out, 0);
+}
+
+/// Append one frame-of-reference chunk: `base`, `width`, packed residuals.
+void put_bitpacked_chunk(ByteArray& out, const std::uint32_t* d,
+                         std::uint32_t len) {
+  const auto [lo, hi] = std::minmax_element(d, d + len);
+  const std::uint32_t base = *lo;
+  const auto width = static_cast<unsigned>(std::bit_width(*hi - base));
+  put_varint(out, base);
+  out.push_back(static_cast<std::uint8_t>(width));
+  std::uint64_t acc = 0;
+  unsigned bits = 0;
+  for (std::uint32_t i = 0; i < len; ++i) {
+    acc |= static_cast<std::uint64_t>(d[i] - base) << bits;
+    bits += width;
+    while (bits >= 8) {
+      out.push_back(static_cast<std::uint8_t>(acc));
+      acc >>= 8;
+      bits -= 8;
+    }
+  }
+  if (bits > 0) out.push_back(static_cast<std::uint8_t>(acc));
+}
+
+/// Little-endian 8-byte load.
+std::uint64_t load_le64(const std::uint8_t* b) {
+  std::uint64_t word = 0;
+  if constexpr (std::endian::native == std::endian::little) {
+    std::memcpy(&word, b, sizeof(word));
+  } else {
+    for (unsigned k = 0; k < 8; ++k) {
+      word |= static_cast<std::uint64_t>(b[k]) << (8 * k);
+    }
+  }
+  return word;
+}
+
+/// Unpack `len` residuals of `Width` bits; `in` must have 8 bytes of slack.
+template <unsigned Width>
+void unpack_chunk(const std::uint8_t* in, std::uint32_t len,
+                  std::uint32_t base, std::uint32_t* out) {
+  constexpr std::uint64_t kMask = (std::uint64_t{1} << Width) - 1;
+  for (std::uint32_t i = 0; i < len; ++i) {
+    const std::size_t bit = std::size_t{i} * Width;
+    out[i] = base + static_cast<std::uint32_t>(
+                        (load_le64(in + bit / 8) >> (bit % 8)) & kMask);
+  }
+}
+
+using UnpackFn = void (*)(const std::uint8_t*, std::uint32_t, std::uint32_t,
+                          std::uint32_t*);
+
+template <std::size_t... W>
+constexpr std::array<UnpackFn, sizeof...(W)> make_unpackers(
+    std::index_sequence<W...>) {
+  return {&unpack_chunk<static_cast<unsigned>(W)>...};
+}
+
+/// One unpacker per bit width, so shifts and masks are compile-time.
+constexpr auto kUnpack = make_unpackers(std::make_index_sequence<33>{});
+
+/// Decode one chunk of `len` deltas from `[p, end)` into `out`.
+bool get_bitpacked_chunk(const std::uint8_t*& p, const std::uint8_t* end,
+                         std::uint32_t len, std::uint32_t* out) {
+  std::uint32_t base = 0;
+  if (!get_varint(p, end, base) || p == end) return false;
+  const unsigned width = *p++;
+  if (width > 32) return false;
+  const std::size_t bytes = (std::size_t{len} * width + 7) / 8;
+  if (bytes > static_cast<std::size_t>(end - p)) return false;
+  if (static_cast<std::size_t>(end - p) >= bytes + 8) {
+    kUnpack[width](p, len, base, out);
+  } else {
+    // Too close to the end for 8-byte loads: unpack from a padded copy.
+    std::array<std::uint8_t, kPostingChunk * 4 + 8> buf{};
+    std::memcpy(buf.data(), p, bytes);
+    kUnpack[width](buf.data(), len, base, out);
+  }
+  p += bytes;
+  return true;
+}
+
+/// Decode a `BitPacked` payload of `n` deltas into absolute times.
+std::optional<std::size_t> decode_bitpacked(const std::uint8_t* in,
+                                            const std::uint8_t* end,
+                                            std::uint32_t n,
+                                            std::uint32_t* out) {
+  const std::uint8_t* p = in;
+  std::uint32_t acc = 0;
+  for (std::uint32_t i = 0; i < n; i += kPostingChunk) {
+    const std::uint32_t len = std::min(kPostingChunk, n - i);
+    if (!get_bitpacked_chunk(p, end, len, out + i)) return std::nullopt;
+    for (std::uint32_t k = i; k < i + len; ++k) out[k] = acc += out[k];
+  }
+  return static_cast<std::size_t>(p - in);
+}
+
+#ifdef AFP_PACK_X86
+/// Shuffle plan for 8 input bytes given their continuation-bit mask: every
+/// complete 1- or 2-byte varint becomes one little-endian u16 lane.
+struct ShufEntry {
+  alignas(16) std::array<std::uint8_t, 16> shuf{};
+  std::uint8_t count{};
+  std::uint8_t consumed{};
+};
+
+constexpr std::array<ShufEntry, 256> make_shuf_table() {
+  std::array<ShufEntry, 256> table{};
+  for (unsigned m = 0; m < 256; ++m) {
+    ShufEntry& e = table[m];
+    e.shuf.fill(0x80);
+    unsigned pos = 0;
+    unsigned lane = 0;
+    while (pos < 8) {
+      const bool cont = (m >> pos) & 1u;
+      if (!cont) {
+        e.shuf[2 * lane] = static_cast<std::uint8_t>(pos);
+        pos += 1;
+      } else if (pos + 1 < 8 && ((m >> (pos + 1)) & 1u) == 0) {
+        e.shuf[2 * lane] = static_cast<std::uint8_t>(pos);
+        e.shuf[2 * lane + 1] = static_cast<std::uint8_t>(pos + 1);
+        pos += 2;
+      } else {
+        break;  // 3+ byte varint (or split across the window): scalar.
+      }
+      ++lane;
+    }
+    e.count = static_cast<std::uint8_t>(lane);
+    e.consumed = static_cast<std::uint8_t>(pos);
+  }
+  return table;
+}
+
+constexpr std::array<ShufEntry, 256> kShufTable = make_shuf_table();
+
+/// Gather up to eight short varints from `p` into u16 lanes.
+__attribute__((target("sse4.1"))) inline __m128i gather_u16(
+    const std::uint8_t* p, const ShufEntry*& e) {
+  const __m128i raw =
+      _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+  e = &kShufTable[static_cast<unsigned>(_mm_movemask_epi8(raw)) & 0xFFu];
+  const __m128i lanes = _mm_shuffle_epi8(
+      raw, _mm_load_si128(reinterpret_cast<const __m128i*>(e->shuf.data())));
+  // Lane = lo | hi << 8 with stop bits clear in hi: fold to 14 bits.
+  return _mm_or_si128(
+      _mm_and_si128(lanes, _mm_set1_epi16(0x007F)),
+      _mm_srli_epi16(_mm_and_si128(lanes, _mm_set1_epi16(0x7F00)), 1));
+}
+
+__attribute__((target("sse4.1"))) std::optional<std::size_t> decode_sse41(
+    const std::uint8_t* in, const std::uint8_t* end, std::uint32_t n,
+    std::uint32_t* out) {
+  const std::uint8_t* p = in;
+  std::uint32_t i = 0;
+  std::uint32_t acc = 0;
+  while (n - i >= 8 && end - p >= 8) {
+    const ShufEntry* e = nullptr;
+    const __m128i v = gather_u16(p, e);
+    if (e->count == 0) {
+      std::uint32_t x = 0;
+      if (!get_varint(p, end, x)) return std::nullopt;
+      acc += x;
+      out[i++] = acc;
+      continue;
+    }
+    // Inclusive prefix sum of 2x4 u32 lanes, carried across the halves.
+    __m128i lo = _mm_cvtepu16_epi32(v);
+    __m128i hi = _mm_cvtepu16_epi32(_mm_srli_si128(v, 8));
+    lo = _mm_add_epi32(lo, _mm_slli_si128(lo, 4));
+    lo = _mm_add_epi32(lo, _mm_slli_si128(lo, 8));
+    lo = _mm_add_epi32(lo, _mm_set1_epi32(static_cast<int>(acc)));
+    hi = _mm_add_epi32(hi, _mm_slli_si128(hi, 4));
+    hi = _mm_add_epi32(hi, _mm_slli_si128(hi, 8));
+    hi = _mm_add_epi32(hi, _mm_shuffle_epi32(lo, 0xFF));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), hi);
+    // Lanes past `count` are zero deltas, so lane 7 holds the running sum.
+    acc = static_cast<std::uint32_t>(_mm_extract_epi32(hi, 3));
+    i += e->count;
+    p += e->consumed;
+  }
+  auto tail = decode_scalar_from(p, end, n - i, out + i, acc);
+  if (!tail) return std::nullopt;
+  return static_cast<std::size_t>(p - in) + *tail;
+}
+
+__attribute__((target("avx2"))) std::optional<std::size_t> decode_avx2(
+    const std::uint8_t* in, const std::uint8_t* end, std::uint32_t n,
+    std::uint32_t* out) {
+  const std::uint8_t* p = in;
+  std::uint32_t i = 0;
+  std::uint32_t acc = 0;
+  const __m256i bcast3 = _mm256_set1_epi32(3);
+  const __m256i bcast7 = _mm256_set1_epi32(7);
+  while (n - i >= 8 && end - p >= 8) {
+    const ShufEntry* e = nullptr;
+    const __m128i v = gather_u16(p, e);
+    if (e->count == 0) {
+      std::uint32_t x = 0;
+      if (!get_varint(p, end, x)) return std::nullopt;
+      acc += x;
+      out[i++] = acc;
+      continue;
+    }
+    // Inclusive prefix sum over 8 u32 lanes: scan each 128-bit half, then
+    // carry lane 3 into the upper half and add the running sum.
+    __m256i x = _mm256_cvtepu16_epi32(v);
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    const __m256i carry = _mm256_blend_epi32(
+        _mm256_setzero_si256(), _mm256_permutevar8x32_epi32(x, bcast3), 0xF0);
+    x = _mm256_add_epi32(x, carry);
+    x = _mm256_add_epi32(x, _mm256_set1_epi32(static_cast<int>(acc)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), x);
+    acc = static_cast<std::uint32_t>(
+        _mm256_cvtsi256_si32(_mm256_permutevar8x32_epi32(x, bcast7)));
+    i += e->count;
+    p += e->consumed;
+  }
+  auto tail = decode_scalar_from(p, end, n - i, out + i, acc);
+  if (!tail) return std::nullopt;
+  return static_cast<std::size_t>(p - in) + *tail;
+}
+#endif
+
+/// Pick the widest kernel the running CPU supports (once per process).
+DecodeFn select_decoder() {
+#ifdef AFP_PACK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return decode_avx2;
+  if (__builtin_cpu_supports("sse4.1")) return decode_sse41;
+#endif
+  return decode_scalar;
+}
+
+const DecodeFn kDecode = select_decoder();
+} // namespace
+
+Result<ByteArray> pack_posting_block(
+    std::uint32_t track_id, std::span<const std::uint32_t> times_sorted,
+    PostingFormat format) {
+  if (times_sorted.empty()) return tl::unexpected(Error::InvalidArgument);
+  if (format != PostingFormat::Varint && format != PostingFormat::BitPacked) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  const auto n = static_cast<std::uint32_t>(times_sorted.size());
+  Array<std::uint32_t> deltas(n);
+  deltas[0] = times_sorted[0];
+  for (std::uint32_t i = 1; i < n; ++i) {
+    if (times_sorted[i] < times_sorted[i - 1]) {
+      return tl::unexpected(Error::InvalidArgument);
+    }
+    deltas[i] = times_sorted[i] - times_sorted[i - 1];
+  }
+
+  ByteArray payload;
+  payload.reserve(5 + 2 * std::size_t{n});
+  if (format == PostingFormat::Varint) {
+    for (std::uint32_t d : deltas) put_varint(payload, d);
+  } else {
+    for (std::uint32_t i = 0; i < n; i += kPostingChunk) {
+      put_bitpacked_chunk(payload, deltas.data() + i,
+                          std::min(kPostingChunk, n - i));
+    }
+  }
+  ByteArray out;
+  out.reserve(16 + payload.size());
+  out.push_back(static_cast<std::uint8_t>(format));
+  put_varint(out, track_id);
+  put_varint(out, n);
+  put_varint(out, static_cast<std::uint32_t>(payload.size()));
+  out.insert(out.end(), payload.begin(), payload.end());
+  return out;
+}
+
+PostingIter::PostingIter(PostingView buf) noexcept
+    : p_(buf.data()),
+      end_(buf.data() + buf.size()),
+      block_end_(buf.data()) {}
+
+bool PostingIter::fail() noexcept {
+  failed_ = true;
+  left_ = 0;
+  p_ = block_end_ = end_;
+  return false;
+}
+
+std::optional<PostingBlockHeader> PostingIter::next_block() noexcept {
+  if (failed_) return std::nullopt;
+  p_ = block_end_;
+  if (p_ == end_) return std::nullopt;
+  PostingBlockHeader h;
+  h.format = static_cast<PostingFormat>(*p_++);
+  const bool known = h.format == PostingFormat::Varint ||
+                     h.format == PostingFormat::BitPacked;
+  if (!known || !get_varint(p_, end_, h.track_id) ||
+      !get_varint(p_, end_, h.n) || !get_varint(p_, end_, h.bytes) ||
+      h.n == 0 || h.bytes > static_cast<std::size_t>(end_ - p_)) {
+    fail();
+    return std::nullopt;
+  }
+  block_end_ = p_ + h.bytes;
+  format_ = h.format;
+  track_id_ = h.track_id;
+  left_ = h.n;
+  t_ = 0;
+  chunk_pos_ = chunk_len_ = 0;
+  return h;
+}
+
+bool PostingIter::read_times(std::span<std::uint32_t> out) noexcept {
+  if (failed_ || out.size() < left_) return fail();
+  auto used = format_ == PostingFormat::Varint
+                  ? kDecode(p_, block_end_, left_, out.data())
+                  : decode_bitpacked(p_, block_end_, left_, out.data());
+  if (!used || p_ + *used != block_end_) return fail();
+  p_ = block_end_;
+  left_ = 0;
+  return true;
+}
+
+bool PostingIter::next_chunk() noexcept {
+  chunk_len_ = std::min(kPostingChunk, left_);
+  chunk_pos_ = 0;
+  return get_bitpacked_chunk(p_, block_end_, chunk_len_, chunk_.data());
+}
+
+std::optional<Anchor> PostingIter::next() noexcept {
+  while (left_ == 0) {
+    if (!next_block()) return std::nullopt;
+  }
+  std::uint32_t dt = 0;
+  bool ok = true;
+  if (format_ == PostingFormat::Varint) {
+    ok = get_varint(p_, block_end_, dt);
+  } else {
+    if (chunk_pos_ == chunk_len_) ok = next_chunk();
+    if (ok) dt = chunk_[chunk_pos_++];
+  }
+  if (!ok || (--left_ == 0 && p_ != block_end_)) {
+    fail();
+    return std::nullopt;
+  }
+  t_ += dt;
+  return Anchor{track_id_, t_};
+}
+
+Result<PostingIter> parse_posting_blocks(PostingView buf) {
+  if (buf.empty()) return tl::unexpected(Error::IntegrityError);
+  return PostingIter(buf);
+}
+} // namespace afp
@@ -1,4 +1,153 @@
 #include "afp/pairing.hpp"
+#include "afp/keys.hpp"
+
+#include <algorithm>
 
 namespace afp {
-}
\ No newline at end of file
+namespace {
+/// Indices of the `k` strongest peaks of `peaks[lo, hi)`, in (t,f) order.
+/// `scratch` is reused by the caller across anchors.
+void strongest(std::span<const Peak> peaks, std::size_t lo, std::size_t hi,
+               std::size_t k, Array<std::uint32_t>& scratch) {
+  scratch.clear();
+  for (std::size_t j = lo; j < hi; ++j) {
+    scratch.push_back(static_cast<std::uint32_t>(j));
+  }
+  if (scratch.size() > k) {
+    // Ties go to the earlier peak, so the choice is deterministic.
+    const auto stronger = [&](std::uint32_t a, std::uint32_t b) {
+      return peaks[a].strength > peaks[b].strength ||
+             (peaks[a].strength == peaks[b].strength && a < b);
+    };
+    const auto kth = scratch.begin() + static_cast<std::ptrdiff_t>(k);
+    std::nth_element(scratch.begin(), kth, scratch.end(), stronger);
+    scratch.resize(k);
+    std::sort(scratch.begin(), scratch.end());
+  }
+}
+
+/// First index in `[from, size)` whose time is at least `t`.
+std::size_t advance_to(std::span<const Peak> peaks, std::size_t from,
+                       std::uint64_t t) {
+  while (from < peaks.size() && peaks[from].t < t) ++from;
+  return from;
+}
+
+/// Anchor/target sweep of `pair_peaks`; `emit(f_a, f_t, dt_bin, t)`
+/// stores one key.
+template <class Emit>
+Result<OK> pair_sweep(std::span<const Peak> peaks, std::size_t n_anchors,
+                      const PairingCfg& pair, const KeyLayout& layout,
+                      Emit&& emit) {
+  if (n_anchors > peaks.size() || pair.dt_min_frames > pair.dt_max_frames) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  Array<std::uint32_t> scratch;
+  scratch.reserve(pair.max_targets_per_anchor);
+  std::size_t lo = 0;
+  std::size_t hi = 0;
+  for (std::size_t i = 0; i < n_anchors; ++i) {
+    const Peak& a = peaks[i];
+    // Anchor times never decrease, so both window edges only move forward.
+    lo = advance_to(peaks, lo, std::uint64_t{a.t} + pair.dt_min_frames);
+    hi = advance_to(peaks, std::max(hi, lo),
+                    std::uint64_t{a.t} + pair.dt_max_frames + 1);
+    const std::size_t first = std::max(lo, i + 1);
+    if (first >= hi) continue;
+    strongest(peaks, first, hi, pair.max_targets_per_anchor, scratch);
+    for (const std::uint32_t j : scratch) {
+      const Peak& tgt = peaks[j];
+      auto dt_bin =
+          quantize_dt(tgt.t - a.t, pair.delta_bin_frames, layout.bits_dt);
+      if (!dt_bin) return tl::unexpected(dt_bin.error());
+      if (auto r = emit(a.f, tgt.f, *dt_bin, a.t); !r) return r;
+    }
+  }
+  return OK{};
+}
+} // namespace
+
+Result<Array<Peak>> select_targets(const Array<Peak>& peaks,
+                                   std::uint32_t anchor_idx,
+                                   const PairingCfg& pair,
+                                   std::uint16_t fprime) {
+  if (anchor_idx >= peaks.size() || peaks[anchor_idx].f >= fprime ||
+      pair.dt_min_frames > pair.dt_max_frames) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  const std::uint64_t ta = peaks[anchor_idx].t;
+  const auto by_t = [](const Peak& p, std::uint64_t t) { return p.t < t; };
+  const auto first = static_cast<std::size_t>(
+      std::lower_bound(peaks.begin(), peaks.end(), ta + pair.dt_min_frames,
+                       by_t) -
+      peaks.begin());
+  const auto last = static_cast<std::size_t>(
+      std::lower_bound(peaks.begin(), peaks.end(),
+                       ta + pair.dt_max_frames + 1, by_t) -
+      peaks.begin());
+  const std::size_t lo = std::max<std::size_t>(first, anchor_idx + 1);
+  Array<std::uint32_t> idx;
+  strongest(peaks, lo, std::max(lo, last), pair.max_targets_per_anchor, idx);
+  Array<Peak> out;
+  out.reserve(idx.size());
+  for (const std::uint32_t j : idx) out.push_back(peaks[j]);
+  return out;
+}
+
+template <unsigned Bits>
+Result<OK> pair_peaks(std::span<const Peak> peaks, std::size_t n_anchors,
+                      const PairingCfg& pair, const KeyLayout& layout,
+                      Array<PackedKeyWithTime<Bits>>& out) {
+  if (packed_key_bits(layout.total_bits) != Bits) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  return pair_sweep(
+      peaks, n_anchors, pair, layout,
+      [&](std::uint32_t f_a, std::uint32_t f_t, std::uint32_t dt_bin,
+          std::uint32_t t) -> Result<OK> {
+        auto key = PackedKey<Bits>::pack(f_a, f_t, dt_bin, layout);
+        if (!key) return tl::unexpected(key.error());
+        out.push_back({*key, t});
+        return OK{};
+      });
+}
+
+template Result<OK> pair_peaks<32>(std::span<const Peak>, std::size_t,
+                                   const PairingCfg&, const KeyLayout&,
+                                   Array<PackedKeyWithTime<32>>&);
+template Result<OK> pair_peaks<48>(std::span<const Peak>, std::size_t,
+                                   const PairingCfg&, const KeyLayout&,
+                                   Array<PackedKeyWithTime<48>>&);
+template Result<OK> pair_peaks<64>(std::span<const Peak>, std::size_t,
+                                   const PairingCfg&, const KeyLayout&,
+                                   Array<PackedKeyWithTime<64>>&);
+
+Result<OK> pair_peaks(std::span<const Peak> peaks, std::size_t n_anchors,
+                      const PairingCfg& pair, const KeyLayout& layout,
+                      Array<KeyWithTime>& out) {
+  return with_packed_key(layout, [&](auto tag) -> Result<OK> {
+    using K = decltype(tag);
+    Array<PackedKeyWithTime<K::kBits>> native;
+    if (auto r = pair_peaks(peaks, n_anchors, pair, layout, native); !r) {
+      return r;
+    }
+    out.reserve(out.size() + native.size());
+    for (const auto& kt : native) {
+      out.push_back(KeyWithTime{to_key(kt.key, layout), kt.t_anchor});
+    }
+    return OK{};
+  });
+}
+
+Result<std::uint32_t> quantize_dt(std::uint32_t dt_frames,
+                                  std::uint16_t delta_bin_frames,
+                                  std::uint8_t bits_dt) {
+  if (delta_bin_frames == 0 || bits_dt == 0 || bits_dt > 32) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  const std::uint32_t max_bin =
+      bits_dt == 32 ? std::numeric_limits<std::uint32_t>::max()
+                    : (std::uint32_t{1} << bits_dt) - 1;
+  return std::min(dt_frames / delta_bin_frames, max_bin);
+}
+} // namespace afp
@@ -1,4 +1,242 @@
-#include "afp/pairing.hpp"
+#include "afp/peaks.hpp"
+
+#include <algorithm>
+#include <limits>
 
 namespace afp {
-}
\ No newline at end of file
+namespace {
+constexpr float kNegInf = -std::numeric_limits<float>::infinity();
+/// Margin (dB) over a frame's median level that a peak must reach.
+constexpr float kSnrMarginDb = 6.f;
+
+/// `out[i] = max(a[i], b[i])` over one row.
+void max_rows(const float* a, const float* b, float* out, std::uint32_t n) {
+  for (std::uint32_t i = 0; i < n; ++i) out[i] = std::max(a[i], b[i]);
+}
+} // namespace
+
+StreamPeakDetector::StreamPeakDetector(std::uint16_t cols,
+                                       std::uint8_t neigh_dt,
+                                       std::uint8_t neigh_df)
+    : cols_(cols),
+      dt_(neigh_dt),
+      df_(neigh_df),
+      ring_(std::size_t{2u * neigh_dt + 1u} * cols, kNegInf),
+      prefix_(cols),
+      raw_(std::size_t{neigh_dt + 1u} * cols),
+      fmax_(cols),
+      win_(cols) {}
+
+void StreamPeakDetector::push_row(std::span<const float> row,
+                                  Array<Peak>& out) {
+  float* raw = raw_.data() + std::size_t{rows_ % (dt_ + 1)} * cols_;
+  std::copy_n(row.begin(), cols_, raw);
+  ++rows_;
+
+  // Frequency pass (van Herk/Gil-Werman): pad with -inf, take per-block
+  // prefix maxima `g` and suffix maxima `h`; the window [i, i + 2*df] then
+  // spans at most two blocks and its max is `max(h[i], g[i + 2*df])`.
+  if (df_ == 0) {
+    std::copy_n(raw, cols_, fmax_.data());
+  } else {
+    const std::uint32_t w = 2 * df_ + 1;
+    const std::uint32_t m = cols_ + 2 * df_;
+    padded_.assign(m, kNegInf);
+    std::copy_n(raw, cols_, padded_.begin() + df_);
+    g_.resize(m);
+    h_.resize(m);
+    for (std::uint32_t p = 0; p < m; ++p) {
+      g_[p] = p % w == 0 ? padded_[p] : std::max(g_[p - 1], padded_[p]);
+    }
+    for (std::uint32_t p = m; p-- > 0;) {
+      h_[p] = p % w == w - 1 || p + 1 == m ? padded_[p]
+                                           : std::max(h_[p + 1], padded_[p]);
+    }
+    max_rows(h_.data(), g_.data() + 2 * df_, fmax_.data(), cols_);
+  }
+  advance(fmax_.data(), out);
+}
+
+void StreamPeakDetector::advance(const float* fmax, Array<Peak>& out) {
+  // Time pass: the same scheme over blocks of `w` rows. The window of the
+  // center `t - dt` is rows [t - 2*dt, t]: the suffix max of the previous
+  // block from slot j + 1 on, plus the running prefix max of this block.
+  const std::uint32_t w = 2 * dt_ + 1;
+  const std::uint32_t j = t_ % w;
+  const auto slot = [&](std::uint32_t s) {
+    return ring_.data() + std::size_t{s} * cols_;
+  };
+  if (j == 0) {
+    for (std::uint32_t s = w - 1; s-- > 0;) {
+      max_rows(slot(s), slot(s + 1), slot(s), cols_);
+    }
+    std::copy_n(fmax, cols_, prefix_.data());
+  } else {
+    max_rows(prefix_.data(), fmax, prefix_.data(), cols_);
+  }
+  const float* win = prefix_.data();
+  if (j + 1 < w) {
+    max_rows(slot(j + 1), prefix_.data(), win_.data(), cols_);
+    win = win_.data();
+  }
+  // Slot j's suffix max was last needed by the previous row.
+  std::copy_n(fmax, cols_, slot(j));
+
+  if (t_++ < dt_) return;
+  const std::uint32_t c = t_ - 1 - dt_;
+  if (c >= rows_) return;
+  const float* raw = raw_.data() + std::size_t{c % (dt_ + 1)} * cols_;
+  for (std::uint32_t f = 0; f < cols_; ++f) {
+    const float v = raw[f];
+    if (v < win[f]) continue;
+    const bool flat = (f == 0 || raw[f - 1] >= v) &&
+                      (f + 1 == cols_ || raw[f + 1] >= v);
+    if (flat && cols_ > 1) continue;
+    out.push_back(Peak{c, static_cast<std::uint16_t>(f), v});
+  }
+}
+
+void StreamPeakDetector::finish(Array<Peak>& out) {
+  // Rows past the end are -inf, which clips the last windows.
+  std::fill(fmax_.begin(), fmax_.end(), kNegInf);
+  for (std::uint32_t i = 0; i < dt_; ++i) advance(fmax_.data(), out);
+  std::fill(ring_.begin(), ring_.end(), kNegInf);
+  rows_ = 0;
+  t_ = 0;
+}
+
+Result<Array<float>> per_frame_thresholds(const ScaledSpec& base,
+                                         ExtractionArena* arena) {
+  const Matrix<float>& m = base.val;
+  if (m.data.size() != std::size_t{m.rows} * m.cols) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  Array<float> thr = arena ? arena->floats(m.rows) : Array<float>{};
+  thr.resize(m.rows);
+  if (m.cols == 0) {
+    std::fill(thr.begin(), thr.end(), kNegInf);
+    return thr;
+  }
+  // The median of a frame estimates its noise floor; each frame is judged
+  // on its own, so thresholds do not depend on how rows are blocked.
+  Array<float> row = arena ? arena->floats(m.cols) : Array<float>{};
+  const auto mid = static_cast<std::ptrdiff_t>(m.cols / 2);
+  for (std::uint32_t t = 0; t < m.rows; ++t) {
+    const auto first =
+        m.data.begin() + static_cast<std::ptrdiff_t>(std::size_t{t} * m.cols);
+    row.assign(first, first + static_cast<std::ptrdiff_t>(m.cols));
+    std::nth_element(row.begin(), row.begin() + mid, row.end());
+    thr[t] = row[static_cast<std::size_t>(mid)] + kSnrMarginDb;
+  }
+  if (arena) arena->recycle(std::move(row));
+  return thr;
+}
+
+Result<Array<Peak>> detect_candidates(const ScaledSpec& det,
+                                      std::uint8_t neigh_dt,
+                                      std::uint8_t neigh_df,
+                                      ExtractionArena* arena) {
+  const Matrix<float>& m = det.val;
+  if (m.cols > std::numeric_limits<std::uint16_t>::max() ||
+      m.data.size() != std::size_t{m.rows} * m.cols) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (m.rows == 0 || m.cols == 0) return tl::unexpected(Error::NoFrames);
+  StreamPeakDetector detector(static_cast<std::uint16_t>(m.cols), neigh_dt,
+                              neigh_df);
+  Array<Peak> out = arena ? arena->peaks(m.rows) : Array<Peak>{};
+  for (std::uint32_t t = 0; t < m.rows; ++t) {
+    detector.push_row(
+        std::span<const float>(m.data).subspan(std::size_t{t} * m.cols,
+                                               m.cols),
+        out);
+  }
+  detector.finish(out);
+  return out;
+}
+
+Result<Array<Peak>> filter_and_nms(Array<Peak> cands, Array<float> thr,
+                                   const FeatureCfg& feat,
+                                   const ScaledSpec& base,
+                                   ExtractionArena* arena) {
+  const Matrix<float>& m = base.val;
+  if (thr.size() < m.rows) return tl::unexpected(Error::InvalidArgument);
+  if (!std::is_sorted(cands.begin(), cands.end(),
+                      [](const Peak& a, const Peak& b) { return a.t < b.t; })) {
+    std::stable_sort(cands.begin(), cands.end(),
+                     [](const Peak& a, const Peak& b) { return a.t < b.t; });
+  }
+  const std::uint32_t cap =
+      feat.max_peaks_per_frame == 0
+          ? std::numeric_limits<std::uint32_t>::max()
+          : feat.max_peaks_per_frame;
+  const std::uint32_t floor = std::min<std::uint32_t>(
+      feat.min_peaks_per_frame, cap);
+  const std::uint32_t sep = feat.nms_min_freq_sep_bins;
+  const auto weaker = [](const Peak& a, const Peak& b) {
+    return a.strength < b.strength || (a.strength == b.strength && a.f > b.f);
+  };
+
+  const auto buffer = [&](std::size_t n) {
+    return arena ? arena->peaks(n) : Array<Peak>{};
+  };
+  Array<Peak> out = buffer(cands.size());
+  // Scratch reused across frames: [passed | failed] candidates, then the
+  // kept peaks of the frame.
+  Array<Peak> scratch = buffer(0);
+  Array<Peak> kept = buffer(0);
+  std::size_t i = 0;
+  while (i < cands.size()) {
+    const std::uint32_t t = cands[i].t;
+    scratch.clear();
+    std::size_t n_pass = 0;
+    for (; i < cands.size() && cands[i].t == t; ++i) {
+      const Peak& c = cands[i];
+      if (t >= m.rows || c.f >= m.cols) {
+        return tl::unexpected(Error::InvalidArgument);
+      }
+      scratch.push_back(c);
+      if (m.data[std::size_t{t} * m.cols + c.f] >= thr[t]) {
+        std::swap(scratch[n_pass++], scratch.back());
+      }
+    }
+
+    kept.clear();
+    // Greedy NMS: pop the strongest remaining candidate of [first, last)
+    // until `limit` peaks are kept.
+    const auto select = [&](std::size_t first, std::size_t last,
+                            std::uint32_t limit) {
+      auto b = scratch.begin() + static_cast<std::ptrdiff_t>(first);
+      auto e = scratch.begin() + static_cast<std::ptrdiff_t>(last);
+      std::make_heap(b, e, weaker);
+      while (b != e && kept.size() < limit) {
+        std::pop_heap(b, e, weaker);
+        const Peak& c = *--e;
+        const bool suppressed =
+            std::any_of(kept.begin(), kept.end(), [&](const Peak& k) {
+              const auto d = c.f > k.f ? c.f - k.f : k.f - c.f;
+              return static_cast<std::uint32_t>(d) < sep;
+            });
+        if (!suppressed) kept.push_back(c);
+      }
+    };
+    select(0, n_pass, cap);
+    if (kept.size() < floor) select(n_pass, scratch.size(), floor);
+
+    std::sort(kept.begin(), kept.end(),
+              [](const Peak& a, const Peak& b) { return a.f < b.f; });
+    out.insert(out.end(), kept.begin(), kept.end());
+  }
+  if (arena) {
+    arena->recycle(std::move(cands));
+    arena->recycle(std::move(thr));
+    arena->recycle(std::move(scratch));
+    arena->recycle(std::move(kept));
+  }
+  if (out.empty()) {
+    if (arena) arena->recycle(std::move(out));
+    return tl::unexpected(Error::NoPeaks);
+  }
+  return out;
+}
+} // namespace afp
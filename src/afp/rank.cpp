@@ -1,4 +1,421 @@
 #include "afp/rank.hpp"
+#include "afp/build.hpp"
+#include "afp/keys.hpp"
+#include "afp/pack.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numeric>
 
 namespace afp {
-}
\ No newline at end of file
+namespace {
+constexpr std::size_t kMinSlots = 16;
+/// Half-width (bins) of the window evaluated around the winning offset.
+constexpr std::int32_t kWindowHalfBins = 8;
+
+std::uint64_t pack_vote_key(std::uint32_t track_id, std::int32_t off_bin) {
+  return (static_cast<std::uint64_t>(track_id) << 32) |
+         static_cast<std::uint32_t>(off_bin);
+}
+
+/// Floor division so negative offsets bin consistently.
+std::int32_t floor_div(std::int64_t num, std::int64_t den) {
+  std::int64_t q = num / den;
+  if ((num % den != 0) && ((num < 0) != (den < 0))) --q;
+  return static_cast<std::int32_t>(q);
+}
+
+/// Query keys grouped by distinct key and fetched in one `get_many`: fetch
+/// `v` (`values[v]`) is group `u = by_key[v]`, which serves the queries
+/// `order[first[u] .. first[u + 1])`. Queries on skipped keys are left out
+/// of `order`.
+struct FetchedKeys {
+  Array<std::uint32_t> order;
+  Array<std::uint32_t> first;
+  Array<std::uint32_t> by_key;
+  Array<std::optional<ValueView>> values;
+};
+
+template <unsigned Bits>
+Result<FetchedKeys> fetch_query_keys(
+    const Array<PackedKeyWithTime<Bits>>& query_keys,
+    std::span<const PackedKey<Bits>> skip_sorted, const KeyLayout& layout,
+    KVReadBatch& batch) {
+  if (packed_key_bits(layout.total_bits) != Bits) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  // Visit query keys in key order so each distinct key is fetched and
+  // decoded once.
+  FetchedKeys out;
+  Array<std::uint32_t>& order = out.order;
+  order.resize(query_keys.size());
+  std::iota(order.begin(), order.end(), 0u);
+  std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+    return query_keys[a].key < query_keys[b].key;
+  });
+  if (!skip_sorted.empty()) {
+    // Drop stoplisted keys with one merge walk over both sorted sequences.
+    auto s = skip_sorted.begin();
+    std::erase_if(order, [&](std::uint32_t i) {
+      const PackedKey<Bits> k = query_keys[i].key;
+      while (s != skip_sorted.end() && *s < k) ++s;
+      return s != skip_sorted.end() && *s == k;
+    });
+  }
+  Array<Key> uniq;
+  for (std::uint32_t j = 0; j < order.size(); ++j) {
+    const PackedKey<Bits> k = query_keys[order[j]].key;
+    if (j == 0 || query_keys[order[j - 1]].key != k) {
+      uniq.push_back(to_key(k, layout));
+      out.first.push_back(j);
+    }
+  }
+  out.first.push_back(static_cast<std::uint32_t>(order.size()));
+
+  // Big-endian keys sort like their native values; otherwise reorder the
+  // on-disk keys for the batch lookup.
+  out.by_key.resize(uniq.size());
+  std::iota(out.by_key.begin(), out.by_key.end(), 0u);
+  if (layout.endian != Endian::Big) {
+    std::sort(out.by_key.begin(), out.by_key.end(),
+              [&](std::uint32_t a, std::uint32_t b) {
+                return uniq[a] < uniq[b];
+              });
+  }
+  Array<Key> fetch(uniq.size());
+  for (std::size_t v = 0; v < fetch.size(); ++v) {
+    fetch[v] = uniq[out.by_key[v]];
+  }
+  auto values = get_many(batch, fetch);
+  if (!values) return tl::unexpected(values.error());
+  out.values = std::move(*values);
+  return out;
+}
+} // namespace
+
+VoteTable::VoteTable(std::size_t expected_bins) {
+  rehash(std::bit_ceil(std::max(kMinSlots, expected_bins * 2)));
+}
+
+void VoteTable::clear() {
+  std::fill(slots_.begin(), slots_.end(), Slot{});
+  size_ = 0;
+}
+
+void VoteTable::rehash(std::size_t capacity) {
+  std::vector<Slot> old = std::move(slots_);
+  slots_.assign(capacity, Slot{});
+  shift_ = static_cast<std::uint8_t>(64 - std::countr_zero(capacity));
+  const std::size_t mask = capacity - 1;
+  for (const Slot& s : old) {
+    if (s.count == 0) continue;
+    std::size_t i = (s.key * 0x9E3779B97F4A7C15ull) >> shift_;
+    while (slots_[i].count != 0) i = (i + 1) & mask;
+    slots_[i] = s;
+  }
+}
+
+void VoteTable::add(std::uint32_t track_id, std::int32_t off_bin,
+                    std::uint32_t n) {
+  if (n == 0) return;
+  if ((size_ + 1) * 2 > slots_.size()) rehash(slots_.size() * 2);
+  const std::uint64_t key = pack_vote_key(track_id, off_bin);
+  const std::size_t mask = slots_.size() - 1;
+  std::size_t i = (key * 0x9E3779B97F4A7C15ull) >> shift_;
+  for (;;) {
+    Slot& s = slots_[i];
+    if (s.count == 0) {
+      s.key = key;
+      s.count = n;
+      ++size_;
+      return;
+    }
+    if (s.key == key) {
+      s.count += n;
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+void VoteTable::remove(std::uint32_t track_id, std::int32_t off_bin,
+                       std::uint32_t n) {
+  if (n == 0) return;
+  const std::uint64_t key = pack_vote_key(track_id, off_bin);
+  const std::size_t mask = slots_.size() - 1;
+  const auto home = [&](std::uint64_t k) -> std::size_t {
+    return (k * 0x9E3779B97F4A7C15ull) >> shift_;
+  };
+  std::size_t i = home(key);
+  while (slots_[i].count != 0 && slots_[i].key != key) i = (i + 1) & mask;
+  if (slots_[i].count == 0) return;
+  if (slots_[i].count > n) {
+    slots_[i].count -= n;
+    return;
+  }
+  // Refill the hole from later in the chain: a slot may move back to `i`
+  // unless its home lies cyclically in (i, j].
+  --size_;
+  for (std::size_t j = (i + 1) & mask; slots_[j].count != 0;
+       j = (j + 1) & mask) {
+    if (((j - home(slots_[j].key)) & mask) >= ((j - i) & mask)) {
+      slots_[i] = slots_[j];
+      i = j;
+    }
+  }
+  slots_[i] = Slot{};
+}
+
+std::uint32_t VoteTable::count(std::uint32_t track_id,
+                               std::int32_t off_bin) const {
+  const std::uint64_t key = pack_vote_key(track_id, off_bin);
+  const std::size_t mask = slots_.size() - 1;
+  std::size_t i = (key * 0x9E3779B97F4A7C15ull) >> shift_;
+  while (slots_[i].count != 0) {
+    if (slots_[i].key == key) return slots_[i].count;
+    i = (i + 1) & mask;
+  }
+  return 0;
+}
+
+template <unsigned Bits>
+Result<OK> vote_offsets(const Array<PackedKeyWithTime<Bits>>& query_keys,
+                        KVReadBatch& batch, const PairingCfg& pair,
+                        const KeyLayout& layout, VoteTable& votes,
+                        std::type_identity_t<std::span<const PackedKey<Bits>>>
+                            skip_sorted,
+                        Array<CastVote>* cast) {
+  if (pair.delta_bin_frames == 0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (query_keys.empty()) return OK{};
+
+  auto fetched = fetch_query_keys(query_keys, skip_sorted, layout, batch);
+  if (!fetched) return tl::unexpected(fetched.error());
+  const FetchedKeys& f = *fetched;
+  Array<std::uint32_t> times;
+  for (std::size_t v = 0; v < f.values.size(); ++v) {
+    const auto& view = f.values[v];
+    const std::uint32_t u = f.by_key[v];
+    if (!view) continue;
+    auto it = parse_posting_blocks(*view);
+    if (!it) return tl::unexpected(it.error());
+    while (auto block = it->next_block()) {
+      if (times.size() < block->n) times.resize(block->n);
+      if (!it->read_times(times)) break;
+      for (std::uint32_t j = f.first[u]; j < f.first[u + 1]; ++j) {
+        const std::uint32_t tq = query_keys[f.order[j]].t_anchor;
+        for (std::uint32_t k = 0; k < block->n; ++k) {
+          const std::int64_t off =
+              static_cast<std::int64_t>(times[k]) - std::int64_t{tq};
+          const std::int32_t bin = floor_div(off, pair.delta_bin_frames);
+          votes.add(block->track_id, bin);
+          if (cast) cast->push_back({tq, block->track_id, bin});
+        }
+      }
+    }
+    if (it->failed()) return tl::unexpected(Error::IntegrityError);
+  }
+  return OK{};
+}
+
+template Result<OK> vote_offsets<32>(const Array<PackedKeyWithTime<32>>&,
+                                     KVReadBatch&, const PairingCfg&,
+                                     const KeyLayout&, VoteTable&,
+                                     std::span<const PackedKey<32>>,
+                                     Array<CastVote>*);
+template Result<OK> vote_offsets<48>(const Array<PackedKeyWithTime<48>>&,
+                                     KVReadBatch&, const PairingCfg&,
+                                     const KeyLayout&, VoteTable&,
+                                     std::span<const PackedKey<48>>,
+                                     Array<CastVote>*);
+template Result<OK> vote_offsets<64>(const Array<PackedKeyWithTime<64>>&,
+                                     KVReadBatch&, const PairingCfg&,
+                                     const KeyLayout&, VoteTable&,
+                                     std::span<const PackedKey<64>>,
+                                     Array<CastVote>*);
+
+Result<Array<Key>> load_hot_keys(const KVHandle& kvh) {
+  auto list = kv_get_info(kvh, kInfoHotKeys);
+  if (!list) return tl::unexpected(list.error());
+  Array<Key> keys;
+  if (!*list) return keys;
+  const ByteArray& bytes = **list;
+  constexpr std::size_t kKeyBytes = sizeof(Key::bytes);
+  if (bytes.size() % kKeyBytes != 0) {
+    return tl::unexpected(Error::IntegrityError);
+  }
+  keys.resize(bytes.size() / kKeyBytes);
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    std::copy_n(bytes.begin() + static_cast<std::ptrdiff_t>(i * kKeyBytes),
+                kKeyBytes, keys[i].bytes.begin());
+  }
+  if (!std::is_sorted(keys.begin(), keys.end())) {
+    return tl::unexpected(Error::IntegrityError);
+  }
+  return keys;
+}
+
+Map<std::tuple<std::uint32_t, std::int32_t>, std::uint32_t> export_votes(
+    const VoteTable& votes) {
+  Map<std::tuple<std::uint32_t, std::int32_t>, std::uint32_t> out;
+  votes.for_each([&](std::uint32_t track, std::int32_t off, std::uint32_t n) {
+    out.emplace(std::make_tuple(track, off), n);
+  });
+  return out;
+}
+
+Result<BestByVotes> select_best_by_votes(const VoteTable& votes) {
+  if (votes.empty()) return tl::unexpected(Error::InvalidArgument);
+
+  BestByVotes best;
+  votes.for_each([&](std::uint32_t track, std::int32_t off, std::uint32_t n) {
+    const bool better =
+        n > best.stats.peak ||
+        (n == best.stats.peak &&
+         std::tie(track, off) < std::tie(best.track_id, best.off_bin));
+    if (better) {
+      best.track_id = track;
+      best.off_bin = off;
+      best.stats.peak = n;
+    }
+  });
+
+  // Weighted quartiles of the winner's offsets inside the evaluation window.
+  const Array<std::int32_t> window = window_around(best.off_bin);
+  Array<std::uint32_t> weights(window.size());
+  std::uint64_t total = 0;
+  for (std::size_t i = 0; i < window.size(); ++i) {
+    weights[i] = votes.count(best.track_id, window[i]);
+    total += weights[i];
+  }
+  auto quantile_bin = [&](std::uint64_t rank) {
+    std::uint64_t acc = 0;
+    for (std::size_t i = 0; i < window.size(); ++i) {
+      acc += weights[i];
+      if (acc > rank) return window[i];
+    }
+    return window.back();
+  };
+  best.stats.iqr_bins = static_cast<float>(quantile_bin((3 * total) / 4) -
+                                           quantile_bin(total / 4));
+  return best;
+}
+
+template <unsigned Bits>
+Result<float> frame_coverage(std::uint32_t best_track,
+                             std::int32_t best_off_bin,
+                             const Array<PackedKeyWithTime<Bits>>& query_keys,
+                             KVReadBatch& batch, const PairingCfg& pair,
+                             const KeyLayout& layout,
+                             std::type_identity_t<
+                                 std::span<const PackedKey<Bits>>>
+                                 skip_sorted) {
+  if (pair.delta_bin_frames == 0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (query_keys.empty()) return 0.f;
+
+  // Stoplisted keys are neither fetched nor counted: a frame whose keys
+  // were all skipped could not have voted, so it stays out of `frames`.
+  auto fetched = fetch_query_keys(query_keys, skip_sorted, layout, batch);
+  if (!fetched) return tl::unexpected(fetched.error());
+  const FetchedKeys& f = *fetched;
+  if (f.order.empty()) return 0.f;
+  // A query frame covers the winner if one of its anchors lands in the
+  // winning bin: a stored time in [tq + lo, tq + lo + delta_bin_frames).
+  const std::int64_t lo =
+      static_cast<std::int64_t>(best_off_bin) * pair.delta_bin_frames;
+  Array<std::uint32_t> covered;
+  Array<std::uint32_t> times;
+  for (std::size_t v = 0; v < f.values.size(); ++v) {
+    const auto& view = f.values[v];
+    const std::uint32_t u = f.by_key[v];
+    if (!view) continue;
+    auto it = parse_posting_blocks(*view);
+    if (!it) return tl::unexpected(it.error());
+    while (auto block = it->next_block()) {
+      if (block->track_id != best_track) continue;
+      if (times.size() < block->n) times.resize(block->n);
+      if (!it->read_times(times)) break;
+      const auto end = times.begin() + block->n;
+      for (std::uint32_t j = f.first[u]; j < f.first[u + 1]; ++j) {
+        const std::uint32_t tq = query_keys[f.order[j]].t_anchor;
+        const std::int64_t from = tq + lo;
+        const auto hit = std::lower_bound(
+            times.begin(), end, from, [](std::uint32_t t, std::int64_t v) {
+              return static_cast<std::int64_t>(t) < v;
+            });
+        if (hit != end &&
+            static_cast<std::int64_t>(*hit) < from + pair.delta_bin_frames) {
+          covered.push_back(tq);
+        }
+      }
+    }
+    if (it->failed()) return tl::unexpected(Error::IntegrityError);
+  }
+
+  Array<std::uint32_t> frames(f.order.size());
+  for (std::size_t i = 0; i < frames.size(); ++i) {
+    frames[i] = query_keys[f.order[i]].t_anchor;
+  }
+  for (Array<std::uint32_t>* v : {&frames, &covered}) {
+    std::sort(v->begin(), v->end());
+    v->erase(std::unique(v->begin(), v->end()), v->end());
+  }
+  return static_cast<float>(covered.size()) /
+         static_cast<float>(frames.size());
+}
+
+template Result<float> frame_coverage<32>(
+    std::uint32_t, std::int32_t, const Array<PackedKeyWithTime<32>>&,
+    KVReadBatch&, const PairingCfg&, const KeyLayout&,
+    std::span<const PackedKey<32>>);
+template Result<float> frame_coverage<48>(
+    std::uint32_t, std::int32_t, const Array<PackedKeyWithTime<48>>&,
+    KVReadBatch&, const PairingCfg&, const KeyLayout&,
+    std::span<const PackedKey<48>>);
+template Result<float> frame_coverage<64>(
+    std::uint32_t, std::int32_t, const Array<PackedKeyWithTime<64>>&,
+    KVReadBatch&, const PairingCfg&, const KeyLayout&,
+    std::span<const PackedKey<64>>);
+
+Result<float> histogram_entropy(
+    const Map<std::int32_t, std::uint32_t>& track_votes,
+    const Array<std::int32_t>& window_bins) {
+  std::uint64_t total = 0;
+  for (const std::int32_t bin : window_bins) {
+    auto it = track_votes.find(bin);
+    if (it != track_votes.end()) total += it->second;
+  }
+  if (total == 0) return 0.f;
+  double h = 0.0;
+  for (const std::int32_t bin : window_bins) {
+    auto it = track_votes.find(bin);
+    if (it == track_votes.end() || it->second == 0) continue;
+    const double p =
+        static_cast<double>(it->second) / static_cast<double>(total);
+    h -= p * std::log2(p);
+  }
+  return static_cast<float>(h);
+}
+
+Map<std::int32_t, std::uint32_t> project_track_hist(const VoteTable& votes,
+                                                    std::uint32_t track_id) {
+  Map<std::int32_t, std::uint32_t> hist;
+  votes.for_each([&](std::uint32_t track, std::int32_t off, std::uint32_t n) {
+    if (track == track_id) hist.emplace(off, n);
+  });
+  return hist;
+}
+
+Array<std::int32_t> window_around(std::int32_t off_bin) {
+  Array<std::int32_t> bins;
+  bins.reserve(2 * kWindowHalfBins + 1);
+  for (std::int32_t d = -kWindowHalfBins; d <= kWindowHalfBins; ++d) {
+    bins.push_back(off_bin + d);
+  }
+  return bins;
+}
+} // namespace afp
@@ -1,4 +1,529 @@
 #include "afp/scale.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
 namespace afp {
-}
\ No newline at end of file
+namespace {
+/// Floor added to magnitudes before the log (-200 dB).
+constexpr float kMagFloor = 1e-10f;
+/// PCEN smoothing coefficient, gain exponent, bias and root.
+constexpr float kPcenS = 0.025f;
+constexpr float kPcenAlpha = 0.98f;
+constexpr float kPcenDelta = 2.f;
+constexpr float kPcenR = 0.5f;
+constexpr float kPcenEps = 1e-6f;
+
+/// Bins per group of the percentile walk.
+constexpr std::uint32_t kHistGroup = 64;
+
+/// Fixed-width histogram over the dB domain. Counts can be removed again,
+/// so it also serves a sliding window; per-group sums keep the percentile
+/// walk short.
+class DbHistogram {
+ public:
+  explicit DbHistogram(std::uint32_t bins)
+      : counts_(bins),
+        groups_((bins + kHistGroup - 1) / kHistGroup),
+        scale_(static_cast<float>(bins) / (kClipHistMaxDb - kClipHistMinDb)) {}
+
+  void add(float v) {
+    const std::uint32_t b = bin(v);
+    ++counts_[b];
+    ++groups_[b / kHistGroup];
+    min_ = std::min(min_, v);
+    max_ = std::max(max_, v);
+    ++n_;
+  }
+
+  void clear() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    std::fill(groups_.begin(), groups_.end(), 0);
+    n_ = 0;
+    min_ = std::numeric_limits<float>::infinity();
+    max_ = -std::numeric_limits<float>::infinity();
+  }
+
+  /// Undo `add(v)` (the running min/max are not narrowed).
+  void remove(float v) {
+    const std::uint32_t b = bin(v);
+    --counts_[b];
+    --groups_[b / kHistGroup];
+    --n_;
+  }
+
+  /// Value at percentile `p` in [0, 100] (linear rank, within one bin),
+  /// clamped to the values added so far.
+  [[nodiscard]] float percentile(float p) const {
+    return percentile(p, min_, max_);
+  }
+
+  /// As above, clamped to [lo, hi] (e.g. the min/max of a window).
+  [[nodiscard]] float percentile(float p, float lo, float hi) const {
+    if (n_ == 0) return 0.f;
+    const double rank = static_cast<double>(p) / 100.0 *
+                        static_cast<double>(n_ - 1);
+    std::uint64_t before = 0;
+    std::size_t g = 0;
+    while (g + 1 < groups_.size() &&
+           static_cast<double>(before + groups_[g]) <= rank) {
+      before += groups_[g++];
+    }
+    std::size_t b = g * kHistGroup;
+    const std::size_t last = std::min(counts_.size(), b + kHistGroup);
+    while (b + 1 < last && static_cast<double>(before + counts_[b]) <= rank) {
+      before += counts_[b++];
+    }
+    const double frac =
+        counts_[b] == 0 ? 0.0
+                        : (rank - static_cast<double>(before)) /
+                              static_cast<double>(counts_[b]);
+    const double v = kClipHistMinDb + (static_cast<double>(b) + frac) / scale_;
+    return std::clamp(static_cast<float>(v), lo, hi);
+  }
+
+ private:
+  std::uint32_t bin(float v) const {
+    const auto bins = static_cast<std::uint32_t>(counts_.size());
+    const float x = (v - kClipHistMinDb) * scale_;
+    return x <= 0.f ? 0u
+           : x >= static_cast<float>(bins - 1)
+               ? bins - 1
+               : static_cast<std::uint32_t>(x);
+  }
+
+  Array<std::uint64_t> counts_;
+  Array<std::uint64_t> groups_;
+  float scale_;
+  std::uint64_t n_{};
+  float min_{std::numeric_limits<float>::infinity()};
+  float max_{-std::numeric_limits<float>::infinity()};
+};
+
+/// Exact linear-rank percentiles of `cells` (reordered in place).
+ClipBounds exact_bounds(Array<float>& cells, float p_lo, float p_hi) {
+  const auto at = [&](float p) {
+    const double rank = static_cast<double>(p) / 100.0 *
+                        static_cast<double>(cells.size() - 1);
+    const auto i = static_cast<std::size_t>(rank);
+    const auto it = cells.begin() + static_cast<std::ptrdiff_t>(i);
+    std::nth_element(cells.begin(), it, cells.end());
+    const float v = *it;
+    if (i + 1 == cells.size()) return v;
+    // The next order statistic is the minimum of the upper partition.
+    const float next = *std::min_element(it + 1, cells.end());
+    return static_cast<float>(v + (rank - static_cast<double>(i)) *
+                                      static_cast<double>(next - v));
+  };
+  const float lo = at(p_lo);
+  return ClipBounds{lo, at(p_hi)};
+}
+
+std::uint32_t hist_bins_or_default(std::uint32_t bins) {
+  return bins == 0 ? kClipHistDefaultBins : bins;
+}
+
+float to_db(float v) { return 20.f * std::log10(v + kMagFloor); }
+
+/// Frames filtered together, one per vector lane.
+constexpr std::uint32_t kBlurLanes = 8;
+using Lanes = std::array<float, kBlurLanes>;
+using LaneRows = std::array<float*, kBlurLanes>;
+
+/// Young-van Vliet recursive Gaussian, normalized so `b + a1 + a2 + a3 = 1`:
+/// `w[n] = b x[n] + a1 w[n-1] + a2 w[n-2] + a3 w[n-3]` (then reversed).
+struct Yvv {
+  float b{};
+  float a1{};
+  float a2{};
+  float a3{};
+  /// Triggs-Sdika matrix: anti-causal start state from the last three
+  /// causal outputs, for an input replicated past the right edge.
+  std::array<std::array<float, 3>, 3> m{};
+
+  /// Coefficients for shape parameter `q` (Young & van Vliet 1995, eq. 8c).
+  static Yvv from_q(double q) {
+    const double q2 = q * q;
+    const double q3 = q2 * q;
+    const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    const double b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+    const double b2 = -(1.4281 * q2 + 1.26661 * q3);
+    const double b3 = 0.422205 * q3;
+    const double a1 = b1 / b0;
+    const double a2 = b2 / b0;
+    const double a3 = b3 / b0;
+    // Triggs & Sdika 2006, eq. 15 (for `a_i` on the right-hand side).
+    const double c = 1.0 / ((1.0 + a1 - a2 + a3) * (1.0 + a2 + (a1 - a3) * a3));
+    const double m[3][3] = {
+        {-a3 * (a1 + a3) - a2 + 1.0, (a3 + a1) * (a2 + a3 * a1),
+         a3 * (a1 + a3 * a2)},
+        {a1 + a3 * a2, -(a2 - 1.0) * (a2 + a3 * a1),
+         -a3 * (a3 * a1 + a3 * a3 + a2 - 1.0)},
+        {a3 * a1 + a2 + a1 * a1 - a2 * a2,
+         a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3,
+         a3 * (a1 + a3 * a2)}};
+    Yvv g{static_cast<float>(1.0 - a1 - a2 - a3), static_cast<float>(a1),
+          static_cast<float>(a2), static_cast<float>(a3)};
+    for (std::size_t i = 0; i < 3; ++i) {
+      for (std::size_t k = 0; k < 3; ++k) {
+        g.m[i][k] = static_cast<float>(c * m[i][k]);
+      }
+    }
+    return g;
+  }
+
+  /// Coefficients for `sigma >= 0.5` (paper eq. 11b for `q`).
+  static Yvv make(float sigma) {
+    const double s = sigma;
+    return from_q(s >= 2.5
+                      ? 0.98711 * s - 0.96330
+                      : 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * s));
+  }
+};
+
+/// Filter state per lane: the last three outputs, newest first.
+struct YvvState {
+  Lanes p{};
+  Lanes q{};
+  Lanes r{};
+
+  void fill(const Lanes& v) { p = q = r = v; }
+
+  /// Anti-causal start past the right edge, given the causal state (`p`
+  /// newest) and the edge input `x` (Triggs & Sdika boundary).
+  void fill_right(const Yvv& g, const Lanes& x) {
+    for (std::uint32_t l = 0; l < kBlurLanes; ++l) {
+      const float u[3] = {p[l] - x[l], q[l] - x[l], r[l] - x[l]};
+      float w[3];
+      for (std::size_t i = 0; i < 3; ++i) {
+        w[i] = x[l] + g.m[i][0] * u[0] + g.m[i][1] * u[1] + g.m[i][2] * u[2];
+      }
+      p[l] = w[0];
+      q[l] = w[1];
+      r[l] = w[2];
+    }
+  }
+
+  /// Advance every lane by one sample `x`, returning the outputs.
+  Lanes step(const Yvv& g, const Lanes& x) {
+    Lanes w;
+    for (std::uint32_t l = 0; l < kBlurLanes; ++l) {
+      w[l] = g.b * x[l] + g.a1 * p[l] + g.a2 * q[l] + g.a3 * r[l];
+    }
+    r = q;
+    q = p;
+    p = w;
+    return w;
+  }
+};
+
+Lanes load(const LaneRows& rows, std::uint32_t f) {
+  Lanes v;
+  for (std::uint32_t l = 0; l < kBlurLanes; ++l) v[l] = rows[l][f];
+  return v;
+}
+
+void store(const LaneRows& rows, std::uint32_t f, const Lanes& v) {
+  for (std::uint32_t l = 0; l < kBlurLanes; ++l) rows[l][f] = v[l];
+}
+
+/// Point the lanes at rows `[t0, t0 + kBlurLanes)` of `m`; lanes past the
+/// last row filter a throwaway copy of it instead.
+LaneRows lane_rows(Matrix<float>& m, std::uint32_t t0, Array<float>& spare) {
+  LaneRows rows;
+  for (std::uint32_t l = 0; l < kBlurLanes; ++l) {
+    const std::uint32_t t = t0 + l;
+    if (t < m.rows) {
+      rows[l] = m.data.data() + std::size_t{t} * m.cols;
+    } else {
+      float* last = m.data.data() + std::size_t{m.rows - 1} * m.cols;
+      spare.resize(std::size_t{kBlurLanes} * m.cols);
+      rows[l] = spare.data() + std::size_t{l} * m.cols;
+      std::copy_n(last, m.cols, rows[l]);
+    }
+  }
+  return rows;
+}
+
+/// Blur `kBlurLanes` rows of `cols` bins in place.
+void blur_lanes(const Yvv& g, const LaneRows& rows, std::uint32_t cols) {
+  const Lanes edge = load(rows, cols - 1);
+  YvvState st;
+  st.fill(load(rows, 0));
+  for (std::uint32_t f = 0; f < cols; ++f) {
+    store(rows, f, st.step(g, load(rows, f)));
+  }
+  st.fill_right(g, edge);
+  for (std::uint32_t f = cols; f-- > 0;) {
+    store(rows, f, st.step(g, load(rows, f)));
+  }
+}
+
+/// Fused DoG over `kBlurLanes` rows: `base` holds the input and receives
+/// G1, `det` receives G1 - G2. The causal pass parks the intermediate G2
+/// in `det`, so each cell is read once per pass.
+void dog_lanes(const Yvv& g1, const Yvv& g2, const LaneRows& base,
+               const LaneRows& det, std::uint32_t cols) {
+  YvvState s1;
+  YvvState s2;
+  const Lanes first = load(base, 0);
+  const Lanes edge = load(base, cols - 1);
+  s1.fill(first);
+  s2.fill(first);
+  for (std::uint32_t f = 0; f < cols; ++f) {
+    const Lanes x = load(base, f);
+    store(base, f, s1.step(g1, x));
+    store(det, f, s2.step(g2, x));
+  }
+  s1.fill_right(g1, edge);
+  s2.fill_right(g2, edge);
+  for (std::uint32_t f = cols; f-- > 0;) {
+    const Lanes y1 = s1.step(g1, load(base, f));
+    const Lanes y2 = s2.step(g2, load(det, f));
+    Lanes d;
+    for (std::uint32_t l = 0; l < kBlurLanes; ++l) d[l] = y1[l] - y2[l];
+    store(base, f, y1);
+    store(det, f, d);
+  }
+}
+} // namespace
+
+struct StreamScaler::State {
+  FeatureCfg feat;
+  bool exact{};
+  bool clip{};
+  std::uint32_t window{};
+  DbHistogram hist;
+
+  // Band of the first push (`fp == 0` before it).
+  std::uint32_t sr{};
+  std::uint32_t fft{};
+  std::uint32_t f0{};
+  std::uint32_t fp{};
+  // PCEN smoother, seeded from the first row.
+  Array<float> smooth;
+  // Ring of the last `window` mapped rows with their min/max; `rows` counts
+  // rows pushed since the start.
+  Array<float> ring;
+  Array<float> ring_min;
+  Array<float> ring_max;
+  std::uint64_t rows{};
+
+  State(const FeatureCfg& f, std::uint32_t hist_bins)
+      : feat(f),
+        exact(f.clip_percentile == PercentileMode::Exact),
+        clip(f.clip_high_pct > 0.f),
+        window(f.clip_window_frames == 0 ? kClipWindowFrames
+                                         : f.clip_window_frames),
+        hist(hist_bins) {}
+
+  void map_row(const float* in, float* out);
+  ClipBounds enter_window(const float* row, ExtractionArena* arena);
+};
+
+void StreamScaler::State::map_row(const float* in, float* out) {
+  if (!feat.use_pcen) {
+    for (std::uint32_t j = 0; j < fp; ++j) out[j] = to_db(in[j]);
+    return;
+  }
+  if (smooth.empty()) smooth.assign(in, in + fp);
+  for (std::uint32_t j = 0; j < fp; ++j) {
+    const float e = in[j];
+    smooth[j] += kPcenS * (e - smooth[j]);
+    const float g = e / std::pow(kPcenEps + smooth[j], kPcenAlpha);
+    out[j] = to_db(std::pow(g + kPcenDelta, kPcenR) -
+                   std::pow(kPcenDelta, kPcenR));
+  }
+}
+
+ClipBounds StreamScaler::State::enter_window(const float* row,
+                                             ExtractionArena* arena) {
+  const auto slot = static_cast<std::size_t>(rows % window);
+  float* cell = ring.data() + slot * fp;
+  if (rows >= window && !exact) {
+    for (std::uint32_t j = 0; j < fp; ++j) hist.remove(cell[j]);
+  }
+  std::copy_n(row, fp, cell);
+  const auto [mn, mx] = std::minmax_element(row, row + fp);
+  ring_min[slot] = *mn;
+  ring_max[slot] = *mx;
+  ++rows;
+  const auto filled = static_cast<std::size_t>(std::min<std::uint64_t>(
+      rows, window));
+
+  if (exact) {
+    Array<float> cells = arena ? arena->floats(filled * fp) : Array<float>{};
+    cells.assign(ring.begin(),
+                 ring.begin() + static_cast<std::ptrdiff_t>(filled * fp));
+    const ClipBounds b =
+        exact_bounds(cells, feat.clip_low_pct, feat.clip_high_pct);
+    if (arena) arena->recycle(std::move(cells));
+    return b;
+  }
+  for (std::uint32_t j = 0; j < fp; ++j) hist.add(cell[j]);
+  const float lo = *std::min_element(ring_min.begin(),
+                                     ring_min.begin() +
+                                         static_cast<std::ptrdiff_t>(filled));
+  const float hi = *std::max_element(ring_max.begin(),
+                                     ring_max.begin() +
+                                         static_cast<std::ptrdiff_t>(filled));
+  return ClipBounds{hist.percentile(feat.clip_low_pct, lo, hi),
+                    hist.percentile(feat.clip_high_pct, lo, hi)};
+}
+
+StreamScaler::StreamScaler(std::unique_ptr<State> state)
+    : state_(std::move(state)) {}
+StreamScaler::StreamScaler(StreamScaler&&) noexcept = default;
+StreamScaler& StreamScaler::operator=(StreamScaler&&) noexcept = default;
+StreamScaler::~StreamScaler() = default;
+
+Result<StreamScaler> StreamScaler::create(const FeatureCfg& feat) {
+  if (!(feat.band_max_hz > feat.band_min_hz) || feat.band_min_hz < 0.f ||
+      feat.clip_low_pct < 0.f || feat.clip_high_pct > 100.f ||
+      (feat.clip_high_pct > 0.f && feat.clip_low_pct > feat.clip_high_pct)) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  const bool hist = feat.clip_high_pct > 0.f &&
+                    feat.clip_percentile != PercentileMode::Exact;
+  return StreamScaler(std::make_unique<State>(
+      feat, hist ? hist_bins_or_default(feat.clip_hist_bins) : 1));
+}
+
+Result<ScaledSpec> StreamScaler::push(STFTSpec spec, ExtractionArena* arena) {
+  State& st = *state_;
+  Matrix<float>& m = spec.mag;
+  if (spec.sr == 0 || spec.fft == 0 || m.cols != spec.fft / 2 + 1 ||
+      m.data.size() != std::size_t{m.rows} * m.cols ||
+      (st.fp != 0 && (spec.sr != st.sr || spec.fft != st.fft))) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (m.rows == 0) return tl::unexpected(Error::NoFrames);
+  if (st.fp == 0) {
+    const double hz_per_bin =
+        static_cast<double>(spec.sr) / static_cast<double>(spec.fft);
+    const auto f0 = static_cast<std::uint32_t>(
+        std::ceil(static_cast<double>(st.feat.band_min_hz) / hz_per_bin));
+    const auto f1 = std::min<std::uint32_t>(
+        m.cols - 1, static_cast<std::uint32_t>(std::floor(
+                        static_cast<double>(st.feat.band_max_hz) /
+                        hz_per_bin)));
+    if (f0 > f1 || f1 - f0 + 1 > std::numeric_limits<std::uint16_t>::max()) {
+      return tl::unexpected(Error::InvalidArgument);
+    }
+    st.sr = spec.sr;
+    st.fft = spec.fft;
+    st.f0 = f0;
+    st.fp = f1 - f0 + 1;
+    if (st.clip) {
+      st.ring.resize(std::size_t{st.window} * st.fp);
+      st.ring_min.resize(st.window);
+      st.ring_max.resize(st.window);
+    }
+  }
+  const std::uint32_t fp = st.fp;
+
+  // Per row: read only in-band bins, map, and write the row compacted in
+  // place (row t lands at t * F' <= t * K + f0, behind the read cursor, so
+  // no input cell is overwritten before it is read); then clip it to its
+  // window's bounds.
+  for (std::uint32_t t = 0; t < m.rows; ++t) {
+    float* out = m.data.data() + std::size_t{t} * fp;
+    st.map_row(m.data.data() + std::size_t{t} * m.cols + st.f0, out);
+    if (!st.clip) continue;
+    const ClipBounds b = st.enter_window(out, arena);
+    for (std::uint32_t j = 0; j < fp; ++j) {
+      out[j] = std::clamp(out[j], b.lo, b.hi);
+    }
+  }
+  m.data.resize(std::size_t{m.rows} * fp);
+  m.cols = fp;
+
+  ScaledSpec out;
+  out.val = std::move(m);
+  out.sr = spec.sr;
+  out.fft = spec.fft;
+  out.hop = spec.hop;
+  out.f0_bin = static_cast<std::uint16_t>(st.f0);
+  out.fprime = static_cast<std::uint16_t>(fp);
+  out.unit = st.feat.use_pcen ? "pcen_log_db" : "log-dB";
+  return out;
+}
+
+void StreamScaler::reset() {
+  State& st = *state_;
+  st.hist.clear();
+  st.fp = 0;
+  st.smooth.clear();
+  st.rows = 0;
+}
+
+Result<ScaledSpec> scale_and_band(STFTSpec spec, FeatureCfg feat,
+                                  ExtractionArena* arena) {
+  auto scaler = StreamScaler::create(feat);
+  if (!scaler) return tl::unexpected(scaler.error());
+  return scaler->push(std::move(spec), arena);
+}
+
+Result<ClipBounds> percentile_clip_bounds(const ScaledSpec& scaled,
+                                          float p_lo, float p_hi,
+                                          PercentileMode mode,
+                                          std::uint32_t hist_bins) {
+  if (p_lo < 0.f || p_hi > 100.f || p_lo > p_hi) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  if (scaled.val.data.empty()) return tl::unexpected(Error::NoFrames);
+  if (mode == PercentileMode::Exact) {
+    Array<float> cells = scaled.val.data;
+    return exact_bounds(cells, p_lo, p_hi);
+  }
+  DbHistogram hist(hist_bins_or_default(hist_bins));
+  for (const float v : scaled.val.data) hist.add(v);
+  return ClipBounds{hist.percentile(p_lo), hist.percentile(p_hi)};
+}
+
+Result<Matrix<float>> gaussian_blur_freq(Matrix<float> m, float sigma_bins) {
+  if (!(sigma_bins >= 0.5f)) return tl::unexpected(Error::InvalidArgument);
+  if (m.rows == 0 || m.cols == 0) return m;
+  const Yvv g = Yvv::make(sigma_bins);
+  Array<float> spare;
+  for (std::uint32_t t0 = 0; t0 < m.rows; t0 += kBlurLanes) {
+    blur_lanes(g, lane_rows(m, t0, spare), m.cols);
+  }
+  return m;
+}
+
+Result<DogOutput> dog_enhance_freq(ScaledSpec scaled, bool use_dog,
+                                   float sigma1_bins, float sigma2_bins,
+                                   ExtractionArena* arena) {
+  if (use_dog && !(sigma1_bins >= 0.5f && sigma1_bins < sigma2_bins)) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  DogOutput out;
+  Matrix<float> val = std::move(scaled.val);
+  out.det = scaled;
+  out.det.val.rows = val.rows;
+  out.det.val.cols = val.cols;
+  if (arena) out.det.val.data = arena->floats(val.data.size());
+  out.base = std::move(scaled);
+  out.base.val = std::move(val);
+  Matrix<float>& base = out.base.val;
+  Matrix<float>& det = out.det.val;
+  if (!use_dog) {
+    det.data.assign(base.data.begin(), base.data.end());
+    return out;
+  }
+  det.data.resize(base.data.size());
+  if (base.rows == 0 || base.cols == 0) return out;
+  const Yvv g1 = Yvv::make(sigma1_bins);
+  const Yvv g2 = Yvv::make(sigma2_bins);
+  Array<float> spare_base;
+  Array<float> spare_det;
+  for (std::uint32_t t0 = 0; t0 < base.rows; t0 += kBlurLanes) {
+    dog_lanes(g1, g2, lane_rows(base, t0, spare_base),
+              lane_rows(det, t0, spare_det), base.cols);
+  }
+  return out;
+}
+} // namespace afp
@@ -1,4 +1,129 @@
 #include "afp/stft.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+#include <kfr/dft.hpp>
+#include <kfr/math.hpp>
+
 namespace afp {
-}
\ No newline at end of file
+namespace {
+/// Frames windowed and transformed per batch (bounds scratch to a few
+/// hundred KiB at typical frame sizes while amortizing kernel dispatch).
+constexpr std::uint32_t kStftBatch = 32;
+} // namespace
+
+struct StftEngine::Impl {
+  std::uint32_t fft;
+  std::uint32_t hop;
+  std::uint32_t bins;
+  kfr::dft_plan_real<float> plan;
+  kfr::univector<float> window;
+  /// Scratch for one batch: windowed frames and their half spectra.
+  kfr::univector<float> frames;
+  kfr::univector<kfr::complex<float>> spectra;
+  kfr::univector<kfr::u8> temp;
+
+  Impl(std::uint32_t frame_size, std::uint32_t hop_size)
+      : fft(frame_size),
+        hop(hop_size),
+        bins(frame_size / 2 + 1),
+        plan(frame_size),
+        window(frame_size),
+        frames(std::size_t{kStftBatch} * frame_size),
+        spectra(std::size_t{kStftBatch} * bins),
+        temp(plan.temp_size) {
+    // Periodic Hann (exact overlap-add at hop = fft / 2).
+    const double step = 2.0 * std::numbers::pi / static_cast<double>(fft);
+    for (std::uint32_t n = 0; n < fft; ++n) {
+      window[n] = static_cast<float>(
+          0.5 - 0.5 * std::cos(step * static_cast<double>(n)));
+    }
+  }
+};
+
+StftEngine::StftEngine(std::unique_ptr<Impl> impl) : impl_(std::move(impl)) {}
+StftEngine::StftEngine(StftEngine&&) noexcept = default;
+StftEngine& StftEngine::operator=(StftEngine&&) noexcept = default;
+StftEngine::~StftEngine() = default;
+
+Result<StftEngine> StftEngine::create(std::uint32_t frame_size,
+                                      std::uint32_t hop_size) {
+  if (frame_size < 2 || frame_size % 2 != 0 || hop_size == 0) {
+    return tl::unexpected(Error::InvalidArgument);
+  }
+  return StftEngine(std::make_unique<Impl>(frame_size, hop_size));
+}
+
+Result<StftEngine*> StftEngine::for_thread(std::uint32_t frame_size,
+                                           std::uint32_t hop_size) {
+  thread_local Map<std::pair<std::uint32_t, std::uint32_t>, StftEngine> cache;
+  const auto id = std::make_pair(frame_size, hop_size);
+  auto it = cache.find(id);
+  if (it == cache.end()) {
+    auto engine = create(frame_size, hop_size);
+    if (!engine) return tl::unexpected(engine.error());
+    it = cache.emplace(id, std::move(*engine)).first;
+  }
+  return &it->second;
+}
+
+std::uint32_t StftEngine::frame_size() const { return impl_->fft; }
+std::uint32_t StftEngine::hop_size() const { return impl_->hop; }
+std::uint32_t StftEngine::bins() const { return impl_->bins; }
+
+std::uint32_t StftEngine::frame_count(std::size_t samples) const {
+  if (samples < impl_->fft) return 0;
+  return static_cast<std::uint32_t>(1 + (samples - impl_->fft) / impl_->hop);
+}
+
+Result<OK> StftEngine::magnitude(std::span<const float> x,
+                                 Matrix<float>& out) {
+  Impl& e = *impl_;
+  const std::uint32_t n_frames = frame_count(x.size());
+  if (n_frames == 0) return tl::unexpected(Error::NoFrames);
+  out.rows = n_frames;
+  out.cols = e.bins;
+  out.data.resize(std::size_t{n_frames} * e.bins);
+
+  const float* win = e.window.data();
+  for (std::uint32_t t0 = 0; t0 < n_frames; t0 += kStftBatch) {
+    const std::uint32_t nb = std::min(kStftBatch, n_frames - t0);
+    for (std::uint32_t b = 0; b < nb; ++b) {
+      const float* src = x.data() + std::size_t{t0 + b} * e.hop;
+      float* dst = e.frames.data() + std::size_t{b} * e.fft;
+      for (std::uint32_t n = 0; n < e.fft; ++n) dst[n] = src[n] * win[n];
+      e.plan.execute(e.spectra.data() + std::size_t{b} * e.bins, dst,
+                     e.temp.data());
+    }
+    // Output rows of the batch are contiguous, like the spectra.
+    const std::size_t cells = std::size_t{nb} * e.bins;
+    kfr::make_univector(out.data.data() + std::size_t{t0} * e.bins, cells) =
+        kfr::cabs(kfr::make_univector(e.spectra.data(), cells));
+  }
+  return OK{};
+}
+
+Result<STFTSpec> stft_magnitude(PCM mid, FeatureCfg feat,
+                                ExtractionArena* arena) {
+  if (feat.use_reassignment) return tl::unexpected(Error::InvalidArgument);
+  auto engine = StftEngine::for_thread(feat.frame_size, feat.hop_size);
+  if (!engine) return tl::unexpected(engine.error());
+  StftEngine& stft = **engine;
+  STFTSpec spec;
+  if (arena) {
+    const std::size_t cells =
+        std::size_t{stft.frame_count(mid.samples.size())} * stft.bins();
+    spec.mag.data = arena->floats(cells);
+  }
+  auto r = stft.magnitude(mid.samples, spec.mag);
+  if (arena) arena->recycle(std::move(mid.samples));
+  if (!r) return tl::unexpected(r.error());
+  spec.sr = mid.sr;
+  spec.fft = feat.frame_size;
+  spec.hop = feat.hop_size;
+  spec.unit = "linear";
+  return spec;
+}
+} // namespace afp
@@ -1,4 +1,24 @@
 #include "afp/types.hpp"
 
 namespace afp {
-}
\ No newline at end of file
+std::string_view error_name(Error e) {
+  switch (e) {
+    case Error::DecodeError: return "decode_error";
+    case Error::UnsupportedFormat: return "unsupported_format";
+    case Error::ResampleError: return "resample_error";
+    case Error::ConfigMismatch: return "config_mismatch";
+    case Error::InvalidArgument: return "invalid_argument";
+    case Error::NumericOverflow: return "numeric_overflow";
+    case Error::KvOpenError: return "kv_open_error";
+    case Error::KvReadError: return "kv_read_error";
+    case Error::KvWriteError: return "kv_write_error";
+    case Error::KvMergeError: return "kv_merge_error";
+    case Error::EmptyAudio: return "empty_audio";
+    case Error::NoFrames: return "no_frames";
+    case Error::NoPeaks: return "no_peaks";
+    case Error::Timeout: return "timeout";
+    case Error::IntegrityError: return "integrity_error";
+  }
+  return "unknown_error";
+}
+} // namespace afp
@@ -1,4 +1,204 @@
 #include "afp/util.hpp"
+#include "afp/audio.hpp"
+#include "afp/codec.hpp"
+#include "afp/keys.hpp"
+#include "afp/mmap.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <utility>
 
 namespace afp {
-}
\ No newline at end of file
+namespace {
+/// LSD radix sort of `recs` over digits `0 .. n_digits` (least significant
+/// first), `digit(rec, d)` giving one byte; passes where every record has
+/// the same byte are skipped. `tmp` is scratch.
+template <class Rec, class Digit>
+void radix_sort(Array<Rec>& recs, Array<Rec>& tmp, unsigned n_digits,
+                Digit digit) {
+  if (recs.size() < 2) return;
+  tmp.resize(recs.size());
+  for (unsigned d = 0; d < n_digits; ++d) {
+    std::array<std::size_t, 256> at{};
+    for (const Rec& r : recs) ++at[digit(r, d)];
+    if (at[digit(recs[0], d)] == recs.size()) continue;
+    std::size_t sum = 0;
+    for (std::size_t& n : at) sum += std::exchange(n, sum);
+    for (const Rec& r : recs) tmp[at[digit(r, d)]++] = r;
+    recs.swap(tmp);
+  }
+}
+
+std::uint8_t time_byte(std::uint32_t t, unsigned i) {
+  return static_cast<std::uint8_t>(t >> (8 * i));
+}
+
+/// Votes at which the peak term of the confidence reaches 1 - 1/e.
+constexpr float kConfidenceVoteScale = 16.f;
+
+/// Byte-wise table of the reflected ECMA-182 polynomial (CRC-64/XZ).
+constexpr std::array<std::uint64_t, 256> kCrc64Table = [] {
+  std::array<std::uint64_t, 256> t{};
+  for (std::uint64_t i = 0; i < 256; ++i) {
+    std::uint64_t c = i;
+    for (int k = 0; k < 8; ++k) {
+      c = (c >> 1) ^ ((c & 1) ? 0xC96C5795D7870F42ull : 0);
+    }
+    t[i] = c;
+  }
+  return t;
+}();
+} // namespace
+
+float calibrate_confidence(std::uint32_t votes_peak, float coverage,
+                           float entropy) {
+  // Each factor is in [0,1] and monotonic in its input: more votes, more
+  // covered frames and a sharper (lower entropy) offset mode all raise it.
+  const float peak =
+      1.f - std::exp(-static_cast<float>(votes_peak) / kConfidenceVoteScale);
+  const float cover = std::clamp(coverage, 0.f, 1.f);
+  const float sharp = 1.f / (1.f + std::max(entropy, 0.f));
+  return peak * cover * sharp;
+}
+
+double bin_to_seconds(std::int32_t off_bin, std::uint32_t hop,
+                      std::uint32_t sr, std::uint16_t delta_bin_frames) {
+  if (sr == 0) return 0.0;
+  return static_cast<double>(off_bin) * delta_bin_frames * hop / sr;
+}
+
+template <unsigned Bits>
+void group_times_by_key(Array<PackedKeyWithTime<Bits>>& pairs,
+                        KeyTimeGroups<Bits>& out) {
+  using Rec = PackedKeyWithTime<Bits>;
+  constexpr unsigned kKeyBytes = PackedKey<Bits>::kBytes;
+  Array<Rec> tmp;
+  // Time bytes first, then key bytes: sorted by (key, t_anchor).
+  radix_sort(pairs, tmp, 4 + kKeyBytes, [](const Rec& r, unsigned d) {
+    return d < 4 ? time_byte(r.t_anchor, d) : r.key.radix_byte(d - 4);
+  });
+
+  out.keys.clear();
+  out.offsets.assign(1, 0);
+  out.times.clear();
+  out.times.reserve(pairs.size());
+  for (std::size_t i = 0; i < pairs.size(); ++i) {
+    if (i == 0 || pairs[i].key != pairs[i - 1].key) {
+      if (i != 0) {
+        out.offsets.push_back(static_cast<std::uint32_t>(out.times.size()));
+      }
+      out.keys.push_back(pairs[i].key);
+    } else if (pairs[i].t_anchor == pairs[i - 1].t_anchor) {
+      continue;
+    }
+    out.times.push_back(pairs[i].t_anchor);
+  }
+  if (!pairs.empty()) {
+    out.offsets.push_back(static_cast<std::uint32_t>(out.times.size()));
+  }
+}
+
+template void group_times_by_key<32>(Array<PackedKeyWithTime<32>>&,
+                                     KeyTimeGroups<32>&);
+template void group_times_by_key<48>(Array<PackedKeyWithTime<48>>&,
+                                     KeyTimeGroups<48>&);
+template void group_times_by_key<64>(Array<PackedKeyWithTime<64>>&,
+                                     KeyTimeGroups<64>&);
+
+template <unsigned Bits>
+void stable_sort_by(Array<PackedKeyWithTime<Bits>>& arr) {
+  using Rec = PackedKeyWithTime<Bits>;
+  constexpr unsigned kKeyBytes = PackedKey<Bits>::kBytes;
+  Array<Rec> tmp;
+  // Key bytes first, then time bytes: sorted by (t_anchor, key).
+  radix_sort(arr, tmp, kKeyBytes + 4, [](const Rec& r, unsigned d) {
+    return d < kKeyBytes ? r.key.radix_byte(d)
+                         : time_byte(r.t_anchor, d - kKeyBytes);
+  });
+}
+
+template void stable_sort_by<32>(Array<PackedKeyWithTime<32>>&);
+template void stable_sort_by<48>(Array<PackedKeyWithTime<48>>&);
+template void stable_sort_by<64>(Array<PackedKeyWithTime<64>>&);
+
+Result<Array<KeyWithTime>> stable_sort_by(Array<KeyWithTime> arr,
+                                          const KeyLayout& layout) {
+  auto sorted = with_packed_key(layout, [&](auto tag) -> Result<OK> {
+    using K = decltype(tag);
+    Array<PackedKeyWithTime<K::kBits>> recs(arr.size());
+    for (std::size_t i = 0; i < arr.size(); ++i) {
+      recs[i] = {from_key<K::kBits>(arr[i].key, layout), arr[i].t_anchor};
+    }
+    stable_sort_by(recs);
+    for (std::size_t i = 0; i < recs.size(); ++i) {
+      arr[i] = {to_key(recs[i].key, layout), recs[i].t_anchor};
+    }
+    return OK{};
+  });
+  if (!sorted) return tl::unexpected(sorted.error());
+  return arr;
+}
+
+ByteArray maybe_compress(ByteArray bytes, const char* algo) {
+  auto cfg = parse_value_compression(algo);
+  if (!cfg || cfg->algo == Compression::None) return bytes;
+  auto codec = ValueCodec::create(std::move(*cfg));
+  if (!codec) return bytes;
+  ByteArray out;
+  codec->append_frame(out, bytes);
+  return out;
+}
+
+std::uint32_t estimate_frames(std::string_view uri, const FeatureCfg& feat) {
+  auto stream = AudioStream::open(std::filesystem::path(uri));
+  if (!stream || feat.hop_size == 0) return 0;
+  const std::uint64_t src = stream->total_frames();
+  const std::uint64_t sr = stream->sample_rate();
+  const std::uint64_t dst = feat.target_sr == 0 ? sr : feat.target_sr;
+  // `StreamResampler` emits ceil(n * dst / src) samples.
+  const std::uint64_t n = (src * dst + sr - 1) / sr;
+  if (n < feat.frame_size) return 0;
+  return static_cast<std::uint32_t>(std::min<std::uint64_t>(
+      1 + (n - feat.frame_size) / feat.hop_size, UINT32_MAX));
+}
+
+std::uint64_t crc64_of_uri(std::string_view uri) {
+  auto file = MappedFile::open(std::filesystem::path(uri));
+  if (!file) return 0;
+  std::uint64_t crc = ~std::uint64_t{0};
+  for (const std::uint8_t b : file->bytes()) {
+    crc = kCrc64Table[(crc ^ b) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+std::uint8_t derive_version(const KeyLayout& layout) {
+  std::uint32_t h = 2166136261u;
+  for (const std::uint8_t v :
+       {layout.total_bits, layout.bits_fa, layout.bits_ft, layout.bits_dt,
+        layout.bits_shard, layout.bits_ver,
+        static_cast<std::uint8_t>(layout.endian)}) {
+    h = (h ^ v) * 16777619u;
+  }
+  return static_cast<std::uint8_t>(h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24));
+}
+
+void observe_hotkey_histogram(Array<std::uint32_t>& hist, std::size_t len) {
+  // Bucket b holds lengths in [2^(b-1), 2^b); bucket 0 holds empty lists.
+  const auto bucket = static_cast<std::size_t>(std::bit_width(len));
+  if (hist.size() <= bucket) hist.resize(bucket + 1, 0);
+  ++hist[bucket];
+}
+
+void merge_histogram(Array<std::uint32_t>& dst,
+                     const Array<std::uint32_t>& src) {
+  if (dst.size() < src.size()) dst.resize(src.size(), 0);
+  for (std::size_t i = 0; i < src.size(); ++i) dst[i] += src[i];
+}
+
+Array<std::uint32_t> render_histogram(const Array<std::uint32_t>& hist) {
+  return hist;
+}
+} // namespace afp
@@ -0,0 +1,2235 @@
+#include "afp/lib.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <numbers>
+#include <random>
+#include <set>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+namespace afp {
+namespace {
+/// Log-normal magnitudes [rows, fft/2+1] (dB spread similar to music).
+STFTSpec random_spec(std::uint32_t rows, std::uint32_t fft,
+                     std::uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::lognormal_distribution<float> mag(0.f, 2.f);
+  STFTSpec spec;
+  spec.sr = 8000;
+  spec.fft = fft;
+  spec.hop = fft / 4;
+  spec.unit = "linear";
+  spec.mag.rows = rows;
+  spec.mag.cols = fft / 2 + 1;
+  spec.mag.data.resize(std::size_t{rows} * spec.mag.cols);
+  for (float& v : spec.mag.data) v = mag(rng);
+  return spec;
+}
+
+FeatureCfg clip_cfg(PercentileMode mode, std::uint32_t bins) {
+  FeatureCfg feat;
+  feat.band_min_hz = 300.f;
+  feat.band_max_hz = 3000.f;
+  feat.clip_low_pct = 5.f;
+  feat.clip_high_pct = 99.f;
+  feat.clip_percentile = mode;
+  feat.clip_hist_bins = bins;
+  return feat;
+}
+
+/// Cells that are strict maxima of their 3x3 neighbourhood (peak proxy).
+std::set<std::pair<std::uint32_t, std::uint32_t>> local_maxima(
+    const Matrix<float>& m) {
+  std::set<std::pair<std::uint32_t, std::uint32_t>> out;
+  for (std::uint32_t t = 1; t + 1 < m.rows; ++t) {
+    for (std::uint32_t f = 1; f + 1 < m.cols; ++f) {
+      const float v = m.data[std::size_t{t} * m.cols + f];
+      bool peak = true;
+      for (std::uint32_t dt = 0; dt < 3 && peak; ++dt) {
+        for (std::uint32_t df = 0; df < 3 && peak; ++df) {
+          if (dt == 1 && df == 1) continue;
+          const std::size_t i = std::size_t{t + dt - 1} * m.cols + f + df - 1;
+          peak = m.data[i] < v;
+        }
+      }
+      if (peak) out.emplace(t, f);
+    }
+  }
+  return out;
+}
+/// 16-bit PCM WAV bytes holding `frames` frames of a deterministic signal.
+ByteArray pcm16_wav(std::uint32_t frames, std::uint16_t channels,
+                    std::uint32_t sr) {
+  const auto put = [](ByteArray& b, std::uint32_t v, int n) {
+    for (int i = 0; i < n; ++i) {
+      b.push_back(static_cast<std::uint8_t>(v >> (8 * i)));
+    }
+  };
+  const std::uint32_t data_bytes = frames * channels * 2u;
+  ByteArray wav = {'R', 'I', 'F', 'F'};
+  put(wav, 36 + data_bytes, 4);
+  for (const char c : std::string_view("WAVEfmt ")) {
+    wav.push_back(static_cast<std::uint8_t>(c));
+  }
+  put(wav, 16, 4);
+  put(wav, 1, 2);
+  put(wav, channels, 2);
+  put(wav, sr, 4);
+  put(wav, sr * channels * 2u, 4);
+  put(wav, channels * 2u, 2);
+  put(wav, 16, 2);
+  for (const char c : std::string_view("data")) {
+    wav.push_back(static_cast<std::uint8_t>(c));
+  }
+  put(wav, data_bytes, 4);
+  std::mt19937 rng(frames);
+  std::uniform_int_distribution<std::uint32_t> sample(0, 0xFFFF);
+  for (std::uint32_t i = 0; i < frames * channels; ++i) {
+    put(wav, sample(rng), 2);
+  }
+  return wav;
+}
+
+/// Extraction settings small enough for the test assets.
+IdentifyCfg extract_cfg() {
+  IdentifyCfg cfg;
+  cfg.feature = clip_cfg(PercentileMode::Histogram, 0);
+  cfg.feature.target_sr = 8000;
+  cfg.feature.frame_size = 512;
+  cfg.feature.hop_size = 128;
+  cfg.feature.neigh_dt = 2;
+  cfg.feature.neigh_df = 3;
+  cfg.feature.max_peaks_per_frame = 5;
+  cfg.feature.min_peaks_per_frame = 1;
+  cfg.feature.nms_min_freq_sep_bins = 2;
+  cfg.pairing.dt_min_frames = 1;
+  cfg.pairing.dt_max_frames = 24;
+  cfg.pairing.delta_bin_frames = 1;
+  cfg.pairing.max_targets_per_anchor = 3;
+  cfg.key_layout.total_bits = 32;
+  cfg.key_layout.bits_fa = 10;
+  cfg.key_layout.bits_ft = 10;
+  cfg.key_layout.bits_dt = 12;
+  return cfg;
+}
+
+/// Whole file as bytes.
+ByteArray read_file(const std::filesystem::path& path) {
+  std::ifstream in(path, std::ios::binary);
+  return ByteArray(std::istreambuf_iterator<char>(in), {});
+}
+
+/// Fresh (removed) temp path for a KV store named `name`.
+std::string temp_kv_path(std::string_view name) {
+  const auto path = std::filesystem::temp_directory_path() / name;
+  std::filesystem::remove_all(path);
+  return path.string();
+}
+
+/// Key whose bytes are all `b`.
+Key key_of(std::uint8_t b) {
+  Key k;
+  k.bytes.fill(b);
+  return k;
+}
+
+/// Ascending times whose deltas mix 1- to 4-byte varints.
+Array<std::uint32_t> mixed_times(std::uint32_t n, std::mt19937& rng) {
+  std::uniform_int_distribution<std::uint32_t> kind(0, 9);
+  Array<std::uint32_t> times(n);
+  std::uint32_t t = 0;
+  for (std::uint32_t i = 0; i < n; ++i) {
+    const std::uint32_t k = kind(rng);
+    const std::uint32_t limit = k < 6   ? 0x7Fu
+                                : k < 8 ? 0x3FFFu
+                                : k < 9 ? 0x1FFFFFu
+                                        : 0xFFFFFFu;
+    t += std::uniform_int_distribution<std::uint32_t>(0, limit)(rng);
+    times[i] = t;
+  }
+  return times;
+}
+
+/// Anchors of `buf` via `next()` and via `next_block()` + `read_times()`;
+/// false if either path reports `failed()`.
+bool decode_both_ways(
+    PostingView buf, Array<std::pair<std::uint32_t, std::uint32_t>>& per_anchor,
+    Array<std::pair<std::uint32_t, std::uint32_t>>& bulk) {
+  auto a = parse_posting_blocks(buf);
+  auto b = parse_posting_blocks(buf);
+  if (!a || !b) return false;
+  while (auto x = a->next()) per_anchor.emplace_back(x->track_id, x->t_anchor);
+  Array<std::uint32_t> times;
+  while (auto block = b->next_block()) {
+    times.resize(block->n);
+    if (!b->read_times(times)) break;
+    for (const std::uint32_t t : times) bulk.emplace_back(block->track_id, t);
+  }
+  return !a->failed() && !b->failed();
+}
+
+/// Codec settings for `algo` at `level` (0 = library default).
+CodecCfg codec_cfg(Compression algo, int level = 0) {
+  CodecCfg cfg;
+  cfg.algo = algo;
+  cfg.level = level;
+  return cfg;
+}
+
+/// Build settings over `extract_cfg`, two shards, serial.
+BuildCfg build_cfg() {
+  const IdentifyCfg id = extract_cfg();
+  BuildCfg cfg;
+  cfg.feature = id.feature;
+  cfg.pairing = id.pairing;
+  cfg.key_layout = id.key_layout;
+  cfg.shard_bits = 1;
+  cfg.workers = 1;
+  return cfg;
+}
+
+/// Manifest of five tracks in `dir`: tracks 1-3 share one recording, so
+/// their keys collide into long postings; 4 and 5 are distinct.
+Array<std::pair<std::uint32_t, std::string>> noise_tracks(
+    const std::filesystem::path& dir) {
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  Array<std::pair<std::uint32_t, std::string>> manifest;
+  for (const std::uint32_t frames : {12000u, 9000u, 10500u}) {
+    const auto path = dir / (std::to_string(frames) + ".wav");
+    const ByteArray wav = pcm16_wav(frames, 1, 8000);
+    std::ofstream(path, std::ios::binary)
+        .write(reinterpret_cast<const char*>(wav.data()),
+               static_cast<std::streamsize>(wav.size()));
+    if (manifest.empty()) {
+      for (const std::uint32_t id : {3u, 1u, 2u}) {
+        manifest.emplace_back(id, path.string());
+      }
+    } else {
+      manifest.emplace_back(static_cast<std::uint32_t>(manifest.size() + 1),
+                            path.string());
+    }
+  }
+  return manifest;
+}
+
+/// Every stored (key, value) of the index at `path`.
+Map<Key, ByteArray> dump_index(std::string_view path,
+                               std::uint8_t shard_bits) {
+  Map<Key, ByteArray> out;
+  auto kvh = open(path, KVMode::ReadOnly, 0);
+  if (!kvh) return out;
+  for (std::uint16_t s = 0; s < (1u << shard_bits); ++s) {
+    (void)scan_shard(*kvh, s, [&](const Key& k, ValueView v) {
+      out.emplace(k, ByteArray(v.begin(), v.end()));
+    });
+  }
+  (void)close(*kvh);
+  return out;
+}
+
+/// `(track_id, t)` anchors of a posting value, in stored order.
+Array<std::pair<std::uint32_t, std::uint32_t>> anchors_of(ValueView value) {
+  Array<std::pair<std::uint32_t, std::uint32_t>> out;
+  auto it = parse_posting_blocks(value);
+  if (!it) return out;
+  Array<std::uint32_t> times;
+  while (auto block = it->next_block()) {
+    times.resize(block->n);
+    if (!it->read_times(times)) break;
+    for (const std::uint32_t t : times) out.emplace_back(block->track_id, t);
+  }
+  return out;
+}
+} // namespace
+
+TEST(PercentileClip, HistogramWithinOneBinOfExact) {
+  // Unclipped, so every percentile of the mapped cells is observable.
+  FeatureCfg raw = clip_cfg(PercentileMode::Exact, 0);
+  raw.clip_high_pct = 0.f;
+  auto scaled = scale_and_band(random_spec(400, 512, 1), raw);
+  ASSERT_TRUE(scaled);
+  for (const float p : {0.f, 1.f, 5.f, 50.f, 95.f, 99.f, 100.f}) {
+    auto exact = percentile_clip_bounds(*scaled, p, p, PercentileMode::Exact);
+    ASSERT_TRUE(exact);
+    for (const std::uint32_t bins : {400u, 4000u}) {
+      auto approx = percentile_clip_bounds(*scaled, p, p,
+                                           PercentileMode::Histogram, bins);
+      ASSERT_TRUE(approx);
+      const float width =
+          (kClipHistMaxDb - kClipHistMinDb) / static_cast<float>(bins);
+      EXPECT_NEAR(approx->lo, exact->lo, width) << "p=" << p;
+    }
+  }
+}
+
+TEST(PercentileClip, HistogramKeepsPeakSetOfExactPath) {
+  const FeatureCfg exact_cfg = clip_cfg(PercentileMode::Exact, 0);
+  const FeatureCfg approx_cfg = clip_cfg(PercentileMode::Histogram, 0);
+  auto exact = scale_and_band(random_spec(600, 512, 7), exact_cfg);
+  auto approx = scale_and_band(random_spec(600, 512, 7), approx_cfg);
+  ASSERT_TRUE(exact);
+  ASSERT_TRUE(approx);
+  ASSERT_EQ(exact->val.data.size(), approx->val.data.size());
+
+  // Once the window is full its cells are dense enough for the histogram
+  // to land within a bin of the exact percentile; the first rows clip to
+  // a handful of cells, where the two interpolate differently.
+  const float width = (kClipHistMaxDb - kClipHistMinDb) /
+                      static_cast<float>(kClipHistDefaultBins);
+  for (std::size_t i = std::size_t{kClipWindowFrames} * exact->val.cols;
+       i < exact->val.data.size(); ++i) {
+    ASSERT_NEAR(exact->val.data[i], approx->val.data[i], width);
+  }
+
+  // Only cells at the clip bounds can change; peaks should all but agree.
+  const auto a = local_maxima(exact->val);
+  const auto b = local_maxima(approx->val);
+  std::size_t common = 0;
+  for (const auto& cell : a) common += b.count(cell);
+  const double jaccard = static_cast<double>(common) /
+                         static_cast<double>(a.size() + b.size() - common);
+  EXPECT_GE(jaccard, 0.99);
+}
+
+TEST(PercentileClip, RejectsBadPercentiles) {
+  ScaledSpec s;
+  s.val.rows = 1;
+  s.val.cols = 1;
+  s.val.data = {1.f};
+  EXPECT_EQ(percentile_clip_bounds(s, 50.f, 10.f).error(),
+            Error::InvalidArgument);
+  EXPECT_EQ(percentile_clip_bounds(s, 0.f, 101.f, PercentileMode::Exact)
+                .error(),
+            Error::InvalidArgument);
+}
+
+TEST(PackedKey, RoundTripsAndKeepsOrderInBigEndian) {
+  KeyLayout layout;
+  layout.total_bits = 40;
+  layout.bits_fa = 14;
+  layout.bits_ft = 14;
+  layout.bits_dt = 12;
+  layout.endian = Endian::Big;
+  std::mt19937 rng(11);
+  std::uniform_int_distribution<std::uint32_t> f(0, (1u << 14) - 1);
+  std::uniform_int_distribution<std::uint32_t> dt(0, (1u << 12) - 1);
+  Array<PackedKey<48>> packed;
+  for (int i = 0; i < 1000; ++i) {
+    auto k = PackedKey<48>::pack(f(rng), f(rng), dt(rng), layout);
+    ASSERT_TRUE(k);
+    const Key key = to_key(*k, layout);
+    EXPECT_EQ(from_key<48>(key, layout), *k);
+    for (std::size_t b = 5; b < key.bytes.size(); ++b) {
+      EXPECT_EQ(key.bytes[b], 0);
+    }
+    if (!packed.empty()) {
+      EXPECT_EQ(packed.back() < *k, to_key(packed.back(), layout) < key);
+    }
+    packed.push_back(*k);
+  }
+  EXPECT_EQ(PackedKey<48>::pack(1u << 14, 0, 0, layout).error(),
+            Error::NumericOverflow);
+  EXPECT_EQ(PackedKey<32>::pack(0, 0, 0, layout).error(),
+            Error::InvalidArgument);
+}
+
+TEST(GroupTimesByKey, MatchesOrderedMapOfSortedUniqueTimes) {
+  for (const unsigned total_bits : {32u, 48u, 64u}) {
+    KeyLayout layout;
+    layout.total_bits = static_cast<std::uint8_t>(total_bits);
+    layout.bits_fa = 10;
+    layout.bits_ft = 10;
+    layout.bits_dt = 8;
+    auto checked = with_packed_key(layout, [&](auto tag) -> Result<OK> {
+      using K = decltype(tag);
+      std::mt19937 rng(total_bits);
+      std::uniform_int_distribution<std::uint32_t> f(0, 15);
+      std::uniform_int_distribution<std::uint32_t> t(0, 70000);
+      Array<PackedKeyWithTime<K::kBits>> pairs;
+      std::map<std::uint64_t, std::set<std::uint32_t>> want;
+      for (int i = 0; i < 5000; ++i) {
+        const std::uint32_t fa = f(rng), ft = f(rng), dt = f(rng);
+        auto key = K::pack(fa, ft, dt, layout);
+        if (!key) return tl::unexpected(key.error());
+        pairs.push_back({*key, t(rng)});
+        want[(fa << 18) | (ft << 8) | dt].insert(pairs.back().t_anchor);
+      }
+      auto by_time = pairs;
+
+      KeyTimeGroups<K::kBits> groups;
+      group_times_by_key(pairs, groups);
+      EXPECT_EQ(groups.size(), want.size());
+      if (groups.size() != want.size()) return OK{};
+      std::size_t g = 0;
+      for (const auto& [packed, times] : want) {
+        const auto fa = static_cast<std::uint32_t>(packed >> 18);
+        const auto ft = static_cast<std::uint32_t>(packed >> 8) & 1023u;
+        const auto dt = static_cast<std::uint32_t>(packed & 255u);
+        EXPECT_TRUE(groups.keys[g] == *K::pack(fa, ft, dt, layout)) << g;
+        const auto got = groups.times_of(g++);
+        EXPECT_TRUE(std::equal(got.begin(), got.end(), times.begin(),
+                               times.end()));
+      }
+
+      stable_sort_by(by_time);
+      for (std::size_t i = 1; i < by_time.size(); ++i) {
+        EXPECT_LE(by_time[i - 1].t_anchor, by_time[i].t_anchor);
+      }
+      return OK{};
+    });
+    ASSERT_TRUE(checked);
+  }
+}
+
+TEST(StableSortBy, MatchesComparisonSortInEveryWidthAndEndian) {
+  struct Case {
+    std::uint8_t total, fa, ft, dt;
+  };
+  for (const Case c : {Case{32, 10, 10, 12}, Case{40, 14, 14, 12},
+                       Case{48, 16, 16, 16}, Case{64, 20, 20, 16}}) {
+    for (const Endian endian : {Endian::Little, Endian::Big}) {
+      KeyLayout layout;
+      layout.total_bits = c.total;
+      layout.bits_fa = c.fa;
+      layout.bits_ft = c.ft;
+      layout.bits_dt = c.dt;
+      layout.endian = endian;
+      std::mt19937 rng(c.total);
+      std::uniform_int_distribution<std::uint32_t> fa(0, (1u << c.fa) - 1);
+      std::uniform_int_distribution<std::uint32_t> ft(0, (1u << c.ft) - 1);
+      std::uniform_int_distribution<std::uint32_t> dt(0, (1u << c.dt) - 1);
+      // Narrow times leave three constant time bytes (skipped passes);
+      // wide ones vary every byte.
+      for (const std::uint32_t t_max : {255u, UINT32_MAX}) {
+        std::uniform_int_distribution<std::uint32_t> t(0, t_max);
+        Array<KeyWithTime> pairs;
+        Array<std::pair<std::uint32_t, std::uint64_t>> want;
+        for (int i = 0; i < 3000; ++i) {
+          const std::uint32_t a = fa(rng), b = ft(rng), d = dt(rng);
+          auto key = pack_key(a, b, d, layout);
+          ASSERT_TRUE(key);
+          pairs.push_back({*key, t(rng)});
+          // Native key order is the integer of the fields, MSB first.
+          want.emplace_back(pairs.back().t_anchor,
+                            (((std::uint64_t{a} << c.ft) | b) << c.dt) | d);
+          if (i % 7 == 0) {
+            pairs.push_back(pairs.back());
+            want.push_back(want.back());
+          }
+        }
+        std::ranges::sort(want);
+        auto sorted = stable_sort_by(pairs, layout);
+        ASSERT_TRUE(sorted);
+        ASSERT_EQ(sorted->size(), want.size());
+        for (std::size_t i = 0; i < want.size(); ++i) {
+          const auto [t_anchor, packed] = want[i];
+          const auto mask = [](unsigned bits) { return (1u << bits) - 1; };
+          EXPECT_EQ((*sorted)[i].t_anchor, t_anchor);
+          EXPECT_EQ((*sorted)[i].key,
+                    *pack_key(static_cast<std::uint32_t>(
+                                  packed >> (c.ft + c.dt)),
+                              static_cast<std::uint32_t>(packed >> c.dt) &
+                                  mask(c.ft),
+                              static_cast<std::uint32_t>(packed) & mask(c.dt),
+                              layout))
+              << int{c.total} << " " << i;
+        }
+      }
+    }
+  }
+  KeyLayout bad;
+  bad.total_bits = 36;
+  EXPECT_EQ(stable_sort_by({}, bad).error(), Error::InvalidArgument);
+  KeyLayout ok{.total_bits = 32, .bits_fa = 10, .bits_ft = 10, .bits_dt = 12};
+  const KeyWithTime one{*pack_key(1, 2, 3, ok), 9};
+  auto single = stable_sort_by({one}, ok);
+  ASSERT_TRUE(single);
+  ASSERT_EQ(single->size(), 1u);
+  EXPECT_EQ((*single)[0].key, one.key);
+  EXPECT_TRUE(stable_sort_by({}, ok).value().empty());
+}
+
+TEST(PairPeaks, SweepMatchesPerAnchorBruteForceAndSelectTargets) {
+  std::mt19937 rng(17);
+  std::uniform_int_distribution<std::uint32_t> t_of(0, 200);
+  std::uniform_int_distribution<std::uint32_t> f_of(0, 63);
+  std::uniform_int_distribution<int> level(0, 5);  // ties in strength
+  std::set<std::pair<std::uint32_t, std::uint32_t>> cells;
+  while (cells.size() < 600) cells.emplace(t_of(rng), f_of(rng));
+  Array<Peak> peaks;
+  for (const auto& [t, f] : cells) {
+    peaks.push_back(Peak{t, static_cast<std::uint16_t>(f),
+                         static_cast<float>(level(rng))});
+  }
+  KeyLayout layout{.total_bits = 32, .bits_fa = 10, .bits_ft = 10};
+  struct Case {
+    std::uint16_t dt_min, dt_max, bin;
+    std::uint8_t k, bits_dt;
+  };
+  for (const Case c : {Case{0, 0, 1, 3, 8}, Case{1, 24, 1, 3, 12},
+                       Case{2, 40, 3, 1, 12}, Case{0, 40, 1, 10, 4},
+                       Case{5, 9, 2, 0, 8}}) {
+    PairingCfg pair;
+    pair.dt_min_frames = c.dt_min;
+    pair.dt_max_frames = c.dt_max;
+    pair.delta_bin_frames = c.bin;
+    pair.max_targets_per_anchor = c.k;
+    layout.bits_dt = c.bits_dt;  // 4 bits clamps the longer Δt bins
+    // Anchors stop short of the last peaks, which only serve as targets.
+    const std::size_t n_anchors = peaks.size() - 50;
+    Array<KeyWithTime> got;
+    ASSERT_TRUE(pair_peaks(peaks, n_anchors, pair, layout, got));
+
+    // Per anchor: later peaks with Δt in range, the k strongest (earlier
+    // peak on ties), emitted in peak order.
+    Array<KeyWithTime> want;
+    for (std::size_t i = 0; i < n_anchors; ++i) {
+      Array<std::size_t> window;
+      for (std::size_t j = i + 1; j < peaks.size(); ++j) {
+        const std::uint32_t dt = peaks[j].t - peaks[i].t;
+        if (dt >= c.dt_min && dt <= c.dt_max) window.push_back(j);
+      }
+      std::stable_sort(window.begin(), window.end(),
+                       [&](std::size_t a, std::size_t b) {
+                         return peaks[a].strength > peaks[b].strength;
+                       });
+      window.resize(std::min<std::size_t>(window.size(), c.k));
+      std::sort(window.begin(), window.end());
+      auto targets = select_targets(peaks, static_cast<std::uint32_t>(i),
+                                    pair, 64);
+      ASSERT_TRUE(targets);
+      ASSERT_EQ(targets->size(), window.size()) << i;
+      for (std::size_t n = 0; n < window.size(); ++n) {
+        const Peak& tgt = peaks[window[n]];
+        EXPECT_EQ(std::tie((*targets)[n].t, (*targets)[n].f),
+                  std::tie(tgt.t, tgt.f));
+        const std::uint32_t dt_bin = std::min<std::uint32_t>(
+            (tgt.t - peaks[i].t) / c.bin, (1u << c.bits_dt) - 1);
+        want.push_back(
+            {*pack_key(peaks[i].f, tgt.f, dt_bin, layout), peaks[i].t});
+      }
+    }
+    ASSERT_EQ(got.size(), want.size());
+    for (std::size_t n = 0; n < want.size(); ++n) {
+      EXPECT_EQ(got[n].key, want[n].key) << n;
+      EXPECT_EQ(got[n].t_anchor, want[n].t_anchor) << n;
+    }
+  }
+  Array<KeyWithTime> out;
+  PairingCfg bad;
+  bad.dt_min_frames = 5;
+  bad.dt_max_frames = 4;
+  bad.delta_bin_frames = 1;
+  EXPECT_EQ(pair_peaks(peaks, 10, bad, layout, out).error(),
+            Error::InvalidArgument);
+  bad.dt_min_frames = 0;
+  EXPECT_EQ(pair_peaks(peaks, peaks.size() + 1, bad, layout, out).error(),
+            Error::InvalidArgument);
+  EXPECT_TRUE(out.empty());
+}
+
+TEST(ExtractionArena, StagesMatchHeapPathAcrossTracks) {
+  FeatureCfg feat = clip_cfg(PercentileMode::Exact, 0);
+  feat.use_pcen = true;
+  feat.use_dog = true;
+  feat.max_peaks_per_frame = 5;
+  feat.nms_min_freq_sep_bins = 2;
+  const auto peaks = [&](std::uint32_t rows, std::uint32_t seed,
+                         ExtractionArena* arena) -> Result<Array<Peak>> {
+    auto scaled = scale_and_band(random_spec(rows, 512, seed), feat, arena);
+    if (!scaled) return tl::unexpected(scaled.error());
+    auto dog = dog_enhance_freq(std::move(*scaled), true, kDogSigma1Bins,
+                                kDogSigma2Bins, arena);
+    if (!dog) return tl::unexpected(dog.error());
+    auto cands = detect_candidates(dog->det, 2, 3, arena);
+    if (!cands) return tl::unexpected(cands.error());
+    Array<float> thr = arena ? arena->floats(rows) : Array<float>{};
+    thr.assign(rows, -30.f);
+    auto out = filter_and_nms(std::move(*cands), std::move(thr), feat,
+                              dog->base, arena);
+    if (arena) {
+      arena->recycle(std::move(dog->det.val.data));
+      arena->recycle(std::move(dog->base.val.data));
+    }
+    return out;
+  };
+
+  ExtractionArena arena;
+  std::size_t retained = 0;
+  for (std::uint32_t track = 0; track < 8; ++track) {
+    const std::uint32_t rows = 300 + 50 * (track % 2);
+    auto heap = peaks(rows, track, nullptr);
+    auto pooled = peaks(rows, track, &arena);
+    ASSERT_TRUE(heap);
+    ASSERT_TRUE(pooled);
+    ASSERT_EQ(heap->size(), pooled->size());
+    for (std::size_t i = 0; i < heap->size(); ++i) {
+      EXPECT_EQ((*heap)[i].t, (*pooled)[i].t);
+      EXPECT_EQ((*heap)[i].f, (*pooled)[i].f);
+      EXPECT_EQ((*heap)[i].strength, (*pooled)[i].strength);
+    }
+    arena.recycle(std::move(*pooled));
+    // Only the spectra fed in from outside add to what is retained.
+    if (track >= 2) {
+      EXPECT_LE(arena.retained_bytes(), retained + (1u << 20));
+    }
+    retained = arena.retained_bytes();
+  }
+
+  ExtractionArena capped(1024);
+  capped.recycle(Array<float>(4096));
+  EXPECT_EQ(capped.retained_bytes(), 0u);
+}
+
+TEST(StreamScaler, BlocksScaleLikeTheWholeSpectrum) {
+  for (const PercentileMode mode :
+       {PercentileMode::Histogram, PercentileMode::Exact}) {
+    for (const bool pcen : {false, true}) {
+      FeatureCfg feat = clip_cfg(mode, 0);
+      feat.use_pcen = pcen;
+      feat.clip_window_frames = 40;
+      const STFTSpec spec = random_spec(203, 256, 9);
+      auto whole = scale_and_band(spec, feat);
+      ASSERT_TRUE(whole);
+
+      auto scaler = StreamScaler::create(feat);
+      ASSERT_TRUE(scaler);
+      ExtractionArena arena;
+      std::mt19937 rng(4);
+      std::uniform_int_distribution<std::uint32_t> len(1, 60);
+      for (int pass = 0; pass < 2; ++pass) {
+        Array<float> rows;
+        for (std::uint32_t t = 0; t < spec.mag.rows;) {
+          const std::uint32_t k = std::min(len(rng), spec.mag.rows - t);
+          STFTSpec block = spec;
+          block.mag.rows = k;
+          block.mag.data.assign(
+              spec.mag.data.begin() +
+                  static_cast<std::ptrdiff_t>(std::size_t{t} * spec.mag.cols),
+              spec.mag.data.begin() + static_cast<std::ptrdiff_t>(
+                                          std::size_t{t + k} *
+                                          spec.mag.cols));
+          auto part = scaler->push(std::move(block), &arena);
+          ASSERT_TRUE(part);
+          EXPECT_EQ(part->fprime, whole->fprime);
+          rows.insert(rows.end(), part->val.data.begin(),
+                      part->val.data.end());
+          t += k;
+        }
+        EXPECT_EQ(rows, whole->val.data) << pcen;
+        scaler->reset();
+      }
+
+      // Each row is clipped to the percentiles of its own window.
+      const std::uint32_t fp = whole->fprime;
+      FeatureCfg raw = feat;
+      raw.clip_high_pct = 0.f;
+      auto mapped = scale_and_band(spec, raw);
+      ASSERT_TRUE(mapped);
+      for (const std::uint32_t t : {0u, 17u, 39u, 40u, 202u}) {
+        const std::uint32_t first = t + 1 > 40 ? t + 1 - 40 : 0;
+        ScaledSpec win = *mapped;
+        win.val.rows = t + 1 - first;
+        win.val.data.assign(
+            mapped->val.data.begin() +
+                static_cast<std::ptrdiff_t>(std::size_t{first} * fp),
+            mapped->val.data.begin() +
+                static_cast<std::ptrdiff_t>(std::size_t{t + 1} * fp));
+        auto b = percentile_clip_bounds(win, feat.clip_low_pct,
+                                        feat.clip_high_pct, mode);
+        ASSERT_TRUE(b);
+        for (std::uint32_t j = 0; j < fp; ++j) {
+          const float v = mapped->val.data[std::size_t{t} * fp + j];
+          ASSERT_EQ(whole->val.data[std::size_t{t} * fp + j],
+                    std::clamp(v, b->lo, b->hi))
+              << t << " " << j;
+        }
+      }
+    }
+  }
+  EXPECT_EQ(StreamScaler::create(clip_cfg(PercentileMode::Exact, 0))
+                ->push(random_spec(0, 256, 1))
+                .error(),
+            Error::NoFrames);
+}
+
+TEST(ScaleAndBand, CropsAndMapsLikeACellByCellReference) {
+  // 8 kHz, fft 256: 31.25 Hz per bin.
+  struct Band {
+    float lo, hi;
+    std::uint32_t f0, f1;
+  };
+  const STFTSpec spec = random_spec(50, 256, 12);
+  for (const Band band : {Band{300.f, 3000.f, 10, 96},
+                          Band{312.5f, 312.5f + 31.25f, 10, 11},
+                          Band{0.f, 5000.f, 0, 128}}) {
+    for (const bool pcen : {false, true}) {
+      FeatureCfg feat;
+      feat.band_min_hz = band.lo;
+      feat.band_max_hz = band.hi;
+      feat.use_pcen = pcen;
+      auto got = scale_and_band(spec, feat);
+      ASSERT_TRUE(got);
+      const std::uint32_t fp = band.f1 - band.f0 + 1;
+      EXPECT_EQ(got->f0_bin, band.f0);
+      EXPECT_EQ(got->fprime, fp);
+      EXPECT_EQ(got->val.rows, spec.mag.rows);
+      EXPECT_EQ(got->val.cols, fp);
+      EXPECT_EQ(got->val.data.size(), std::size_t{spec.mag.rows} * fp);
+      EXPECT_STREQ(got->unit, pcen ? "pcen_log_db" : "log-dB");
+      EXPECT_EQ(std::tie(got->sr, got->fft, got->hop),
+                std::tie(spec.sr, spec.fft, spec.hop));
+
+      // dB of the magnitude, or of PCEN with its smoother seeded by row 0
+      // (s = 0.025, alpha = 0.98, delta = 2, r = 0.5, eps = 1e-6). PCEN
+      // subtracts sqrt(2) from sqrt(g + 2), which costs float digits at
+      // small g.
+      Array<double> smooth(fp);
+      for (std::uint32_t t = 0; t < spec.mag.rows; ++t) {
+        for (std::uint32_t j = 0; j < fp; ++j) {
+          const double e =
+              spec.mag.data[std::size_t{t} * spec.mag.cols + band.f0 + j];
+          double v = e;
+          if (pcen) {
+            smooth[j] = t == 0 ? e : smooth[j] + 0.025 * (e - smooth[j]);
+            const double g = e / std::pow(1e-6 + smooth[j], 0.98);
+            v = std::sqrt(g + 2.0) - std::sqrt(2.0);
+          }
+          EXPECT_NEAR(got->val.data[std::size_t{t} * fp + j],
+                      20.0 * std::log10(v + 1e-10), pcen ? 0.05 : 1e-3)
+              << t << " " << j;
+        }
+      }
+    }
+  }
+  FeatureCfg feat;
+  feat.band_min_hz = 3000.f;
+  feat.band_max_hz = 300.f;
+  EXPECT_EQ(scale_and_band(spec, feat).error(), Error::InvalidArgument);
+  feat.band_min_hz = 4500.f;  // above Nyquist: an empty band
+  feat.band_max_hz = 5000.f;
+  EXPECT_EQ(scale_and_band(spec, feat).error(), Error::InvalidArgument);
+  feat.band_min_hz = 300.f;
+  STFTSpec narrow = spec;
+  narrow.mag.cols = 100;
+  EXPECT_EQ(scale_and_band(narrow, feat).error(), Error::InvalidArgument);
+}
+
+TEST(StreamPeakDetector, MatchesBruteForceWindowMaxWithPlateaus) {
+  std::mt19937 rng(16);
+  // Few distinct levels, so windows often hold ties and flat runs.
+  std::uniform_int_distribution<int> level(0, 4);
+  for (const auto& [rows, cols] : {std::pair<std::uint32_t, std::uint32_t>{
+                                       23, 37},
+                                   {1, 9},
+                                   {6, 1},
+                                   {4, 2}}) {
+    ScaledSpec det;
+    det.val.rows = rows;
+    det.val.cols = cols;
+    det.val.data.resize(std::size_t{rows} * cols);
+    for (float& v : det.val.data) v = static_cast<float>(level(rng));
+    const auto at = [&](std::uint32_t t, std::uint32_t f) {
+      return det.val.data[std::size_t{t} * cols + f];
+    };
+    for (std::uint8_t dt = 0; dt <= 4; ++dt) {
+      for (std::uint8_t df = 0; df <= 4; ++df) {
+        Array<Peak> want;
+        for (std::uint32_t t = 0; t < rows; ++t) {
+          for (std::uint32_t f = 0; f < cols; ++f) {
+            const float v = at(t, f);
+            float win = v;
+            for (std::uint32_t u = t > dt ? t - dt : 0;
+                 u <= std::min(rows - 1, t + dt); ++u) {
+              for (std::uint32_t g = f > df ? f - df : 0;
+                   g <= std::min(cols - 1, f + df); ++g) {
+                win = std::max(win, at(u, g));
+              }
+            }
+            const bool above = (f > 0 && v > at(t, f - 1)) ||
+                               (f + 1 < cols && v > at(t, f + 1));
+            if (v == win && (above || cols == 1)) {
+              want.push_back(Peak{t, static_cast<std::uint16_t>(f), v});
+            }
+          }
+        }
+        const auto same = [](const Array<Peak>& a, const Array<Peak>& b) {
+          return std::ranges::equal(a, b, [](const Peak& x, const Peak& y) {
+            return x.t == y.t && x.f == y.f && x.strength == y.strength;
+          });
+        };
+        auto got = detect_candidates(det, dt, df);
+        ASSERT_TRUE(got);
+        EXPECT_TRUE(same(*got, want))
+            << rows << "x" << cols << " dt=" << int{dt} << " df=" << int{df};
+
+        // Streaming, twice through one detector (`finish` starts over).
+        StreamPeakDetector detector(static_cast<std::uint16_t>(cols), dt, df);
+        for (int pass = 0; pass < 2; ++pass) {
+          Array<Peak> streamed;
+          for (std::uint32_t t = 0; t < rows; ++t) {
+            detector.push_row(std::span<const float>(det.val.data)
+                                  .subspan(std::size_t{t} * cols, cols),
+                              streamed);
+            // Row t - dt is final once row t is in.
+            if (!streamed.empty()) {
+              EXPECT_LE(streamed.back().t + dt, t);
+            }
+          }
+          EXPECT_EQ(detector.rows_pushed(), rows);
+          detector.finish(streamed);
+          EXPECT_TRUE(same(streamed, want)) << pass;
+        }
+      }
+    }
+  }
+}
+
+TEST(FilterAndNms, MatchesBruteForceGreedySelection) {
+  std::mt19937 rng(17);
+  std::uniform_int_distribution<int> level(0, 6);
+  std::uniform_real_distribution<float> cell(-60.f, 0.f);
+  ScaledSpec det;
+  ScaledSpec base;
+  det.val.rows = base.val.rows = 40;
+  det.val.cols = base.val.cols = 64;
+  det.val.data.resize(40 * 64);
+  base.val.data.resize(40 * 64);
+  for (float& v : det.val.data) v = static_cast<float>(level(rng));
+  for (float& v : base.val.data) v = cell(rng);
+  auto cands = detect_candidates(det, 0, 1);
+  ASSERT_TRUE(cands);
+  Array<float> thr(40);
+  for (float& v : thr) v = cell(rng);
+  thr[3] = 1.f;  // nothing passes: the frame lives on backfill alone
+
+  // Per frame: passing candidates strongest first (lower f on ties), each
+  // kept unless within `sep` of a kept one, up to the cap; then failed
+  // ones the same way up to the floor; emitted by f.
+  const auto brute = [&](const FeatureCfg& feat) {
+    const std::uint32_t cap = feat.max_peaks_per_frame == 0
+                                  ? UINT32_MAX
+                                  : feat.max_peaks_per_frame;
+    const std::uint32_t floor =
+        std::min<std::uint32_t>(feat.min_peaks_per_frame, cap);
+    Array<Peak> out;
+    for (std::uint32_t t = 0; t < 40; ++t) {
+      Array<Peak> pass;
+      Array<Peak> fail;
+      for (const Peak& c : *cands) {
+        if (c.t != t) continue;
+        (base.val.data[std::size_t{t} * 64 + c.f] >= thr[t] ? pass : fail)
+            .push_back(c);
+      }
+      Array<Peak> kept;
+      const auto greedy = [&](Array<Peak> from, std::uint32_t limit) {
+        std::sort(from.begin(), from.end(), [](const Peak& a, const Peak& b) {
+          return a.strength > b.strength ||
+                 (a.strength == b.strength && a.f < b.f);
+        });
+        for (const Peak& c : from) {
+          if (kept.size() >= limit) break;
+          const bool near = std::ranges::any_of(kept, [&](const Peak& k) {
+            return std::abs(int{c.f} - int{k.f}) <
+                   int{feat.nms_min_freq_sep_bins};
+          });
+          if (!near) kept.push_back(c);
+        }
+      };
+      greedy(pass, cap);
+      if (kept.size() < floor) greedy(fail, floor);
+      std::sort(kept.begin(), kept.end(),
+                [](const Peak& a, const Peak& b) { return a.f < b.f; });
+      out.insert(out.end(), kept.begin(), kept.end());
+    }
+    return out;
+  };
+
+  ExtractionArena arena;
+  using Levels = std::array<std::uint8_t, 3>;
+  for (const std::uint8_t cap : std::array<std::uint8_t, 4>{0, 1, 3, 8}) {
+    for (const std::uint8_t floor : Levels{0, 2, 5}) {
+      for (const std::uint8_t sep : Levels{0, 1, 3}) {
+        FeatureCfg feat;
+        feat.max_peaks_per_frame = cap;
+        feat.min_peaks_per_frame = floor;
+        feat.nms_min_freq_sep_bins = sep;
+        const Array<Peak> want = brute(feat);
+        // Candidates out of frame order are grouped first.
+        Array<Peak> shuffled = *cands;
+        std::shuffle(shuffled.begin(), shuffled.end(), rng);
+        for (const bool use_arena : {false, true}) {
+          auto got = filter_and_nms(use_arena ? shuffled : *cands, thr, feat,
+                                    base, use_arena ? &arena : nullptr);
+          if (want.empty()) {
+            EXPECT_EQ(got.error(), Error::NoPeaks);
+            continue;
+          }
+          ASSERT_TRUE(got);
+          ASSERT_EQ(got->size(), want.size())
+              << cap << " " << floor << " " << int{sep};
+          for (std::size_t i = 0; i < want.size(); ++i) {
+            EXPECT_EQ(std::tie((*got)[i].t, (*got)[i].f),
+                      std::tie(want[i].t, want[i].f))
+                << cap << " " << floor << " " << int{sep} << " " << i;
+          }
+        }
+      }
+    }
+  }
+  EXPECT_EQ(filter_and_nms(*cands, Array<float>(39), FeatureCfg{}, base)
+                .error(),
+            Error::InvalidArgument);
+}
+
+TEST(PerFrameThresholds, RowMedianPlusMarginIndependentOfBlocking) {
+  auto scaled = scale_and_band(random_spec(37, 256, 3),
+                               clip_cfg(PercentileMode::Exact, 0));
+  ASSERT_TRUE(scaled);
+  const Matrix<float>& m = scaled->val;
+  auto thr = per_frame_thresholds(*scaled);
+  ASSERT_TRUE(thr);
+  ASSERT_EQ(thr->size(), m.rows);
+  for (std::uint32_t t = 0; t < m.rows; ++t) {
+    const auto row = std::span(m.data).subspan(std::size_t{t} * m.cols,
+                                                m.cols);
+    const auto above = std::count_if(row.begin(), row.end(), [&](float v) {
+      return v + 6.f > (*thr)[t];
+    });
+    const auto below = std::count_if(row.begin(), row.end(), [&](float v) {
+      return v + 6.f < (*thr)[t];
+    });
+    EXPECT_LE(below, m.cols / 2) << t;
+    EXPECT_LE(above, m.cols - m.cols / 2) << t;
+  }
+
+  // Any split of the rows yields the same thresholds, with or without an
+  // arena.
+  ExtractionArena arena;
+  ScaledSpec head = *scaled;
+  ScaledSpec tail = *scaled;
+  const std::uint32_t split = 11;
+  head.val.rows = split;
+  head.val.data.resize(std::size_t{split} * m.cols);
+  tail.val.rows = m.rows - split;
+  tail.val.data.erase(tail.val.data.begin(),
+                      tail.val.data.begin() +
+                          static_cast<std::ptrdiff_t>(split * m.cols));
+  auto a = per_frame_thresholds(head, &arena);
+  auto b = per_frame_thresholds(tail, &arena);
+  ASSERT_TRUE(a);
+  ASSERT_TRUE(b);
+  a->insert(a->end(), b->begin(), b->end());
+  EXPECT_EQ(*a, *thr);
+
+  ScaledSpec bad = *scaled;
+  bad.val.data.pop_back();
+  EXPECT_EQ(per_frame_thresholds(bad).error(), Error::InvalidArgument);
+}
+
+TEST(VoteTable, MatchesOrderedMapThroughGrowthAndClear) {
+  VoteTable votes;
+  std::mt19937 rng(5);
+  std::uniform_int_distribution<std::uint32_t> track(0, 40);
+  std::uniform_int_distribution<std::int32_t> off(-300, 300);
+  for (int round = 0; round < 2; ++round) {
+    Map<std::tuple<std::uint32_t, std::int32_t>, std::uint32_t> want;
+    // Extremes of both fields must not alias in the packed 64-bit key.
+    constexpr auto kMin = std::numeric_limits<std::int32_t>::min();
+    constexpr auto kMax = std::numeric_limits<std::int32_t>::max();
+    const std::pair<std::uint32_t, std::int32_t> edges[] = {
+        {0, -1}, {0xFFFFFFFFu, 0}, {0xFFFFFFFFu, -1}, {1, kMin}, {0, kMax}};
+    for (const auto& [t, o] : edges) {
+      votes.add(t, o, 2);
+      want[{t, o}] += 2;
+    }
+    // Far more bins than the initial 16 slots, so the table rehashes often.
+    for (int i = 0; i < 20000; ++i) {
+      const std::uint32_t t = track(rng);
+      const std::int32_t o = off(rng);
+      const std::uint32_t n = i % 7 == 0 ? 0 : 1;
+      votes.add(t, o, n);
+      if (n != 0) want[{t, o}] += n;
+    }
+    EXPECT_EQ(votes.size(), want.size());
+    EXPECT_EQ(export_votes(votes), want);
+    for (const auto& [bin, n] : want) {
+      ASSERT_EQ(votes.count(std::get<0>(bin), std::get<1>(bin)), n);
+    }
+    EXPECT_EQ(votes.count(41, 0), 0u);
+
+    votes.clear();
+    EXPECT_TRUE(votes.empty());
+    EXPECT_EQ(votes.count(0, -1), 0u);
+    EXPECT_TRUE(export_votes(votes).empty());
+  }
+}
+
+TEST(VoteTable, RemoveMatchesOrderedMapUnderChurn) {
+  VoteTable votes;
+  Map<std::tuple<std::uint32_t, std::int32_t>, std::uint32_t> want;
+  std::mt19937 rng(6);
+  // Few tracks and offsets: long probe chains that deletions must keep
+  // intact.
+  std::uniform_int_distribution<std::uint32_t> track(0, 6);
+  std::uniform_int_distribution<std::int32_t> off(-40, 40);
+  std::uniform_int_distribution<std::uint32_t> n(1, 3);
+  for (int i = 0; i < 30000; ++i) {
+    const std::uint32_t t = track(rng);
+    const std::int32_t o = off(rng);
+    const std::uint32_t k = n(rng);
+    if (i % 3 == 0) {
+      votes.add(t, o, k);
+      want[{t, o}] += k;
+      continue;
+    }
+    votes.remove(t, o, k);
+    if (auto it = want.find({t, o}); it != want.end()) {
+      if (it->second > k) {
+        it->second -= k;
+      } else {
+        want.erase(it);
+      }
+    }
+    if (i % 1000 == 1) {
+      ASSERT_EQ(votes.size(), want.size());
+      for (const auto& [bin, c] : want) {
+        ASSERT_EQ(votes.count(std::get<0>(bin), std::get<1>(bin)), c);
+      }
+    }
+  }
+  EXPECT_EQ(export_votes(votes), want);
+  for (const auto& [bin, c] : want) {
+    votes.remove(std::get<0>(bin), std::get<1>(bin), c);
+  }
+  EXPECT_TRUE(votes.empty());
+  EXPECT_TRUE(export_votes(votes).empty());
+  votes.remove(1, 1);
+  EXPECT_TRUE(votes.empty());
+}
+
+TEST(VoteTable, BestBinTiesGoToTheSmallestTrackAndOffset) {
+  VoteTable votes(4);
+  EXPECT_EQ(select_best_by_votes(votes).error(), Error::InvalidArgument);
+  votes.add(9, -5, 3);
+  votes.add(4, 12, 3);
+  votes.add(4, 7, 3);
+  votes.add(2, 0, 1);
+  auto best = select_best_by_votes(votes);
+  ASSERT_TRUE(best);
+  EXPECT_EQ(best->track_id, 4u);
+  EXPECT_EQ(best->off_bin, 7);
+  EXPECT_EQ(best->stats.peak, 3u);
+
+  // Same votes inserted in another order (other slots): same winner.
+  VoteTable again;
+  again.add(2, 0, 1);
+  again.add(4, 7, 3);
+  again.add(4, 12, 3);
+  again.add(9, -5, 3);
+  auto same = select_best_by_votes(again);
+  ASSERT_TRUE(same);
+  EXPECT_EQ(std::tie(same->track_id, same->off_bin),
+            std::tie(best->track_id, best->off_bin));
+
+  again.add(9, -5);
+  EXPECT_EQ(select_best_by_votes(again)->track_id, 9u);
+  EXPECT_EQ(select_best_by_votes(again)->off_bin, -5);
+}
+
+TEST(PostingBlock, EveryFormatRoundTripsThroughBothDecodePaths) {
+  std::mt19937 rng(8);
+  for (const PostingFormat format :
+       {PostingFormat::Varint, PostingFormat::BitPacked}) {
+    ByteArray value;
+    Array<std::pair<std::uint32_t, std::uint32_t>> want;
+    // Lengths around the 8-lane SIMD step and the 128-delta chunk.
+    for (const std::uint32_t n : {1u, 7u, 8u, 9u, 127u, 128u, 129u, 300u}) {
+      const std::uint32_t track = n * 1000003u;
+      const Array<std::uint32_t> times = mixed_times(n, rng);
+      auto block = pack_posting_block(track, times, format);
+      ASSERT_TRUE(block);
+      EXPECT_EQ((*block)[0], static_cast<std::uint8_t>(format));
+      value.insert(value.end(), block->begin(), block->end());
+      for (const std::uint32_t t : times) want.emplace_back(track, t);
+    }
+    // `next()` decodes varints one at a time (scalar); `read_times()` runs
+    // the widest kernel the CPU supports.
+    Array<std::pair<std::uint32_t, std::uint32_t>> per_anchor;
+    Array<std::pair<std::uint32_t, std::uint32_t>> bulk;
+    ASSERT_TRUE(decode_both_ways(value, per_anchor, bulk));
+    EXPECT_EQ(per_anchor, want);
+    EXPECT_EQ(bulk, want);
+  }
+  const Array<std::uint32_t> unsorted = {5, 4};
+  EXPECT_EQ(pack_posting_block(1, unsorted).error(), Error::InvalidArgument);
+  EXPECT_EQ(pack_posting_block(1, {}).error(), Error::InvalidArgument);
+  EXPECT_EQ(pack_posting_block(1, unsorted, PostingFormat{7}).error(),
+            Error::InvalidArgument);
+}
+
+TEST(PostingBlock, BitPackedRoundTripsEveryResidualWidth) {
+  std::mt19937 rng(9);
+  for (std::uint32_t width = 0; width <= 32; ++width) {
+    const std::uint64_t span = (std::uint64_t{1} << width) - 1;
+    // Keep the running sum in u32: full chunks up to 22 bits, then pairs.
+    const std::uint32_t n = width <= 22 ? 300 : 2;
+    const std::uint32_t base = width <= 22 ? 3 : 0;
+    std::uniform_int_distribution<std::uint64_t> residual(0, span);
+    Array<std::uint32_t> deltas(n);
+    for (std::uint32_t i = 0; i < n; ++i) {
+      // Each chunk holds the extremes, so its width is exactly `width`.
+      const std::uint32_t at = i % kPostingChunk;
+      const std::uint64_t r = at == 0 ? 0 : at == 1 ? span : residual(rng);
+      deltas[i] = static_cast<std::uint32_t>(base + r);
+    }
+    Array<std::uint32_t> times(n);
+    std::uint32_t t = 0;
+    for (std::uint32_t i = 0; i < n; ++i) times[i] = t += deltas[i];
+
+    auto block = pack_posting_block(42, times, PostingFormat::BitPacked);
+    ASSERT_TRUE(block);
+    // Header (format, track 42, n, bytes), then chunk 0's base and width.
+    const std::uint8_t* p = block->data() + 2;
+    for (int field = 0; field < 3; ++field) {
+      while (*p++ & 0x80) {
+      }
+    }
+    EXPECT_EQ(*p, width);
+
+    Array<std::pair<std::uint32_t, std::uint32_t>> per_anchor;
+    Array<std::pair<std::uint32_t, std::uint32_t>> bulk;
+    ASSERT_TRUE(decode_both_ways(*block, per_anchor, bulk)) << width;
+    ASSERT_EQ(per_anchor.size(), n);
+    for (std::uint32_t i = 0; i < n; ++i) {
+      ASSERT_EQ(per_anchor[i].second, times[i]) << width << " " << i;
+    }
+    EXPECT_EQ(bulk, per_anchor) << width;
+  }
+}
+
+TEST(PostingBlock, CorruptOrShortInputSetsFailed) {
+  std::mt19937 rng(10);
+  EXPECT_EQ(parse_posting_blocks({}).error(), Error::IntegrityError);
+  for (const PostingFormat format :
+       {PostingFormat::Varint, PostingFormat::BitPacked}) {
+    auto block = pack_posting_block(7, mixed_times(150, rng), format);
+    ASSERT_TRUE(block);
+    Array<std::pair<std::uint32_t, std::uint32_t>> a;
+    Array<std::pair<std::uint32_t, std::uint32_t>> b;
+    // Every strict prefix cuts the header or the payload.
+    for (std::size_t len = 1; len < block->size(); ++len) {
+      a.clear();
+      b.clear();
+      EXPECT_FALSE(decode_both_ways(PostingView(block->data(), len), a, b))
+          << len;
+    }
+    // Unknown format byte, a stray byte after the block, a zero count.
+    ByteArray bad = *block;
+    bad[0] = 9;
+    EXPECT_FALSE(decode_both_ways(bad, a, b));
+    bad = *block;
+    bad.push_back(static_cast<std::uint8_t>(format));
+    EXPECT_FALSE(decode_both_ways(bad, a, b));
+    const ByteArray empty_block = {static_cast<std::uint8_t>(format), 7, 0, 0};
+    EXPECT_FALSE(decode_both_ways(empty_block, a, b));
+  }
+  // Payload bytes larger than declared anchors need: leftovers fail.
+  const ByteArray slack = {1, 7, 1, 2, 5, 5};
+  Array<std::pair<std::uint32_t, std::uint32_t>> a;
+  Array<std::pair<std::uint32_t, std::uint32_t>> b;
+  EXPECT_FALSE(decode_both_ways(slack, a, b));
+  // A five-byte varint carrying more than 32 bits.
+  const ByteArray wide = {1, 7, 1, 5, 0xFF, 0xFF, 0xFF, 0xFF, 0x1F};
+  EXPECT_FALSE(decode_both_ways(wide, a, b));
+  // A bit width above 32.
+  const ByteArray too_wide = {2, 7, 1, 3, 0, 33, 0};
+  EXPECT_FALSE(decode_both_ways(too_wide, a, b));
+}
+
+TEST(PostingIter, NextBlockSkipsUnreadAndPartlyReadBlocks) {
+  std::mt19937 rng(7);
+  ByteArray value;
+  Array<Array<std::uint32_t>> times;
+  Array<std::size_t> sizes;
+  for (std::uint32_t i = 0; i < 12; ++i) {
+    times.push_back(mixed_times(1 + 37 * i, rng));
+    const auto format =
+        i % 2 == 0 ? PostingFormat::Varint : PostingFormat::BitPacked;
+    auto block = pack_posting_block(100 + i, times.back(), format);
+    ASSERT_TRUE(block);
+    sizes.push_back(block->size());
+    value.insert(value.end(), block->begin(), block->end());
+  }
+  // Per block, by i % 3: bulk decode, skip unread, or take i / 2 anchors
+  // one at a time and leave the rest.
+  auto it = parse_posting_blocks(value);
+  ASSERT_TRUE(it);
+  Array<std::uint32_t> out;
+  for (std::uint32_t i = 0; i < 12; ++i) {
+    const auto header = it->next_block();
+    ASSERT_TRUE(header) << i;
+    EXPECT_EQ(header->format, i % 2 == 0 ? PostingFormat::Varint
+                                         : PostingFormat::BitPacked);
+    EXPECT_EQ(header->track_id, 100 + i);
+    EXPECT_EQ(header->n, times[i].size());
+    EXPECT_LT(header->bytes, sizes[i]);
+    if (i % 3 == 0) {
+      out.assign(header->n, 0);
+      ASSERT_TRUE(it->read_times(out));
+      EXPECT_EQ(out, times[i]);
+    } else if (i % 3 == 2) {
+      for (std::uint32_t k = 0; k < i / 2; ++k) {
+        const auto anchor = it->next();
+        ASSERT_TRUE(anchor);
+        EXPECT_EQ(anchor->track_id, 100 + i);
+        EXPECT_EQ(anchor->t_anchor, times[i][k]);
+      }
+    }
+  }
+  EXPECT_FALSE(it->next_block());
+  EXPECT_FALSE(it->failed());
+
+  // A buffer shorter than the block fails rather than overrunning.
+  auto short_out = parse_posting_blocks(value);
+  ASSERT_TRUE(short_out);
+  ASSERT_TRUE(short_out->next_block());
+  ASSERT_TRUE(short_out->next_block());
+  out.assign(times[1].size() - 1, 0);
+  EXPECT_FALSE(short_out->read_times(out));
+  EXPECT_TRUE(short_out->failed());
+  EXPECT_FALSE(short_out->next_block());
+}
+
+TEST(ValueCodec, EveryAlgorithmRoundTripsMultiFrameValues) {
+  std::mt19937 rng(12);
+  // Posting blocks: the values the codec sees in an index.
+  Array<ByteArray> samples;
+  for (std::uint32_t i = 0; i < 600; ++i) {
+    auto block = pack_posting_block(i % 50, mixed_times(40 + i % 90, rng));
+    ASSERT_TRUE(block);
+    samples.push_back(std::move(*block));
+  }
+  auto dict = train_value_dictionary(samples, 4096);
+  ASSERT_TRUE(dict);
+  EXPECT_EQ(train_value_dictionary({}, 4096).error(), Error::InvalidArgument);
+
+  const ByteArray small(20, 7);
+  ByteArray big;
+  for (int i = 0; i < 40; ++i) {
+    big.insert(big.end(), samples[0].begin(), samples[0].end());
+  }
+  for (const char* spec : {"none", "lz4", "zstd", "zstd:19", "zstd+dict"}) {
+    const bool with_dict = std::string_view(spec) == "zstd+dict";
+    auto cfg = parse_value_compression(with_dict ? "zstd" : spec);
+    ASSERT_TRUE(cfg) << spec;
+    if (with_dict) cfg->dictionary = *dict;
+    auto codec = ValueCodec::create(*cfg);
+    ASSERT_TRUE(codec) << spec;
+    EXPECT_EQ(codec->cfg().min_bytes, 64u);
+
+    // Three writes, as three appends to one key: raw, compressed, raw.
+    ByteArray stored;
+    ByteArray want;
+    for (const ByteArray& raw : {small, big, samples[7]}) {
+      codec->append_frame(stored, raw);
+      want.insert(want.end(), raw.begin(), raw.end());
+    }
+    ByteArray out = {0xAA};
+    ASSERT_TRUE(codec->decode(stored, out)) << spec;
+    EXPECT_EQ(ByteArray(out.begin() + 1, out.end()), want) << spec;
+    EXPECT_FALSE(ValueCodec::single_frame(stored));
+
+    ByteArray one;
+    codec->append_frame(one, big);
+    EXPECT_TRUE(ValueCodec::single_frame(one));
+    EXPECT_EQ(one[0], static_cast<std::uint8_t>(cfg->algo)) << spec;
+    EXPECT_EQ(ValueCodec::raw_payload(one).has_value(),
+              cfg->algo == Compression::None);
+    if (cfg->algo != Compression::None) {
+      EXPECT_LT(one.size(), big.size());
+    }
+    if (with_dict) {
+      // Dictionary frames need the dictionary to decode.
+      auto plain = ValueCodec::create(codec_cfg(Compression::Zstd));
+      ASSERT_TRUE(plain);
+      ByteArray lost;
+      EXPECT_EQ(plain->decode(one, lost).error(), Error::IntegrityError);
+    }
+  }
+  CodecCfg lz4_dict = codec_cfg(Compression::Lz4);
+  lz4_dict.dictionary = *dict;
+  EXPECT_EQ(ValueCodec::create(lz4_dict).error(), Error::InvalidArgument);
+  EXPECT_EQ(ValueCodec::create(codec_cfg(Compression::Zstd, 99)).error(),
+            Error::InvalidArgument);
+}
+
+TEST(ValueCodec, ParsesSpecsAndRejectsBadOnes) {
+  EXPECT_EQ(parse_value_compression(nullptr)->algo, Compression::None);
+  EXPECT_EQ(parse_value_compression("lz4")->algo, Compression::Lz4);
+  auto zstd = parse_value_compression("zstd:7");
+  ASSERT_TRUE(zstd);
+  EXPECT_EQ(zstd->algo, Compression::Zstd);
+  EXPECT_EQ(zstd->level, 7);
+  EXPECT_EQ(parse_value_compression("zstd:-3")->level, -3);
+  for (const char* bad :
+       {"lz4:x", "none:3", "zstd:", "zstd:3x", "gzip", "", "ZSTD"}) {
+    EXPECT_EQ(parse_value_compression(bad).error(), Error::InvalidArgument)
+        << bad;
+  }
+}
+
+TEST(ValueCodec, ValuesBelowMinBytesStayRaw) {
+  for (const Compression algo : {Compression::Lz4, Compression::Zstd}) {
+    CodecCfg cfg = codec_cfg(algo);
+    cfg.min_bytes = 100;
+    auto codec = ValueCodec::create(cfg);
+    ASSERT_TRUE(codec);
+    const ByteArray below(99, 3);
+    const ByteArray at(100, 3);
+    ByteArray a;
+    ByteArray b;
+    codec->append_frame(a, below);
+    codec->append_frame(b, at);
+    EXPECT_EQ(a[0], static_cast<std::uint8_t>(Compression::None));
+    ASSERT_TRUE(ValueCodec::raw_payload(a));
+    EXPECT_TRUE(std::ranges::equal(*ValueCodec::raw_payload(a), below));
+    EXPECT_EQ(b[0], static_cast<std::uint8_t>(algo));
+    // Incompressible input falls back to a raw frame too.
+    std::mt19937 rng(13);
+    ByteArray noise(4096);
+    for (std::uint8_t& x : noise) x = static_cast<std::uint8_t>(rng());
+    ByteArray c;
+    codec->append_frame(c, noise);
+    EXPECT_EQ(c[0], static_cast<std::uint8_t>(Compression::None));
+  }
+}
+
+TEST(ValueCodec, DecodeRejectsTruncatedAndMislabelledFrames) {
+  const ByteArray raw(100, 9);  // raw_len < 128: one-byte varint header
+  for (const Compression algo :
+       {Compression::None, Compression::Lz4, Compression::Zstd}) {
+    auto codec = ValueCodec::create(codec_cfg(algo));
+    ASSERT_TRUE(codec);
+    ByteArray frame;
+    codec->append_frame(frame, raw);
+    ASSERT_EQ(frame[1], raw.size());
+    ByteArray out;
+    for (std::size_t len = 1; len < frame.size(); ++len) {
+      out.clear();
+      EXPECT_EQ(codec->decode(std::span(frame.data(), len), out).error(),
+                Error::IntegrityError)
+          << len;
+    }
+    for (const int tag : {3, 0x80, 0xFF}) {
+      ByteArray bad = frame;
+      bad[0] = static_cast<std::uint8_t>(tag);
+      EXPECT_EQ(codec->decode(bad, out).error(), Error::IntegrityError);
+    }
+    // A raw length that disagrees with the payload.
+    ByteArray wrong = frame;
+    --wrong[1];
+    EXPECT_EQ(codec->decode(wrong, out).error(), Error::IntegrityError);
+    // A trailing partial frame after a good one.
+    ByteArray tail = frame;
+    tail.push_back(static_cast<std::uint8_t>(algo));
+    EXPECT_EQ(codec->decode(tail, out).error(), Error::IntegrityError);
+    if (algo == Compression::None) continue;
+
+    // A few stored bytes claiming 512 MiB are refused before any buffer
+    // is sized for them.
+    ByteArray hostile = {static_cast<std::uint8_t>(algo), 0x80, 0x80, 0x80,
+                         0x80, 0x02, 4, 0, 0, 0, 0};
+    ByteArray fresh;
+    EXPECT_EQ(codec->decode(hostile, fresh).error(), Error::IntegrityError);
+    EXPECT_LT(fresh.capacity(), std::size_t{1} << 20);
+    // Real highly compressible values stay within the ratio bound.
+    const ByteArray zeros(std::size_t{4} << 20, 0);
+    ByteArray packed;
+    codec->append_frame(packed, zeros);
+    ASSERT_LT(packed.size(), zeros.size() / 200);
+    out.clear();
+    ASSERT_TRUE(codec->decode(packed, out));
+    EXPECT_EQ(out, zeros);
+  }
+}
+
+TEST(GaussianBlur, RecursiveMatchesSampledGaussianWithReplicatedEdges) {
+  std::mt19937 rng(14);
+  std::normal_distribution<float> noise(0.f, 10.f);
+  // Rows 0-5: noise on a step; rows 6-10: a smooth sinusoid. Both edges
+  // sit at different levels, so the edge handling is observable.
+  Matrix<float> m;
+  m.rows = 11;
+  m.cols = 173;
+  m.data.resize(std::size_t{m.rows} * m.cols);
+  for (std::uint32_t t = 0; t < m.rows; ++t) {
+    for (std::uint32_t f = 0; f < m.cols; ++f) {
+      const auto x = static_cast<float>(f);
+      m.data[std::size_t{t} * m.cols + f] =
+          t < 6 ? noise(rng) + (f < m.cols / 2 ? -40.f : 20.f)
+                : 30.f * std::sin(0.05f * x) + static_cast<float>(t);
+    }
+  }
+  const auto [lo, hi] = std::minmax_element(m.data.begin(), m.data.end());
+  const double range = *hi - *lo;
+  const int cols = static_cast<int>(m.cols);
+  for (const float sigma : {0.5f, 0.8f, 1.f, 1.5f, 2.f, 3.f, 5.f, 8.f}) {
+    auto fast = gaussian_blur_freq(m, sigma);
+    ASSERT_TRUE(fast);
+    const int radius = static_cast<int>(std::ceil(5.f * sigma));
+    Array<double> kernel;
+    double sum = 0;
+    for (int k = -radius; k <= radius; ++k) {
+      kernel.push_back(std::exp(-0.5 * k * k / (double{sigma} * sigma)));
+      sum += kernel.back();
+    }
+    for (std::uint32_t t = 0; t < m.rows; ++t) {
+      const float* row = m.data.data() + std::size_t{t} * m.cols;
+      // Third-order recursion vs the sampled kernel: ~3% of the range on
+      // white noise, well under 1% on smooth input.
+      const double tol = (t < 6 ? 0.03 : 0.007) * range;
+      for (int f = 0; f < cols; ++f) {
+        double ref = 0;
+        for (int k = -radius; k <= radius; ++k) {
+          ref += kernel[static_cast<std::size_t>(k + radius)] *
+                 row[std::clamp(f + k, 0, cols - 1)];
+        }
+        ASSERT_NEAR(fast->data[std::size_t{t} * m.cols +
+                               static_cast<std::size_t>(f)],
+                    ref / sum, tol)
+            << "sigma=" << sigma << " t=" << t << " f=" << f;
+      }
+    }
+  }
+  EXPECT_EQ(gaussian_blur_freq(m, 0.4f).error(), Error::InvalidArgument);
+}
+
+TEST(GaussianBlur, FusedDogIsTheDifferenceOfTwoBlurs) {
+  // 13 rows: the second group of eight lanes is partly padding.
+  ScaledSpec scaled;
+  scaled.val.rows = 13;
+  scaled.val.cols = 97;
+  scaled.fprime = 97;
+  std::mt19937 rng(15);
+  std::normal_distribution<float> noise(-30.f, 12.f);
+  scaled.val.data.resize(std::size_t{13} * 97);
+  for (float& v : scaled.val.data) v = noise(rng);
+  const float s1 = 1.2f;
+  const float s2 = 4.f;
+  auto g1 = gaussian_blur_freq(scaled.val, s1);
+  auto g2 = gaussian_blur_freq(scaled.val, s2);
+  ASSERT_TRUE(g1);
+  ASSERT_TRUE(g2);
+  ExtractionArena arena;
+  for (ExtractionArena* a : {static_cast<ExtractionArena*>(nullptr), &arena}) {
+    auto dog = dog_enhance_freq(scaled, true, s1, s2, a);
+    ASSERT_TRUE(dog);
+    ASSERT_EQ(dog->det.val.rows, 13u);
+    ASSERT_EQ(dog->det.val.data.size(), g1->data.size());
+    for (std::size_t i = 0; i < g1->data.size(); ++i) {
+      ASSERT_FLOAT_EQ(dog->base.val.data[i], g1->data[i]) << i;
+      ASSERT_FLOAT_EQ(dog->det.val.data[i], g1->data[i] - g2->data[i]) << i;
+    }
+  }
+  auto plain = dog_enhance_freq(scaled, false, 0.f, 0.f);
+  ASSERT_TRUE(plain);
+  EXPECT_EQ(plain->det.val.data, scaled.val.data);
+  EXPECT_EQ(plain->base.val.data, scaled.val.data);
+  EXPECT_EQ(dog_enhance_freq(scaled, true, s2, s1).error(),
+            Error::InvalidArgument);
+}
+
+TEST(KVReadBatch, GetManyMatchesGetAcrossShardsAndCodecs) {
+  for (const Compression algo : {Compression::None, Compression::Zstd}) {
+    const std::string path = temp_kv_path(
+        algo == Compression::None ? "afp_get_many_raw" : "afp_get_many_zstd");
+    auto kvh = open(path, KVMode::Create, 4);
+    ASSERT_TRUE(kvh);
+    if (algo != Compression::None) {
+      ASSERT_TRUE(kv_set_codec(*kvh, codec_cfg(algo)));
+    }
+    // Keys ordered by byte 0; even ones are stored, odd ones absent. The
+    // last byte varies too, or every key would hash to one shard.
+    const auto key = [](std::uint32_t b) {
+      Key k = key_of(static_cast<std::uint8_t>(b));
+      k.bytes.back() = static_cast<std::uint8_t>(b / 2);
+      return k;
+    };
+    // Up to three appended blocks per key, so some values are multi-frame.
+    std::mt19937 rng(6);
+    Map<Key, Array<std::pair<std::uint32_t, std::uint32_t>>> want;
+    for (std::uint32_t b = 0; b < 256; b += 2) {
+      const Key k = key(b);
+      for (std::uint32_t track = 0; track <= b % 3; ++track) {
+        const Array<std::uint32_t> times = mixed_times(1 + b, rng);
+        auto block = pack_posting_block(track, times);
+        ASSERT_TRUE(block);
+        ASSERT_TRUE(put_append(*kvh, shard_for_key(*kvh, k), k, *block));
+        for (const std::uint32_t t : times) want[k].emplace_back(track, t);
+      }
+    }
+
+    KVReadBatch batch(*kvh);
+    for (const std::uint32_t stride : {1u, 3u, 7u}) {
+      Array<Key> keys;
+      for (std::uint32_t b = 0; b < 256; b += stride) {
+        keys.push_back(key(b));
+        if (b % 5 == 0) keys.push_back(keys.back());  // duplicates allowed
+      }
+      auto views = get_many(batch, keys);
+      ASSERT_TRUE(views);
+      ASSERT_EQ(views->size(), keys.size());
+      std::set<std::uint16_t> shards;
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        const std::uint16_t s = shard_for_key(*kvh, keys[i]);
+        shards.insert(s);
+        const auto copy = get(*kvh, s, keys[i]);
+        ASSERT_TRUE(copy);
+        ASSERT_EQ((*views)[i].has_value(), copy->has_value()) << i;
+        if (!copy->has_value()) continue;
+        EXPECT_TRUE(std::ranges::equal(*(*views)[i], **copy));
+        EXPECT_EQ(anchors_of(*(*views)[i]), want[keys[i]]);
+      }
+      EXPECT_GT(shards.size(), 1u);
+    }
+    const Array<Key> unsorted = {key(4), key(2)};
+    EXPECT_EQ(get_many(batch, unsorted).error(), Error::InvalidArgument);
+    EXPECT_TRUE(get_many(batch, {})->empty());
+    batch.release();
+    ASSERT_TRUE(close(*kvh));
+    std::filesystem::remove_all(path);
+  }
+}
+
+TEST(Rank, FrameCoverageCountsQueryFramesVotingForTheWinner) {
+  const std::string path = temp_kv_path("afp_coverage");
+  auto kvh = open(path, KVMode::Create, 1);
+  ASSERT_TRUE(kvh);
+  const KeyLayout layout = extract_cfg().key_layout;
+  const auto key = [](std::uint32_t v) { return PackedKey<32>{v}; };
+  const auto put = [&](PackedKey<32> native, std::uint32_t track,
+                       Array<std::uint32_t> times) {
+    const Key k = to_key(native, layout);
+    auto block = pack_posting_block(track, times);
+    ASSERT_TRUE(block);
+    ASSERT_TRUE(put_append(*kvh, shard_for_key(*kvh, k), k, *block));
+  };
+  put(key(1), 7, {100, 200});
+  put(key(1), 9, {105});
+  put(key(2), 7, {150});
+
+  PairingCfg pair;
+  pair.delta_bin_frames = 4;
+  // Bin 22 holds stored times in [tq + 88, tq + 92).
+  const Array<PackedKeyWithTime<32>> query = {
+      {key(1), 10}, {key(2), 60}, {key(3), 70}, {key(1), 20}};
+  {
+    KVReadBatch batch(*kvh);
+    auto cov = frame_coverage(7, 22, query, batch, pair, layout);
+    ASSERT_TRUE(cov);
+    EXPECT_FLOAT_EQ(*cov, 0.5f);
+    auto other = frame_coverage(9, 23, query, batch, pair, layout);
+    ASSERT_TRUE(other);
+    EXPECT_FLOAT_EQ(*other, 0.25f);
+    EXPECT_FLOAT_EQ(
+        *frame_coverage(7, 22, Array<PackedKeyWithTime<32>>{}, batch, pair,
+                        layout),
+        0.f);
+    KeyLayout wide = layout;
+    wide.total_bits = 64;
+    EXPECT_EQ(frame_coverage(7, 22, query, batch, pair, wide).error(),
+              Error::InvalidArgument);
+    pair.delta_bin_frames = 0;
+    EXPECT_EQ(frame_coverage(7, 22, query, batch, pair, layout).error(),
+              Error::InvalidArgument);
+  }
+  ASSERT_TRUE(close(*kvh));
+  std::filesystem::remove_all(path);
+}
+
+TEST(Rank, FrameCoverageLeavesStoplistedFramesOutOfADropIndex) {
+  const auto dir = std::filesystem::temp_directory_path() / "afp_cov_tracks";
+  const auto manifest = noise_tracks(dir);
+  BuildCfg cfg = build_cfg();
+  // Tracks 1-3 share a recording: at this cap all their keys run hot.
+  cfg.hot_key_pct = 60.f;
+  cfg.hot_key_policy = HotKeyPolicy::Drop;
+  const std::string path = temp_kv_path("afp_cov_drop");
+  ASSERT_TRUE(build_db(manifest, cfg, path));
+
+  // Query: track 4, then track 3's keys past its end.
+  const auto keys_of = [&](std::size_t i) {
+    return extract_native_keys<32>(std::filesystem::path(manifest[i].second),
+                                   cfg.feature, cfg.pairing, cfg.key_layout);
+  };
+  ASSERT_EQ(manifest[0].first, 3u);
+  ASSERT_EQ(manifest[3].first, 4u);
+  const std::uint32_t track = 4;
+  auto query = keys_of(3);
+  auto tail = keys_of(0);
+  ASSERT_TRUE(query && tail);
+  for (auto kt : *tail) {
+    kt.t_anchor += 1u << 20;
+    query->push_back(kt);
+  }
+  auto kvh = open(path, KVMode::ReadOnly, 0);
+  ASSERT_TRUE(kvh);
+  auto hot_keys = load_hot_keys(*kvh);
+  ASSERT_TRUE(hot_keys);
+  Array<PackedKey<32>> hot;
+  for (const Key& k : *hot_keys) hot.push_back(from_key<32>(k, cfg.key_layout));
+  std::sort(hot.begin(), hot.end());
+
+  // Frames with a key off the stoplist; the rest could not have voted.
+  std::set<std::uint32_t> all;
+  std::set<std::uint32_t> live;
+  for (const auto& kt : *query) {
+    all.insert(kt.t_anchor);
+    if (!std::binary_search(hot.begin(), hot.end(), kt.key)) {
+      live.insert(kt.t_anchor);
+    }
+  }
+  ASSERT_LT(live.size(), all.size());
+  ASSERT_FALSE(live.empty());
+  {
+    KVReadBatch batch(*kvh);
+    // Every live frame is stored at its own time (offset bin 0).
+    auto cov = frame_coverage(track, 0, *query, batch, cfg.pairing,
+                              cfg.key_layout, hot);
+    ASSERT_TRUE(cov);
+    EXPECT_FLOAT_EQ(*cov, 1.f);
+    auto unskipped =
+        frame_coverage(track, 0, *query, batch, cfg.pairing, cfg.key_layout);
+    ASSERT_TRUE(unskipped);
+    EXPECT_FLOAT_EQ(*unskipped, static_cast<float>(live.size()) /
+                                    static_cast<float>(all.size()));
+    EXPECT_FLOAT_EQ(*frame_coverage(track, 0, *query, batch, cfg.pairing,
+                                    cfg.key_layout, Array<PackedKey<32>>{}),
+                    *unskipped);
+  }
+  ASSERT_TRUE(close(*kvh));
+  std::filesystem::remove_all(path);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(Rank, EntropyConfidenceAndSeconds) {
+  const Map<std::int32_t, std::uint32_t> hist = {{1, 2}, {2, 2}, {40, 9}};
+  EXPECT_FLOAT_EQ(*histogram_entropy(hist, window_around(0)), 1.f);
+  EXPECT_FLOAT_EQ(*histogram_entropy(hist, window_around(40)), 0.f);
+  EXPECT_FLOAT_EQ(*histogram_entropy(hist, window_around(-100)), 0.f);
+
+  const float base = calibrate_confidence(20, 0.5f, 1.f);
+  EXPECT_GT(base, 0.f);
+  EXPECT_LT(base, 1.f);
+  EXPECT_GT(calibrate_confidence(40, 0.5f, 1.f), base);
+  EXPECT_GT(calibrate_confidence(20, 0.9f, 1.f), base);
+  EXPECT_LT(calibrate_confidence(20, 0.5f, 2.f), base);
+  EXPECT_EQ(calibrate_confidence(0, 1.f, 0.f), 0.f);
+  EXPECT_LE(calibrate_confidence(1u << 30, 2.f, -1.f), 1.f);
+
+  EXPECT_DOUBLE_EQ(bin_to_seconds(10, 256, 8000, 2), 0.64);
+  EXPECT_DOUBLE_EQ(bin_to_seconds(-10, 256, 8000, 2), -0.64);
+  EXPECT_EQ(bin_to_seconds(10, 256, 0, 2), 0.0);
+}
+
+TEST(AudioStream, ChunkedReadsMatchWholeDecode) {
+  const ByteArray wav = pcm16_wav(10007, 2, 11025);
+  auto whole = decode_and_downmix(wav, DecodeMode::MidSide);
+  ASSERT_TRUE(whole);
+  ASSERT_TRUE(whole->side_opt);
+  auto mid_only = decode_and_downmix(wav);
+  ASSERT_TRUE(mid_only);
+  EXPECT_FALSE(mid_only->side_opt);
+  EXPECT_EQ(mid_only->mid.samples, whole->mid.samples);
+  EXPECT_EQ(whole->mid.sr, 11025u);
+
+  auto stream = AudioStream::open(wav);
+  ASSERT_TRUE(stream);
+  EXPECT_EQ(stream->channels(), 2);
+  Array<float> mid, side, all_mid, all_side;
+  while (const std::size_t n = stream->read(1000, mid, &side)) {
+    EXPECT_LE(n, 1000u);
+    all_mid.insert(all_mid.end(), mid.begin(), mid.end());
+    all_side.insert(all_side.end(), side.begin(), side.end());
+  }
+  EXPECT_EQ(all_mid, whole->mid.samples);
+  EXPECT_EQ(all_side, whole->side_opt->samples);
+
+  EXPECT_EQ(AudioStream::open(std::span<const std::uint8_t>{}).error(),
+            Error::EmptyAudio);
+  const ByteArray junk(64, 0x5A);
+  EXPECT_EQ(AudioStream::open(junk).error(), Error::UnsupportedFormat);
+}
+
+TEST(AudioStream, WindowDecodesOnlyTheRequestedRange) {
+  const ByteArray wav = pcm16_wav(20000, 2, 11025);
+  auto whole = decode_and_downmix(wav);
+  ASSERT_TRUE(whole);
+
+  // 0.1 s → frame 1103 (rounded); 0.2 s → 2205 frames.
+  auto clip = decode_and_downmix(wav, DecodeMode::MidOnly, {0.1, 0.2});
+  ASSERT_TRUE(clip);
+  const auto& all = whole->mid.samples;
+  EXPECT_EQ(clip->mid.samples, Array<float>(all.begin() + 1103,
+                                            all.begin() + 1103 + 2205));
+
+  // A window running past the end stops at the end.
+  auto tail = decode_and_downmix(wav, DecodeMode::MidOnly, {1.5, 10.0});
+  ASSERT_TRUE(tail);
+  EXPECT_EQ(tail->mid.samples.size(), all.size() - 16538);
+
+  EXPECT_EQ(decode_and_downmix(wav, DecodeMode::MidOnly, {-1.0, 0.0}).error(),
+            Error::InvalidArgument);
+}
+
+TEST(MappedFile, PathInputsDecodeLikeBytes) {
+  const ByteArray wav = pcm16_wav(5003, 1, 8000);
+  const auto path = std::filesystem::temp_directory_path() / "afp_mmap.wav";
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(wav.data()),
+              static_cast<std::streamsize>(wav.size()));
+  }
+  auto file = MappedFile::open(path);
+  ASSERT_TRUE(file);
+  EXPECT_TRUE(std::equal(wav.begin(), wav.end(), file->bytes().begin(),
+                         file->bytes().end()));
+
+  auto from_bytes = decode_and_downmix(wav);
+  auto from_path = decode_and_downmix(path);
+  ASSERT_TRUE(from_bytes);
+  ASSERT_TRUE(from_path);
+  EXPECT_EQ(from_path->mid.samples, from_bytes->mid.samples);
+  std::filesystem::remove(path);
+
+  EXPECT_EQ(MappedFile::open(path).error(), Error::DecodeError);
+  EXPECT_EQ(decode_and_downmix(path).error(), Error::DecodeError);
+}
+
+TEST(StftEngine, BatchedMagnitudesMatchNaiveDft) {
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> sample(-1.f, 1.f);
+  // 70 frames spans two full batches and a partial one; no overlap too.
+  for (const auto& [fft, hop] : {std::pair<std::uint32_t, std::uint32_t>{
+                                     64, 24},
+                                 {16, 16}}) {
+    auto engine = StftEngine::create(fft, hop);
+    ASSERT_TRUE(engine);
+    EXPECT_EQ(engine->bins(), fft / 2 + 1);
+    const std::size_t n = fft + std::size_t{69} * hop + hop - 1;
+    Array<float> x(n);
+    for (float& v : x) v = sample(rng);
+    Matrix<float> mag;
+    ASSERT_TRUE(engine->magnitude(x, mag));
+    ASSERT_EQ(mag.rows, 70u);
+    ASSERT_EQ(mag.cols, fft / 2 + 1);
+    ASSERT_EQ(mag.data.size(), std::size_t{70} * mag.cols);
+    const double step = 2.0 * std::numbers::pi / fft;
+    double worst = 0.0;
+    for (std::uint32_t t = 0; t < mag.rows; ++t) {
+      for (std::uint32_t k = 0; k < mag.cols; ++k) {
+        double re = 0.0;
+        double im = 0.0;
+        for (std::uint32_t i = 0; i < fft; ++i) {
+          const double w = 0.5 - 0.5 * std::cos(step * i);
+          const double v = w * x[std::size_t{t} * hop + i];
+          re += v * std::cos(step * k * i);
+          im -= v * std::sin(step * k * i);
+        }
+        const float got = mag.data[std::size_t{t} * mag.cols + k];
+        worst = std::max(worst, std::abs(std::hypot(re, im) - got));
+      }
+    }
+    EXPECT_LT(worst, 1e-4 * fft);
+
+    // The buffer is reused: a shorter input leaves exactly its own frames.
+    ASSERT_TRUE(
+        engine->magnitude(std::span<const float>(x).first(fft + hop), mag));
+    EXPECT_EQ(mag.rows, 2u);
+    EXPECT_EQ(mag.data.size(), std::size_t{2} * mag.cols);
+  }
+}
+
+TEST(StftEngine, FrameCountEdgesAndBadSizes) {
+  auto engine = StftEngine::create(64, 24);
+  ASSERT_TRUE(engine);
+  EXPECT_EQ(engine->frame_count(0), 0u);
+  EXPECT_EQ(engine->frame_count(63), 0u);
+  EXPECT_EQ(engine->frame_count(64), 1u);
+  EXPECT_EQ(engine->frame_count(64 + 23), 1u);
+  EXPECT_EQ(engine->frame_count(64 + 24), 2u);
+  EXPECT_EQ(engine->frame_count(64 + 24 * 1000), 1001u);
+  Matrix<float> mag;
+  const Array<float> short_input(63);
+  EXPECT_EQ(engine->magnitude(short_input, mag).error(), Error::NoFrames);
+
+  EXPECT_EQ(StftEngine::create(63, 24).error(), Error::InvalidArgument);
+  EXPECT_EQ(StftEngine::create(0, 24).error(), Error::InvalidArgument);
+  EXPECT_EQ(StftEngine::create(64, 0).error(), Error::InvalidArgument);
+  auto mine = StftEngine::for_thread(64, 24);
+  ASSERT_TRUE(mine);
+  EXPECT_EQ(*StftEngine::for_thread(64, 24), *mine);
+  EXPECT_NE(*StftEngine::for_thread(128, 24), *mine);
+  EXPECT_EQ((*mine)->hop_size(), 24u);
+}
+
+TEST(IdentifySession, EncodedPushMatchesOneShotDecode) {
+  const IdentifyCfg cfg = extract_cfg();
+  const std::string path = temp_kv_path("afp_session");
+  {
+    auto kvh = open(path, KVMode::Create, 1);
+    ASSERT_TRUE(kvh);
+    ASSERT_TRUE(close(*kvh));
+  }
+  std::mt19937 rng(11);
+  std::uniform_int_distribution<std::size_t> len(1, 5000);
+  // The ID3 asset also carries a LAME Info frame with gapless trim.
+  for (const char* name : {"tiny_raw.mp3", "tiny_id3.mp3"}) {
+    const ByteArray mp3 =
+        read_file(std::filesystem::path(TEST_ASSETS_DIR) / name);
+    ASSERT_FALSE(mp3.empty()) << name;
+    auto want = extract_keys_for_track(mp3, cfg.feature, cfg.pairing,
+                                       cfg.key_layout);
+    ASSERT_TRUE(want) << name;
+    ASSERT_FALSE(want->empty()) << name;
+
+    auto session = IdentifySession::open(cfg, path);
+    ASSERT_TRUE(session);
+    for (int pass = 0; pass < 2; ++pass) {
+      for (std::size_t i = 0; i < mp3.size();) {
+        const std::size_t k = std::min(len(rng), mp3.size() - i);
+        ASSERT_TRUE(session->push_encoded(
+            std::span<const std::uint8_t>(mp3).subspan(i, k)));
+        i += k;
+      }
+      auto res = session->finish();
+      ASSERT_TRUE(res) << name;
+      EXPECT_TRUE(std::holds_alternative<IdentifyResultNoMatch>(*res));
+      auto got = stable_sort_by(session->query_keys(), cfg.key_layout);
+      ASSERT_TRUE(got);
+      ASSERT_EQ(got->size(), want->size()) << name;
+      for (std::size_t i = 0; i < want->size(); ++i) {
+        ASSERT_EQ((*got)[i].key, (*want)[i].key) << name << " " << i;
+        ASSERT_EQ((*got)[i].t_anchor, (*want)[i].t_anchor) << name << " " << i;
+      }
+      session->reset();
+    }
+  }
+  std::filesystem::remove_all(path);
+}
+
+TEST(IdentifySession, OldKeysExpireSoTheStreamMatchesTheNewTrack) {
+  const auto dir = std::filesystem::temp_directory_path() / "afp_window_tracks";
+  const auto manifest = noise_tracks(dir);
+  const std::string path = temp_kv_path("afp_window");
+  ASSERT_TRUE(build_db(manifest, build_cfg(), path));
+
+  IdentifyCfg cfg = extract_cfg();
+  cfg.max_entropy = 1e9f;
+  // Track 5 (about 80 frames) then track 4 (about 70) as one stream.
+  const auto run = [&](std::uint32_t window) -> Result<IdentifyResult> {
+    cfg.session_window_frames = window;
+    auto session = IdentifySession::open(cfg, path);
+    if (!session) return tl::unexpected(session.error());
+    for (const std::size_t i : {4u, 3u}) {
+      auto stream =
+          AudioStream::open(std::filesystem::path(manifest[i].second));
+      if (!stream) return tl::unexpected(stream.error());
+      Array<float> mid;
+      while (stream->read(kDecodeChunkFrames, mid) != 0) {
+        if (auto m = session->push_pcm(mid, 1, stream->sample_rate()); !m) {
+          return tl::unexpected(m.error());
+        }
+      }
+    }
+    auto res = session->finish();
+    const auto keys = session->query_keys();
+    if (window != 0 && !keys.empty()) {
+      const auto [lo, hi] = std::minmax_element(
+          keys.begin(), keys.end(), [](const auto& a, const auto& b) {
+            return a.t_anchor < b.t_anchor;
+          });
+      EXPECT_LT(hi->t_anchor - lo->t_anchor, window);
+    }
+    return res;
+  };
+  const auto track_of = [](const IdentifyResult& r) {
+    const auto* m = std::get_if<IdentifyResultMatch>(&r);
+    return m ? m->value.track_id : 0u;
+  };
+
+  // Unbounded, track 5's older votes still outweigh track 4's.
+  auto all = run(1u << 30);
+  ASSERT_TRUE(all);
+  EXPECT_EQ(track_of(*all), 5u);
+  auto recent = run(40);
+  ASSERT_TRUE(recent);
+  EXPECT_EQ(track_of(*recent), 4u);
+  // The default window spans both tracks.
+  auto fallback = run(0);
+  ASSERT_TRUE(fallback);
+  EXPECT_EQ(track_of(*fallback), track_of(*all));
+  std::filesystem::remove_all(path);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(StreamKeyExtractor, ExcerptKeysMatchTheTrackAwayFromItsStart) {
+  IdentifyCfg cfg = extract_cfg();
+  cfg.feature.clip_window_frames = 32;
+  const ByteArray wav = pcm16_wav(48000, 1, 8000);
+  // Drop the first 50 hops: the excerpt's frame t is the track's t + 50.
+  constexpr std::uint32_t kShift = 50;
+  constexpr std::size_t kHeader = 44;
+  ByteArray excerpt(wav.begin(), wav.begin() + kHeader);
+  excerpt.insert(excerpt.end(),
+                 wav.begin() + kHeader + kShift * cfg.feature.hop_size * 2,
+                 wav.end());
+  const auto put32 = [&](std::size_t at, std::size_t v) {
+    for (std::size_t i = 0; i < 4; ++i) {
+      excerpt[at + i] = static_cast<std::uint8_t>(v >> (8 * i));
+    }
+  };
+  put32(4, excerpt.size() - 8);
+  put32(40, excerpt.size() - kHeader);
+
+  auto track = extract_keys_for_track(wav, cfg.feature, cfg.pairing,
+                                      cfg.key_layout);
+  auto part = extract_keys_for_track(excerpt, cfg.feature, cfg.pairing,
+                                     cfg.key_layout);
+  ASSERT_TRUE(track);
+  ASSERT_TRUE(part);
+  // Past the clip window and the peak neighbourhood both see the same rows
+  // (the tracks end together, so the end needs no margin).
+  const std::uint32_t from = cfg.feature.clip_window_frames +
+                             2 * cfg.feature.neigh_dt + 8;
+  const auto settled = [&](const Array<KeyWithTime>& keys,
+                           std::uint32_t shift) {
+    std::set<std::pair<std::uint32_t, Key>> out;
+    for (const KeyWithTime& k : keys) {
+      if (k.t_anchor >= from + (kShift - shift)) {
+        out.emplace(k.t_anchor + shift, k.key);
+      }
+    }
+    return out;
+  };
+  const auto want = settled(*track, 0);
+  ASSERT_GT(want.size(), 1000u);
+  EXPECT_EQ(settled(*part, kShift), want);
+}
+
+TEST(TrackMeta, FramesChecksumAndLayoutVersion) {
+  const auto dir = std::filesystem::temp_directory_path();
+  const auto write = [](const std::filesystem::path& path,
+                        std::span<const std::uint8_t> bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(bytes.data()),
+              static_cast<std::streamsize>(bytes.size()));
+  };
+  const auto wav_path = dir / "afp_meta.wav";
+  write(wav_path, pcm16_wav(20000, 2, 11025));
+  FeatureCfg feat;
+  feat.target_sr = 8000;
+  feat.frame_size = 512;
+  feat.hop_size = 128;
+  // 20000 frames at 11025 Hz → 14513 samples at 8000 Hz.
+  EXPECT_EQ(estimate_frames(wav_path.string(), feat),
+            1u + (14513u - 512u) / 128u);
+  feat.target_sr = 0;
+  EXPECT_EQ(estimate_frames(wav_path.string(), feat),
+            1u + (20000u - 512u) / 128u);
+
+  // The MP3 count comes from a header scan; it matches a full decode.
+  const std::string mp3 = std::string(TEST_ASSETS_DIR) + "/tiny_raw.mp3";
+  auto stream = AudioStream::open(std::filesystem::path(mp3));
+  auto decoded = decode_and_downmix(std::filesystem::path(mp3));
+  ASSERT_TRUE(stream);
+  ASSERT_TRUE(decoded);
+  EXPECT_EQ(stream->total_frames(), decoded->mid.samples.size());
+  Array<float> mid;
+  EXPECT_GT(stream->read(100, mid), 0u);
+  EXPECT_EQ(mid, Array<float>(decoded->mid.samples.begin(),
+                              decoded->mid.samples.begin() + 100));
+
+  // CRC-64/XZ check value.
+  const auto crc_path = dir / "afp_meta.txt";
+  const std::string_view check = "123456789";
+  write(crc_path, std::span(reinterpret_cast<const std::uint8_t*>(
+                                check.data()),
+                            check.size()));
+  EXPECT_EQ(crc64_of_uri(crc_path.string()), 0x995DC9BBDF1939FAull);
+  std::filesystem::remove(crc_path);
+  std::filesystem::remove(wav_path);
+  EXPECT_EQ(crc64_of_uri(crc_path.string()), 0u);
+  EXPECT_EQ(estimate_frames(wav_path.string(), feat), 0u);
+
+  KeyLayout a{.total_bits = 32, .bits_fa = 10, .bits_ft = 10, .bits_dt = 12};
+  KeyLayout b = a;
+  b.bits_dt = 11;
+  KeyLayout c = a;
+  c.endian = Endian::Big;
+  EXPECT_EQ(derive_version(a), derive_version(KeyLayout(a)));
+  EXPECT_NE(derive_version(a), derive_version(b));
+  EXPECT_NE(derive_version(a), derive_version(c));
+}
+
+TEST(StreamResampler, PolyphaseMatchesDirectSincInAnyChunking) {
+  std::mt19937 rng(5);
+  std::normal_distribution<float> noise(0.f, 0.3f);
+  // 44101 → 8000 reduces to 8000 phases: too many to cache.
+  for (const auto& [src, dst] :
+       {std::pair{44100u, 8000u}, {48000u, 11025u}, {8000u, 16000u},
+        {44101u, 8000u}}) {
+    Array<float> x(9001);
+    for (float& v : x) v = noise(rng);
+
+    // Direct windowed sinc, taps past either end dropped.
+    const double ratio = static_cast<double>(dst) / static_cast<double>(src);
+    const double fc = 0.5 * std::min(1.0, ratio) * 0.95;
+    const auto hw = static_cast<std::int64_t>(std::ceil(16.0 / (2.0 * fc)));
+    const auto n = static_cast<std::int64_t>(x.size());
+    Array<float> want;
+    for (std::uint64_t o = 0; o * src < x.size() * dst; ++o) {
+      const auto t = static_cast<std::int64_t>(o * src / dst);
+      const double frac =
+          static_cast<double>(o * src % dst) / static_cast<double>(dst);
+      double acc = 0.0;
+      for (auto i = std::max<std::int64_t>(0, t - hw + 1);
+           i <= std::min(n - 1, t + hw); ++i) {
+        const double d = static_cast<double>(i - t) - frac;
+        const double arg = std::numbers::pi * 2.0 * fc * d;
+        const double w = d / static_cast<double>(hw);
+        const double a = std::numbers::pi * (w + 1.0);
+        acc += 2.0 * fc * (arg == 0.0 ? 1.0 : std::sin(arg) / arg) *
+               (0.42 - 0.5 * std::cos(a) + 0.08 * std::cos(2.0 * a)) *
+               x[static_cast<std::size_t>(i)];
+      }
+      want.push_back(static_cast<float>(acc));
+    }
+
+    Array<float> whole;
+    StreamResampler one(src, dst);
+    one.process(x, whole);
+    one.flush(whole);
+    ASSERT_EQ(whole.size(), want.size()) << src << "->" << dst;
+    for (std::size_t i = 0; i < want.size(); ++i) {
+      ASSERT_NEAR(whole[i], want[i], 1e-5f) << src << "->" << dst;
+    }
+
+    Array<float> chunked;
+    StreamResampler many(src, dst);
+    std::uniform_int_distribution<std::size_t> len(1, 700);
+    for (std::size_t i = 0; i < x.size();) {
+      const std::size_t k = std::min(len(rng), x.size() - i);
+      many.process(std::span<const float>(x).subspan(i, k), chunked);
+      i += k;
+    }
+    many.flush(chunked);
+    EXPECT_EQ(chunked, whole);
+  }
+}
+
+TEST(BuildDb, HotKeysAboveThePercentileCapAreDroppedOrThinned) {
+  const auto dir = std::filesystem::temp_directory_path() / "afp_hot_tracks";
+  const auto manifest = noise_tracks(dir);
+  BuildCfg cfg = build_cfg();
+  const std::string base_path = temp_kv_path("afp_hot_base");
+  ASSERT_TRUE(build_db(manifest, cfg, base_path));
+  const Map<Key, ByteArray> base = dump_index(base_path, cfg.shard_bits);
+  ASSERT_FALSE(base.empty());
+
+  // Cap: the shortest length reaching the 80th percentile of key lengths.
+  cfg.hot_key_pct = 80.f;
+  Array<std::uint64_t> lengths;
+  for (const auto& [k, v] : base) lengths.push_back(anchors_of(v).size());
+  std::sort(lengths.begin(), lengths.end());
+  const auto rank = static_cast<std::size_t>(
+      std::ceil(0.8 * static_cast<double>(lengths.size())));
+  const std::uint64_t cap = lengths[rank - 1];
+  Array<Key> hot;
+  for (const auto& [k, v] : base) {
+    if (anchors_of(v).size() > cap) hot.push_back(k);
+  }
+  ASSERT_GE(cap, 1u);
+  ASSERT_FALSE(hot.empty());
+
+  for (const HotKeyPolicy policy :
+       {HotKeyPolicy::Drop, HotKeyPolicy::Truncate}) {
+    cfg.hot_key_policy = policy;
+    const std::string path = temp_kv_path(
+        policy == HotKeyPolicy::Drop ? "afp_hot_drop" : "afp_hot_truncate");
+    auto report = build_db(manifest, cfg, path);
+    ASSERT_TRUE(report);
+    EXPECT_EQ(report->hot_keys, hot.size());
+    {
+      auto kvh = open(path, KVMode::ReadOnly, 0);
+      ASSERT_TRUE(kvh);
+      auto list = load_hot_keys(*kvh);
+      ASSERT_TRUE(list);
+      EXPECT_EQ(*list, hot);
+      auto cap_le = kv_get_info(*kvh, kInfoHotKeyCap);
+      ASSERT_TRUE(cap_le && *cap_le);
+      EXPECT_EQ(**cap_le,
+                (ByteArray{static_cast<std::uint8_t>(cap), 0, 0, 0}));
+      ASSERT_TRUE(close(*kvh));
+    }
+
+    const Map<Key, ByteArray> pruned = dump_index(path, cfg.shard_bits);
+    for (const auto& [k, v] : base) {
+      auto want = anchors_of(v);
+      std::sort(want.begin(), want.end());
+      const auto found = pruned.find(k);
+      if (want.size() <= cap) {
+        ASSERT_NE(found, pruned.end());
+        auto got = anchors_of(found->second);
+        std::sort(got.begin(), got.end());
+        EXPECT_EQ(got, want);
+        continue;
+      }
+      if (policy == HotKeyPolicy::Drop) {
+        EXPECT_EQ(found, pruned.end());
+        continue;
+      }
+      // Thinned to an even stride over the sorted (track, t) anchors.
+      ASSERT_NE(found, pruned.end());
+      Array<std::pair<std::uint32_t, std::uint32_t>> stride;
+      for (std::uint64_t i = 0; i < cap; ++i) {
+        stride.push_back(want[i * want.size() / cap]);
+      }
+      EXPECT_EQ(anchors_of(found->second), stride);
+    }
+    std::filesystem::remove_all(path);
+  }
+  std::filesystem::remove_all(base_path);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(BuildDb, IndexDoesNotDependOnWorkerCount) {
+  const auto dir = std::filesystem::temp_directory_path() / "afp_det_tracks";
+  const auto manifest = noise_tracks(dir);
+  BuildCfg cfg = build_cfg();
+  const std::string serial_path = temp_kv_path("afp_det_serial");
+  auto serial = build_db(manifest, cfg, serial_path);
+  ASSERT_TRUE(serial);
+  cfg.workers = 4;
+  const std::string pooled_path = temp_kv_path("afp_det_pooled");
+  auto pooled = build_db(manifest, cfg, pooled_path);
+  ASSERT_TRUE(pooled);
+
+  EXPECT_EQ(pooled->keys_total, serial->keys_total);
+  EXPECT_EQ(pooled->unique_keys, serial->unique_keys);
+  EXPECT_EQ(pooled->hotkey_histogram, serial->hotkey_histogram);
+  const Map<Key, ByteArray> a = dump_index(serial_path, cfg.shard_bits);
+  const Map<Key, ByteArray> b = dump_index(pooled_path, cfg.shard_bits);
+  ASSERT_FALSE(a.empty());
+  EXPECT_EQ(a, b);
+  // Blocks are in track order, whatever the manifest order (3, 1, 2, ...).
+  std::size_t shared = 0;
+  std::size_t unsorted = 0;
+  for (const auto& [k, v] : a) {
+    const auto anchors = anchors_of(v);
+    unsorted += !std::is_sorted(anchors.begin(), anchors.end());
+    shared += anchors.front().first != anchors.back().first;
+  }
+  EXPECT_GT(shared, 0u);
+  EXPECT_EQ(unsorted, 0u);
+  std::filesystem::remove_all(serial_path);
+  std::filesystem::remove_all(pooled_path);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(BuildDbBulk, ManySpilledRunsMergeToTheBuildDbIndex) {
+  const auto dir = std::filesystem::temp_directory_path() / "afp_bulk_tracks";
+  const auto manifest = noise_tracks(dir);
+  BuildCfg cfg = build_cfg();
+  const std::string online_path = temp_kv_path("afp_bulk_online");
+  auto online = build_db(manifest, cfg, online_path);
+  ASSERT_TRUE(online);
+  cfg.workers = 2;
+  BulkLoadCfg bulk;
+  bulk.spill_dir = (dir / "runs").string();
+  bulk.run_triples = 64;  // dozens of runs in the k-way merge
+  const std::string bulk_path = temp_kv_path("afp_bulk_offline");
+  auto offline = build_db_bulk(manifest, cfg, bulk_path, bulk);
+  ASSERT_TRUE(offline);
+
+  EXPECT_EQ(offline->keys_total, online->keys_total);
+  EXPECT_EQ(offline->unique_keys, online->unique_keys);
+  EXPECT_EQ(offline->hotkey_histogram, online->hotkey_histogram);
+  EXPECT_GT(online->keys_total, 20 * bulk.run_triples);
+  const Map<Key, ByteArray> a = dump_index(online_path, cfg.shard_bits);
+  ASSERT_FALSE(a.empty());
+  EXPECT_EQ(dump_index(bulk_path, cfg.shard_bits), a);
+  EXPECT_TRUE(std::filesystem::is_empty(bulk.spill_dir));
+  std::filesystem::remove_all(online_path);
+  std::filesystem::remove_all(bulk_path);
+  std::filesystem::remove_all(dir);
+}
+
+TEST(PutAppendMany, AppendsEachBlockInOrderLikePutAppend) {
+  const std::string path = temp_kv_path("afp_append_many");
+  auto kvh = open(path, KVMode::Create, 1);
+  ASSERT_TRUE(kvh);
+  ASSERT_TRUE(put_append(*kvh, 0, key_of(2), {1, 2}));
+  // Repeated keys within one batch extend what the batch wrote before.
+  Array<std::pair<Key, ByteArray>> blocks = {{key_of(4), {40}},
+                                             {key_of(2), {20}},
+                                             {key_of(4), {41, 42}},
+                                             {key_of(1), {10}}};
+  ASSERT_TRUE(put_append_many(*kvh, 0, blocks));
+  Array<std::pair<Key, ByteArray>> more = {{key_of(1), {11}}};
+  ASSERT_TRUE(put_append_many(*kvh, 0, more));
+  ASSERT_TRUE(put_append_many(*kvh, 0, {}));
+  EXPECT_EQ(put_append_many(*kvh, 1, more).error(), Error::InvalidArgument);
+  ASSERT_TRUE(close(*kvh));
+
+  const Map<Key, ByteArray> want = {{key_of(1), {10, 11}},
+                                    {key_of(2), {1, 2, 20}},
+                                    {key_of(4), {40, 41, 42}}};
+  EXPECT_EQ(dump_index(path, 0), want);
+  std::filesystem::remove_all(path);
+}
+
+TEST(BulkMerge, AppendsPastTheLastKeyAndExtendsStoredOnes) {
+  struct Source final : SortedKeyValueSource {
+    Array<std::pair<Key, ByteArray>> items;
+    std::size_t at = 0;
+    std::optional<std::pair<Key, ByteArray>> next() override {
+      if (at == items.size()) return std::nullopt;
+      return items[at++];
+    }
+  };
+  const std::string path = temp_kv_path("afp_bulk_merge");
+  auto kvh = open(path, KVMode::Create, 1);
+  ASSERT_TRUE(kvh);
+  ASSERT_TRUE(put_append(*kvh, 0, key_of(2), {1, 2}));
+  ASSERT_TRUE(put_append(*kvh, 0, key_of(5), {3}));
+  // Key 1 sits below the last key and 2 and 5 exist: read-modify-write.
+  // Keys from 7 on are past the last key and go in with MDB_APPEND.
+  Source src;
+  src.items = {{key_of(1), {10}}, {key_of(2), {20}}, {key_of(5), {50, 51}}};
+  for (std::uint8_t b = 7; b < 255; ++b) src.items.push_back({key_of(b), {b}});
+  ASSERT_TRUE(bulk_merge(*kvh, 0, SortedKeyValueIter{&src}));
+  Source none;
+  EXPECT_EQ(bulk_merge(*kvh, 1, SortedKeyValueIter{&none}).error(),
+            Error::InvalidArgument);
+
+  Map<Key, ByteArray> want = {{key_of(1), {10}},
+                              {key_of(2), {1, 2, 20}},
+                              {key_of(5), {3, 50, 51}}};
+  for (std::uint8_t b = 7; b < 255; ++b) want[key_of(b)] = {b};
+  ASSERT_TRUE(close(*kvh));
+  EXPECT_EQ(dump_index(path, 0), want);
+  std::filesystem::remove_all(path);
+}
+} // namespace afp